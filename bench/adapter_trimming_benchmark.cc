@@ -0,0 +1,143 @@
+// Compare the overlap search used for adapter trimming with the seed-based
+// search it replaced, on simulated Nextera read pairs whose insert sizes follow
+// a normal distribution. Report the time per pair, the number of trimmed pairs
+// and the number of pairs on which the two searches trim the same length.
+//
+// Usage: adapter_trimming_benchmark [read_length] [mean_insert_size]
+//            [insert_size_sd] [num_pairs]
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "adapter_trimming.h"
+
+namespace {
+// The search before the SSE scan: find one of two exact seeds of read1 in the
+// reverse complement of read2 and verify the rest of the overlap base by base.
+int FindAdapterOverlapLengthWithSeeds(const char *read1, const std::string &negative_read2, int min_overlap_length, int error_threshold) {
+  uint32_t read2_length = negative_read2.length();
+  int seed_length = min_overlap_length / 2;
+  for (int si = 0; si < error_threshold + 1; ++si) {
+    int seed_start_position = negative_read2.find(read1 + si * seed_length, 0, seed_length);
+    while ((uint32_t)seed_start_position != std::string::npos && read2_length - seed_start_position + seed_length * si >= (uint32_t)min_overlap_length && seed_start_position >= si * seed_length) {
+      bool can_merge = true;
+      int num_errors = 0;
+      for (int i = 0; i < seed_length * si; ++i) {
+        if (negative_read2[seed_start_position - si * seed_length + i] != read1[i]) {
+          ++num_errors;
+        }
+        if (num_errors > error_threshold) {
+          can_merge = false;
+          break;
+        }
+      }
+      for (uint32_t i = seed_length; i + seed_start_position < read2_length; ++i) {
+        if (negative_read2[seed_start_position + i] != read1[si * seed_length + i]) {
+          ++num_errors;
+        }
+        if (num_errors > error_threshold) {
+          can_merge = false;
+          break;
+        }
+      }
+      if (can_merge) {
+        return read2_length - seed_start_position + si * seed_length;
+      }
+      seed_start_position = negative_read2.find(read1 + si * seed_length, seed_start_position + 1, seed_length);
+    }
+  }
+  return 0;
+}
+
+std::string ReverseComplement(const std::string &sequence) {
+  std::string reverse_complement(sequence.rbegin(), sequence.rend());
+  for (char &base : reverse_complement) {
+    switch (base) {
+      case 'A': base = 'T'; break;
+      case 'C': base = 'G'; break;
+      case 'G': base = 'C'; break;
+      case 'T': base = 'A'; break;
+      default: base = 'N';
+    }
+  }
+  return reverse_complement;
+}
+
+double GetRealTime() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  int read_length = argc > 1 ? atoi(argv[1]) : 150;
+  double mean_insert_size = argc > 2 ? atof(argv[2]) : 200;
+  double insert_size_sd = argc > 3 ? atof(argv[3]) : 80;
+  int num_pairs = argc > 4 ? atoi(argv[4]) : 200000;
+  // Same as the default --min-read-length and the mismatch threshold in
+  // TrimAdapterForPairedEndRead.
+  const int min_overlap_length = 30;
+  const int error_threshold = 1;
+  const double substitution_rate = 0.005;
+  const std::string adapter1 = "CTGTCTCTTATACACATCTCCGAGCCCACGAGAC";
+  const std::string adapter2 = "CTGTCTCTTATACACATCTGACGCTGCCGACGA";
+  const char *bases = "ACGT";
+  std::mt19937 generator(1);
+  std::normal_distribution<double> insert_size_distribution(mean_insert_size, insert_size_sd);
+  std::uniform_int_distribution<int> base_distribution(0, 3);
+  std::uniform_real_distribution<double> error_distribution(0, 1);
+  std::vector<std::string> reads1(num_pairs);
+  std::vector<std::string> negative_reads2(num_pairs);
+  for (int pair_index = 0; pair_index < num_pairs; ++pair_index) {
+    int insert_size = std::max(20, (int)insert_size_distribution(generator));
+    std::string fragment(insert_size, 'A');
+    for (char &base : fragment) {
+      base = bases[base_distribution(generator)];
+    }
+    // Reads running past the insert continue into the adapter and then into
+    // the poly-A/poly-G tail of the sequencer.
+    std::string read1 = (fragment + adapter1 + std::string(read_length, 'A')).substr(0, read_length);
+    std::string read2 = (ReverseComplement(fragment) + adapter2 + std::string(read_length, 'G')).substr(0, read_length);
+    for (char &base : read1) {
+      if (error_distribution(generator) < substitution_rate) {
+        base = bases[base_distribution(generator)];
+      }
+    }
+    for (char &base : read2) {
+      if (error_distribution(generator) < substitution_rate) {
+        base = bases[base_distribution(generator)];
+      }
+    }
+    reads1[pair_index] = read1;
+    negative_reads2[pair_index] = ReverseComplement(read2);
+  }
+
+  std::vector<int> seed_overlap_lengths(num_pairs);
+  double real_start_time = GetRealTime();
+  for (int pair_index = 0; pair_index < num_pairs; ++pair_index) {
+    seed_overlap_lengths[pair_index] = FindAdapterOverlapLengthWithSeeds(reads1[pair_index].data(), negative_reads2[pair_index], min_overlap_length, error_threshold);
+  }
+  double seed_search_time = GetRealTime() - real_start_time;
+  std::vector<int> scan_overlap_lengths(num_pairs);
+  real_start_time = GetRealTime();
+  for (int pair_index = 0; pair_index < num_pairs; ++pair_index) {
+    scan_overlap_lengths[pair_index] = chromap::FindAdapterOverlapLength(reads1[pair_index].data(), read_length, negative_reads2[pair_index].data(), read_length, min_overlap_length, error_threshold);
+  }
+  double scan_time = GetRealTime() - real_start_time;
+
+  int num_seed_trims = 0;
+  int num_scan_trims = 0;
+  int num_same_trims = 0;
+  for (int pair_index = 0; pair_index < num_pairs; ++pair_index) {
+    num_seed_trims += seed_overlap_lengths[pair_index] > 0 ? 1 : 0;
+    num_scan_trims += scan_overlap_lengths[pair_index] > 0 ? 1 : 0;
+    num_same_trims += seed_overlap_lengths[pair_index] == scan_overlap_lengths[pair_index] ? 1 : 0;
+  }
+  std::cout << "Read length: " << read_length << ", insert size: " << mean_insert_size << "+-" << insert_size_sd << ", number of pairs: " << num_pairs << ".\n";
+  std::cout << "Seed search: " << seed_search_time * 1e9 / num_pairs << " ns/pair, trimmed " << num_seed_trims << " pairs.\n";
+  std::cout << "SSE scan: " << scan_time * 1e9 / num_pairs << " ns/pair, trimmed " << num_scan_trims << " pairs.\n";
+  std::cout << "Same trims: " << num_same_trims << "/" << num_pairs << ".\n";
+  return 0;
+}
@@ -0,0 +1,127 @@
+// Write a synthetic single-cell ATAC-seq data set on a reference made of many
+// short contigs, like a draft assembly or a reference with many unplaced
+// scaffolds, for the many-contigs benchmark in the Makefile. The output
+// directory gets ref.fa, wl.txt and the gzipped read and barcode files r1.fq.gz,
+// r2.fq.gz and bc.fq.gz. Each read pair comes from a random fragment on a
+// random contig, and a fifth of the pairs are PCR duplicates of earlier ones.
+//
+// Usage: many_contigs_data output_directory [num_contigs] [contig_length]
+//            [num_pairs] [num_barcodes]
+#include <iostream>
+#include <random>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+const int READ_LENGTH = 50;
+const int BARCODE_LENGTH = 16;
+const int MIN_FRAGMENT_LENGTH = 150;
+const int MAX_FRAGMENT_LENGTH = 300;
+
+struct Fragment {
+  uint32_t contig_index;
+  int start_position;
+  int length;
+  uint32_t barcode_index;
+};
+
+std::string GenerateSequence(int length, std::mt19937 &generator) {
+  const char *bases = "ACGT";
+  std::string sequence(length, 'A');
+  for (char &base : sequence) {
+    base = bases[generator() % 4];
+  }
+  return sequence;
+}
+
+std::string ReverseComplement(const std::string &sequence) {
+  std::string reverse_complement(sequence.rbegin(), sequence.rend());
+  for (char &base : reverse_complement) {
+    switch (base) {
+      case 'A': base = 'T'; break;
+      case 'C': base = 'G'; break;
+      case 'G': base = 'C'; break;
+      case 'T': base = 'A'; break;
+      default: base = 'N';
+    }
+  }
+  return reverse_complement;
+}
+
+// The mode is passed to gzopen, where "wT" writes the file uncompressed.
+gzFile OpenOutputFile(const std::string &file_path, const char *mode) {
+  gzFile file = gzopen(file_path.c_str(), mode);
+  if (file == NULL) {
+    std::cerr << "Cannot open " << file_path << "!\n";
+    exit(-1);
+  }
+  return file;
+}
+
+void WriteFastqRecord(gzFile file, uint32_t pair_index, const std::string &sequence) {
+  std::string record = "@r" + std::to_string(pair_index) + "\n" + sequence + "\n+\n" + std::string(sequence.length(), 'I') + "\n";
+  gzwrite(file, record.data(), record.length());
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: many_contigs_data output_directory [num_contigs] [contig_length] [num_pairs] [num_barcodes]\n";
+    return 1;
+  }
+  std::string output_directory = argv[1];
+  uint32_t num_contigs = argc > 2 ? atol(argv[2]) : 100000;
+  int contig_length = argc > 3 ? atoi(argv[3]) : 400;
+  uint32_t num_pairs = argc > 4 ? atol(argv[4]) : 400000;
+  uint32_t num_barcodes = argc > 5 ? atol(argv[5]) : 500;
+  if (contig_length < MAX_FRAGMENT_LENGTH) {
+    std::cerr << "The contig length should be at least " << MAX_FRAGMENT_LENGTH << "!\n";
+    return 1;
+  }
+  std::mt19937 generator(1);
+
+  std::vector<std::string> contigs(num_contigs);
+  gzFile reference_file = OpenOutputFile(output_directory + "/ref.fa", "wT");
+  for (uint32_t ci = 0; ci < num_contigs; ++ci) {
+    contigs[ci] = GenerateSequence(contig_length, generator);
+    std::string record = ">c" + std::to_string(ci) + "\n" + contigs[ci] + "\n";
+    gzwrite(reference_file, record.data(), record.length());
+  }
+  gzclose(reference_file);
+
+  std::vector<std::string> barcodes(num_barcodes);
+  gzFile whitelist_file = OpenOutputFile(output_directory + "/wl.txt", "wT");
+  for (std::string &barcode : barcodes) {
+    barcode = GenerateSequence(BARCODE_LENGTH, generator);
+    gzputs(whitelist_file, (barcode + "\n").c_str());
+  }
+  gzclose(whitelist_file);
+
+  gzFile read1_file = OpenOutputFile(output_directory + "/r1.fq.gz", "wb1");
+  gzFile read2_file = OpenOutputFile(output_directory + "/r2.fq.gz", "wb1");
+  gzFile barcode_file = OpenOutputFile(output_directory + "/bc.fq.gz", "wb1");
+  std::vector<Fragment> fragments;
+  fragments.reserve(num_pairs);
+  for (uint32_t pair_index = 0; pair_index < num_pairs; ++pair_index) {
+    Fragment fragment;
+    if (!fragments.empty() && generator() % 5 == 0) {
+      fragment = fragments[generator() % fragments.size()];
+    } else {
+      fragment.contig_index = generator() % num_contigs;
+      fragment.length = MIN_FRAGMENT_LENGTH + generator() % (MAX_FRAGMENT_LENGTH - MIN_FRAGMENT_LENGTH + 1);
+      fragment.start_position = generator() % (contig_length - fragment.length + 1);
+      fragment.barcode_index = generator() % num_barcodes;
+    }
+    fragments.emplace_back(fragment);
+    const std::string &contig = contigs[fragment.contig_index];
+    WriteFastqRecord(read1_file, pair_index, contig.substr(fragment.start_position, READ_LENGTH));
+    WriteFastqRecord(read2_file, pair_index, ReverseComplement(contig.substr(fragment.start_position + fragment.length - READ_LENGTH, READ_LENGTH)));
+    WriteFastqRecord(barcode_file, pair_index, barcodes[fragment.barcode_index]);
+  }
+  gzclose(read1_file);
+  gzclose(read2_file);
+  gzclose(barcode_file);
+  return 0;
+}
@@ -0,0 +1,119 @@
+// Compare SortMappings with std::sort on random mapping records that look like
+// a sorted mapping container of one large reference sequence, with a third of
+// the records being PCR duplicates of earlier ones. Report the time of each
+// sort and check that both give the same order.
+//
+// Usage: radix_sort_benchmark [num_mappings] [record_type]
+// where record_type is p for PairedEndMappingWithBarcode, f for
+// PairedEndFragmentWithBarcode or s for MappingWithoutBarcode, and all of them
+// are run by default.
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "chromap.h"
+
+namespace {
+using namespace chromap;
+
+const uint32_t REFERENCE_SEQUENCE_LENGTH = 248000000;
+const uint32_t NUM_CELL_BARCODES = 20000;
+
+template <typename MappingRecord>
+void GenerateFragment(std::mt19937_64 &generator, MappingRecord *mapping) {
+  // Barcodes are spread over the 32 bits like the 2-bit encoded sequences.
+  mapping->cell_barcode = generator() % NUM_CELL_BARCODES * 2654435761u;
+  mapping->fragment_start_position = generator() % REFERENCE_SEQUENCE_LENGTH;
+  mapping->fragment_length = 50 + generator() % 700;
+  mapping->mapq = generator() % 61;
+  mapping->direction = generator() & 1;
+  mapping->is_unique = 1;
+  mapping->num_dups = 1;
+}
+
+template <typename MappingRecord>
+void GenerateMapping(std::mt19937_64 &generator, MappingRecord *mapping);
+
+template <>
+void GenerateMapping(std::mt19937_64 &generator, PairedEndMappingWithBarcode *mapping) {
+  GenerateFragment(generator, mapping);
+  mapping->positive_alignment_length = 50;
+  mapping->negative_alignment_length = 50;
+}
+
+template <>
+void GenerateMapping(std::mt19937_64 &generator, PairedEndFragmentWithBarcode *mapping) {
+  GenerateFragment(generator, mapping);
+}
+
+template <>
+void GenerateMapping(std::mt19937_64 &generator, MappingWithoutBarcode *mapping) {
+  mapping->fragment_start_position = generator() % REFERENCE_SEQUENCE_LENGTH;
+  mapping->fragment_length = 50 + generator() % 100;
+  mapping->mapq = generator() % 61;
+  mapping->direction = generator() & 1;
+  mapping->is_unique = 1;
+  mapping->num_dups = 1;
+}
+
+template <typename MappingRecord>
+void GenerateMappings(size_t num_mappings, std::vector<MappingRecord> *mappings) {
+  std::mt19937_64 generator(7);
+  mappings->resize(num_mappings);
+  for (size_t mi = 0; mi < num_mappings; ++mi) {
+    MappingRecord &mapping = (*mappings)[mi];
+    if (mi > 0 && generator() % 3 == 0) {
+      mapping = (*mappings)[generator() % mi];
+    } else {
+      GenerateMapping(generator, &mapping);
+    }
+    mapping.read_id = mi;
+  }
+}
+
+double GetRealTime() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename MappingRecord>
+void RunBenchmark(const std::string &record_name, size_t num_mappings) {
+  std::vector<MappingRecord> sorted_mappings;
+  GenerateMappings(num_mappings, &sorted_mappings);
+  double real_start_time = GetRealTime();
+  std::sort(sorted_mappings.begin(), sorted_mappings.end());
+  double std_sort_time = GetRealTime() - real_start_time;
+  std::vector<MappingRecord> radix_sorted_mappings;
+  GenerateMappings(num_mappings, &radix_sorted_mappings);
+  real_start_time = GetRealTime();
+  SortMappings(radix_sorted_mappings.data(), radix_sorted_mappings.data() + radix_sorted_mappings.size());
+  double radix_sort_time = GetRealTime() - real_start_time;
+  bool are_identical = true;
+  for (size_t mi = 0; mi < num_mappings; ++mi) {
+    if (sorted_mappings[mi] < radix_sorted_mappings[mi] || radix_sorted_mappings[mi] < sorted_mappings[mi]) {
+      are_identical = false;
+      break;
+    }
+  }
+  std::cout << record_name << " (" << sizeof(MappingRecord) << " bytes), number of mappings: " << num_mappings << ".\n";
+  std::cout << "std::sort: " << std_sort_time << "s, radix sort: " << radix_sort_time << "s, speedup: " << std_sort_time / radix_sort_time << ", " << (are_identical ? "identical order" : "DIFFERENT ORDER") << ".\n";
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  size_t num_mappings = argc > 1 ? atol(argv[1]) : 10000000;
+  char record_type = argc > 2 ? argv[2][0] : 'a';
+  if (record_type == 'a' || record_type == 'p') {
+    RunBenchmark<PairedEndMappingWithBarcode>("PairedEndMappingWithBarcode", num_mappings);
+  }
+  if (record_type == 'a' || record_type == 'f') {
+    RunBenchmark<PairedEndFragmentWithBarcode>("PairedEndFragmentWithBarcode", num_mappings);
+  }
+  if (record_type == 'a' || record_type == 's') {
+    RunBenchmark<MappingWithoutBarcode>("MappingWithoutBarcode", num_mappings);
+  }
+  return 0;
+}
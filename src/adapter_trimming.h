@@ -0,0 +1,38 @@
+#ifndef ADAPTERTRIMMING_H_
+#define ADAPTERTRIMMING_H_
+
+#include <algorithm>
+#include <smmintrin.h>
+
+namespace chromap {
+// When the insert is shorter than the reads, the start of read1 overlaps the
+// end of the reverse complement of read2 and both reads run into adapters.
+// Return the longest overlap of at least min_overlap_length bases with at most
+// error_threshold mismatches, or 0 if there is none. Every overlap is tried
+// from the longest down, comparing 16 bases at a time and giving up on an
+// overlap as soon as it has too many mismatches.
+inline int FindAdapterOverlapLength(const char *read1, int read1_length, const char *negative_read2, int read2_length, int min_overlap_length, int error_threshold) {
+  for (int overlap_length = std::min(read1_length, read2_length); overlap_length >= std::max(min_overlap_length, 1); --overlap_length) {
+    const char *overlap = negative_read2 + read2_length - overlap_length;
+    int num_errors = 0;
+    int i = 0;
+    for (; i + 16 <= overlap_length && num_errors <= error_threshold; i += 16) {
+      __m128i read1_vpu = _mm_loadu_si128((const __m128i *)(read1 + i));
+      __m128i overlap_vpu = _mm_loadu_si128((const __m128i *)(overlap + i));
+      int match_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(read1_vpu, overlap_vpu));
+      num_errors += __builtin_popcount((~match_mask) & 0xffff);
+    }
+    for (; i < overlap_length && num_errors <= error_threshold; ++i) {
+      if (read1[i] != overlap[i]) {
+        ++num_errors;
+      }
+    }
+    if (num_errors <= error_threshold) {
+      return overlap_length;
+    }
+  }
+  return 0;
+}
+} // namespace chromap
+
+#endif // ADAPTERTRIMMING_H_
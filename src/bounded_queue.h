@@ -0,0 +1,72 @@
+#ifndef BOUNDEDQUEUE_H_
+#define BOUNDEDQUEUE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace chromap {
+// Fixed-capacity ring buffer connecting two pipeline stages. Push blocks when
+// the queue is full and Pop blocks when it is empty, so a slow stage applies
+// backpressure to the stage feeding it. Time spent blocked and the queue
+// occupancy seen by each push are recorded for the pipeline stats.
+template <typename T>
+class BoundedQueue {
+ public:
+  BoundedQueue(size_t capacity) : buffer_(capacity) {}
+  ~BoundedQueue() {}
+  void Push(const T &item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (size_ == buffer_.size()) {
+      std::chrono::steady_clock::time_point wait_start_time = std::chrono::steady_clock::now();
+      not_full_.wait(lock, [this] { return size_ < buffer_.size(); });
+      push_wait_time_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - wait_start_time).count();
+    }
+    buffer_[(head_ + size_) % buffer_.size()] = item;
+    ++size_;
+    ++num_pushes_;
+    sum_occupancy_ += size_;
+    not_empty_.notify_one();
+  }
+  T Pop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (size_ == 0) {
+      std::chrono::steady_clock::time_point wait_start_time = std::chrono::steady_clock::now();
+      not_empty_.wait(lock, [this] { return size_ > 0; });
+      pop_wait_time_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - wait_start_time).count();
+    }
+    T item = buffer_[head_];
+    head_ = (head_ + 1) % buffer_.size();
+    --size_;
+    not_full_.notify_one();
+    return item;
+  }
+  inline size_t GetCapacity() const {
+    return buffer_.size();
+  }
+  inline double GetPushWaitTime() const {
+    return push_wait_time_;
+  }
+  inline double GetPopWaitTime() const {
+    return pop_wait_time_;
+  }
+  inline double GetAverageOccupancy() const {
+    return num_pushes_ == 0 ? 0 : (double)sum_occupancy_ / num_pushes_;
+  }
+
+ protected:
+  std::vector<T> buffer_;
+  size_t head_ = 0;
+  size_t size_ = 0;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  double push_wait_time_ = 0;
+  double pop_wait_time_ = 0;
+  uint64_t num_pushes_ = 0;
+  uint64_t sum_occupancy_ = 0;
+};
+} // namespace chromap
+
+#endif // BOUNDEDQUEUE_H_
@@ -1,7 +1,9 @@
 #include "chromap.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <bitset>
+#include <ctype.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream> 
@@ -11,7 +13,11 @@
 #include <random>
 #include <smmintrin.h>
 #include <sstream>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "adapter_trimming.h"
 #include "cxxopts.hpp"
 #include "ksw.h"
 #include "mmcache.hpp"
@@ -20,107 +26,29 @@ namespace chromap {
 template <typename MappingRecord>
 void Chromap<MappingRecord>::TrimAdapterForPairedEndRead(uint32_t pair_index, SequenceBatch *read_batch1, SequenceBatch *read_batch2) {
   const char *read1 = read_batch1->GetSequenceAt(pair_index);
-  uint32_t read2_length = read_batch2->GetSequenceLengthAt(pair_index);
-  const std::string &negative_read2 = read_batch2->GetNegativeSequenceAt(pair_index);
-  int min_overlap_length = min_read_length_;
-  int seed_length = min_overlap_length / 2;
+  int read1_length = read_batch1->GetSequenceLengthAt(pair_index);
+  int read2_length = read_batch2->GetSequenceLengthAt(pair_index);
+  const char *negative_read2 = read_batch2->GetNegativeSequenceAt(pair_index);
   int error_threshold_for_merging = 1;
-  bool is_merged = false;
-  for (int si = 0; si < error_threshold_for_merging + 1; ++si) {
-    int seed_start_position = negative_read2.find(read1 + si * seed_length, 0, seed_length);
-    while ((uint32_t)seed_start_position != std::string::npos && read2_length - seed_start_position + seed_length * si >= (uint32_t)min_overlap_length && seed_start_position >= si * seed_length) {
-      bool can_merge = true;
-      int num_errors = 0;
-      for (int i = 0; i < seed_length * si; ++i) {
-        if (negative_read2[seed_start_position - si * seed_length + i] != read1[i]) {
-          ++num_errors;
-        }
-        if (num_errors > error_threshold_for_merging) {
-          can_merge = false;
-          break;
-        }
-      }
-      for (uint32_t i = seed_length; i + seed_start_position < read2_length; ++i) {
-        if (negative_read2[seed_start_position + i] != read1[si * seed_length + i]) {
-          ++num_errors;
-        }
-        if (num_errors > error_threshold_for_merging) {
-          can_merge = false;
-          break;
-        }
-      }
-      if (can_merge) {
-        // Trim adapters and TODO: fix sequencing errors
-        int overlap_length = read2_length - seed_start_position + si * seed_length;
-        read_batch1->TrimSequenceAt(pair_index, overlap_length);
-        read_batch2->TrimSequenceAt(pair_index, overlap_length);
-        is_merged = true;
-        //std::cerr << "Trimed! overlap length: " << overlap_length << ", " << read1.GetLength() << " " << read2.GetLength() << "\n";
-        break;
-      }
-      seed_start_position = negative_read2.find(read1 + si * seed_length, seed_start_position + 1, seed_length);
-    }
-    if (is_merged) {
-      break;
-    }
+  int overlap_length = FindAdapterOverlapLength(read1, read1_length, negative_read2, read2_length, min_read_length_, error_threshold_for_merging);
+  if (overlap_length > 0) {
+    // Trim adapters and TODO: fix sequencing errors
+    read_batch1->TrimSequenceAt(pair_index, overlap_length);
+    read_batch2->TrimSequenceAt(pair_index, overlap_length);
   }
 }
 
 template <typename MappingRecord>
-bool Chromap<MappingRecord>::PairedEndReadWithBarcodeIsDuplicate(uint32_t pair_index, const SequenceBatch &barcode_batch, const SequenceBatch &read_batch1, const SequenceBatch &read_batch2) {
-  int dedupe_seed_length = 16;
-  uint32_t barcode_key = barcode_batch.GenerateSeedFromSequenceAt(pair_index, 0, dedupe_seed_length);
-  uint64_t read1_seed1 = read_batch1.GenerateSeedFromSequenceAt(pair_index, 0, dedupe_seed_length);
-  uint64_t read2_seed1 = read_batch2.GenerateSeedFromSequenceAt(pair_index, 0, dedupe_seed_length);
-  uint64_t read_seed_key = (read1_seed1 << (dedupe_seed_length * 2)) | read2_seed1;
-  uint64_t read1_seed2 = read_batch1.GenerateSeedFromSequenceAt(pair_index, dedupe_seed_length, dedupe_seed_length * 2);
-  uint64_t read2_seed2 = read_batch2.GenerateSeedFromSequenceAt(pair_index, dedupe_seed_length, dedupe_seed_length * 2);
-  khiter_t barcode_table_iterator = kh_get(k32, barcode_lookup_table_, barcode_key);
-  if (barcode_table_iterator != kh_end(barcode_lookup_table_)) {
-    uint32_t read_lookup_table_index = kh_value(barcode_lookup_table_, barcode_table_iterator);
-    //std::cerr << "Have barcode, try to check read. " << read_lookup_table_index << "\n";
-    khash_t(k128) *read_lookup_table = read_lookup_tables_[read_lookup_table_index];
-    khiter_t read_lookup_table_iterator = kh_get(k128, read_lookup_table, read_seed_key);
-    if (read_lookup_table_iterator != kh_end(read_lookup_table)) {
-      //std::cerr << "Have barcode, have read, try whether match.\n";
-      uint128_t read_seeds = kh_value(read_lookup_table, read_lookup_table_iterator);
-      if (read_seeds.first == read1_seed2 && read_seeds.second == read2_seed2) {
-        //std::cerr << "Have barcode, have read, and match.\n";
-        return true;
-      } else {
-        //std::cerr << "Have barcode, have read, but don't match.\n";
-        return false;
-      }
-    } else {
-      //std::cerr << "Have barcode, no read.\n";
-      uint128_t read_seeds = {.first = read1_seed2, .second = read2_seed2};
-      int khash_return_code;
-      khiter_t read_lookup_table_insert_iterator = kh_put(k128, read_lookup_table, read_seed_key, &khash_return_code);
-      assert(khash_return_code != -1 && khash_return_code != 0);
-      kh_value(read_lookup_table, read_lookup_table_insert_iterator) = read_seeds;
-      //std::cerr << "Have barcode, no read.\n";
-      return false;
-    }
-  } else {
-    // insert the barcode and append a new read hash table to tables and then insert the reads
-    //std::cerr << "No barcode, no read.\n";
-    int khash_return_code;
-    khiter_t barcode_table_insert_iterator = kh_put(k32, barcode_lookup_table_, barcode_key, &khash_return_code);
-    assert(khash_return_code != -1 && khash_return_code != 0);
-    kh_value(barcode_lookup_table_, barcode_table_insert_iterator) = read_lookup_tables_.size();
-    khash_t(k128) *read_lookup_table = kh_init(k128);
-    khiter_t read_lookup_table_iterator = kh_put(k128, read_lookup_table, read_seed_key, &khash_return_code);
-    assert(khash_return_code != -1 && khash_return_code != 0);
-    uint128_t read_seeds = {.first = read1_seed2, .second = read2_seed2};
-    kh_value(read_lookup_table, read_lookup_table_iterator) = read_seeds;
-    read_lookup_tables_.push_back(read_lookup_table);
-    if (kh_size(barcode_lookup_table_) >= (uint32_t)allocated_barcode_lookup_table_size_) {
-      allocated_barcode_lookup_table_size_ <<= 1;
-      kh_resize(k32, barcode_lookup_table_, allocated_barcode_lookup_table_size_);
-    }
-    //std::cerr << "No barcode, no read.\n";
-    return false;
+bool Chromap<MappingRecord>::PairedEndReadWithBarcodeIsDuplicate(uint32_t pair_index, const SequenceBatch &barcode_batch, const SequenceBatch &read_batch1, const SequenceBatch &read_batch2, uint64_t *read_pair_hash) {
+  // The fingerprint covers the (corrected) barcode and both mates in full, so
+  // flagged pairs would have been mapped to the same place as the first one.
+  uint64_t barcode_hash = 0;
+  if (!is_bulk_data_) {
+    barcode_hash = DuplicateReadPairSet::HashSequence(barcode_batch.GetSequenceAt(pair_index), barcode_batch.GetSequenceLengthAt(pair_index), 0);
   }
+  uint64_t read1_hash = DuplicateReadPairSet::HashSequence(read_batch1.GetSequenceAt(pair_index), read_batch1.GetSequenceLengthAt(pair_index), barcode_hash);
+  *read_pair_hash = DuplicateReadPairSet::HashSequence(read_batch2.GetSequenceAt(pair_index), read_batch2.GetSequenceLengthAt(pair_index), read1_hash);
+  return duplicate_read_pair_set_.Insert(*read_pair_hash, read1_hash, read_batch1.GetSequenceIdAt(pair_index));
 }
 
 template <typename MappingRecord>
@@ -198,79 +126,270 @@ void Chromap<MappingRecord>::CorrectBarcodeAt(uint32_t barcode_index, SequenceBa
 
 template <typename MappingRecord>
 uint32_t Chromap<MappingRecord>::CallPeaks(uint16_t coverage_threshold, uint32_t num_reference_sequences, const SequenceBatch &reference) {
+  return CallPeaksOnBarcodedFragments(coverage_threshold, num_reference_sequences, reference, HasBarcodedFragments<MappingRecord>());
+}
+
+template <typename MappingRecord>
+uint32_t Chromap<MappingRecord>::CallPeaksOnBarcodedFragments(uint16_t coverage_threshold, uint32_t num_reference_sequences, const SequenceBatch &reference, std::false_type has_barcoded_fragments) {
   return 0;
 }
- 
-template <>
-uint32_t Chromap<PairedEndMappingWithBarcode>::CallPeaks(uint16_t coverage_threshold, uint32_t num_reference_sequences, const SequenceBatch &reference) {
+
+template <typename MappingRecord>
+uint32_t Chromap<MappingRecord>::CallPeaksOnBarcodedFragments(uint16_t coverage_threshold, uint32_t num_reference_sequences, const SequenceBatch &reference, std::true_type has_barcoded_fragments) {
   double real_start_time = GetRealTime();
-  std::vector<std::vector<PairedEndMappingWithBarcode> > &mappings = allocate_multi_mappings_ ? allocated_mappings_on_diff_ref_seqs_ : (remove_pcr_duplicates_ ? deduped_mappings_on_diff_ref_seqs_ : mappings_on_diff_ref_seqs_);
-  // Build pileup
+  std::vector<std::vector<MappingRecord> > &mappings = allocate_multi_mappings_ ? allocated_mappings_on_diff_ref_seqs_ : (remove_pcr_duplicates_ ? deduped_mappings_on_diff_ref_seqs_ : mappings_on_diff_ref_seqs_);
+  // The genome-wide background of the Poisson peak caller is the smoothed
+  // signal the cut sites would give if they were spread evenly.
+  double genome_background_lambda = 0;
+  if (peak_pvalue_cutoff_ > 0) {
+    uint64_t num_cut_sites = 0;
+    uint64_t genome_length = 0;
+    for (uint32_t ri = 0; ri < num_reference_sequences; ++ri) {
+      num_cut_sites += 2 * mappings[ri].size();
+      genome_length += reference.GetSequenceLengthAt(ri);
+    }
+    genome_background_lambda = (double)num_cut_sites * cut_site_smoothing_length_ / std::max(genome_length, (uint64_t)1);
+    std::cerr << "Call peaks on " << num_cut_sites << " cut sites with genome background lambda " << genome_background_lambda << ".\n";
+  }
+  // Call peaks and build their trees on each ref seq in parallel
+  peaks_on_diff_ref_seqs_.assign(num_reference_sequences, std::vector<Peak>());
+  tree_extras_on_diff_ref_seqs_.assign(num_reference_sequences, std::vector<uint32_t>());
+  tree_info_on_diff_ref_seqs_.assign(num_reference_sequences, std::pair<int, uint32_t>(0, 0));
+#pragma omp parallel for default(none) shared(coverage_threshold, genome_background_lambda, num_reference_sequences, reference, mappings) schedule(dynamic, 1) num_threads(num_threads_)
   for (uint32_t ri = 0; ri < num_reference_sequences; ++ri) {
-    pileup_on_diff_ref_seqs_.emplace_back(std::vector<uint16_t>());
-    pileup_on_diff_ref_seqs_[ri].assign(reference.GetSequenceLengthAt(ri), 0);
-    for (size_t mi = 0; mi < mappings[ri].size(); ++mi) {
-      for (uint16_t pi = 0; pi < mappings[ri][mi].fragment_length; ++pi) {
-        ++pileup_on_diff_ref_seqs_[ri][mappings[ri][mi].GetStartPosition() + pi];
-      }
+    if (mappings[ri].empty()) {
+      continue;
     }
+    if (peak_pvalue_cutoff_ > 0) {
+      CallPeaksOnCutSites(genome_background_lambda, reference.GetSequenceLengthAt(ri), mappings[ri], &(peaks_on_diff_ref_seqs_[ri]));
+      MergePeaks(&(peaks_on_diff_ref_seqs_[ri]));
+    } else {
+      CallPeaksOnReferenceSequence(coverage_threshold, reference.GetSequenceLengthAt(ri), mappings[ri], &(peaks_on_diff_ref_seqs_[ri]));
+    }
+    tree_extras_on_diff_ref_seqs_[ri].assign(peaks_on_diff_ref_seqs_[ri].size(), 0);
+    BuildAugmentedTreeForPeaks(ri);
   }
-  std::cerr << "Built pileup in " << Chromap<>::GetRealTime() - real_start_time << "s.\n";
-  real_start_time = GetRealTime();
-  // Call and save peaks
-  tree_extras_on_diff_ref_seqs_.clear();
-  tree_info_on_diff_ref_seqs_.clear();
-  tree_extras_on_diff_ref_seqs_.reserve(num_reference_sequences);
-  tree_info_on_diff_ref_seqs_.reserve(num_reference_sequences);
-  uint32_t peak_count = 0; 
+  // Number and output the peaks in the order of the ref seqs
+  uint32_t peak_count = 0;
   for (uint32_t ri = 0; ri < num_reference_sequences; ++ri) {
-    tree_extras_on_diff_ref_seqs_.emplace_back(std::vector<uint32_t>());
-    tree_extras_on_diff_ref_seqs_[ri].reserve(reference.GetSequenceLengthAt(ri) / 100);
-    peaks_on_diff_ref_seqs_.emplace_back(std::vector<Peak>());
-    uint32_t peak_start_position = 0;
-    uint16_t peak_length = 0;
-    for (size_t pi = 0; pi < reference.GetSequenceLengthAt(ri); ++pi) {
-      if (pileup_on_diff_ref_seqs_[ri][pi] >= coverage_threshold) {
-        if (peak_length == 0) { // start a new peak
-          peak_start_position = pi;
-        }
-        ++peak_length; // extend the peak
-      } else if (peak_length > 0) { // save the previous peak
-        // TODO(Haowen): improve peak calling
-        peaks_on_diff_ref_seqs_[ri].emplace_back(Peak{peak_start_position, peak_length, peak_count}); 
-        tree_extras_on_diff_ref_seqs_[ri].emplace_back(0);
-        output_tools_->OutputPeaks(peak_start_position, peak_length, ri, reference);
-        ++peak_count;
-        peak_length = 0;
-      }
+    for (Peak &peak : peaks_on_diff_ref_seqs_[ri]) {
+      peak.index = peak_count;
+      output_tools_->OutputPeaks(peak.start_position, peak.length, ri, reference);
+      ++peak_count;
     }
-    BuildAugmentedTreeForPeaks(ri);
   }
   std::cerr << "Call peaks and built peak augmented tree in " << Chromap<>::GetRealTime() - real_start_time << "s.\n";
-  // Output feature matrix
   return peak_count;
 }
 
+template <typename MappingRecord>
+void Chromap<MappingRecord>::CallPeaksOnReferenceSequence(uint16_t coverage_threshold, uint32_t reference_sequence_length, const std::vector<MappingRecord> &mappings, std::vector<Peak> *peaks) {
+  // Sweep the fragment start and end positions in order, so the coverage is
+  // only evaluated where it changes and no per-base pileup is needed. The
+  // fragments are usually sorted by start already.
+  std::vector<uint32_t> start_positions;
+  std::vector<uint32_t> end_positions;
+  start_positions.reserve(mappings.size());
+  end_positions.reserve(mappings.size());
+  for (const MappingRecord &mapping : mappings) {
+    uint32_t start_position = std::min(mapping.GetStartPosition(), reference_sequence_length);
+    start_positions.emplace_back(start_position);
+    end_positions.emplace_back(std::max(start_position, std::min(mapping.GetStartPosition() + mapping.fragment_length, reference_sequence_length)));
+  }
+  if (!std::is_sorted(start_positions.begin(), start_positions.end())) {
+    std::sort(start_positions.begin(), start_positions.end());
+  }
+  std::sort(end_positions.begin(), end_positions.end());
+  // A peak needs at least one fragment, and the depth saturates at the max of
+  // the threshold type rather than wrapping around.
+  uint32_t min_depth = std::max(coverage_threshold, (uint16_t)1);
+  uint64_t depth = 0;
+  bool in_peak = false;
+  uint32_t peak_start_position = 0;
+  size_t si = 0;
+  size_t ei = 0;
+  while (ei < end_positions.size()) {
+    uint32_t position = end_positions[ei];
+    if (si < start_positions.size() && start_positions[si] < position) {
+      position = start_positions[si];
+    }
+    for (; si < start_positions.size() && start_positions[si] == position; ++si) {
+      ++depth;
+    }
+    for (; ei < end_positions.size() && end_positions[ei] == position; ++ei) {
+      --depth;
+    }
+    uint32_t saturated_depth = std::min(depth, (uint64_t)std::numeric_limits<uint16_t>::max());
+    if (!in_peak && saturated_depth >= min_depth) {
+      in_peak = true;
+      peak_start_position = position;
+    } else if (in_peak && saturated_depth < min_depth) {
+      in_peak = false;
+      peaks->emplace_back(Peak{peak_start_position, position - peak_start_position, 0});
+    }
+  }
+}
+
+template <typename MappingRecord>
+void Chromap<MappingRecord>::CallPeaksOnCutSites(double genome_background_lambda, uint32_t reference_sequence_length, const std::vector<MappingRecord> &mappings, std::vector<Peak> *peaks) {
+  // The two ends of each fragment are its Tn5 cut sites.
+  std::vector<int64_t> cut_sites;
+  cut_sites.reserve(2 * mappings.size());
+  for (const MappingRecord &mapping : mappings) {
+    cut_sites.emplace_back(mapping.GetStartPosition());
+    cut_sites.emplace_back(mapping.GetStartPosition() + std::max((int64_t)mapping.fragment_length - 1, (int64_t)0));
+  }
+  std::sort(cut_sites.begin(), cut_sites.end());
+  // Each track adds one over [c - length / 2, c - length / 2 + length) for each
+  // cut site c. Track 0 is the smoothed signal, and the others count the cut
+  // sites in the windows around each position for the local background. The
+  // tracks only change at these interval ends, so sweeping them in order gives
+  // every position where the signal or the background can change.
+  size_t num_tracks = 1 + peak_lambda_windows_.size();
+  std::vector<int64_t> track_lengths(num_tracks, cut_site_smoothing_length_);
+  for (size_t ti = 1; ti < num_tracks; ++ti) {
+    track_lengths[ti] = peak_lambda_windows_[ti - 1];
+  }
+  std::vector<size_t> entering_indices(num_tracks, 0);
+  std::vector<size_t> exiting_indices(num_tracks, 0);
+  std::vector<uint64_t> counts(num_tracks, 0);
+  bool in_peak = false;
+  uint32_t peak_start_position = 0;
+  uint64_t last_signal = 0;
+  double last_lambda = -1;
+  bool last_is_enriched = false;
+  while (true) {
+    int64_t position = std::numeric_limits<int64_t>::max();
+    for (size_t ti = 0; ti < num_tracks; ++ti) {
+      int64_t offset = track_lengths[ti] / 2;
+      if (entering_indices[ti] < cut_sites.size()) {
+        position = std::min(position, cut_sites[entering_indices[ti]] - offset);
+      }
+      if (exiting_indices[ti] < cut_sites.size()) {
+        position = std::min(position, cut_sites[exiting_indices[ti]] - offset + track_lengths[ti]);
+      }
+    }
+    if (position == std::numeric_limits<int64_t>::max()) {
+      break;
+    }
+    // Intervals sticking out of the ref seq are clipped to it.
+    position = std::max(position, (int64_t)0);
+    if (position >= reference_sequence_length) {
+      if (in_peak) {
+        peaks->emplace_back(Peak{peak_start_position, reference_sequence_length - peak_start_position, 0});
+      }
+      break;
+    }
+    for (size_t ti = 0; ti < num_tracks; ++ti) {
+      int64_t offset = track_lengths[ti] / 2;
+      for (; entering_indices[ti] < cut_sites.size() && cut_sites[entering_indices[ti]] - offset <= position; ++entering_indices[ti]) {
+        ++counts[ti];
+      }
+      for (; exiting_indices[ti] < cut_sites.size() && cut_sites[exiting_indices[ti]] - offset + track_lengths[ti] <= position; ++exiting_indices[ti]) {
+        --counts[ti];
+      }
+    }
+    // The local lambda is the highest of the genome-wide background and the
+    // backgrounds of the windows, each scaled to the smoothing length.
+    double lambda = genome_background_lambda;
+    for (size_t ti = 1; ti < num_tracks; ++ti) {
+      lambda = std::max(lambda, (double)counts[ti] * track_lengths[0] / track_lengths[ti]);
+    }
+    if (counts[0] != last_signal || lambda != last_lambda) {
+      last_signal = counts[0];
+      last_lambda = lambda;
+      last_is_enriched = counts[0] > 0 && GetPoissonUpperTailScore(counts[0], lambda) >= peak_pvalue_cutoff_;
+    }
+    if (!in_peak && last_is_enriched) {
+      in_peak = true;
+      peak_start_position = position;
+    } else if (in_peak && !last_is_enriched) {
+      in_peak = false;
+      peaks->emplace_back(Peak{peak_start_position, (uint32_t)position - peak_start_position, 0});
+    }
+  }
+}
+
+template <typename MappingRecord>
+void Chromap<MappingRecord>::MergePeaks(std::vector<Peak> *peaks) {
+  // Merge the peaks separated by at most peak_merge_max_length_ bases, and then
+  // drop the ones shorter than peak_min_length_.
+  size_t num_merged_peaks = 0;
+  for (size_t pi = 0; pi < peaks->size(); ++pi) {
+    const Peak &peak = (*peaks)[pi];
+    if (num_merged_peaks > 0) {
+      Peak &last_peak = (*peaks)[num_merged_peaks - 1];
+      if (peak.start_position <= last_peak.start_position + last_peak.length + (uint32_t)peak_merge_max_length_) {
+        last_peak.length = peak.start_position + peak.length - last_peak.start_position;
+        continue;
+      }
+    }
+    (*peaks)[num_merged_peaks++] = peak;
+  }
+  peaks->resize(num_merged_peaks);
+  peaks->erase(std::remove_if(peaks->begin(), peaks->end(), [this](const Peak &peak) { return peak.length < (uint32_t)peak_min_length_; }), peaks->end());
+}
+
+template <typename MappingRecord>
+double Chromap<MappingRecord>::GetPoissonUpperTailScore(uint64_t observation, double lambda) {
+  if (observation == 0) {
+    return 0;
+  }
+  if (observation > lambda) {
+    // The terms decrease from the observation on, so sum them relative to the
+    // first one in log space, which doesn't underflow for tiny p-values.
+    double log_first_term = -lambda + observation * log(lambda) - lgamma(observation + 1.0);
+    double sum = 1;
+    double term = 1;
+    for (uint64_t i = observation + 1; term > sum * 1e-12; ++i) {
+      term *= lambda / i;
+      sum += term;
+    }
+    return -(log_first_term + log(sum)) / log(10.0);
+  }
+  // The tail is large, so take the complement of the terms below the
+  // observation, which decrease from observation - 1 downwards.
+  double log_last_term = -lambda + (observation - 1) * log(lambda) - lgamma((double)observation);
+  double sum = 1;
+  double term = 1;
+  for (uint64_t i = observation - 1; i > 0 && term > sum * 1e-12; --i) {
+    term *= i / lambda;
+    sum += term;
+  }
+  double p_value = 1 - exp(log_last_term + log(sum));
+  return -log10(std::max(p_value, std::numeric_limits<double>::min()));
+}
+
 template <typename MappingRecord>
 void Chromap<MappingRecord>::OutputFeatureMatrix(uint32_t num_sequences, const SequenceBatch &reference) {
+  OutputFeatureMatrixOfBarcodedFragments(num_sequences, reference, HasBarcodedFragments<MappingRecord>());
+}
+
+template <typename MappingRecord>
+void Chromap<MappingRecord>::OutputFeatureMatrixOfBarcodedFragments(uint32_t num_sequences, const SequenceBatch &reference, std::false_type has_barcoded_fragments) {
 }
 
-template <>
-void Chromap<PairedEndMappingWithBarcode>::OutputFeatureMatrix(uint32_t num_sequences, const SequenceBatch &reference) {
+template <typename MappingRecord>
+void Chromap<MappingRecord>::OutputFeatureMatrixOfBarcodedFragments(uint32_t num_sequences, const SequenceBatch &reference, std::true_type has_barcoded_fragments) {
   uint32_t num_peaks = 0;
   if (cell_by_bin_) {
     output_tools_->OutputPeaks(bin_size_, num_sequences, reference);
+    // Prefix sums of the numbers of bins, so the bins of a mapping are found
+    // without going through the ref seqs before it.
+    bin_offsets_on_diff_ref_seqs_.assign(num_sequences + 1, 0);
     for (uint32_t i = 0; i < num_sequences; ++i) {
       uint32_t ref_seq_length = reference.GetSequenceLengthAt(i);
-      num_peaks += ref_seq_length / bin_size_;
+      uint32_t num_bins = ref_seq_length / bin_size_;
       if (ref_seq_length % bin_size_ != 0) {
-        ++num_peaks;
+        ++num_bins;
       }
+      bin_offsets_on_diff_ref_seqs_[i + 1] = bin_offsets_on_diff_ref_seqs_[i] + num_bins;
     }
+    num_peaks = bin_offsets_on_diff_ref_seqs_[num_sequences];
   } else {
     num_peaks = CallPeaks(depth_cutoff_to_call_peak_, num_sequences, reference);
   }
-  std::vector<std::vector<PairedEndMappingWithBarcode> > &mappings = allocate_multi_mappings_ ? allocated_mappings_on_diff_ref_seqs_ : (remove_pcr_duplicates_ ? deduped_mappings_on_diff_ref_seqs_ : mappings_on_diff_ref_seqs_);
+  std::vector<std::vector<MappingRecord> > &mappings = allocate_multi_mappings_ ? allocated_mappings_on_diff_ref_seqs_ : (remove_pcr_duplicates_ ? deduped_mappings_on_diff_ref_seqs_ : mappings_on_diff_ref_seqs_);
   double real_start_time = GetRealTime();
   // First pass to index barcodes
   uint32_t barcode_index = 0;
@@ -300,7 +419,7 @@ void Chromap<PairedEndMappingWithBarcode>::OutputFeatureMatrix(uint32_t num_sequ
       uint64_t barcode_index = kh_value(barcode_index_table_, barcode_index_table_iterator);
       overlapped_peak_indices.clear();
       if (cell_by_bin_) {
-        GetNumOverlappedBins(rid, mappings[rid][mi].GetStartPosition(), mappings[rid][mi].GetEndPosition() - mappings[rid][mi].GetStartPosition(), num_sequences, reference, overlapped_peak_indices);
+        GetNumOverlappedBins(rid, mappings[rid][mi].GetStartPosition(), mappings[rid][mi].GetEndPosition() - mappings[rid][mi].GetStartPosition(), overlapped_peak_indices);
       } else {
         GetNumOverlappedPeaks(rid, mappings[rid][mi], overlapped_peak_indices);
       }
@@ -339,22 +458,16 @@ void Chromap<PairedEndMappingWithBarcode>::OutputFeatureMatrix(uint32_t num_sequ
 }
 
 template <typename MappingRecord>
-void Chromap<MappingRecord>::GetNumOverlappedBins(uint32_t rid, uint32_t start_position, uint16_t mapping_length, uint32_t num_sequences, const SequenceBatch &reference, std::vector<uint32_t> &overlapped_peak_indices) {
-  uint32_t bin_index = 0;
-  for (uint32_t i = 0; i < rid; ++i) {
-    uint32_t ref_seq_length = reference.GetSequenceLengthAt(i);
-    bin_index += ref_seq_length / bin_size_;
-    if (ref_seq_length % bin_size_ != 0) {
-      ++bin_index;
-    }
+void Chromap<MappingRecord>::GetNumOverlappedBins(uint32_t rid, uint32_t start_position, uint16_t mapping_length, std::vector<uint32_t> &overlapped_peak_indices) {
+  // Bins are numbered on each ref seq and then shifted by the bins before it.
+  uint32_t first_bin_index = start_position / bin_size_;
+  uint32_t last_bin_index = mapping_length > 0 ? (start_position + mapping_length - 1) / bin_size_ : first_bin_index;
+  uint32_t num_bins = bin_offsets_on_diff_ref_seqs_[rid + 1] - bin_offsets_on_diff_ref_seqs_[rid];
+  if (last_bin_index >= num_bins) {
+    last_bin_index = num_bins - 1;
   }
-  bin_index += start_position / bin_size_;
-  overlapped_peak_indices.emplace_back(bin_index);
-  uint32_t max_num_overlapped_bins = mapping_length / bin_size_ + 2;
-  for (uint32_t i = 0; i < max_num_overlapped_bins; ++i) {
-    if (start_position + mapping_length - 1 >= (bin_index + 1 + i) * bin_size_) {
-      overlapped_peak_indices.emplace_back(bin_index + 1 + i);
-    }
+  for (uint32_t bin_index = first_bin_index; bin_index <= last_bin_index; ++bin_index) {
+    overlapped_peak_indices.emplace_back(bin_offsets_on_diff_ref_seqs_[rid] + bin_index);
   }
 }
 
@@ -392,7 +505,7 @@ void Chromap<MappingRecord>::BuildAugmentedTreeForPeaks(uint32_t ref_id) {
       last = extras[last_i];
   }
   max_level = k - 1;
-  tree_info_on_diff_ref_seqs_.emplace_back(max_level, peaks.size());
+  tree_info_on_diff_ref_seqs_[ref_id] = std::make_pair(max_level, (uint32_t)peaks.size());
 }
 
 template <typename MappingRecord>
@@ -447,19 +560,31 @@ uint32_t Chromap<MappingRecord>::LoadPairedEndReadsWithBarcodes(SequenceBatch *r
   uint32_t num_loaded_pairs = 0;
   while (num_loaded_pairs < read_batch_size_) {
     bool no_more_read1 = read_batch1->LoadOneSequenceAndSaveAt(num_loaded_pairs);
-    bool no_more_read2 = read_batch2->LoadOneSequenceAndSaveAt(num_loaded_pairs);
+    bool no_more_read2 = true;
+    if (read_file2_paths_.empty()) {
+      // Mates are interleaved in the read 1 stream, so read 2 borrows it.
+      read_batch2->SwapLoadingState(*read_batch1);
+      no_more_read2 = read_batch2->LoadOneSequenceAndSaveAt(num_loaded_pairs);
+      read_batch2->SwapLoadingState(*read_batch1);
+    } else {
+      no_more_read2 = read_batch2->LoadOneSequenceAndSaveAt(num_loaded_pairs);
+    }
     bool no_more_barcode = no_more_read2;
     if (!is_bulk_data_) {
-      no_more_barcode = barcode_batch->LoadOneSequenceAndSaveAt(num_loaded_pairs);
+      if (!BarcodesAreInReadNames()) {
+        no_more_barcode = barcode_batch->LoadOneSequenceAndSaveAt(num_loaded_pairs);
+      } else if (!no_more_read1) {
+        SaveBarcodeInReadNameAt(num_loaded_pairs, *read_batch1, barcode_batch);
+      }
     }
     if ((!no_more_read1) && (!no_more_read2) && (!no_more_barcode)) {
+      // The lanes are loaded as one stream, so mates must come from the same lane.
+      if (read_batch1->GetCurrentFileIndex() != read_batch2->GetCurrentFileIndex() || (!is_bulk_data_ && !BarcodesAreInReadNames() && barcode_batch->GetCurrentFileIndex() != read_batch1->GetCurrentFileIndex())) {
+        Chromap<>::ExitWithMessage("Numbers of reads and barcodes don't match!");
+      }
       if (read_batch1->GetSequenceLengthAt(num_loaded_pairs) < (uint32_t)min_read_length_ || read_batch2->GetSequenceLengthAt(num_loaded_pairs) < (uint32_t)min_read_length_) {
         continue; // reads are too short, just drop.
       }
-      //if (PairedEndReadWithBarcodeIsDuplicate(num_loaded_pairs, (*barcode_batch), (*read_batch1), (*read_batch2))) {
-      //  num_duplicated_reads_ += 2;
-      //  continue;
-      //}
     } else if (no_more_read1 && no_more_read2 && no_more_barcode) {
       break;
     } else {
@@ -475,34 +600,82 @@ uint32_t Chromap<MappingRecord>::LoadPairedEndReadsWithBarcodes(SequenceBatch *r
   return num_loaded_pairs;
 }
 
+template <typename MappingRecord>
+void Chromap<MappingRecord>::SaveBarcodeInReadNameAt(uint32_t read_index, const SequenceBatch &read_batch, SequenceBatch *barcode_batch) {
+  const char *barcode = NULL;
+  uint32_t barcode_length = 0;
+  const char *barcode_qual = NULL;
+  uint32_t barcode_qual_length = 0;
+  if (!barcode_tag_.empty()) {
+    // Tagged fields such as CB:Z:ACGT are separated by white spaces in the comment
+    const char *comment = read_batch.GetSequenceCommentAt(read_index);
+    uint32_t comment_length = read_batch.GetSequenceCommentLengthAt(read_index);
+    uint32_t field_start = 0;
+    while (field_start < comment_length) {
+      uint32_t field_end = field_start;
+      while (field_end < comment_length && !isspace(comment[field_end])) {
+        ++field_end;
+      }
+      const char *field = comment + field_start;
+      uint32_t field_length = field_end - field_start;
+      if (field_length > barcode_tag_.size() && strncmp(field, barcode_tag_.data(), barcode_tag_.size()) == 0) {
+        barcode = field + barcode_tag_.size();
+        barcode_length = field_length - barcode_tag_.size();
+      } else if (!barcode_qual_tag_.empty() && field_length > barcode_qual_tag_.size() && strncmp(field, barcode_qual_tag_.data(), barcode_qual_tag_.size()) == 0) {
+        barcode_qual = field + barcode_qual_tag_.size();
+        barcode_qual_length = field_length - barcode_qual_tag_.size();
+      }
+      field_start = field_end + 1;
+    }
+  } else {
+    const char *name = read_batch.GetSequenceNameAt(read_index);
+    uint32_t name_length = read_batch.GetSequenceNameLengthAt(read_index);
+    int num_fields = 1 + std::count(name, name + name_length, barcode_name_delimiter_);
+    int field_index = barcode_name_field_ > 0 ? barcode_name_field_ - 1 : num_fields + barcode_name_field_;
+    if (field_index >= 0 && field_index < num_fields) {
+      uint32_t field_start = 0;
+      for (int fi = 0; fi < field_index; ++fi) {
+        field_start = (const char*)memchr(name + field_start, barcode_name_delimiter_, name_length - field_start) - name + 1;
+      }
+      const char *field_end = (const char*)memchr(name + field_start, barcode_name_delimiter_, name_length - field_start);
+      barcode = name + field_start;
+      barcode_length = (field_end == NULL ? name + name_length : field_end) - barcode;
+    }
+  }
+  // Drop suffixes such as the -1 of 10x barcodes
+  uint32_t num_bases = 0;
+  while (num_bases < barcode_length && isalpha(barcode[num_bases])) {
+    ++num_bases;
+  }
+  if (num_bases == 0) {
+    Chromap<>::ExitWithMessage("No cell barcode found in the header of read " + std::string(read_batch.GetSequenceNameAt(read_index)));
+  }
+  barcode_batch->SaveSequenceAt(read_index, barcode, num_bases, barcode_qual_length >= num_bases ? barcode_qual : NULL);
+}
+
 template <typename MappingRecord>
 void Chromap<MappingRecord>::ComputeBarcodeAbundance(uint64_t max_num_sample_barcodes) {
   double real_start_time = Chromap<>::GetRealTime();
   SequenceBatch barcode_batch(read_batch_size_);
-  for (size_t read_file_index = 0; read_file_index < read_file1_paths_.size(); ++read_file_index) {
-    barcode_batch.InitializeLoading(barcode_file_paths_[read_file_index]);
-    uint32_t num_loaded_barcodes = barcode_batch.LoadBatch();
-    while (num_loaded_barcodes > 0) {
-      for (uint32_t barcode_index = 0; barcode_index < num_loaded_barcodes; ++barcode_index) {
-        uint32_t barcode_length = barcode_batch.GetSequenceLengthAt(barcode_index);
-        uint32_t barcode_key = barcode_batch.GenerateSeedFromSequenceAt(barcode_index, 0, barcode_length);
-        khiter_t barcode_whitelist_lookup_table_iterator = kh_get(k32, barcode_whitelist_lookup_table_, barcode_key);
-        if (barcode_whitelist_lookup_table_iterator != kh_end(barcode_whitelist_lookup_table_)) {
-          // Correct barcode
-          kh_value(barcode_whitelist_lookup_table_, barcode_whitelist_lookup_table_iterator) += 1;
-          ++num_sample_barcodes_;
-        }
+  barcode_batch.InitializeLoading(barcode_file_paths_, num_prefetched_lanes_, GetNumInflateThreadsPerReadFile(1));
+  uint32_t num_loaded_barcodes = barcode_batch.LoadBatch();
+  while (num_loaded_barcodes > 0) {
+    for (uint32_t barcode_index = 0; barcode_index < num_loaded_barcodes; ++barcode_index) {
+      uint32_t barcode_length = barcode_batch.GetSequenceLengthAt(barcode_index);
+      uint32_t barcode_key = barcode_batch.GenerateSeedFromSequenceAt(barcode_index, 0, barcode_length);
+      khiter_t barcode_whitelist_lookup_table_iterator = kh_get(k32, barcode_whitelist_lookup_table_, barcode_key);
+      if (barcode_whitelist_lookup_table_iterator != kh_end(barcode_whitelist_lookup_table_)) {
+        // Correct barcode
+        kh_value(barcode_whitelist_lookup_table_, barcode_whitelist_lookup_table_iterator) += 1;
+        ++num_sample_barcodes_;
       }
-      if (num_sample_barcodes_ >= max_num_sample_barcodes) {
-        break;
-      }
-      num_loaded_barcodes = barcode_batch.LoadBatch();
     }
-    barcode_batch.FinalizeLoading();
     if (num_sample_barcodes_ >= max_num_sample_barcodes) {
       break;
     }
+    num_loaded_barcodes = barcode_batch.LoadBatch();
   }
+  barcode_batch.FinalizeLoading();
   std::cerr << "Compute barcode abundance using " << num_sample_barcodes_ << " in "<< Chromap<>::GetRealTime() - real_start_time << "s.\n";
 }
 
@@ -615,115 +788,166 @@ void Chromap<MappingRecord>::SupplementCandidates(const Index &index, uint32_t r
   }
 }
 
+template <typename MappingRecord>
+void Chromap<MappingRecord>::WaitForOutputTurn(int chunk_index, std::mutex *chunk_mutex, std::condition_variable *output_turn_condition, const int *next_chunk_to_output) {
+  std::unique_lock<std::mutex> lock(*chunk_mutex);
+  output_turn_condition->wait(lock, [chunk_index, next_chunk_to_output] { return *next_chunk_to_output == chunk_index; });
+}
+
+template <typename MappingRecord>
+void Chromap<MappingRecord>::OutputDedupedMappingsInBuffer(const SequenceBatch &reference, std::vector<MappingRecord> *deduped_mappings, std::vector<std::pair<uint32_t, size_t> > *deduped_mapping_ends) {
+  size_t mi = 0;
+  for (const std::pair<uint32_t, size_t> &deduped_mapping_end : *deduped_mapping_ends) {
+    for (; mi < deduped_mapping_end.second; ++mi) {
+      output_tools_->AppendMapping(deduped_mapping_end.first, reference, (*deduped_mappings)[mi]);
+    }
+  }
+  deduped_mappings->clear();
+  deduped_mapping_ends->clear();
+}
+
 template <typename MappingRecord>
 void Chromap<MappingRecord>::PostProcessingInLowMemory(uint32_t num_mappings_in_mem, uint32_t num_reference_sequences, const SequenceBatch &reference) {
   if (num_mappings_in_mem > 0) {
-    TempMappingFileHandle<MappingRecord> temp_mapping_file_handle;
-    temp_mapping_file_handle.file_path = mapping_output_file_path_ + ".temp" + std::to_string(temp_mapping_file_handles_.size());
-    temp_mapping_file_handles_.emplace_back(temp_mapping_file_handle);
-    SortOutputMappings(num_reference_sequences, &mappings_on_diff_ref_seqs_);
-    //double output_temp_mapping_start_time = Chromap<>::GetRealTime();
-    output_tools_-> OutputTempMapping(temp_mapping_file_handle.file_path, num_reference_sequences, mappings_on_diff_ref_seqs_);
-    //std::cerr << "Output temp mappings in " << Chromap<>::GetRealTime() - output_temp_mapping_start_time << "s.\n";
+    SortOutputMappings(num_reference_sequences, &mappings_on_diff_ref_seqs_, num_threads_);
+    temp_mapping_spiller_.Spill(/*are_sorted=*/true, &mappings_on_diff_ref_seqs_);
     num_mappings_in_mem = 0;
-    for (uint32_t i = 0; i < num_reference_sequences; ++i) {
-      mappings_on_diff_ref_seqs_[i].clear();
-    }
   }
+  temp_mapping_spiller_.Wait();
+  temp_mapping_spiller_.OutputStats();
+  std::vector<TempMappingFileHandle<MappingRecord> > &temp_mapping_file_handles = temp_mapping_spiller_.GetTempMappingFileHandles();
   double sort_and_dedupe_start_time = Chromap<>::GetRealTime();
-  // Calculate block size and initialize
-  uint64_t max_mem_size = 10 * ((uint64_t)1 << 30);
-  for (size_t hi = 0; hi < temp_mapping_file_handles_.size(); ++hi) {
-    temp_mapping_file_handles_[hi].block_size = max_mem_size / temp_mapping_file_handles_.size() / sizeof(MappingRecord);
-    temp_mapping_file_handles_[hi].InitializeTempMappingLoading(num_reference_sequences);
-    temp_mapping_file_handles_[hi].LoadTempMappingBlock(num_reference_sequences);
-  }
-  // Merge and dedupe
-  bool all_merged = false;
-  uint32_t last_rid = std::numeric_limits<uint32_t>::max();
-  MappingRecord last_mapping;
-  uint8_t dup_count = 0;
+  for (size_t hi = 0; hi < temp_mapping_file_handles.size(); ++hi) {
+    temp_mapping_file_handles[hi].InitializeTempMappingLoading();
+  }
+  // Each ref seq is merged on its own, so the threads merge different ref seqs
+  // in parallel. Each thread needs a block buffer for every run. The merged
+  // mappings have to be written in ref seq order, so a thread whose turn to
+  // write hasn't come yet also buffers up to a block of deduped mappings, and
+  // then waits for its turn. There are only as many threads as the memory
+  // budget allows.
+  uint64_t merge_buffer_size_per_thread = std::max((size_t)1, temp_mapping_file_handles.size()) * TempMappingRunCursor<MappingRecord>::GetMaxMemoryBytes();
+  const uint64_t max_num_buffered_mappings_per_thread = TEMP_MAPPING_BLOCK_SIZE;
+  uint64_t output_buffer_size_per_thread = max_num_buffered_mappings_per_thread * sizeof(MappingRecord);
+  int num_merging_threads = std::max((uint64_t)1, std::min((uint64_t)num_threads_, mem_budget_ / (merge_buffer_size_per_thread + output_buffer_size_per_thread)));
+  // With one thread the merged mappings go out right away.
+  bool output_directly = num_merging_threads == 1;
+  // Only the ref seqs with mappings in some temp file are merged. Consecutive
+  // ref seqs are merged together until they hold about a block of mappings,
+  // so that the threads don't take turns on every short contig.
+  std::vector<std::pair<uint32_t, uint64_t> > num_mappings_on_rids;
+  for (const TempMappingFileHandle<MappingRecord> &temp_mapping_file_handle : temp_mapping_file_handles) {
+    for (const typename TempMappingFileHandle<MappingRecord>::RefSeqSection &section : temp_mapping_file_handle.sections) {
+      num_mappings_on_rids.emplace_back(section.rid, section.num_mappings);
+    }
+  }
+  std::sort(num_mappings_on_rids.begin(), num_mappings_on_rids.end());
+  std::vector<uint32_t> rids_with_mappings;
+  std::vector<uint32_t> chunk_starts;
+  uint64_t num_mappings_in_chunk = 0;
+  for (const std::pair<uint32_t, uint64_t> &num_mappings_on_rid : num_mappings_on_rids) {
+    if (rids_with_mappings.empty() || rids_with_mappings.back() != num_mappings_on_rid.first) {
+      if (rids_with_mappings.empty() || num_mappings_in_chunk >= TEMP_MAPPING_BLOCK_SIZE) {
+        chunk_starts.emplace_back(rids_with_mappings.size());
+        num_mappings_in_chunk = 0;
+      }
+      rids_with_mappings.emplace_back(num_mappings_on_rid.first);
+    }
+    num_mappings_in_chunk += num_mappings_on_rid.second;
+  }
+  chunk_starts.emplace_back(rids_with_mappings.size());
+  int num_chunks = chunk_starts.size() - 1;
   uint64_t num_uni_mappings = 0;
   uint64_t num_multi_mappings = 0;
   uint64_t num_mappings_passing_filters = 0;
-  while (!all_merged) {
-    // Merge, dedupe and output
-    // Find min first (sorted by rid and then barcode and then positions)
-    size_t min_handle_index = temp_mapping_file_handles_.size();
-    uint32_t min_rid = std::numeric_limits<uint32_t>::max();
-    for (size_t hi = 0; hi < temp_mapping_file_handles_.size(); ++hi) {
-      TempMappingFileHandle<MappingRecord> &current_handle = temp_mapping_file_handles_[hi];
-      if (!current_handle.all_loaded) {
-        if (min_handle_index == temp_mapping_file_handles_.size() || current_handle.current_rid < min_rid || (current_handle.current_rid == min_rid && current_handle.mappings[current_handle.current_mapping_index] < temp_mapping_file_handles_[min_handle_index].mappings[temp_mapping_file_handles_[min_handle_index].current_mapping_index])) {
-          min_handle_index = hi;
-          min_rid = current_handle.current_rid;
-        }
+  // The chunks are handed out and written in order, so the thread holding the
+  // first chunk not yet written never waits.
+  std::mutex chunk_mutex;
+  std::condition_variable output_turn_condition;
+  int next_chunk_to_merge = 0;
+  int next_chunk_to_output = 0;
+#pragma omp parallel default(none) shared(num_chunks, chunk_starts, rids_with_mappings, reference, temp_mapping_file_handles, output_directly, chunk_mutex, output_turn_condition, next_chunk_to_merge, next_chunk_to_output) num_threads(num_merging_threads) reduction(+:num_uni_mappings, num_multi_mappings, num_mappings_passing_filters)
+  {
+    std::vector<TempMappingRunCursor<MappingRecord> > cursors(temp_mapping_file_handles.size());
+    std::vector<MappingRecord> deduped_mappings;
+    // (rid, end in deduped_mappings) of the ref seqs buffered.
+    std::vector<std::pair<uint32_t, size_t> > deduped_mapping_ends;
+    while (true) {
+      int ci = 0;
+      {
+        std::lock_guard<std::mutex> lock(chunk_mutex);
+        ci = next_chunk_to_merge++;
       }
-    }
-    // Append current min to mappings if not a duplicate
-    if (min_handle_index != temp_mapping_file_handles_.size()) {
-      MappingRecord &current_min_mapping = temp_mapping_file_handles_[min_handle_index].mappings[temp_mapping_file_handles_[min_handle_index].current_mapping_index];
-      if (last_rid == min_rid && current_min_mapping == last_mapping) {
-        ++dup_count;
-      } else {
-        if (dup_count > 0) {
-          if (last_mapping.mapq >= mapq_threshold_) {
-            //if (allocate_multi_mappings_ || (only_output_unique_mappings_ && last_mapping.is_unique == 1)) {
-            last_mapping.num_dups = dup_count;
-            if (Tn5_shift_) {
-              //last_mapping.fragment_start_position += 4;
-              //last_mapping.positive_alignment_length -= 4;
-              //last_mapping.fragment_length -= 9;
-              //last_mapping.negative_alignment_length -= 5;
-              last_mapping.Tn5Shift();
+      if (ci >= num_chunks) {
+        break;
+      }
+      bool is_output_turn = output_directly;
+      for (uint32_t i = chunk_starts[ci]; i < chunk_starts[ci + 1]; ++i) {
+        uint32_t rid = rids_with_mappings[i];
+        for (size_t hi = 0; hi < temp_mapping_file_handles.size(); ++hi) {
+          cursors[hi].Initialize(temp_mapping_file_handles[hi], rid);
+        }
+        LoserTree<TempMappingRunCursor<MappingRecord> > loser_tree;
+        loser_tree.Initialize(&cursors);
+        MappingRecord last_mapping;
+        uint32_t dup_count = 0;
+        while (true) {
+          bool all_merged = loser_tree.IsEmpty();
+          // Output the last mapping once it has no more duplicates.
+          if (dup_count > 0 && (all_merged || !(cursors[loser_tree.GetWinner()].Current() == last_mapping))) {
+            if (last_mapping.mapq >= mapq_threshold_) {
+              last_mapping.num_dups = dup_count;
+              if (Tn5_shift_) {
+                last_mapping.Tn5Shift();
+              }
+              if (is_output_turn) {
+                output_tools_->AppendMapping(rid, reference, last_mapping);
+              } else {
+                deduped_mappings.emplace_back(last_mapping);
+                if (deduped_mappings.size() >= max_num_buffered_mappings_per_thread) {
+                  deduped_mapping_ends.emplace_back(rid, deduped_mappings.size());
+                  WaitForOutputTurn(ci, &chunk_mutex, &output_turn_condition, &next_chunk_to_output);
+                  OutputDedupedMappingsInBuffer(reference, &deduped_mappings, &deduped_mapping_ends);
+                  is_output_turn = true;
+                }
+              }
+              ++num_mappings_passing_filters;
             }
-            output_tools_->AppendMapping(last_rid, reference, last_mapping);
-            ++num_mappings_passing_filters;
-            //}
+            if (last_mapping.is_unique == 1) {
+              ++num_uni_mappings;
+            } else {
+              ++num_multi_mappings;
+            }
+            dup_count = 0;
           }
-          if (last_mapping.is_unique == 1) {
-            ++num_uni_mappings;
-          } else {
-            ++num_multi_mappings;
+          if (all_merged) {
+            break;
+          }
+          if (dup_count == 0) {
+            last_mapping = cursors[loser_tree.GetWinner()].Current();
           }
+          ++dup_count;
+          loser_tree.Next();
+        }
+        if (!deduped_mappings.empty()) {
+          deduped_mapping_ends.emplace_back(rid, deduped_mappings.size());
         }
-        last_mapping = current_min_mapping;
-        last_rid = min_rid;
-        dup_count = 1;
       }
-      temp_mapping_file_handles_[min_handle_index].Next(num_reference_sequences);
-    }
-    // Check if all are merged.
-    all_merged = true;
-    for (size_t hi = 0; hi < temp_mapping_file_handles_.size(); ++hi) {
-      if (!temp_mapping_file_handles_[hi].all_loaded) {
-        all_merged = false;
+      if (!is_output_turn) {
+        WaitForOutputTurn(ci, &chunk_mutex, &output_turn_condition, &next_chunk_to_output);
+        OutputDedupedMappingsInBuffer(reference, &deduped_mappings, &deduped_mapping_ends);
       }
+      {
+        std::lock_guard<std::mutex> lock(chunk_mutex);
+        ++next_chunk_to_output;
+      }
+      output_turn_condition.notify_all();
     }
   }
-  if (last_mapping.mapq >= mapq_threshold_) {
-    //if (allocate_multi_mappings_ || (only_output_unique_mappings_ && last_mapping.is_unique == 1)) {
-    last_mapping.num_dups = dup_count;
-    if (Tn5_shift_) {
-      //last_mapping.fragment_start_position += 4;
-      //last_mapping.positive_alignment_length -= 4;
-      //last_mapping.fragment_length -= 9;
-      //last_mapping.negative_alignment_length -= 5;
-      last_mapping.Tn5Shift();
-    }
-    output_tools_->AppendMapping(last_rid, reference, last_mapping);
-    ++num_mappings_passing_filters;
-    //}
-  }
-  if (last_mapping.is_unique == 1) {
-    ++num_uni_mappings;
-  } else {
-    ++num_multi_mappings;
-  }
   // Delete temp files
-  for (size_t hi = 0; hi < temp_mapping_file_handles_.size(); ++hi) {
-    temp_mapping_file_handles_[hi].FinalizeTempMappingLoading();
-    remove(temp_mapping_file_handles_[hi].file_path.c_str());
+  for (size_t hi = 0; hi < temp_mapping_file_handles.size(); ++hi) {
+    temp_mapping_file_handles[hi].FinalizeTempMappingLoading();
+    remove(temp_mapping_file_handles[hi].file_path.c_str());
   }
   std::cerr << "Sorted, deduped and outputed mappings in " << Chromap<>::GetRealTime() - sort_and_dedupe_start_time << "s.\n";
   std::cerr << "# uni-mappings: " << num_uni_mappings << ", # multi-mappings: " << num_multi_mappings << ", total: " << num_uni_mappings + num_multi_mappings << ".\n";
@@ -735,26 +959,45 @@ void Chromap<MappingRecord>::MapPairedEndReads() {
   double real_start_time = Chromap<>::GetRealTime();
   // Load reference
   SequenceBatch reference;
-  reference.InitializeLoading(reference_file_path_);
+  reference.InitializeLoading(reference_file_path_, num_threads_);
   uint32_t num_reference_sequences = reference.LoadAllSequences();
   // Load index
   Index index(min_num_seeds_required_for_mapping_, max_seed_frequencies_, index_file_path_);
   index.Load();
   kmer_size_ = index.GetKmerSize();
   window_size_ = index.GetWindowSize();
+  InitializeBandedAlignKernels();
   //index.Statistics(num_sequences, reference);
-  // Initialize read batches
-  SequenceBatch read_batch1(read_batch_size_);
-  SequenceBatch read_batch2(read_batch_size_);
-  SequenceBatch barcode_batch(read_batch_size_);
+  // Initialize read batches. Loaded batches are swapped into a fixed pool that
+  // circulates through the reader, mapper and writer stages of the pipeline.
+  std::vector<std::unique_ptr<SequenceBatch> > read_batches1;
+  std::vector<std::unique_ptr<SequenceBatch> > read_batches2;
+  std::vector<std::unique_ptr<SequenceBatch> > barcode_batches;
+  std::vector<uint32_t> num_loaded_pairs_in_batches(num_batches_in_pipeline_, 0);
+  for (int bi = 0; bi < num_batches_in_pipeline_; ++bi) {
+    read_batches1.emplace_back(new SequenceBatch(read_batch_size_));
+    read_batches2.emplace_back(new SequenceBatch(read_batch_size_));
+    barcode_batches.emplace_back(new SequenceBatch(read_batch_size_));
+  }
   SequenceBatch read_batch1_for_loading(read_batch_size_);
   SequenceBatch read_batch2_for_loading(read_batch_size_);
   SequenceBatch barcode_batch_for_loading(read_batch_size_);
   // Initialize cache
   mm_cache mm_to_candidates_cache(2000003);
   mm_to_candidates_cache.SetKmerLength(kmer_size_);
-  struct _mm_history *mm_history1 = new struct _mm_history[read_batch_size_];
-  struct _mm_history *mm_history2 = new struct _mm_history[read_batch_size_];
+  // The cache is updated with the minimizers and candidates of a batch on its
+  // own thread while the mappers go on with the next batch, so the history is
+  // double-buffered.
+  const int num_mm_histories = 2;
+  std::vector<struct _mm_history *> mm_histories1(num_mm_histories);
+  std::vector<struct _mm_history *> mm_histories2(num_mm_histories);
+  // The number of pairs and of reads so far when each history was filled.
+  std::vector<uint32_t> num_loaded_pairs_in_mm_histories(num_mm_histories, 0);
+  std::vector<uint64_t> num_reads_in_mm_histories(num_mm_histories, 0);
+  for (int hi = 0; hi < num_mm_histories; ++hi) {
+    mm_histories1[hi] = new struct _mm_history[read_batch_size_];
+    mm_histories2[hi] = new struct _mm_history[read_batch_size_];
+  }
   // Initialize mapping container
   mappings_on_diff_ref_seqs_.reserve(num_reference_sequences);
   deduped_mappings_on_diff_ref_seqs_.reserve(num_reference_sequences);
@@ -762,11 +1005,25 @@ void Chromap<MappingRecord>::MapPairedEndReads() {
     mappings_on_diff_ref_seqs_.emplace_back(std::vector<MappingRecord>());
     deduped_mappings_on_diff_ref_seqs_.emplace_back(std::vector<MappingRecord>());
   }
+  bool dedup_while_mapping = online_dedup_ && DuplicateFragmentSet<MappingRecord>::IsSupported();
+  // Identical read pairs are only mapped once when the mappings are deduped in
+  // memory. Which of them is mapped depends on the thread timing, so this is
+  // limited to the formats without read names.
+  bool skip_duplicates_before_mapping = remove_pcr_duplicates_ && !low_memory_mode_ && (output_mapping_in_BED_ || output_mapping_in_TagAlign_);
+  // The fingerprint hash of each pair is kept until the mappings of its batch
+  // are merged, so that its duplicates can be credited to its fragment.
+  std::vector<std::vector<uint64_t> > read_pair_hashes_in_batches(num_batches_in_pipeline_);
+  if (dedup_while_mapping) {
+    duplicate_fragment_set_.Initialize(num_reference_sequences);
+    for (int bi = 0; bi < num_batches_in_pipeline_; ++bi) {
+      read_pair_hashes_in_batches[bi].resize(read_batch_size_);
+    }
+  }
   // Initialize output tools
   if (output_mapping_in_BED_) {
     output_tools_ = std::unique_ptr<BEDPEOutputTools<MappingRecord> >(new BEDPEOutputTools<MappingRecord>);
   } else if (output_mapping_in_TagAlign_) {
-    output_tools_ = std::unique_ptr<PairedTagAlignOutputTools<MappingRecord> >(new PairedTagAlignOutputTools<MappingRecord>);
+    output_tools_ = NewPairedTagAlignOutputTools(std::is_same<MappingRecord, typename FullLayoutTraits<MappingRecord>::FullLayout>());
   } else if (output_mapping_in_PAF_) {
     output_tools_ = std::unique_ptr<PairedPAFOutputTools<MappingRecord> >(new PairedPAFOutputTools<MappingRecord>);
   } else if (output_mapping_in_SAM_) {
@@ -777,13 +1034,28 @@ void Chromap<MappingRecord>::MapPairedEndReads() {
   output_tools_->InitializeMappingOutput(mapping_output_file_path_);
   output_tools_->OutputHeader(num_reference_sequences, reference);
   uint32_t num_mappings_in_mem = 0;
-  //uint64_t max_num_mappings_in_mem = 1 * ((uint64_t)1 << 30) / sizeof(MappingRecord);
-  uint64_t max_num_mappings_in_mem = 1 * ((uint64_t)1 << 28) / sizeof(MappingRecord);
-  // Preprocess barcodes for single cell data
+  // In low memory mode, a quarter of the memory budget is filled with mappings
+  // while the previous quarter is being spilled.
+  uint64_t max_num_mappings_in_mem = mem_budget_ / 4 / sizeof(MappingRecord);
+  if (low_memory_mode_) {
+    // Runs sharing a scratch directory tell their temp files apart by pid.
+    std::string temp_file_path_prefix = temp_directory_path_.empty() ? mapping_output_file_path_ : temp_directory_path_ + "/chromap." + std::to_string(getpid());
+    temp_mapping_spiller_.Initialize(temp_file_path_prefix, num_reference_sequences);
+  }
+  // Preprocess barcodes for single cell data. Streamed barcodes can only be
+  // read once and barcodes in read names would need another pass over the
+  // reads, so their abundance is accumulated from each batch before it is
+  // mapped instead.
+  bool update_barcode_abundance_in_batches = BarcodesAreInReadNames();
   if (!is_bulk_data_) {
     if (!barcode_whitelist_file_path_.empty()) {
       LoadBarcodeWhitelist();
-      ComputeBarcodeAbundance(initial_num_sample_barcodes_);
+      for (const std::string &barcode_file_path : barcode_file_paths_) {
+        update_barcode_abundance_in_batches = update_barcode_abundance_in_batches || ParallelGzipReader::IsStream(barcode_file_path);
+      }
+      if (!update_barcode_abundance_in_batches) {
+        ComputeBarcodeAbundance(initial_num_sample_barcodes_);
+      }
     }
   }
   static uint64_t thread_num_candidates = 0;
@@ -792,167 +1064,365 @@ void Chromap<MappingRecord>::MapPairedEndReads() {
   static uint64_t thread_num_uniquely_mapped_reads = 0; 
   static uint64_t thread_num_barcode_in_whitelist = 0; 
   static uint64_t thread_num_corrected_barcode = 0; 
-#pragma omp threadprivate(thread_num_candidates, thread_num_mappings, thread_num_mapped_reads, thread_num_uniquely_mapped_reads, thread_num_barcode_in_whitelist, thread_num_corrected_barcode)
-  double real_start_mapping_time = Chromap<>::GetRealTime();
-  for (size_t read_file_index = 0; read_file_index < read_file1_paths_.size(); ++read_file_index) {
-    read_batch1_for_loading.InitializeLoading(read_file1_paths_[read_file_index]);
-    read_batch2_for_loading.InitializeLoading(read_file2_paths_[read_file_index]);
-    if (!is_bulk_data_) {
-      barcode_batch_for_loading.InitializeLoading(barcode_file_paths_[read_file_index]);
-    }
-    uint32_t num_loaded_pairs_for_loading = 0;
-    uint32_t num_loaded_pairs = LoadPairedEndReadsWithBarcodes(&read_batch1_for_loading, &read_batch2_for_loading, &barcode_batch_for_loading);
-    read_batch1_for_loading.SwapSequenceBatch(read_batch1);
-    read_batch2_for_loading.SwapSequenceBatch(read_batch2);
-    barcode_batch_for_loading.SwapSequenceBatch(barcode_batch);
-    std::vector<std::vector<std::vector<MappingRecord> > > mappings_on_diff_ref_seqs_for_diff_threads;
-    std::vector<std::vector<std::vector<MappingRecord> > > mappings_on_diff_ref_seqs_for_diff_threads_for_saving;
-    mappings_on_diff_ref_seqs_for_diff_threads.reserve(num_threads_);
-    mappings_on_diff_ref_seqs_for_diff_threads_for_saving.reserve(num_threads_);
+  static uint64_t thread_num_duplicated_reads = 0; 
+#pragma omp threadprivate(thread_num_candidates, thread_num_mappings, thread_num_mapped_reads, thread_num_uniquely_mapped_reads, thread_num_barcode_in_whitelist, thread_num_corrected_barcode, thread_num_duplicated_reads)
+  // Mapping threads, one reader thread loading batches and one writer thread
+  // moving mappings out of the per-thread buffers.
+  int num_mapping_threads = std::max(1, num_threads_ - 1);
+  std::vector<std::vector<MappingBuffer<MappingRecord> > > mapping_buffers_for_diff_batches(num_batches_in_pipeline_);
+  for (int bi = 0; bi < num_batches_in_pipeline_; ++bi) {
+    mapping_buffers_for_diff_batches[bi] = std::vector<MappingBuffer<MappingRecord> >(num_threads_);
     for (int ti = 0; ti < num_threads_; ++ti) {
-      mappings_on_diff_ref_seqs_for_diff_threads.emplace_back(std::vector<std::vector<MappingRecord> >(num_reference_sequences));
-      mappings_on_diff_ref_seqs_for_diff_threads_for_saving.emplace_back(std::vector<std::vector<MappingRecord> >(num_reference_sequences));
-      for (uint32_t i = 0; i < num_reference_sequences; ++i) {
-        mappings_on_diff_ref_seqs_for_diff_threads[ti][i].reserve((num_loaded_pairs + num_loaded_pairs / 1000 * max_num_best_mappings_) / num_threads_ / num_reference_sequences);
-        mappings_on_diff_ref_seqs_for_diff_threads_for_saving[ti][i].reserve((num_loaded_pairs + num_loaded_pairs / 1000 * max_num_best_mappings_) / num_threads_ / num_reference_sequences);
+      mapping_buffers_for_diff_batches[bi][ti].Reserve((read_batch_size_ + read_batch_size_ / 1000 * max_num_best_mappings_) / num_mapping_threads);
+    }
+  }
+  double reader_busy_time = 0;
+  double mapper_busy_time = 0;
+  double writer_busy_time = 0;
+  double cache_updater_busy_time = 0;
+  double mapper_wait_time = 0;
+  BoundedQueue<int> free_batch_queue(num_batches_in_pipeline_);
+  BoundedQueue<int> loaded_batch_queue(num_batches_in_pipeline_);
+  BoundedQueue<int> mapped_batch_queue(num_batches_in_pipeline_);
+  for (int bi = 0; bi < num_batches_in_pipeline_; ++bi) {
+    free_batch_queue.Push(bi);
+  }
+  BoundedQueue<int> free_mm_history_queue(num_mm_histories);
+  BoundedQueue<int> filled_mm_history_queue(num_mm_histories);
+  for (int hi = 0; hi < num_mm_histories; ++hi) {
+    free_mm_history_queue.Push(hi);
+  }
+  double real_start_mapping_time = Chromap<>::GetRealTime();
+  // All the lanes are loaded as one stream of batches, so the pipeline runs
+  // through lane boundaries without draining.
+  bool load_barcode_files = !is_bulk_data_ && !BarcodesAreInReadNames();
+  int num_inflate_threads = GetNumInflateThreadsPerReadFile(1 + (read_file2_paths_.empty() ? 0 : 1) + (load_barcode_files ? 1 : 0));
+  read_batch1_for_loading.InitializeLoading(read_file1_paths_, num_prefetched_lanes_, num_inflate_threads);
+  read_batch1_for_loading.SetNumIdBits(ReadIdTraits<decltype(MappingRecord::read_id)>::NUM_BITS);
+  if (!read_file2_paths_.empty()) {
+    read_batch2_for_loading.InitializeLoading(read_file2_paths_, num_prefetched_lanes_, num_inflate_threads);
+  }
+  if (load_barcode_files) {
+    barcode_batch_for_loading.InitializeLoading(barcode_file_paths_, num_prefetched_lanes_, num_inflate_threads);
+  }
+  // Reader stage: fill free batches until the files are exhausted, then send -1.
+  std::thread reader_thread([&]() {
+    while (true) {
+      int batch_index = free_batch_queue.Pop();
+      double real_load_start_time = Chromap<>::GetRealTime();
+      uint32_t num_loaded_pairs = LoadPairedEndReadsWithBarcodes(&read_batch1_for_loading, &read_batch2_for_loading, &barcode_batch_for_loading);
+      reader_busy_time += Chromap<>::GetRealTime() - real_load_start_time;
+      if (num_loaded_pairs == 0) {
+        free_batch_queue.Push(batch_index);
+        loaded_batch_queue.Push(-1);
+        break;
+      }
+      read_batch1_for_loading.SwapSequenceBatch(*read_batches1[batch_index]);
+      read_batch2_for_loading.SwapSequenceBatch(*read_batches2[batch_index]);
+      barcode_batch_for_loading.SwapSequenceBatch(*barcode_batches[batch_index]);
+      num_loaded_pairs_in_batches[batch_index] = num_loaded_pairs;
+      loaded_batch_queue.Push(batch_index);
+    }
+  });
+  // Writer stage: move the mappings of each mapped batch into the container and spill in low memory mode,
+  // or write them right away for unsorted output.
+  uint64_t num_output_mappings = 0;
+  std::thread writer_thread([&]() {
+    while (true) {
+      int batch_index = mapped_batch_queue.Pop();
+      if (batch_index < 0) {
+        break;
+      }
+      double real_write_start_time = Chromap<>::GetRealTime();
+      if (unsorted_output_) {
+        num_output_mappings += OutputMappingsInBuffers(num_reference_sequences, reference, &mapping_buffers_for_diff_batches[batch_index]);
+        writer_busy_time += Chromap<>::GetRealTime() - real_write_start_time;
+        free_batch_queue.Push(batch_index);
+        continue;
+      }
+      if (dedup_while_mapping) {
+        num_mappings_in_mem += duplicate_fragment_set_.Merge(Tn5_shift_, *read_batches1[batch_index], read_pair_hashes_in_batches[batch_index], &duplicate_read_pair_set_, &mapping_buffers_for_diff_batches[batch_index]);
+        writer_busy_time += Chromap<>::GetRealTime() - real_write_start_time;
+        free_batch_queue.Push(batch_index);
+        continue;
+      }
+      // The mappers are still running, so the writer moves on its own.
+      num_mappings_in_mem += MoveMappingsInBuffersToMappingContainer(num_reference_sequences, &mapping_buffers_for_diff_batches[batch_index], 1);
+      if (low_memory_mode_ && num_mappings_in_mem > max_num_mappings_in_mem) {
+        // The mappings are sorted and written on the spilling thread.
+        temp_mapping_spiller_.Spill(/*are_sorted=*/false, &mappings_on_diff_ref_seqs_);
+        num_mappings_in_mem = 0;
+      }
+      writer_busy_time += Chromap<>::GetRealTime() - real_write_start_time;
+      free_batch_queue.Push(batch_index);
+    }
+  });
+  // Cache updater stage: add the first half of the pairs of each mapped batch
+  // to the cache, then hand the history back to the mappers.
+  std::thread cache_updater_thread([&]() {
+    while (true) {
+      int mm_history_index = filled_mm_history_queue.Pop();
+      if (mm_history_index < 0) {
+        break;
       }
+      double real_update_start_time = Chromap<>::GetRealTime();
+      struct _mm_history *mm_history1 = mm_histories1[mm_history_index];
+      struct _mm_history *mm_history2 = mm_histories2[mm_history_index];
+      uint32_t num_loaded_pairs = num_loaded_pairs_in_mm_histories[mm_history_index];
+      for (uint32_t pair_index = 0; pair_index < num_loaded_pairs / 2; ++pair_index) {
+        if (num_reads_in_mm_histories[mm_history_index] >= 2 * 5000000 && pair_index >= num_loaded_pairs / num_threads_) {
+          break;
+        }
+        mm_to_candidates_cache.Update(mm_history1[pair_index].minimizers, mm_history1[pair_index].positive_candidates, mm_history1[pair_index].negative_candidates, mm_history1[pair_index].repetitive_seed_length);
+        mm_to_candidates_cache.Update(mm_history2[pair_index].minimizers, mm_history2[pair_index].positive_candidates, mm_history2[pair_index].negative_candidates, mm_history2[pair_index].repetitive_seed_length);
+        if (mm_history1[pair_index].positive_candidates.size() < mm_history1[pair_index].positive_candidates.capacity() / 2) {
+          std::vector<Candidate>().swap(mm_history1[pair_index].positive_candidates);
+        }
+        if (mm_history1[pair_index].negative_candidates.size() < mm_history1[pair_index].negative_candidates.capacity() / 2) {
+          std::vector<Candidate>().swap(mm_history1[pair_index].negative_candidates);
+        }
+        if (mm_history2[pair_index].positive_candidates.size() < mm_history2[pair_index].positive_candidates.capacity() / 2) {
+          std::vector<Candidate>().swap(mm_history2[pair_index].positive_candidates);
+        }
+        if (mm_history2[pair_index].negative_candidates.size() < mm_history2[pair_index].negative_candidates.capacity() / 2) {
+          std::vector<Candidate>().swap(mm_history2[pair_index].negative_candidates);
+        }
+      }
+      cache_updater_busy_time += Chromap<>::GetRealTime() - real_update_start_time;
+      free_mm_history_queue.Push(mm_history_index);
     }
-#pragma omp parallel default(none) shared(reference, index, read_batch1, read_batch2, barcode_batch, read_batch1_for_loading, read_batch2_for_loading, barcode_batch_for_loading, std::cerr, num_loaded_pairs_for_loading, num_loaded_pairs, num_reference_sequences, mappings_on_diff_ref_seqs_for_diff_threads, mappings_on_diff_ref_seqs_for_diff_threads_for_saving, num_mappings_in_mem, max_num_mappings_in_mem, temp_mapping_file_handles_, mm_to_candidates_cache, mm_history1, mm_history2) num_threads(num_threads_) reduction(+:num_candidates_, num_mappings_, num_mapped_reads_, num_uniquely_mapped_reads_, num_barcode_in_whitelist_, num_corrected_barcode_)
-    {
-      thread_num_candidates = 0;
-      thread_num_mappings = 0;
-      thread_num_mapped_reads = 0;
-      thread_num_uniquely_mapped_reads = 0;
-      thread_num_barcode_in_whitelist = 0;
-      thread_num_corrected_barcode = 0;
-      std::vector<std::pair<uint64_t, uint64_t> > minimizers1;
-      std::vector<std::pair<uint64_t, uint64_t> > minimizers2;
-      std::vector<uint64_t> positive_hits1;
-      std::vector<uint64_t> positive_hits2;
-      std::vector<uint64_t> negative_hits1;
-      std::vector<uint64_t> negative_hits2;
-      positive_hits1.reserve(max_seed_frequencies_[0]);
-      positive_hits2.reserve(max_seed_frequencies_[0]);
-      negative_hits1.reserve(max_seed_frequencies_[0]);
-      negative_hits2.reserve(max_seed_frequencies_[0]);
-      std::vector<Candidate> positive_candidates1;
-      std::vector<Candidate> positive_candidates2;
-      std::vector<Candidate> negative_candidates1;
-      std::vector<Candidate> negative_candidates2;
-      positive_candidates1.reserve(max_seed_frequencies_[0]);
-      positive_candidates2.reserve(max_seed_frequencies_[0]);
-      negative_candidates1.reserve(max_seed_frequencies_[0]);
-      negative_candidates2.reserve(max_seed_frequencies_[0]);
-      std::vector<Candidate> positive_candidates1_buffer;
-      std::vector<Candidate> positive_candidates2_buffer;
-      std::vector<Candidate> negative_candidates1_buffer;
-      std::vector<Candidate> negative_candidates2_buffer;
-      positive_candidates1_buffer.reserve(max_seed_frequencies_[0]);
-      positive_candidates2_buffer.reserve(max_seed_frequencies_[0]);
-      negative_candidates1_buffer.reserve(max_seed_frequencies_[0]);
-      negative_candidates2_buffer.reserve(max_seed_frequencies_[0]);
-      std::vector<std::pair<int, uint64_t> > positive_mappings1;
-      std::vector<std::pair<int, uint64_t> > positive_mappings2;
-      std::vector<std::pair<int, uint64_t> > negative_mappings1;
-      std::vector<std::pair<int, uint64_t> > negative_mappings2;
-      positive_mappings1.reserve(max_seed_frequencies_[0]);
-      positive_mappings2.reserve(max_seed_frequencies_[0]);
-      negative_mappings1.reserve(max_seed_frequencies_[0]);
-      negative_mappings2.reserve(max_seed_frequencies_[0]);
-      std::vector<SplitMapping> positive_split_mappings1;
-      std::vector<SplitMapping> negative_split_mappings1;
-      std::vector<SplitMapping> positive_split_mappings2;
-      std::vector<SplitMapping> negative_split_mappings2;
-      positive_split_mappings1.reserve(max_seed_frequencies_[0]);
-      negative_split_mappings1.reserve(max_seed_frequencies_[0]);
-      positive_split_mappings2.reserve(max_seed_frequencies_[0]);
-      negative_split_mappings2.reserve(max_seed_frequencies_[0]);
-      std::vector<std::pair<uint32_t, uint32_t> > F1R2_best_mappings;
-      std::vector<std::pair<uint32_t, uint32_t> > F2R1_best_mappings;
-      std::vector<std::pair<uint32_t, uint32_t> > F1F2_best_mappings;
-      std::vector<std::pair<uint32_t, uint32_t> > R1R2_best_mappings;
-      F1R2_best_mappings.reserve(max_seed_frequencies_[0]);
-      F2R1_best_mappings.reserve(max_seed_frequencies_[0]);
-      if (split_alignment_) {
-        F1F2_best_mappings.reserve(max_seed_frequencies_[0]);
-        R1R2_best_mappings.reserve(max_seed_frequencies_[0]);
-      }
-      // we will use reservoir sampling 
-      std::vector<int> best_mapping_indices(max_num_best_mappings_);
-      std::mt19937 generator(11);
+  });
+  int mapping_batch_index = -1;
+  int mm_history_index = -1;
+  uint32_t num_loaded_pairs = 0;
+  uint32_t next_pair_index = 0;
+  uint32_t num_pairs_per_chunk = 1;
+#pragma omp parallel default(none) shared(reference, index, read_batches1, read_batches2, barcode_batches, num_loaded_pairs_in_batches, std::cerr, update_barcode_abundance_in_batches, mapping_batch_index, num_loaded_pairs, next_pair_index, num_pairs_per_chunk, mapper_busy_time, mapper_wait_time, loaded_batch_queue, mapped_batch_queue, mapping_buffers_for_diff_batches, read_pair_hashes_in_batches, mm_to_candidates_cache, skip_duplicates_before_mapping, mm_history_index, mm_histories1, mm_histories2, num_loaded_pairs_in_mm_histories, num_reads_in_mm_histories, free_mm_history_queue, filled_mm_history_queue) num_threads(num_mapping_threads) reduction(+:num_candidates_, num_mappings_, num_mapped_reads_, num_uniquely_mapped_reads_, num_barcode_in_whitelist_, num_corrected_barcode_, num_duplicated_reads_)
+  {
+    thread_num_candidates = 0;
+    thread_num_mappings = 0;
+    thread_num_mapped_reads = 0;
+    thread_num_uniquely_mapped_reads = 0;
+    thread_num_barcode_in_whitelist = 0;
+    thread_num_corrected_barcode = 0;
+    thread_num_duplicated_reads = 0;
+    std::vector<std::pair<uint64_t, uint64_t> > minimizers1;
+    std::vector<std::pair<uint64_t, uint64_t> > minimizers2;
+    std::vector<uint64_t> positive_hits1;
+    std::vector<uint64_t> positive_hits2;
+    std::vector<uint64_t> negative_hits1;
+    std::vector<uint64_t> negative_hits2;
+    positive_hits1.reserve(max_seed_frequencies_[0]);
+    positive_hits2.reserve(max_seed_frequencies_[0]);
+    negative_hits1.reserve(max_seed_frequencies_[0]);
+    negative_hits2.reserve(max_seed_frequencies_[0]);
+    std::vector<Candidate> positive_candidates1;
+    std::vector<Candidate> positive_candidates2;
+    std::vector<Candidate> negative_candidates1;
+    std::vector<Candidate> negative_candidates2;
+    positive_candidates1.reserve(max_seed_frequencies_[0]);
+    positive_candidates2.reserve(max_seed_frequencies_[0]);
+    negative_candidates1.reserve(max_seed_frequencies_[0]);
+    negative_candidates2.reserve(max_seed_frequencies_[0]);
+    std::vector<Candidate> positive_candidates1_buffer;
+    std::vector<Candidate> positive_candidates2_buffer;
+    std::vector<Candidate> negative_candidates1_buffer;
+    std::vector<Candidate> negative_candidates2_buffer;
+    positive_candidates1_buffer.reserve(max_seed_frequencies_[0]);
+    positive_candidates2_buffer.reserve(max_seed_frequencies_[0]);
+    negative_candidates1_buffer.reserve(max_seed_frequencies_[0]);
+    negative_candidates2_buffer.reserve(max_seed_frequencies_[0]);
+    std::vector<std::pair<int, uint64_t> > positive_mappings1;
+    std::vector<std::pair<int, uint64_t> > positive_mappings2;
+    std::vector<std::pair<int, uint64_t> > negative_mappings1;
+    std::vector<std::pair<int, uint64_t> > negative_mappings2;
+    positive_mappings1.reserve(max_seed_frequencies_[0]);
+    positive_mappings2.reserve(max_seed_frequencies_[0]);
+    negative_mappings1.reserve(max_seed_frequencies_[0]);
+    negative_mappings2.reserve(max_seed_frequencies_[0]);
+    std::vector<SplitMapping> positive_split_mappings1;
+    std::vector<SplitMapping> negative_split_mappings1;
+    std::vector<SplitMapping> positive_split_mappings2;
+    std::vector<SplitMapping> negative_split_mappings2;
+    positive_split_mappings1.reserve(max_seed_frequencies_[0]);
+    negative_split_mappings1.reserve(max_seed_frequencies_[0]);
+    positive_split_mappings2.reserve(max_seed_frequencies_[0]);
+    negative_split_mappings2.reserve(max_seed_frequencies_[0]);
+    std::vector<std::pair<uint32_t, uint32_t> > F1R2_best_mappings;
+    std::vector<std::pair<uint32_t, uint32_t> > F2R1_best_mappings;
+    std::vector<std::pair<uint32_t, uint32_t> > F1F2_best_mappings;
+    std::vector<std::pair<uint32_t, uint32_t> > R1R2_best_mappings;
+    F1R2_best_mappings.reserve(max_seed_frequencies_[0]);
+    F2R1_best_mappings.reserve(max_seed_frequencies_[0]);
+    if (split_alignment_) {
+      F1F2_best_mappings.reserve(max_seed_frequencies_[0]);
+      R1R2_best_mappings.reserve(max_seed_frequencies_[0]);
+    }
+    // we will use reservoir sampling 
+    std::vector<int> best_mapping_indices(max_num_best_mappings_);
+    std::mt19937 generator(11);
+    while (true) {
 #pragma omp single
       {
-        double real_batch_start_time = Chromap<>::GetRealTime();
-        while (num_loaded_pairs > 0) {
+        double real_wait_start_time = Chromap<>::GetRealTime();
+        mapping_batch_index = loaded_batch_queue.Pop();
+        mapper_wait_time += Chromap<>::GetRealTime() - real_wait_start_time;
+        if (mapping_batch_index >= 0) {
+          num_loaded_pairs = num_loaded_pairs_in_batches[mapping_batch_index];
           num_reads_ += num_loaded_pairs;
           num_reads_ += num_loaded_pairs;
-#pragma omp task
-          {
-            num_loaded_pairs_for_loading = LoadPairedEndReadsWithBarcodes(&read_batch1_for_loading, &read_batch2_for_loading, &barcode_batch_for_loading);
-          } // end of openmp loading task
-          //int grain_size = 5000;
-          //#pragma omp taskloop grainsize(grain_size) //num_tasks(num_threads_* 50)
-#pragma omp taskloop num_tasks(num_threads_* num_threads_)
-          for (uint32_t pair_index = 0; pair_index < num_loaded_pairs; ++pair_index) {
-            read_batch1.PrepareNegativeSequenceAt(pair_index);
-            read_batch2.PrepareNegativeSequenceAt(pair_index);
-            //std::cerr << pair_index<<" "<<read_batch1.GetSequenceNameAt(pair_index) << "\n";
-            if (trim_adapters_) {
-              TrimAdapterForPairedEndRead(pair_index, &read_batch1, &read_batch2);
+          next_pair_index = 0;
+          num_pairs_per_chunk = std::max(1u, num_loaded_pairs / (num_threads_ * num_threads_));
+          if (update_barcode_abundance_in_batches && num_sample_barcodes_ < initial_num_sample_barcodes_) {
+            UpdateBarcodeAbundance(num_loaded_pairs, *barcode_batches[mapping_batch_index]);
+          }
+          // Only blocks if the cache updater is still on the history filled
+          // two batches ago.
+          mm_history_index = free_mm_history_queue.Pop();
+          num_loaded_pairs_in_mm_histories[mm_history_index] = num_loaded_pairs;
+          num_reads_in_mm_histories[mm_history_index] = num_reads_;
+        }
+      } // end of openmp single
+      if (mapping_batch_index < 0) {
+        break;
+      }
+      double real_batch_start_time = Chromap<>::GetRealTime();
+      struct _mm_history *mm_history1 = mm_histories1[mm_history_index];
+      struct _mm_history *mm_history2 = mm_histories2[mm_history_index];
+      SequenceBatch &read_batch1 = *read_batches1[mapping_batch_index];
+      SequenceBatch &read_batch2 = *read_batches2[mapping_batch_index];
+      SequenceBatch &barcode_batch = *barcode_batches[mapping_batch_index];
+      MappingBuffer<MappingRecord> &mappings_on_diff_ref_seqs = mapping_buffers_for_diff_batches[mapping_batch_index][omp_get_thread_num()];
+      std::vector<uint64_t> &read_pair_hashes = read_pair_hashes_in_batches[mapping_batch_index];
+      // Mapping threads pull chunks of read pairs until the batch is drained.
+      while (true) {
+        uint32_t chunk_start_pair_index;
+#pragma omp atomic capture
+        {
+          chunk_start_pair_index = next_pair_index;
+          next_pair_index += num_pairs_per_chunk;
+        }
+        if (chunk_start_pair_index >= num_loaded_pairs) {
+          break;
+        }
+        uint32_t chunk_end_pair_index = std::min(num_loaded_pairs, chunk_start_pair_index + num_pairs_per_chunk);
+        for (uint32_t pair_index = chunk_start_pair_index; pair_index < chunk_end_pair_index; ++pair_index) {
+          read_batch1.PrepareNegativeSequenceAt(pair_index);
+          read_batch2.PrepareNegativeSequenceAt(pair_index);
+          //std::cerr << pair_index<<" "<<read_batch1.GetSequenceNameAt(pair_index) << "\n";
+          if (trim_adapters_) {
+            TrimAdapterForPairedEndRead(pair_index, &read_batch1, &read_batch2);
+          }
+          if (!barcode_whitelist_file_path_.empty()) {
+            CorrectBarcodeAt(pair_index, &barcode_batch, &thread_num_barcode_in_whitelist, &thread_num_corrected_barcode); 
+          }
+          uint64_t read_pair_hash = 0;
+          if (skip_duplicates_before_mapping && PairedEndReadWithBarcodeIsDuplicate(pair_index, barcode_batch, read_batch1, read_batch2, &read_pair_hash)) {
+            thread_num_duplicated_reads += 2;
+            continue;
+          }
+          if (!read_pair_hashes.empty()) {
+            read_pair_hashes[pair_index] = read_pair_hash;
+          }
+          minimizers1.clear();
+          minimizers2.clear();
+          minimizers1.reserve(read_batch1.GetSequenceLengthAt(pair_index) / window_size_ * 2);
+          minimizers2.reserve(read_batch2.GetSequenceLengthAt(pair_index) / window_size_ * 2);
+          index.GenerateMinimizerSketch(read_batch1, pair_index, &minimizers1);
+          index.GenerateMinimizerSketch(read_batch2, pair_index, &minimizers2);
+          //std::cerr << "m1" << " " << minimizers1.size() << "\n";
+          //for (auto &mi : minimizers1) {
+          //  std::cerr << (mi.second >> 33) << " " << (uint32_t) (mi.second >> 1) << "\n";
+          //}
+          //std::cerr << "m2" << " " << minimizers2.size() << "\n";
+          //for (auto &mi : minimizers2) {
+          //  std::cerr << (mi.second >> 33) << " " << (uint32_t) (mi.second >> 1) << "\n";
+          //}
+          if (minimizers1.size() != 0 && minimizers2.size() != 0) {
+            positive_hits1.clear();
+            positive_hits2.clear();
+            negative_hits1.clear();
+            negative_hits2.clear();
+            positive_candidates1.clear();
+            positive_candidates2.clear();
+            negative_candidates1.clear();
+            negative_candidates2.clear();
+            positive_candidates1_buffer.clear();
+            positive_candidates2_buffer.clear();
+            negative_candidates1_buffer.clear();
+            negative_candidates2_buffer.clear();
+            uint32_t repetitive_seed_length1 = 0;
+            uint32_t repetitive_seed_length2 = 0;
+            // Generate candidates
+            if (mm_to_candidates_cache.Query(minimizers1, positive_candidates1, negative_candidates1, repetitive_seed_length1, read_batch1.GetSequenceLengthAt(pair_index)) == -1) {
+              index.GenerateCandidates(error_threshold_, minimizers1, &repetitive_seed_length1, &positive_hits1, &negative_hits1, &positive_candidates1, &negative_candidates1);
+            }
+            uint32_t current_num_candidates1 = positive_candidates1.size() + negative_candidates1.size();
+            if (mm_to_candidates_cache.Query(minimizers2, positive_candidates2, negative_candidates2, repetitive_seed_length2, read_batch2.GetSequenceLengthAt(pair_index)) == -1) {
+              index.GenerateCandidates(error_threshold_, minimizers2, &repetitive_seed_length2, &positive_hits2, &negative_hits2, &positive_candidates2, &negative_candidates2);
             }
-            if (!barcode_whitelist_file_path_.empty()) {
-              CorrectBarcodeAt(pair_index, &barcode_batch, &thread_num_barcode_in_whitelist, &thread_num_corrected_barcode); 
+            uint32_t current_num_candidates2 = positive_candidates2.size() + negative_candidates2.size();
+            if (pair_index < num_loaded_pairs / 2 && (pair_index < num_loaded_pairs / num_threads_ || num_reads_ < 2 * 5000000)) {
+              mm_history1[pair_index].minimizers = minimizers1;
+              mm_history1[pair_index].positive_candidates = positive_candidates1;
+              mm_history1[pair_index].negative_candidates = negative_candidates1;
+              mm_history1[pair_index].repetitive_seed_length = repetitive_seed_length1;
+              mm_history2[pair_index].minimizers = minimizers2;
+              mm_history2[pair_index].positive_candidates = positive_candidates2;
+              mm_history2[pair_index].negative_candidates = negative_candidates2;
+              mm_history2[pair_index].repetitive_seed_length = repetitive_seed_length2;
             }
-            minimizers1.clear();
-            minimizers2.clear();
-            minimizers1.reserve(read_batch1.GetSequenceLengthAt(pair_index) / window_size_ * 2);
-            minimizers2.reserve(read_batch2.GetSequenceLengthAt(pair_index) / window_size_ * 2);
-            index.GenerateMinimizerSketch(read_batch1, pair_index, &minimizers1);
-            index.GenerateMinimizerSketch(read_batch2, pair_index, &minimizers2);
-            //std::cerr << "m1" << " " << minimizers1.size() << "\n";
-            //for (auto &mi : minimizers1) {
-            //  std::cerr << (mi.second >> 33) << " " << (uint32_t) (mi.second >> 1) << "\n";
+            // Test whether we need to augment the candidate list with mate information.
+            //std::cerr << "before supplement" << "\n";
+            //std::cerr << "p1" << "\n";
+            //for (auto &ci : positive_candidates1) {
+            //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
             //}
-            //std::cerr << "m2" << " " << minimizers2.size() << "\n";
-            //for (auto &mi : minimizers2) {
-            //  std::cerr << (mi.second >> 33) << " " << (uint32_t) (mi.second >> 1) << "\n";
+            //std::cerr << "n1" << "\n";
+            //for (auto &ci : negative_candidates1) {
+            //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
             //}
-            if (minimizers1.size() != 0 && minimizers2.size() != 0) {
-              positive_hits1.clear();
-              positive_hits2.clear();
-              negative_hits1.clear();
-              negative_hits2.clear();
+            //std::cerr << "p2" << "\n";
+            //for (auto &ci : positive_candidates2) {
+            //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
+            //}
+            //std::cerr << "n2" << "\n";
+            //for (auto &ci : negative_candidates2) {
+            //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
+            //}
+            if (!split_alignment_) {
+              SupplementCandidates(index, repetitive_seed_length1, repetitive_seed_length2, minimizers1, minimizers2, positive_hits1, positive_hits2, positive_candidates1, positive_candidates2, positive_candidates1_buffer, positive_candidates2_buffer, negative_hits1, negative_hits2, negative_candidates1, negative_candidates2, negative_candidates1_buffer, negative_candidates2_buffer);
+              current_num_candidates1 = positive_candidates1.size() + negative_candidates1.size();
+              current_num_candidates2 = positive_candidates2.size() + negative_candidates2.size();
+            }
+            if (current_num_candidates1 > 0 && current_num_candidates2 > 0 && !split_alignment_) {
+              positive_candidates1.swap(positive_candidates1_buffer);
+              negative_candidates1.swap(negative_candidates1_buffer);
+              positive_candidates2.swap(positive_candidates2_buffer);
+              negative_candidates2.swap(negative_candidates2_buffer);
               positive_candidates1.clear();
               positive_candidates2.clear();
               negative_candidates1.clear();
               negative_candidates2.clear();
-              positive_candidates1_buffer.clear();
-              positive_candidates2_buffer.clear();
-              negative_candidates1_buffer.clear();
-              negative_candidates2_buffer.clear();
-              uint32_t repetitive_seed_length1 = 0;
-              uint32_t repetitive_seed_length2 = 0;
-              // Generate candidates
-              if (mm_to_candidates_cache.Query(minimizers1, positive_candidates1, negative_candidates1, repetitive_seed_length1, read_batch1.GetSequenceLengthAt(pair_index)) == -1) {
-                index.GenerateCandidates(error_threshold_, minimizers1, &repetitive_seed_length1, &positive_hits1, &negative_hits1, &positive_candidates1, &negative_candidates1);
-              }
-              uint32_t current_num_candidates1 = positive_candidates1.size() + negative_candidates1.size();
-              if (mm_to_candidates_cache.Query(minimizers2, positive_candidates2, negative_candidates2, repetitive_seed_length2, read_batch2.GetSequenceLengthAt(pair_index)) == -1) {
-                index.GenerateCandidates(error_threshold_, minimizers2, &repetitive_seed_length2, &positive_hits2, &negative_hits2, &positive_candidates2, &negative_candidates2);
-              }
-              uint32_t current_num_candidates2 = positive_candidates2.size() + negative_candidates2.size();
-              if (pair_index < num_loaded_pairs / 2 && (pair_index < num_loaded_pairs / num_threads_ || num_reads_ < 2 * 5000000)) {
-                mm_history1[pair_index].minimizers = minimizers1;
-                mm_history1[pair_index].positive_candidates = positive_candidates1;
-                mm_history1[pair_index].negative_candidates = negative_candidates1;
-                mm_history1[pair_index].repetitive_seed_length = repetitive_seed_length1;
-                mm_history2[pair_index].minimizers = minimizers2;
-                mm_history2[pair_index].positive_candidates = positive_candidates2;
-                mm_history2[pair_index].negative_candidates = negative_candidates2;
-                mm_history2[pair_index].repetitive_seed_length = repetitive_seed_length2;
-              }
-              // Test whether we need to augment the candidate list with mate information.
-              //std::cerr << "before supplement" << "\n";
+              // Paired-end filter
+              //std::cerr << "p1" << "\n";
+              //for (auto &ci : positive_candidates1_buffer) {
+              //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
+              //}
+              //std::cerr << "n1" << "\n";
+              //for (auto &ci : negative_candidates1_buffer) {
+              //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
+              //}
+              //std::cerr << "p2" << "\n";
+              //for (auto &ci : positive_candidates2_buffer) {
+              //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
+              //}
+              //std::cerr << "n2" << "\n";
+              //for (auto &ci : negative_candidates2_buffer) {
+              //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
+              //}
+              //std::cerr << "#pc1: " << positive_candidates1_buffer.size() << ", #nc1: " << negative_candidates1_buffer.size() << ", #pc2: " << positive_candidates2_buffer.size() << ", #nc2: " << negative_candidates2_buffer.size() << "\n";
+              ReduceCandidatesForPairedEndRead(positive_candidates1_buffer, negative_candidates1_buffer, positive_candidates2_buffer, negative_candidates2_buffer, &positive_candidates1, &negative_candidates1, &positive_candidates2, &negative_candidates2);
               //std::cerr << "p1" << "\n";
               //for (auto &ci : positive_candidates1) {
               //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
@@ -969,218 +1439,160 @@ void Chromap<MappingRecord>::MapPairedEndReads() {
               //for (auto &ci : negative_candidates2) {
               //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
               //}
-              if (!split_alignment_) {
-                SupplementCandidates(index, repetitive_seed_length1, repetitive_seed_length2, minimizers1, minimizers2, positive_hits1, positive_hits2, positive_candidates1, positive_candidates2, positive_candidates1_buffer, positive_candidates2_buffer, negative_hits1, negative_hits2, negative_candidates1, negative_candidates2, negative_candidates1_buffer, negative_candidates2_buffer);
-                current_num_candidates1 = positive_candidates1.size() + negative_candidates1.size();
-                current_num_candidates2 = positive_candidates2.size() + negative_candidates2.size();
-              }
-              if (current_num_candidates1 > 0 && current_num_candidates2 > 0 && !split_alignment_) {
-                positive_candidates1.swap(positive_candidates1_buffer);
-                negative_candidates1.swap(negative_candidates1_buffer);
-                positive_candidates2.swap(positive_candidates2_buffer);
-                negative_candidates2.swap(negative_candidates2_buffer);
-                positive_candidates1.clear();
-                positive_candidates2.clear();
-                negative_candidates1.clear();
-                negative_candidates2.clear();
-                // Paired-end filter
-                //std::cerr << "p1" << "\n";
-                //for (auto &ci : positive_candidates1_buffer) {
-                //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
-                //}
-                //std::cerr << "n1" << "\n";
-                //for (auto &ci : negative_candidates1_buffer) {
-                //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
-                //}
-                //std::cerr << "p2" << "\n";
-                //for (auto &ci : positive_candidates2_buffer) {
-                //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
-                //}
-                //std::cerr << "n2" << "\n";
-                //for (auto &ci : negative_candidates2_buffer) {
-                //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
-                //}
-                //std::cerr << "#pc1: " << positive_candidates1_buffer.size() << ", #nc1: " << negative_candidates1_buffer.size() << ", #pc2: " << positive_candidates2_buffer.size() << ", #nc2: " << negative_candidates2_buffer.size() << "\n";
-                ReduceCandidatesForPairedEndRead(positive_candidates1_buffer, negative_candidates1_buffer, positive_candidates2_buffer, negative_candidates2_buffer, &positive_candidates1, &negative_candidates1, &positive_candidates2, &negative_candidates2);
-                //std::cerr << "p1" << "\n";
-                //for (auto &ci : positive_candidates1) {
-                //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
-                //}
-                //std::cerr << "n1" << "\n";
-                //for (auto &ci : negative_candidates1) {
-                //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
-                //}
-                //std::cerr << "p2" << "\n";
-                //for (auto &ci : positive_candidates2) {
-                //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
-                //}
-                //std::cerr << "n2" << "\n";
-                //for (auto &ci : negative_candidates2) {
-                //  std::cerr << (ci.position >> 32) << " " << (uint32_t) ci.position << " " << (int)ci.count << "\n";
-                //}
-                //std::cerr << "After pe filter, #pc1: " << positive_candidates1.size() << ", #nc1: " << negative_candidates1.size() << ", #pc2: " << positive_candidates2.size() << ", #nc2: " << negative_candidates2.size() << "\n";
-                current_num_candidates1 = positive_candidates1.size() + negative_candidates1.size();
-                current_num_candidates2 = positive_candidates2.size() + negative_candidates2.size();
+              //std::cerr << "After pe filter, #pc1: " << positive_candidates1.size() << ", #nc1: " << negative_candidates1.size() << ", #pc2: " << positive_candidates2.size() << ", #nc2: " << negative_candidates2.size() << "\n";
+              current_num_candidates1 = positive_candidates1.size() + negative_candidates1.size();
+              current_num_candidates2 = positive_candidates2.size() + negative_candidates2.size();
+            }
+            // Verify candidates
+            if (current_num_candidates1 > 0 && current_num_candidates2 > 0) {
+              thread_num_candidates += positive_candidates1.size() + positive_candidates2.size() + negative_candidates1.size() + negative_candidates2.size();
+              positive_mappings1.clear();
+              positive_mappings2.clear();
+              negative_mappings1.clear();
+              negative_mappings2.clear();
+              positive_split_mappings1.clear();
+              negative_split_mappings1.clear();
+              positive_split_mappings2.clear();
+              negative_split_mappings2.clear();
+              int min_num_errors1, second_min_num_errors1;
+              int num_best_mappings1, num_second_best_mappings1;
+              int min_num_errors2, second_min_num_errors2;
+              int num_best_mappings2, num_second_best_mappings2;
+              VerifyCandidates(read_batch1, pair_index, reference, minimizers1, positive_candidates1, negative_candidates1, &positive_mappings1, &positive_split_mappings1, &negative_mappings1, &negative_split_mappings1, &min_num_errors1, &num_best_mappings1, &second_min_num_errors1, &num_second_best_mappings1);
+              uint32_t current_num_mappings1 = positive_mappings1.size() + negative_mappings1.size();
+              VerifyCandidates(read_batch2, pair_index, reference, minimizers2, positive_candidates2, negative_candidates2, &positive_mappings2, &positive_split_mappings2, &negative_mappings2, &negative_split_mappings2, &min_num_errors2, &num_best_mappings2, &second_min_num_errors2, &num_second_best_mappings2);
+              uint32_t current_num_mappings2 = positive_mappings2.size() + negative_mappings2.size();
+              if (split_alignment_) {
+                current_num_mappings1 = positive_split_mappings1.size() + negative_split_mappings1.size();
+                current_num_mappings2 = positive_split_mappings2.size() + negative_split_mappings2.size();
               }
-              // Verify candidates
-              if (current_num_candidates1 > 0 && current_num_candidates2 > 0) {
-                thread_num_candidates += positive_candidates1.size() + positive_candidates2.size() + negative_candidates1.size() + negative_candidates2.size();
-                positive_mappings1.clear();
-                positive_mappings2.clear();
-                negative_mappings1.clear();
-                negative_mappings2.clear();
-                positive_split_mappings1.clear();
-                negative_split_mappings1.clear();
-                positive_split_mappings2.clear();
-                negative_split_mappings2.clear();
-                int min_num_errors1, second_min_num_errors1;
-                int num_best_mappings1, num_second_best_mappings1;
-                int min_num_errors2, second_min_num_errors2;
-                int num_best_mappings2, num_second_best_mappings2;
-                VerifyCandidates(read_batch1, pair_index, reference, minimizers1, positive_candidates1, negative_candidates1, &positive_mappings1, &positive_split_mappings1, &negative_mappings1, &negative_split_mappings1, &min_num_errors1, &num_best_mappings1, &second_min_num_errors1, &num_second_best_mappings1);
-                uint32_t current_num_mappings1 = positive_mappings1.size() + negative_mappings1.size();
-                VerifyCandidates(read_batch2, pair_index, reference, minimizers2, positive_candidates2, negative_candidates2, &positive_mappings2, &positive_split_mappings2, &negative_mappings2, &negative_split_mappings2, &min_num_errors2, &num_best_mappings2, &second_min_num_errors2, &num_second_best_mappings2);
-                uint32_t current_num_mappings2 = positive_mappings2.size() + negative_mappings2.size();
+              if (current_num_mappings1 > 0 && current_num_mappings2 > 0) {
+                int min_sum_errors, second_min_sum_errors;
+                int num_best_mappings, num_second_best_mappings;
+                F1R2_best_mappings.clear();
+                F2R1_best_mappings.clear();
                 if (split_alignment_) {
-                  current_num_mappings1 = positive_split_mappings1.size() + negative_split_mappings1.size();
-                  current_num_mappings2 = positive_split_mappings2.size() + negative_split_mappings2.size();
+                  F1F2_best_mappings.clear();
+                  R1R2_best_mappings.clear();
                 }
-                if (current_num_mappings1 > 0 && current_num_mappings2 > 0) {
-                  int min_sum_errors, second_min_sum_errors;
-                  int num_best_mappings, num_second_best_mappings;
-                  F1R2_best_mappings.clear();
-                  F2R1_best_mappings.clear();
-                  if (split_alignment_) {
-                    F1F2_best_mappings.clear();
-                    R1R2_best_mappings.clear();
-                  }
-                  std::vector<std::vector<MappingRecord> > &mappings_on_diff_ref_seqs = mappings_on_diff_ref_seqs_for_diff_threads[omp_get_thread_num()];
-                  if (!split_alignment_) { 
-                    // GenerateBestMappingsForPairedEndRead assumes the mappings are sorted by coordinate for non split alignments
-                    // In split alignment, we don't want to sort and this keeps mapping and split_sites vectors consistent.
-                    std::sort(positive_mappings1.begin(), positive_mappings1.end(), [](const std::pair<int,uint64_t> &a, const std::pair<int,uint64_t> &b) { return a.second < b.second; });
-                    std::sort(positive_mappings2.begin(), positive_mappings2.end(), [](const std::pair<int,uint64_t> &a, const std::pair<int,uint64_t> &b) { return a.second < b.second; });
-                    std::sort(negative_mappings1.begin(), negative_mappings1.end(), [](const std::pair<int,uint64_t> &a, const std::pair<int,uint64_t> &b) { return a.second < b.second; });
-                    std::sort(negative_mappings2.begin(), negative_mappings2.end(), [](const std::pair<int,uint64_t> &a, const std::pair<int,uint64_t> &b) { return a.second < b.second; });
-                  }
-                  //std::vector<int> positive_split_sites1;
-                  //std::vector<int> negative_split_sites1;
-                  //std::vector<int> positive_split_sites2;
-                  //std::vector<int> negative_split_sites2;
-                  //if (!split_alignment_) {
-                    GenerateBestMappingsForPairedEndRead(pair_index, positive_candidates1.size(), negative_candidates1.size(), repetitive_seed_length1, min_num_errors1, num_best_mappings1, second_min_num_errors1, num_second_best_mappings1, read_batch1, positive_mappings1, positive_split_mappings1, negative_mappings1, negative_split_mappings1, positive_candidates2.size(), negative_candidates2.size(), repetitive_seed_length2, min_num_errors2, num_best_mappings2, second_min_num_errors2, num_second_best_mappings2, read_batch2, reference, barcode_batch, positive_mappings2, positive_split_mappings2, negative_mappings2, negative_split_mappings2, &best_mapping_indices, &generator, &F1R2_best_mappings, &F2R1_best_mappings, &F1F2_best_mappings, &R1R2_best_mappings, &min_sum_errors, &num_best_mappings, &second_min_sum_errors, &num_second_best_mappings, &mappings_on_diff_ref_seqs);
-                  //} else {
-                    //GenerateBestSplitMappingsForPairedEndRead(pair_index, positive_candidates1.size(), negative_candidates1.size(), repetitive_seed_length1, min_num_errors1, num_best_mappings1, second_min_num_errors1, num_second_best_mappings1, read_batch1, positive_split_mappings1, negative_split_mappings1, positive_candidates2.size(), negative_candidates2.size(), repetitive_seed_length2, min_num_errors2, num_best_mappings2, second_min_num_errors2, num_second_best_mappings2, read_batch2, positive_split_mappings2, negative_split_mappings2, reference, barcode_batch, &best_mapping_indices, &generator, &min_sum_errors, &num_best_mappings, &second_min_sum_errors, &num_second_best_mappings, &mappings_on_diff_ref_seqs);
-                  //}
-                  if (num_best_mappings == 1) {
-                    ++thread_num_uniquely_mapped_reads;
-                    ++thread_num_uniquely_mapped_reads;
-                  }
-                  thread_num_mappings += std::min(num_best_mappings, max_num_best_mappings_);
-                  thread_num_mappings += std::min(num_best_mappings, max_num_best_mappings_);
-                  if (num_best_mappings > 0) {
-                    ++thread_num_mapped_reads;
-                    ++thread_num_mapped_reads;
-                  }
+                if (!split_alignment_) { 
+                  // GenerateBestMappingsForPairedEndRead assumes the mappings are sorted by coordinate for non split alignments
+                  // In split alignment, we don't want to sort and this keeps mapping and split_sites vectors consistent.
+                  std::sort(positive_mappings1.begin(), positive_mappings1.end(), [](const std::pair<int,uint64_t> &a, const std::pair<int,uint64_t> &b) { return a.second < b.second; });
+                  std::sort(positive_mappings2.begin(), positive_mappings2.end(), [](const std::pair<int,uint64_t> &a, const std::pair<int,uint64_t> &b) { return a.second < b.second; });
+                  std::sort(negative_mappings1.begin(), negative_mappings1.end(), [](const std::pair<int,uint64_t> &a, const std::pair<int,uint64_t> &b) { return a.second < b.second; });
+                  std::sort(negative_mappings2.begin(), negative_mappings2.end(), [](const std::pair<int,uint64_t> &a, const std::pair<int,uint64_t> &b) { return a.second < b.second; });
+                }
+                //std::vector<int> positive_split_sites1;
+                //std::vector<int> negative_split_sites1;
+                //std::vector<int> positive_split_sites2;
+                //std::vector<int> negative_split_sites2;
+                //if (!split_alignment_) {
+                  GenerateBestMappingsForPairedEndRead(pair_index, positive_candidates1.size(), negative_candidates1.size(), repetitive_seed_length1, min_num_errors1, num_best_mappings1, second_min_num_errors1, num_second_best_mappings1, read_batch1, positive_mappings1, positive_split_mappings1, negative_mappings1, negative_split_mappings1, positive_candidates2.size(), negative_candidates2.size(), repetitive_seed_length2, min_num_errors2, num_best_mappings2, second_min_num_errors2, num_second_best_mappings2, read_batch2, reference, barcode_batch, positive_mappings2, positive_split_mappings2, negative_mappings2, negative_split_mappings2, &best_mapping_indices, &generator, &F1R2_best_mappings, &F2R1_best_mappings, &F1F2_best_mappings, &R1R2_best_mappings, &min_sum_errors, &num_best_mappings, &second_min_sum_errors, &num_second_best_mappings, &mappings_on_diff_ref_seqs);
+                //} else {
+                  //GenerateBestSplitMappingsForPairedEndRead(pair_index, positive_candidates1.size(), negative_candidates1.size(), repetitive_seed_length1, min_num_errors1, num_best_mappings1, second_min_num_errors1, num_second_best_mappings1, read_batch1, positive_split_mappings1, negative_split_mappings1, positive_candidates2.size(), negative_candidates2.size(), repetitive_seed_length2, min_num_errors2, num_best_mappings2, second_min_num_errors2, num_second_best_mappings2, read_batch2, positive_split_mappings2, negative_split_mappings2, reference, barcode_batch, &best_mapping_indices, &generator, &min_sum_errors, &num_best_mappings, &second_min_sum_errors, &num_second_best_mappings, &mappings_on_diff_ref_seqs);
+                //}
+                if (num_best_mappings == 1) {
+                  ++thread_num_uniquely_mapped_reads;
+                  ++thread_num_uniquely_mapped_reads;
+                }
+                thread_num_mappings += std::min(num_best_mappings, max_num_best_mappings_);
+                thread_num_mappings += std::min(num_best_mappings, max_num_best_mappings_);
+                if (num_best_mappings > 0) {
+                  ++thread_num_mapped_reads;
+                  ++thread_num_mapped_reads;
                 }
-              }
-            }
-            //std::cerr << "\n";
-          }
-          //if (num_reads_ / 2 > initial_num_sample_barcodes_) {
-          //  if (!is_bulk_data_) {
-          //    if (!barcode_whitelist_file_path_.empty()) {
-          //      UpdateBarcodeAbundance(num_loaded_pairs, barcode_batch);
-          //    }
-          //  }
-          //}
-          // Update cache
-          for (uint32_t pair_index = 0; pair_index < num_loaded_pairs / 2; ++pair_index) {
-            if (num_reads_ >= 2 * 5000000 && pair_index >= num_loaded_pairs / num_threads_) {
-              break;
-            }
-            mm_to_candidates_cache.Update(mm_history1[pair_index].minimizers, mm_history1[pair_index].positive_candidates, mm_history1[pair_index].negative_candidates, mm_history1[pair_index].repetitive_seed_length);
-            mm_to_candidates_cache.Update(mm_history2[pair_index].minimizers, mm_history2[pair_index].positive_candidates, mm_history2[pair_index].negative_candidates, mm_history2[pair_index].repetitive_seed_length);
-            if (mm_history1[pair_index].positive_candidates.size() < mm_history1[pair_index].positive_candidates.capacity() / 2) {
-              std::vector<Candidate>().swap(mm_history1[pair_index].positive_candidates);
-            }
-            if (mm_history1[pair_index].negative_candidates.size() < mm_history1[pair_index].negative_candidates.capacity() / 2) {
-              std::vector<Candidate>().swap(mm_history1[pair_index].negative_candidates);
-            }
-            if (mm_history2[pair_index].positive_candidates.size() < mm_history2[pair_index].positive_candidates.capacity() / 2) {
-              std::vector<Candidate>().swap(mm_history2[pair_index].positive_candidates);
-            }
-            if (mm_history2[pair_index].negative_candidates.size() < mm_history2[pair_index].negative_candidates.capacity() / 2) {
-              std::vector<Candidate>().swap(mm_history2[pair_index].negative_candidates);
-            }
-          }
-#pragma omp taskwait
-          std::cerr << "Mapped " << num_loaded_pairs << " read pairs in " << Chromap<>::GetRealTime() - real_batch_start_time << "s.\n";
-          real_batch_start_time = Chromap<>::GetRealTime();
-          // Swap to next batch
-          num_loaded_pairs = num_loaded_pairs_for_loading;
-          read_batch1_for_loading.SwapSequenceBatch(read_batch1);
-          read_batch2_for_loading.SwapSequenceBatch(read_batch2);
-          barcode_batch_for_loading.SwapSequenceBatch(barcode_batch);
-          mappings_on_diff_ref_seqs_for_diff_threads.swap(mappings_on_diff_ref_seqs_for_diff_threads_for_saving);
-#pragma omp task
-          {
-            // Handle output
-            num_mappings_in_mem += MoveMappingsInBuffersToMappingContainer(num_reference_sequences, &mappings_on_diff_ref_seqs_for_diff_threads_for_saving);
-            if (low_memory_mode_ && num_mappings_in_mem > max_num_mappings_in_mem) {
-              TempMappingFileHandle<MappingRecord> temp_mapping_file_handle;
-              temp_mapping_file_handle.file_path = mapping_output_file_path_ + ".temp" + std::to_string(temp_mapping_file_handles_.size());
-              temp_mapping_file_handles_.emplace_back(temp_mapping_file_handle);
-              SortOutputMappings(num_reference_sequences, &mappings_on_diff_ref_seqs_);
-              output_tools_-> OutputTempMapping(temp_mapping_file_handle.file_path, num_reference_sequences, mappings_on_diff_ref_seqs_);
-              num_mappings_in_mem = 0;
-              for (uint32_t i = 0; i < num_reference_sequences; ++i) {
-                mappings_on_diff_ref_seqs_[i].clear();
               }
             }
           }
+          //std::cerr << "\n";
         }
+      }
+#pragma omp barrier
+#pragma omp single
+      {
+        mapper_busy_time += Chromap<>::GetRealTime() - real_batch_start_time;
+        // Hand the mappings to the writer and the history to the cache updater
+        // so that both run concurrently with the mapping of the next batch.
+        mapped_batch_queue.Push(mapping_batch_index);
+        std::cerr << "Mapped " << num_loaded_pairs << " read pairs in " << Chromap<>::GetRealTime() - real_batch_start_time << "s.\n";
+        //if (num_reads_ / 2 > initial_num_sample_barcodes_) {
+        //  if (!is_bulk_data_) {
+        //    if (!barcode_whitelist_file_path_.empty()) {
+        //      UpdateBarcodeAbundance(num_loaded_pairs, barcode_batch);
+        //    }
+        //  }
+        //}
+        filled_mm_history_queue.Push(mm_history_index);
       } // end of openmp single
-      num_barcode_in_whitelist_ += thread_num_barcode_in_whitelist;
-      num_corrected_barcode_ += thread_num_corrected_barcode;
-      num_candidates_ += thread_num_candidates;
-      num_mappings_ += thread_num_mappings;
-      num_mapped_reads_ += thread_num_mapped_reads;
-      num_uniquely_mapped_reads_ += thread_num_uniquely_mapped_reads;
-    } // end of openmp parallel region
-    read_batch1_for_loading.FinalizeLoading();
-    read_batch2_for_loading.FinalizeLoading();
-    if (!is_bulk_data_) {
-      barcode_batch_for_loading.FinalizeLoading();
     }
+    num_barcode_in_whitelist_ += thread_num_barcode_in_whitelist;
+    num_corrected_barcode_ += thread_num_corrected_barcode;
+    num_candidates_ += thread_num_candidates;
+    num_mappings_ += thread_num_mappings;
+    num_mapped_reads_ += thread_num_mapped_reads;
+    num_uniquely_mapped_reads_ += thread_num_uniquely_mapped_reads;
+    num_duplicated_reads_ += thread_num_duplicated_reads;
+  } // end of openmp parallel region
+  mapped_batch_queue.Push(-1);
+  filled_mm_history_queue.Push(-1);
+  reader_thread.join();
+  writer_thread.join();
+  cache_updater_thread.join();
+  read_batch1_for_loading.FinalizeLoading();
+  if (!read_file2_paths_.empty()) {
+    read_batch2_for_loading.FinalizeLoading();
+  }
+  if (!is_bulk_data_ && !BarcodesAreInReadNames()) {
+    barcode_batch_for_loading.FinalizeLoading();
   }
   std::cerr << "Mapped all reads in " << Chromap<>::GetRealTime() - real_start_mapping_time << "s.\n";
-  delete[] mm_history1;
-  delete[] mm_history2;
+  std::cerr << "Reader busy " << reader_busy_time << "s, blocked " << free_batch_queue.GetPopWaitTime() << "s on free batches. ";
+  std::cerr << "Mappers busy " << mapper_busy_time << "s, blocked " << mapper_wait_time << "s on loaded batches. ";
+  std::cerr << "Writer busy " << writer_busy_time << "s, blocked " << mapped_batch_queue.GetPopWaitTime() << "s on mapped batches. ";
+  std::cerr << "Cache updater busy " << cache_updater_busy_time << "s, mappers blocked " << free_mm_history_queue.GetPopWaitTime() << "s on it.\n";
+  std::cerr << "Average queue occupancy: loaded " << loaded_batch_queue.GetAverageOccupancy() << "/" << loaded_batch_queue.GetCapacity() << ", mapped " << mapped_batch_queue.GetAverageOccupancy() << "/" << mapped_batch_queue.GetCapacity() << ".\n";
+  for (int hi = 0; hi < num_mm_histories; ++hi) {
+    delete[] mm_histories1[hi];
+    delete[] mm_histories2[hi];
+  }
   OutputMappingStatistics();
   if (!is_bulk_data_) {
     OutputBarcodeStatistics();
   }
   index.Destroy();
-  if (low_memory_mode_) {
+  if (unsorted_output_) {
+    std::cerr << "Number of output mappings (passed filters): " << num_output_mappings << "\n";
+  } else if (low_memory_mode_) {
     PostProcessingInLowMemory(num_mappings_in_mem, num_reference_sequences, reference);
   } else {
     //OutputMappingStatistics(num_reference_sequences, mappings_on_diff_ref_seqs_, mappings_on_diff_ref_seqs_);
-    if (Tn5_shift_) {
+    if (!dedup_while_mapping) {
+      OutputMappingMemoryUsage(num_reference_sequences, mappings_on_diff_ref_seqs_);
+    }
+    if (Tn5_shift_ && !dedup_while_mapping) {
       ApplyTn5ShiftOnPairedEndMapping(num_reference_sequences, &mappings_on_diff_ref_seqs_);
     }
     if (remove_pcr_duplicates_) {
-      RemovePCRDuplicate(num_reference_sequences);
+      duplicate_read_pair_set_.FinalizeDuplicateCounts();
+      if (dedup_while_mapping) {
+        double real_dedupe_start_time = Chromap<>::GetRealTime();
+        std::cerr << "Deduped " << num_mappings_in_mem << " mappings into " << duplicate_fragment_set_.GetNumFragments() << " unique fragments using " << duplicate_fragment_set_.GetMemoryBytes() / (1024.0 * 1024.0) << "MB while mapping.\n";
+        uint64_t num_deduped_mappings = duplicate_fragment_set_.Finalize(duplicate_read_pair_set_, &deduped_mappings_on_diff_ref_seqs_);
+        std::cerr << num_deduped_mappings << " mappings left after dedupe in " << Chromap<>::GetRealTime() - real_dedupe_start_time << "s.\n";
+      } else {
+        RemovePCRDuplicate(num_reference_sequences);
+      }
       std::cerr << "After removing PCR duplications, ";
       OutputMappingStatistics(num_reference_sequences, deduped_mappings_on_diff_ref_seqs_, deduped_mappings_on_diff_ref_seqs_);
     } else {
-      SortOutputMappings(num_reference_sequences, &mappings_on_diff_ref_seqs_);
+      SortOutputMappings(num_reference_sequences, &mappings_on_diff_ref_seqs_, num_threads_);
     }
     if (allocate_multi_mappings_) {
       AllocateMultiMappings(num_reference_sequences);
       std::cerr << "After allocating multi-mappings, ";
       OutputMappingStatistics(num_reference_sequences, allocated_mappings_on_diff_ref_seqs_, allocated_mappings_on_diff_ref_seqs_);
-      SortOutputMappings(num_reference_sequences, &allocated_mappings_on_diff_ref_seqs_);
+      SortOutputMappings(num_reference_sequences, &allocated_mappings_on_diff_ref_seqs_, num_threads_);
       OutputMappings(num_reference_sequences, reference, allocated_mappings_on_diff_ref_seqs_);
     } else {
       std::vector<std::vector<MappingRecord> > &mappings = remove_pcr_duplicates_ ? deduped_mappings_on_diff_ref_seqs_ : mappings_on_diff_ref_seqs_;
@@ -1277,9 +1689,9 @@ void Chromap<MappingRecord>::RecalibrateBestMappingsForPairedEndReadOnOneDirecti
   const char *read2 = read_batch2.GetSequenceAt(pair_index);
   uint32_t read1_length = read_batch1.GetSequenceLengthAt(pair_index);
   uint32_t read2_length = read_batch2.GetSequenceLengthAt(pair_index);
-  const std::string &negative_read1 = read_batch1.GetNegativeSequenceAt(pair_index);
-  const std::string &negative_read2 = read_batch2.GetNegativeSequenceAt(pair_index);
-  //uint32_t read_id = read_batch1.GetSequenceIdAt(pair_index);
+  const char *negative_read1 = read_batch1.GetNegativeSequenceAt(pair_index);
+  const char *negative_read2 = read_batch2.GetNegativeSequenceAt(pair_index);
+  //uint64_t read_id = read_batch1.GetSequenceIdAt(pair_index);
   for (uint32_t mi = 0; mi < edit_best_mappings.size(); ++mi) {
     uint32_t i1 = edit_best_mappings[mi].first;
     uint32_t i2 = edit_best_mappings[mi].second;
@@ -1301,9 +1713,9 @@ void Chromap<MappingRecord>::RecalibrateBestMappingsForPairedEndReadOnOneDirecti
       int current_alignment_score1, current_alignment_score2, current_alignment_score; 
       if (first_read_direction == kPositive) {
         current_alignment_score1 = ksw_semi_global2(read1_length + 2 * error_threshold_, reference.GetSequenceAt(rid1) + verification_window_start_position1, read1_length, read1, 5, mat, gap_open_penalties_[0], gap_extension_penalties_[0], gap_open_penalties_[1], gap_extension_penalties_[1], error_threshold_ * 2 + 1, NULL, NULL);
-        current_alignment_score2 = ksw_semi_global2(read2_length + 2 * error_threshold_, reference.GetSequenceAt(rid2) + verification_window_start_position2, read2_length, negative_read2.data(), 5, mat, gap_open_penalties_[0], gap_extension_penalties_[0], gap_open_penalties_[1], gap_extension_penalties_[1], error_threshold_ * 2 + 1, NULL, NULL);
+        current_alignment_score2 = ksw_semi_global2(read2_length + 2 * error_threshold_, reference.GetSequenceAt(rid2) + verification_window_start_position2, read2_length, negative_read2, 5, mat, gap_open_penalties_[0], gap_extension_penalties_[0], gap_open_penalties_[1], gap_extension_penalties_[1], error_threshold_ * 2 + 1, NULL, NULL);
       } else {
-        current_alignment_score1 = ksw_semi_global2(read1_length + 2 * error_threshold_, reference.GetSequenceAt(rid1) + verification_window_start_position1, read1_length, negative_read1.data(), 5, mat, gap_open_penalties_[0], gap_extension_penalties_[0], gap_open_penalties_[1], gap_extension_penalties_[1], error_threshold_ * 2 + 1, NULL, NULL);
+        current_alignment_score1 = ksw_semi_global2(read1_length + 2 * error_threshold_, reference.GetSequenceAt(rid1) + verification_window_start_position1, read1_length, negative_read1, 5, mat, gap_open_penalties_[0], gap_extension_penalties_[0], gap_open_penalties_[1], gap_extension_penalties_[1], error_threshold_ * 2 + 1, NULL, NULL);
         current_alignment_score2 = ksw_semi_global2(read1_length + 2 * error_threshold_, reference.GetSequenceAt(rid2) + verification_window_start_position2, read2_length, read2, 5, mat, gap_open_penalties_[0], gap_extension_penalties_[0], gap_open_penalties_[1], gap_extension_penalties_[1], error_threshold_ * 2 + 1, NULL, NULL);
       }
       current_alignment_score = current_alignment_score1 + current_alignment_score2;
@@ -1431,48 +1843,39 @@ void Chromap<MappingRecord>::GenerateBestMappingsForPairedEndReadOnOneDirection(
 }
 
 template<typename MappingRecord>
-void Chromap<MappingRecord>::EmplaceBackMappingRecord(uint32_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, std::vector<MappingRecord> *mappings_on_diff_ref_seqs) {
-}
-
-template<>
-void Chromap<PairedEndMappingWithoutBarcode>::EmplaceBackMappingRecord(uint32_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, std::vector<PairedEndMappingWithoutBarcode> *mappings_on_diff_ref_seqs) {
-  mappings_on_diff_ref_seqs->emplace_back(PairedEndMappingWithoutBarcode{read_id, fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups, positive_alignment_length, negative_alignment_length});
-}
-
-template<>
-void Chromap<PairedEndMappingWithBarcode>::EmplaceBackMappingRecord(uint32_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, std::vector<PairedEndMappingWithBarcode> *mappings_on_diff_ref_seqs) {
-  mappings_on_diff_ref_seqs->emplace_back(PairedEndMappingWithBarcode{read_id, barcode, fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups, positive_alignment_length, negative_alignment_length});
+void Chromap<MappingRecord>::EmplaceBackMappingRecord(uint64_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
+  PairedEndMappingAppender<MappingRecord>::Append(read_id, barcode, fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups, positive_alignment_length, negative_alignment_length, reference_sequence_index, mappings_on_diff_ref_seqs);
 }
 
 template<typename MappingRecord>
-void Chromap<MappingRecord>::EmplaceBackMappingRecord(uint32_t read_id, const char *read1_name, const char *read2_name, uint16_t read1_length, uint16_t read2_length, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq1, uint8_t mapq2, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, std::vector<MappingRecord> *mappings_on_diff_ref_seqs) {
+void Chromap<MappingRecord>::EmplaceBackMappingRecord(uint64_t read_id, const char *read1_name, const char *read2_name, uint16_t read1_length, uint16_t read2_length, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq1, uint8_t mapq2, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
 }
 
 template<>
-void Chromap<PairedPAFMapping>::EmplaceBackMappingRecord(uint32_t read_id, const char *read1_name, const char *read2_name, uint16_t read1_length, uint16_t read2_length, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq1, uint8_t mapq2, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, std::vector<PairedPAFMapping> *mappings_on_diff_ref_seqs) {
-  mappings_on_diff_ref_seqs->emplace_back(PairedPAFMapping{read_id, std::string(read1_name), std::string(read2_name), read1_length, read2_length, fragment_start_position, fragment_length, positive_alignment_length, negative_alignment_length, mapq1 < mapq2 ? mapq1 : mapq2, mapq1, mapq2, direction, is_unique, num_dups});
+void Chromap<PairedPAFMapping>::EmplaceBackMappingRecord(uint64_t read_id, const char *read1_name, const char *read2_name, uint16_t read1_length, uint16_t read2_length, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq1, uint8_t mapq2, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, uint32_t reference_sequence_index, MappingBuffer<PairedPAFMapping> *mappings_on_diff_ref_seqs) {
+  mappings_on_diff_ref_seqs->AppendOn(reference_sequence_index, PairedPAFMapping{read_id, std::string(read1_name), std::string(read2_name), read1_length, read2_length, fragment_start_position, fragment_length, positive_alignment_length, negative_alignment_length, mapq1 < mapq2 ? mapq1 : mapq2, mapq1, mapq2, direction, is_unique, num_dups});
 }
 
 template<typename MappingRecord>
-void Chromap<MappingRecord>::EmplaceBackMappingRecord(uint32_t read_id, const char *read_name, uint32_t cell_barcode, int rid1, int rid2, uint32_t pos1, uint32_t pos2, int direction1, int direction2, uint8_t mapq, uint8_t is_unique, uint8_t num_dups, std::vector<MappingRecord> *mappings_on_diff_ref_seqs) {
+void Chromap<MappingRecord>::EmplaceBackMappingRecord(uint64_t read_id, const char *read_name, uint32_t cell_barcode, int rid1, int rid2, uint32_t pos1, uint32_t pos2, int direction1, int direction2, uint8_t mapq, uint8_t is_unique, uint8_t num_dups, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
 }
 
 template<>
-void Chromap<PairsMapping>::EmplaceBackMappingRecord(uint32_t read_id, const char *read_name, uint32_t cell_barcode, int rid1, int rid2, uint32_t pos1, uint32_t pos2, int direction1, int direction2, uint8_t mapq, uint8_t is_unique, uint8_t num_dups, std::vector<PairsMapping> *mappings_on_diff_ref_seqs) {
-  mappings_on_diff_ref_seqs->emplace_back(PairsMapping{read_id, std::string(read_name), cell_barcode, rid1, rid2, pos1, pos2, direction1, direction2, mapq, is_unique, num_dups});
+void Chromap<PairsMapping>::EmplaceBackMappingRecord(uint64_t read_id, const char *read_name, uint32_t cell_barcode, int rid1, int rid2, uint32_t pos1, uint32_t pos2, int direction1, int direction2, uint8_t mapq, uint8_t is_unique, uint8_t num_dups, uint32_t reference_sequence_index, MappingBuffer<PairsMapping> *mappings_on_diff_ref_seqs) {
+  mappings_on_diff_ref_seqs->AppendOn(reference_sequence_index, PairsMapping{read_id, std::string(read_name), cell_barcode, rid1, rid2, pos1, pos2, direction1, direction2, mapq, is_unique, num_dups});
 }
 
 template <typename MappingRecord>
-void Chromap<MappingRecord>::ProcessBestMappingsForPairedEndReadOnOneDirection(Direction first_read_direction, Direction second_read_direction, uint32_t pair_index, uint8_t mapq, int num_candidates1, uint32_t repetitive_seed_length1, int min_num_errors1, int num_best_mappings1, int second_min_num_errors1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<std::pair<int, uint64_t> > &mappings1, const std::vector<SplitMapping> &split_mappings1, int num_candidates2, uint32_t repetitive_seed_length2, int min_num_errors2, int num_best_mappings2, int second_min_num_errors2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<int> &best_mapping_indices, const std::vector<std::pair<int, uint64_t> > &mappings2, const std::vector<SplitMapping> &split_mappings2, const std::vector<std::pair<uint32_t, uint32_t> > &best_mappings, int min_sum_errors, int num_best_mappings, int second_min_sum_errors, int num_second_best_mappings, int *best_mapping_index, int *num_best_mappings_reported, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs) {
+void Chromap<MappingRecord>::ProcessBestMappingsForPairedEndReadOnOneDirection(Direction first_read_direction, Direction second_read_direction, uint32_t pair_index, uint8_t mapq, int num_candidates1, uint32_t repetitive_seed_length1, int min_num_errors1, int num_best_mappings1, int second_min_num_errors1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<std::pair<int, uint64_t> > &mappings1, const std::vector<SplitMapping> &split_mappings1, int num_candidates2, uint32_t repetitive_seed_length2, int min_num_errors2, int num_best_mappings2, int second_min_num_errors2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<int> &best_mapping_indices, const std::vector<std::pair<int, uint64_t> > &mappings2, const std::vector<SplitMapping> &split_mappings2, const std::vector<std::pair<uint32_t, uint32_t> > &best_mappings, int min_sum_errors, int num_best_mappings, int second_min_sum_errors, int num_second_best_mappings, int *best_mapping_index, int *num_best_mappings_reported, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
 	const char *read1 = read_batch1.GetSequenceAt(pair_index);
 	const char *read2 = read_batch2.GetSequenceAt(pair_index);
 	uint32_t read1_length = read_batch1.GetSequenceLengthAt(pair_index);
 	uint32_t read2_length = read_batch2.GetSequenceLengthAt(pair_index);
   const char *read1_name = read_batch1.GetSequenceNameAt(pair_index);
   const char *read2_name = read_batch2.GetSequenceNameAt(pair_index);
-	const std::string &negative_read1 = read_batch1.GetNegativeSequenceAt(pair_index);
-	const std::string &negative_read2 = read_batch2.GetNegativeSequenceAt(pair_index);
-	uint32_t read_id = read_batch1.GetSequenceIdAt(pair_index);
+	const char *negative_read1 = read_batch1.GetNegativeSequenceAt(pair_index);
+	const char *negative_read2 = read_batch2.GetNegativeSequenceAt(pair_index);
+	uint64_t read_id = read_batch1.GetSequenceIdAt(pair_index);
 	uint8_t is_unique = (num_best_mappings == 1 || num_best_mappings1 == 1 || num_best_mappings2 == 1) ? 1 : 0;
 	uint32_t barcode_key = 0;
 	if (!is_bulk_data_) {
@@ -1507,10 +1910,10 @@ void Chromap<MappingRecord>::ProcessBestMappingsForPairedEndReadOnOneDirection(D
         uint8_t mapq1 = 0;
         uint8_t mapq2 = 0;
         if (first_read_direction == kNegative) {
-          effect_read1 = negative_read1.data();
+          effect_read1 = negative_read1;
         }
         if (second_read_direction == kNegative) {
-          effect_read2 = negative_read2.data();
+          effect_read2 = negative_read2;
         }
         if (split_alignment_) {
           ref_start_position1 = split_mappings1[i1].mapping_start_position_on_ref;
@@ -1552,8 +1955,8 @@ void Chromap<MappingRecord>::ProcessBestMappingsForPairedEndReadOnOneDirection(D
             flag1 |= BAM_FSECONDARY;
             flag2 |= BAM_FSECONDARY;
           }
-          EmplaceBackMappingRecord(read_id, read1_name, 1, ref_start_position1, rid1, flag1, 0, is_unique, mapq, NM1, n_cigar1, cigar1, MD_tag1, &((*mappings_on_diff_ref_seqs)[rid1])); 
-          EmplaceBackMappingRecord(read_id, read2_name, 1, ref_start_position2, rid2, flag2, 0, is_unique, mapq, NM2, n_cigar2, cigar2, MD_tag2, &((*mappings_on_diff_ref_seqs)[rid2])); 
+          EmplaceBackMappingRecord(read_id, read1_name, 1, ref_start_position1, rid1, flag1, 0, is_unique, mapq, NM1, n_cigar1, cigar1, MD_tag1, rid1, mappings_on_diff_ref_seqs); 
+          EmplaceBackMappingRecord(read_id, read2_name, 1, ref_start_position2, rid2, flag2, 0, is_unique, mapq, NM2, n_cigar2, cigar2, MD_tag2, rid2, mappings_on_diff_ref_seqs); 
         } else if (output_mapping_in_pairs_) {
           int position1 = ref_start_position1;
           int position2 = ref_start_position2;
@@ -1568,9 +1971,9 @@ void Chromap<MappingRecord>::ProcessBestMappingsForPairedEndReadOnOneDirection(D
           }
 
           if (rid1 < rid2 || (rid1 == rid2 && position1 < position2)) {
-            EmplaceBackMappingRecord(read_id, read1_name, barcode_key, rid1, rid2, position1, position2, direction, direction2, mapq, is_unique, 1, &((*mappings_on_diff_ref_seqs)[rid1]));
+            EmplaceBackMappingRecord(read_id, read1_name, barcode_key, rid1, rid2, position1, position2, direction, direction2, mapq, is_unique, 1, rid1, mappings_on_diff_ref_seqs);
           } else {
-            EmplaceBackMappingRecord(read_id, read1_name, barcode_key, rid2, rid1, position2, position1, direction2, direction, mapq, is_unique, 1, &((*mappings_on_diff_ref_seqs)[rid2]));
+            EmplaceBackMappingRecord(read_id, read1_name, barcode_key, rid2, rid1, position2, position1, direction2, direction, mapq, is_unique, 1, rid2, mappings_on_diff_ref_seqs);
           }
         } else if (output_mapping_in_PAF_) {
           uint32_t fragment_start_position = ref_start_position1;
@@ -1583,7 +1986,7 @@ void Chromap<MappingRecord>::ProcessBestMappingsForPairedEndReadOnOneDirection(D
             positive_alignment_length = ref_end_position2 - ref_start_position2 + 1;
             negative_alignment_length = ref_end_position1 - ref_start_position1 + 1;
           }
-          EmplaceBackMappingRecord(read_id, read1_name, read2_name, (uint16_t)read_batch1.GetSequenceLengthAt(pair_index), (uint16_t)read_batch2.GetSequenceLengthAt(pair_index), barcode_key, fragment_start_position, fragment_length, mapq1, mapq2, direction, is_unique, 1, positive_alignment_length, negative_alignment_length, &((*mappings_on_diff_ref_seqs)[rid1]));
+          EmplaceBackMappingRecord(read_id, read1_name, read2_name, (uint16_t)read_batch1.GetSequenceLengthAt(pair_index), (uint16_t)read_batch2.GetSequenceLengthAt(pair_index), barcode_key, fragment_start_position, fragment_length, mapq1, mapq2, direction, is_unique, 1, positive_alignment_length, negative_alignment_length, rid1, mappings_on_diff_ref_seqs);
         } else {
           uint32_t fragment_start_position = ref_start_position1;
           uint16_t fragment_length = ref_end_position2 - ref_start_position1 + 1;
@@ -1595,7 +1998,7 @@ void Chromap<MappingRecord>::ProcessBestMappingsForPairedEndReadOnOneDirection(D
             positive_alignment_length = ref_end_position2 - ref_start_position2 + 1;
             negative_alignment_length = ref_end_position1 - ref_start_position1 + 1;
           }
-          EmplaceBackMappingRecord(read_id, barcode_key, fragment_start_position, fragment_length, mapq, direction, is_unique, 1, positive_alignment_length, negative_alignment_length, &((*mappings_on_diff_ref_seqs)[rid1]));
+          EmplaceBackMappingRecord(read_id, barcode_key, fragment_start_position, fragment_length, mapq, direction, is_unique, 1, positive_alignment_length, negative_alignment_length, rid1, mappings_on_diff_ref_seqs);
         }
         (*num_best_mappings_reported)++;
         if (*num_best_mappings_reported == std::min(max_num_best_mappings_, num_best_mappings)) {
@@ -1608,7 +2011,7 @@ void Chromap<MappingRecord>::ProcessBestMappingsForPairedEndReadOnOneDirection(D
 }
 
 template <typename MappingRecord>
-void Chromap<MappingRecord>::GenerateBestSplitMappingsForPairedEndRead(uint32_t pair_index, int num_positive_candidates1, int num_negative_candidates1, uint32_t repetitive_seed_length1, int best_mapping_score1, int num_best_mappings1, int second_best_mapping_score1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<SplitMapping> &positive_mappings1, const std::vector<SplitMapping> &negative_mappings1, int num_positive_candidates2, int num_negative_candidates2, uint32_t repetitive_seed_length2, int best_mapping_score2, int num_best_mappings2, int second_best_mapping_score2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const std::vector<SplitMapping> &positive_mappings2, const std::vector<SplitMapping> &negative_mappings2, const SequenceBatch &reference, const SequenceBatch &barcode_batch, std::vector<int> *best_mapping_indices, std::mt19937 *generator, int *best_mapping_score, int *num_best_mappings, int *second_best_mapping_score, int *num_second_best_mappings, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs) {
+void Chromap<MappingRecord>::GenerateBestSplitMappingsForPairedEndRead(uint32_t pair_index, int num_positive_candidates1, int num_negative_candidates1, uint32_t repetitive_seed_length1, int best_mapping_score1, int num_best_mappings1, int second_best_mapping_score1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<SplitMapping> &positive_mappings1, const std::vector<SplitMapping> &negative_mappings1, int num_positive_candidates2, int num_negative_candidates2, uint32_t repetitive_seed_length2, int best_mapping_score2, int num_best_mappings2, int second_best_mapping_score2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const std::vector<SplitMapping> &positive_mappings2, const std::vector<SplitMapping> &negative_mappings2, const SequenceBatch &reference, const SequenceBatch &barcode_batch, std::vector<int> *best_mapping_indices, std::mt19937 *generator, int *best_mapping_score, int *num_best_mappings, int *second_best_mapping_score, int *num_second_best_mappings, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
   //*min_sum_errors = 2 * error_threshold_ + 1;
   //*num_best_mappings = 0;
   //*second_min_sum_errors = *min_sum_errors;
@@ -1618,7 +2021,7 @@ void Chromap<MappingRecord>::GenerateBestSplitMappingsForPairedEndRead(uint32_t
 }
 
 template <typename MappingRecord>
-void Chromap<MappingRecord>::GenerateBestSplitMappingsForPairedEndReadOnOneMate(uint32_t pair_index, int num_positive_candidates, int num_negative_candidates, uint32_t repetitive_seed_length, int best_mapping_score, int num_best_mappings, int second_best_mapping_score, int num_second_best_mappings, const SequenceBatch &read_batch, const std::vector<SplitMapping> &positive_mappings, const std::vector<SplitMapping> &negative_mappings, const SequenceBatch &reference, const SequenceBatch &barcode_batch, std::vector<int> *best_mapping_indices, std::mt19937 *generator, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs) {
+void Chromap<MappingRecord>::GenerateBestSplitMappingsForPairedEndReadOnOneMate(uint32_t pair_index, int num_positive_candidates, int num_negative_candidates, uint32_t repetitive_seed_length, int best_mapping_score, int num_best_mappings, int second_best_mapping_score, int num_second_best_mappings, const SequenceBatch &read_batch, const std::vector<SplitMapping> &positive_mappings, const std::vector<SplitMapping> &negative_mappings, const SequenceBatch &reference, const SequenceBatch &barcode_batch, std::vector<int> *best_mapping_indices, std::mt19937 *generator, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
   uint8_t mapq = 0;
   // we will use reservoir sampling 
   std::iota(best_mapping_indices->begin(), best_mapping_indices->end(), 0);
@@ -1642,8 +2045,8 @@ void Chromap<MappingRecord>::GenerateBestSplitMappingsForPairedEndReadOnOneMate(
 }
  
 template <typename MappingRecord>
-void Chromap<MappingRecord>::ProcessBestSplitMappingsForSingleEndRead(Direction mapping_direction, uint8_t mapq, int num_candidates, uint32_t repetitive_seed_length, int max_mapping_score, int num_best_mappings, int second_max_mapping_score, int num_second_best_mappings, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<int> &best_mapping_indices, const std::vector<SplitMapping> &mappings, int *best_mapping_index, int *num_best_mappings_reported, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs) {
-  uint32_t read_id = read_batch.GetSequenceIdAt(read_index);
+void Chromap<MappingRecord>::ProcessBestSplitMappingsForSingleEndRead(Direction mapping_direction, uint8_t mapq, int num_candidates, uint32_t repetitive_seed_length, int max_mapping_score, int num_best_mappings, int second_max_mapping_score, int num_second_best_mappings, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<int> &best_mapping_indices, const std::vector<SplitMapping> &mappings, int *best_mapping_index, int *num_best_mappings_reported, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
+  uint64_t read_id = read_batch.GetSequenceIdAt(read_index);
   const char *read_name = read_batch.GetSequenceNameAt(read_index);
   uint8_t is_unique = num_best_mappings == 1 ? 1 : 0;
   uint32_t barcode_key = 0;
@@ -1670,11 +2073,11 @@ void Chromap<MappingRecord>::ProcessBestSplitMappingsForSingleEndRead(Direction
             flag |= BAM_FSECONDARY;
           }
           int64_t mapping_position_of_read5_on_ref = mapping_direction == kPositive ? mappings[mi].mapping_start_position_on_ref : mappings[mi].mapping_start_position_on_ref + mappings[mi].mapping_length_on_ref;
-          EmplaceBackMappingRecord(read_id, read_name, 1, mapping_position_of_read5_on_ref, rid, flag, direction, is_unique, mapq, NM, n_cigar, cigar, MD_tag, &((*mappings_on_diff_ref_seqs)[rid])); 
+          EmplaceBackMappingRecord(read_id, read_name, 1, mapping_position_of_read5_on_ref, rid, flag, direction, is_unique, mapq, NM, n_cigar, cigar, MD_tag, rid, mappings_on_diff_ref_seqs); 
         } else if (output_mapping_in_PAF_) {
-          EmplaceBackMappingRecord(read_id, read_name, mappings[mi].mapping_length_on_read, barcode_key, mappings[mi].mapping_start_position_on_ref, mappings[mi].mapping_length_on_ref, mapq, direction, is_unique, 1, &((*mappings_on_diff_ref_seqs)[rid]));
+          EmplaceBackMappingRecord(read_id, read_name, mappings[mi].mapping_length_on_read, barcode_key, mappings[mi].mapping_start_position_on_ref, mappings[mi].mapping_length_on_ref, mapq, direction, is_unique, 1, rid, mappings_on_diff_ref_seqs);
         } else {
-          EmplaceBackMappingRecord(read_id, barcode_key, mappings[mi].mapping_start_position_on_ref, mappings[mi].mapping_length_on_ref, mapq, direction, is_unique, 1, &((*mappings_on_diff_ref_seqs)[rid]));
+          EmplaceBackMappingRecord(read_id, barcode_key, mappings[mi].mapping_start_position_on_ref, mappings[mi].mapping_length_on_ref, mapq, direction, is_unique, 1, rid, mappings_on_diff_ref_seqs);
         }
         (*num_best_mappings_reported)++;
         if (*num_best_mappings_reported == std::min(max_num_best_mappings_, num_best_mappings)) {
@@ -1687,7 +2090,7 @@ void Chromap<MappingRecord>::ProcessBestSplitMappingsForSingleEndRead(Direction
 }
 
 template <typename MappingRecord>
-void Chromap<MappingRecord>::GenerateBestMappingsForPairedEndRead(uint32_t pair_index, int num_positive_candidates1, int num_negative_candidates1, uint32_t repetitive_seed_length1, int min_num_errors1, int num_best_mappings1, int second_min_num_errors1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<std::pair<int, uint64_t> > &positive_mappings1, const std::vector<SplitMapping> &positive_split_mappings1, const std::vector<std::pair<int, uint64_t> > &negative_mappings1, const std::vector<SplitMapping> &negative_split_mappings1, int num_positive_candidates2, int num_negative_candidates2, uint32_t repetitive_seed_length2, int min_num_errors2, int num_best_mappings2, int second_min_num_errors2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<std::pair<int, uint64_t> > &positive_mappings2, const std::vector<SplitMapping> &positive_split_mappings2, const std::vector<std::pair<int, uint64_t> > &negative_mappings2, const std::vector<SplitMapping> &negative_split_mappings2, std::vector<int> *best_mapping_indices, std::mt19937 *generator, std::vector<std::pair<uint32_t, uint32_t> > *F1R2_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *F2R1_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *F1F2_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *R1R2_best_mappings, int *min_sum_errors, int *num_best_mappings, int *second_min_sum_errors, int *num_second_best_mappings, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs) {
+void Chromap<MappingRecord>::GenerateBestMappingsForPairedEndRead(uint32_t pair_index, int num_positive_candidates1, int num_negative_candidates1, uint32_t repetitive_seed_length1, int min_num_errors1, int num_best_mappings1, int second_min_num_errors1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<std::pair<int, uint64_t> > &positive_mappings1, const std::vector<SplitMapping> &positive_split_mappings1, const std::vector<std::pair<int, uint64_t> > &negative_mappings1, const std::vector<SplitMapping> &negative_split_mappings1, int num_positive_candidates2, int num_negative_candidates2, uint32_t repetitive_seed_length2, int min_num_errors2, int num_best_mappings2, int second_min_num_errors2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<std::pair<int, uint64_t> > &positive_mappings2, const std::vector<SplitMapping> &positive_split_mappings2, const std::vector<std::pair<int, uint64_t> > &negative_mappings2, const std::vector<SplitMapping> &negative_split_mappings2, std::vector<int> *best_mapping_indices, std::mt19937 *generator, std::vector<std::pair<uint32_t, uint32_t> > *F1R2_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *F2R1_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *F1F2_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *R1R2_best_mappings, int *min_sum_errors, int *num_best_mappings, int *second_min_sum_errors, int *num_second_best_mappings, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
   *min_sum_errors = 2 * error_threshold_ + 1;
   *num_best_mappings = 0;
   *second_min_sum_errors = *min_sum_errors;
@@ -1773,12 +2176,13 @@ template <typename MappingRecord>
 void Chromap<MappingRecord>::MapSingleEndReads() {
   double real_start_time = Chromap<>::GetRealTime();
   SequenceBatch reference;
-  reference.InitializeLoading(reference_file_path_);
+  reference.InitializeLoading(reference_file_path_, num_threads_);
   uint32_t num_reference_sequences = reference.LoadAllSequences();
   Index index(min_num_seeds_required_for_mapping_, max_seed_frequencies_, index_file_path_);
   index.Load();
   kmer_size_ = index.GetKmerSize();
   window_size_ = index.GetWindowSize();
+  InitializeBandedAlignKernels();
   //index.Statistics(num_sequences, reference);
   SequenceBatch read_batch(read_batch_size_);
   SequenceBatch read_batch_for_loading(read_batch_size_);
@@ -1810,144 +2214,151 @@ void Chromap<MappingRecord>::MapSingleEndReads() {
   static uint64_t thread_num_uniquely_mapped_reads = 0; 
 #pragma omp threadprivate(thread_num_candidates, thread_num_mappings, thread_num_mapped_reads, thread_num_uniquely_mapped_reads)
   double real_start_mapping_time = Chromap<>::GetRealTime();
-  for (size_t read_file_index = 0; read_file_index < read_file1_paths_.size(); ++read_file_index) {
-    read_batch_for_loading.InitializeLoading(read_file1_paths_[read_file_index]);
-    if (!is_bulk_data_) {
-      barcode_batch_for_loading.InitializeLoading(barcode_file_paths_[read_file_index]);
-    }
-    uint32_t num_loaded_reads_for_loading = 0;
-    uint32_t num_loaded_reads = LoadSingleEndReadsWithBarcodes(&read_batch_for_loading, &barcode_batch_for_loading);
-    read_batch_for_loading.SwapSequenceBatch(read_batch);
-    barcode_batch_for_loading.SwapSequenceBatch(barcode_batch);
-    std::vector<std::vector<std::vector<MappingRecord> > > mappings_on_diff_ref_seqs_for_diff_threads;
-    std::vector<std::vector<std::vector<MappingRecord> > > mappings_on_diff_ref_seqs_for_diff_threads_for_saving;
-    mappings_on_diff_ref_seqs_for_diff_threads.reserve(num_threads_);
-    mappings_on_diff_ref_seqs_for_diff_threads_for_saving.reserve(num_threads_);
-    for (int ti = 0; ti < num_threads_; ++ti) {
-      mappings_on_diff_ref_seqs_for_diff_threads.emplace_back(std::vector<std::vector<MappingRecord> >(num_reference_sequences));
-      mappings_on_diff_ref_seqs_for_diff_threads_for_saving.emplace_back(std::vector<std::vector<MappingRecord> >(num_reference_sequences));
-      for (uint32_t i = 0; i < num_reference_sequences; ++i) {
-        mappings_on_diff_ref_seqs_for_diff_threads[ti][i].reserve((num_loaded_reads + num_loaded_reads / 1000 * max_num_best_mappings_) / num_threads_ / num_reference_sequences);
-        mappings_on_diff_ref_seqs_for_diff_threads_for_saving[ti][i].reserve((num_loaded_reads + num_loaded_reads / 1000 * max_num_best_mappings_) / num_threads_ / num_reference_sequences);
-      }
-    }
-#pragma omp parallel default(none) shared(reference, index, read_batch, barcode_batch, read_batch_for_loading, barcode_batch_for_loading, std::cerr, num_loaded_reads_for_loading, num_loaded_reads, num_reference_sequences, mappings_on_diff_ref_seqs_for_diff_threads, mappings_on_diff_ref_seqs_for_diff_threads_for_saving, mm_to_candidates_cache, mm_history) num_threads(num_threads_) reduction(+:num_candidates_, num_mappings_, num_mapped_reads_, num_uniquely_mapped_reads_)
-    {
-      thread_num_candidates = 0;
-      thread_num_mappings = 0;
-      thread_num_mapped_reads = 0;
-      thread_num_uniquely_mapped_reads = 0;
-      std::vector<std::pair<uint64_t, uint64_t> > minimizers;
-      std::vector<uint64_t> positive_hits;
-      std::vector<uint64_t> negative_hits;
-      positive_hits.reserve(max_seed_frequencies_[0]);
-      negative_hits.reserve(max_seed_frequencies_[0]);
-      std::vector<Candidate> positive_candidates;
-      std::vector<Candidate> negative_candidates;
-      positive_candidates.reserve(max_seed_frequencies_[0]);
-      negative_candidates.reserve(max_seed_frequencies_[0]);
-      std::vector<std::pair<int, uint64_t> > positive_mappings;
-      std::vector<std::pair<int, uint64_t> > negative_mappings;
-      positive_mappings.reserve(max_seed_frequencies_[0]);
-      negative_mappings.reserve(max_seed_frequencies_[0]);
-      std::vector<SplitMapping> positive_split_mappings;
-      std::vector<SplitMapping> negative_split_mappings;
-      positive_split_mappings.reserve(max_seed_frequencies_[0]);
-      negative_split_mappings.reserve(max_seed_frequencies_[0]);
+  bool load_barcode_files = !is_bulk_data_ && !BarcodesAreInReadNames();
+  int num_inflate_threads = GetNumInflateThreadsPerReadFile(load_barcode_files ? 2 : 1);
+  read_batch_for_loading.InitializeLoading(read_file1_paths_, num_prefetched_lanes_, num_inflate_threads);
+  read_batch_for_loading.SetNumIdBits(ReadIdTraits<decltype(MappingRecord::read_id)>::NUM_BITS);
+  if (load_barcode_files) {
+    barcode_batch_for_loading.InitializeLoading(barcode_file_paths_, num_prefetched_lanes_, num_inflate_threads);
+  }
+  uint32_t num_loaded_reads_for_loading = 0;
+  uint64_t num_output_mappings = 0;
+  uint32_t num_loaded_reads = LoadSingleEndReadsWithBarcodes(&read_batch_for_loading, &barcode_batch_for_loading);
+  read_batch_for_loading.SwapSequenceBatch(read_batch);
+  barcode_batch_for_loading.SwapSequenceBatch(barcode_batch);
+  std::vector<MappingBuffer<MappingRecord> > mapping_buffers_for_diff_threads(num_threads_);
+  std::vector<MappingBuffer<MappingRecord> > mapping_buffers_for_diff_threads_for_saving(num_threads_);
+  for (int ti = 0; ti < num_threads_; ++ti) {
+    mapping_buffers_for_diff_threads[ti].Reserve((num_loaded_reads + num_loaded_reads / 1000 * max_num_best_mappings_) / num_threads_);
+    mapping_buffers_for_diff_threads_for_saving[ti].Reserve((num_loaded_reads + num_loaded_reads / 1000 * max_num_best_mappings_) / num_threads_);
+  }
+#pragma omp parallel default(none) shared(reference, index, read_batch, barcode_batch, read_batch_for_loading, barcode_batch_for_loading, std::cerr, num_loaded_reads_for_loading, num_loaded_reads, num_reference_sequences, mapping_buffers_for_diff_threads, mapping_buffers_for_diff_threads_for_saving, num_output_mappings, mm_to_candidates_cache, mm_history) num_threads(num_threads_) reduction(+:num_candidates_, num_mappings_, num_mapped_reads_, num_uniquely_mapped_reads_)
+  {
+    thread_num_candidates = 0;
+    thread_num_mappings = 0;
+    thread_num_mapped_reads = 0;
+    thread_num_uniquely_mapped_reads = 0;
+    std::vector<std::pair<uint64_t, uint64_t> > minimizers;
+    std::vector<uint64_t> positive_hits;
+    std::vector<uint64_t> negative_hits;
+    positive_hits.reserve(max_seed_frequencies_[0]);
+    negative_hits.reserve(max_seed_frequencies_[0]);
+    std::vector<Candidate> positive_candidates;
+    std::vector<Candidate> negative_candidates;
+    positive_candidates.reserve(max_seed_frequencies_[0]);
+    negative_candidates.reserve(max_seed_frequencies_[0]);
+    std::vector<std::pair<int, uint64_t> > positive_mappings;
+    std::vector<std::pair<int, uint64_t> > negative_mappings;
+    positive_mappings.reserve(max_seed_frequencies_[0]);
+    negative_mappings.reserve(max_seed_frequencies_[0]);
+    std::vector<SplitMapping> positive_split_mappings;
+    std::vector<SplitMapping> negative_split_mappings;
+    positive_split_mappings.reserve(max_seed_frequencies_[0]);
+    negative_split_mappings.reserve(max_seed_frequencies_[0]);
 #pragma omp single
-      {
-        while (num_loaded_reads > 0) {
-          double real_batch_start_time = Chromap<>::GetRealTime();
-          num_reads_ += num_loaded_reads;
+    {
+      while (num_loaded_reads > 0) {
+        double real_batch_start_time = Chromap<>::GetRealTime();
+        num_reads_ += num_loaded_reads;
 #pragma omp task
-          {
-            num_loaded_reads_for_loading = LoadSingleEndReadsWithBarcodes(&read_batch_for_loading, &barcode_batch_for_loading);
-          } // end of openmp loading task
-          //int grain_size = 10000;
+        {
+          num_loaded_reads_for_loading = LoadSingleEndReadsWithBarcodes(&read_batch_for_loading, &barcode_batch_for_loading);
+        } // end of openmp loading task
+        //int grain_size = 10000;
 //#pragma omp taskloop grainsize(grain_size) //num_tasks(num_threads_* 50)
 #pragma omp taskloop num_tasks(num_threads_* num_threads_)
-          for (uint32_t read_index = 0; read_index < num_loaded_reads; ++read_index) {
-            read_batch.PrepareNegativeSequenceAt(read_index);
-            minimizers.clear();
-            minimizers.reserve(read_batch.GetSequenceLengthAt(read_index) / window_size_ * 2);
-            index.GenerateMinimizerSketch(read_batch, read_index, &minimizers);
-            if (minimizers.size() > 0) {
-              positive_hits.clear();
-              negative_hits.clear();
-              positive_candidates.clear();
-              negative_candidates.clear();
-              uint32_t repetitive_seed_length = 0;
-              if (mm_to_candidates_cache.Query(minimizers, positive_candidates, negative_candidates, repetitive_seed_length, read_batch.GetSequenceLengthAt(read_index)) == -1) {
-                index.GenerateCandidates(error_threshold_, minimizers, &repetitive_seed_length, &positive_hits, &negative_hits, &positive_candidates, &negative_candidates);
-              }
-              if (read_index < num_loaded_reads / 2 && (read_index <  num_loaded_reads / num_threads_ || num_reads_ < 5000000)) {
-                mm_history[read_index].minimizers = minimizers;
-                mm_history[read_index].positive_candidates = positive_candidates;
-                mm_history[read_index].negative_candidates = negative_candidates;
-              }
-              uint32_t current_num_candidates = positive_candidates.size() + negative_candidates.size(); 
-              if (current_num_candidates > 0) {
-                thread_num_candidates += current_num_candidates;
-                positive_mappings.clear();
-                negative_mappings.clear();
-                positive_split_mappings.clear();
-                negative_split_mappings.clear();
-                int min_num_errors, second_min_num_errors;
-                int num_best_mappings, num_second_best_mappings;
-                VerifyCandidates(read_batch, read_index, reference, minimizers, positive_candidates, negative_candidates, &positive_mappings, &positive_split_mappings, &negative_mappings, &negative_split_mappings, &min_num_errors, &num_best_mappings, &second_min_num_errors, &num_second_best_mappings);
-                uint32_t current_num_mappings = positive_mappings.size() + negative_mappings.size();
-                if (current_num_mappings > 0) {
-                  std::vector<std::vector<MappingRecord> > &mappings_on_diff_ref_seqs = mappings_on_diff_ref_seqs_for_diff_threads[omp_get_thread_num()];
-                  GenerateBestMappingsForSingleEndRead(positive_candidates.size(), negative_candidates.size(), repetitive_seed_length, min_num_errors, num_best_mappings, second_min_num_errors, num_second_best_mappings, read_batch, read_index, reference, barcode_batch, positive_mappings, positive_split_mappings, negative_mappings, negative_split_mappings, &mappings_on_diff_ref_seqs);
-                  thread_num_mappings += std::min(num_best_mappings, max_num_best_mappings_);
-                  ++thread_num_mapped_reads;
-                  if (num_best_mappings == 1) {
-                    ++thread_num_uniquely_mapped_reads;
-                  }
+        for (uint32_t read_index = 0; read_index < num_loaded_reads; ++read_index) {
+          read_batch.PrepareNegativeSequenceAt(read_index);
+          minimizers.clear();
+          minimizers.reserve(read_batch.GetSequenceLengthAt(read_index) / window_size_ * 2);
+          index.GenerateMinimizerSketch(read_batch, read_index, &minimizers);
+          if (minimizers.size() > 0) {
+            positive_hits.clear();
+            negative_hits.clear();
+            positive_candidates.clear();
+            negative_candidates.clear();
+            uint32_t repetitive_seed_length = 0;
+            if (mm_to_candidates_cache.Query(minimizers, positive_candidates, negative_candidates, repetitive_seed_length, read_batch.GetSequenceLengthAt(read_index)) == -1) {
+              index.GenerateCandidates(error_threshold_, minimizers, &repetitive_seed_length, &positive_hits, &negative_hits, &positive_candidates, &negative_candidates);
+            }
+            if (read_index < num_loaded_reads / 2 && (read_index <  num_loaded_reads / num_threads_ || num_reads_ < 5000000)) {
+              mm_history[read_index].minimizers = minimizers;
+              mm_history[read_index].positive_candidates = positive_candidates;
+              mm_history[read_index].negative_candidates = negative_candidates;
+            }
+            uint32_t current_num_candidates = positive_candidates.size() + negative_candidates.size(); 
+            if (current_num_candidates > 0) {
+              thread_num_candidates += current_num_candidates;
+              positive_mappings.clear();
+              negative_mappings.clear();
+              positive_split_mappings.clear();
+              negative_split_mappings.clear();
+              int min_num_errors, second_min_num_errors;
+              int num_best_mappings, num_second_best_mappings;
+              VerifyCandidates(read_batch, read_index, reference, minimizers, positive_candidates, negative_candidates, &positive_mappings, &positive_split_mappings, &negative_mappings, &negative_split_mappings, &min_num_errors, &num_best_mappings, &second_min_num_errors, &num_second_best_mappings);
+              uint32_t current_num_mappings = positive_mappings.size() + negative_mappings.size();
+              if (current_num_mappings > 0) {
+                MappingBuffer<MappingRecord> &mappings_on_diff_ref_seqs = mapping_buffers_for_diff_threads[omp_get_thread_num()];
+                GenerateBestMappingsForSingleEndRead(positive_candidates.size(), negative_candidates.size(), repetitive_seed_length, min_num_errors, num_best_mappings, second_min_num_errors, num_second_best_mappings, read_batch, read_index, reference, barcode_batch, positive_mappings, positive_split_mappings, negative_mappings, negative_split_mappings, &mappings_on_diff_ref_seqs);
+                thread_num_mappings += std::min(num_best_mappings, max_num_best_mappings_);
+                ++thread_num_mapped_reads;
+                if (num_best_mappings == 1) {
+                  ++thread_num_uniquely_mapped_reads;
                 }
               }
             }
           }
-          for (uint32_t read_index = 0; read_index < num_loaded_reads / 2; ++read_index) {
-            if (num_reads_ >= 5000000 && read_index >= num_loaded_reads / num_threads_) {
-              break;
-            }
-            mm_to_candidates_cache.Update(mm_history[read_index].minimizers, mm_history[read_index].positive_candidates, mm_history[read_index].negative_candidates, mm_history[read_index].repetitive_seed_length);
-            if (mm_history[read_index].positive_candidates.size() < mm_history[read_index].positive_candidates.capacity() / 2) {
-              std::vector<Candidate>().swap(mm_history[read_index].positive_candidates);
-            }
-            if (mm_history[read_index].negative_candidates.size() < mm_history[read_index].negative_candidates.capacity() / 2) {
-              std::vector<Candidate>().swap(mm_history[read_index].negative_candidates);
-            }
+        }
+        for (uint32_t read_index = 0; read_index < num_loaded_reads / 2; ++read_index) {
+          if (num_reads_ >= 5000000 && read_index >= num_loaded_reads / num_threads_) {
+            break;
           }
-          //std::cerr<<"cache memusage: " << mm_to_candidates_cache.GetMemoryBytes() <<"\n" ;
+          mm_to_candidates_cache.Update(mm_history[read_index].minimizers, mm_history[read_index].positive_candidates, mm_history[read_index].negative_candidates, mm_history[read_index].repetitive_seed_length);
+          if (mm_history[read_index].positive_candidates.size() < mm_history[read_index].positive_candidates.capacity() / 2) {
+            std::vector<Candidate>().swap(mm_history[read_index].positive_candidates);
+          }
+          if (mm_history[read_index].negative_candidates.size() < mm_history[read_index].negative_candidates.capacity() / 2) {
+            std::vector<Candidate>().swap(mm_history[read_index].negative_candidates);
+          }
+        }
+        //std::cerr<<"cache memusage: " << mm_to_candidates_cache.GetMemoryBytes() <<"\n" ;
 #pragma omp taskwait
-          num_loaded_reads = num_loaded_reads_for_loading;
-          read_batch_for_loading.SwapSequenceBatch(read_batch);
-          barcode_batch_for_loading.SwapSequenceBatch(barcode_batch);
-          mappings_on_diff_ref_seqs_for_diff_threads.swap(mappings_on_diff_ref_seqs_for_diff_threads_for_saving);
+        num_loaded_reads = num_loaded_reads_for_loading;
+        read_batch_for_loading.SwapSequenceBatch(read_batch);
+        barcode_batch_for_loading.SwapSequenceBatch(barcode_batch);
+        mapping_buffers_for_diff_threads.swap(mapping_buffers_for_diff_threads_for_saving);
 #pragma omp task
-          {
-            MoveMappingsInBuffersToMappingContainer(num_reference_sequences, &mappings_on_diff_ref_seqs_for_diff_threads_for_saving);
+        {
+          if (unsorted_output_) {
+            num_output_mappings += OutputMappingsInBuffers(num_reference_sequences, reference, &mapping_buffers_for_diff_threads_for_saving);
+          } else {
+            MoveMappingsInBuffersToMappingContainer(num_reference_sequences, &mapping_buffers_for_diff_threads_for_saving, 1);
           }
-          std::cerr << "Mapped in " << Chromap<>::GetRealTime() - real_batch_start_time << "s.\n";
         }
-      } // end of openmp single
-      {
-        num_candidates_ += thread_num_candidates;
-        num_mappings_ += thread_num_mappings;
-        num_mapped_reads_ += thread_num_mapped_reads;
-        num_uniquely_mapped_reads_ += thread_num_uniquely_mapped_reads;
-      } // end of updating shared mapping stats
-    } // end of openmp parallel region
-    read_batch_for_loading.FinalizeLoading();
-    if (!is_bulk_data_) {
-      barcode_batch_for_loading.FinalizeLoading();
-    }
+        std::cerr << "Mapped in " << Chromap<>::GetRealTime() - real_batch_start_time << "s.\n";
+      }
+    } // end of openmp single
+    {
+      num_candidates_ += thread_num_candidates;
+      num_mappings_ += thread_num_mappings;
+      num_mapped_reads_ += thread_num_mapped_reads;
+      num_uniquely_mapped_reads_ += thread_num_uniquely_mapped_reads;
+    } // end of updating shared mapping stats
+  } // end of openmp parallel region
+  read_batch_for_loading.FinalizeLoading();
+  if (!is_bulk_data_ && !BarcodesAreInReadNames()) {
+    barcode_batch_for_loading.FinalizeLoading();
   }
   delete[] mm_history;
   OutputMappingStatistics();
   std::cerr << "Mapped all reads in " << Chromap<>::GetRealTime() - real_start_mapping_time << "s.\n";
+  if (unsorted_output_) {
+    std::cerr << "Number of output mappings (passed filters): " << num_output_mappings << "\n";
+    output_tools_->FinalizeMappingOutput();
+    reference.FinalizeLoading();
+    std::cerr << "Total time: " << Chromap<>::GetRealTime() - real_start_time << "s.\n";
+    return;
+  }
   OutputMappingStatistics(num_reference_sequences, mappings_on_diff_ref_seqs_, mappings_on_diff_ref_seqs_);
   if (Tn5_shift_) {
     ApplyTn5ShiftOnSingleEndMapping(num_reference_sequences, &mappings_on_diff_ref_seqs_);
@@ -1957,13 +2368,13 @@ void Chromap<MappingRecord>::MapSingleEndReads() {
     std::cerr << "After removing PCR duplications, ";
     OutputMappingStatistics(num_reference_sequences, deduped_mappings_on_diff_ref_seqs_, deduped_mappings_on_diff_ref_seqs_);
   } else {
-    SortOutputMappings(num_reference_sequences, &mappings_on_diff_ref_seqs_);
+    SortOutputMappings(num_reference_sequences, &mappings_on_diff_ref_seqs_, num_threads_);
   }
   if (allocate_multi_mappings_) {
     AllocateMultiMappings(num_reference_sequences);
     std::cerr << "After allocating multi-mappings, ";
     OutputMappingStatistics(num_reference_sequences, allocated_mappings_on_diff_ref_seqs_, allocated_mappings_on_diff_ref_seqs_);
-    SortOutputMappings(num_reference_sequences, &allocated_mappings_on_diff_ref_seqs_);
+    SortOutputMappings(num_reference_sequences, &allocated_mappings_on_diff_ref_seqs_, num_threads_);
     OutputMappings(num_reference_sequences, reference, allocated_mappings_on_diff_ref_seqs_);
   } else {
     std::vector<std::vector<MappingRecord> > &mappings = remove_pcr_duplicates_ ? deduped_mappings_on_diff_ref_seqs_ : mappings_on_diff_ref_seqs_;
@@ -1975,35 +2386,26 @@ void Chromap<MappingRecord>::MapSingleEndReads() {
 }
 
 template<typename MappingRecord>
-void Chromap<MappingRecord>::EmplaceBackMappingRecord(uint32_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, std::vector<MappingRecord> *mappings_on_diff_ref_seqs) {
-}
-
-template<>
-void Chromap<MappingWithoutBarcode>::EmplaceBackMappingRecord(uint32_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, std::vector<MappingWithoutBarcode> *mappings_on_diff_ref_seqs) {
-  mappings_on_diff_ref_seqs->emplace_back(MappingWithoutBarcode{read_id, fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups});
-}
-
-template<>
-void Chromap<MappingWithBarcode>::EmplaceBackMappingRecord(uint32_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, std::vector<MappingWithBarcode> *mappings_on_diff_ref_seqs) {
-  mappings_on_diff_ref_seqs->emplace_back(MappingWithBarcode{read_id, barcode, fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups});
+void Chromap<MappingRecord>::EmplaceBackMappingRecord(uint64_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
+  SingleEndMappingAppender<MappingRecord>::Append(read_id, barcode, fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups, reference_sequence_index, mappings_on_diff_ref_seqs);
 }
 
 template<typename MappingRecord>
-void Chromap<MappingRecord>::EmplaceBackMappingRecord(uint32_t read_id, const char *read_name, uint16_t read_length, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, std::vector<MappingRecord> *mappings_on_diff_ref_seqs) {
+void Chromap<MappingRecord>::EmplaceBackMappingRecord(uint64_t read_id, const char *read_name, uint16_t read_length, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
 }
 
 template<>
-void Chromap<PAFMapping>::EmplaceBackMappingRecord(uint32_t read_id, const char *read_name, uint16_t read_length, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, std::vector<PAFMapping> *mappings_on_diff_ref_seqs) {
-  mappings_on_diff_ref_seqs->emplace_back(PAFMapping{read_id, std::string(read_name), read_length, fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups});
+void Chromap<PAFMapping>::EmplaceBackMappingRecord(uint64_t read_id, const char *read_name, uint16_t read_length, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint32_t reference_sequence_index, MappingBuffer<PAFMapping> *mappings_on_diff_ref_seqs) {
+  mappings_on_diff_ref_seqs->AppendOn(reference_sequence_index, PAFMapping{read_id, std::string(read_name), read_length, fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups});
 }
 
 template<typename MappingRecord>
-void Chromap<MappingRecord>::EmplaceBackMappingRecord(uint32_t read_id, const char *read_name, uint8_t num_dups, int64_t position, int rid, int flag, uint8_t direction, uint8_t is_unique, uint8_t mapq, uint32_t NM, int n_cigar, uint32_t *cigar, std::string &MD_tag, std::vector<MappingRecord> *mappings_on_diff_ref_seqs) {
+void Chromap<MappingRecord>::EmplaceBackMappingRecord(uint64_t read_id, const char *read_name, uint8_t num_dups, int64_t position, int rid, int flag, uint8_t direction, uint8_t is_unique, uint8_t mapq, uint32_t NM, int n_cigar, uint32_t *cigar, std::string &MD_tag, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
 }
 
 template<>
-void Chromap<SAMMapping>::EmplaceBackMappingRecord(uint32_t read_id, const char *read_name, uint8_t num_dups, int64_t position, int rid, int flag, uint8_t direction, uint8_t is_unique, uint8_t mapq, uint32_t NM, int n_cigar, uint32_t *cigar, std::string &MD_tag, std::vector<SAMMapping> *mappings_on_diff_ref_seqs) {
-  mappings_on_diff_ref_seqs->emplace_back(SAMMapping{read_id, std::string(read_name), num_dups, position, rid, flag, direction, 0, is_unique, mapq, NM, n_cigar, cigar, MD_tag});
+void Chromap<SAMMapping>::EmplaceBackMappingRecord(uint64_t read_id, const char *read_name, uint8_t num_dups, int64_t position, int rid, int flag, uint8_t direction, uint8_t is_unique, uint8_t mapq, uint32_t NM, int n_cigar, uint32_t *cigar, std::string &MD_tag, uint32_t reference_sequence_index, MappingBuffer<SAMMapping> *mappings_on_diff_ref_seqs) {
+  mappings_on_diff_ref_seqs->AppendOn(reference_sequence_index, SAMMapping{read_id, std::string(read_name), num_dups, position, rid, flag, direction, 0, is_unique, mapq, NM, n_cigar, cigar, MD_tag});
 }
 
 template <typename MappingRecord>
@@ -2172,7 +2574,8 @@ void Chromap<MappingRecord>::GetRefStartEndPositionForReadFromMapping(Direction
       *ref_end_position = position;
     }
   } else { // reverse strand
-    int read_start_site = full_read_length - (split_mapping.mapping_length_on_read + split_mapping.mapping_start_position_on_read5);
+    // split_mapping is only filled in split alignment mode.
+    int read_start_site = split_alignment_ ? full_read_length - (split_mapping.mapping_length_on_read + split_mapping.mapping_start_position_on_read5) : 0;
     if (output_mapping_in_SAM_) {
       *n_cigar = 0;
       int mapping_end_position = split_alignment_ ? split_mapping.mapping_length_on_ref + error_threshold_ - 1 : mapping.second;
@@ -2203,12 +2606,12 @@ void Chromap<MappingRecord>::GetRefStartEndPositionForReadFromMapping(Direction
 }
 
 template <typename MappingRecord>
-void Chromap<MappingRecord>::ProcessBestMappingsForSingleEndRead(Direction mapping_direction, uint8_t mapq, int num_candidates, uint32_t repetitive_seed_length, int min_num_errors, int num_best_mappings, int second_min_num_errors, int num_second_best_mappings, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<int> &best_mapping_indices, const std::vector<std::pair<int, uint64_t> > &mappings, const std::vector<SplitMapping> &split_mappings, int *best_mapping_index, int *num_best_mappings_reported, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs) {
+void Chromap<MappingRecord>::ProcessBestMappingsForSingleEndRead(Direction mapping_direction, uint8_t mapq, int num_candidates, uint32_t repetitive_seed_length, int min_num_errors, int num_best_mappings, int second_min_num_errors, int num_second_best_mappings, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<int> &best_mapping_indices, const std::vector<std::pair<int, uint64_t> > &mappings, const std::vector<SplitMapping> &split_mappings, int *best_mapping_index, int *num_best_mappings_reported, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
   const char *read = read_batch.GetSequenceAt(read_index);
-  uint32_t read_id = read_batch.GetSequenceIdAt(read_index);
+  uint64_t read_id = read_batch.GetSequenceIdAt(read_index);
   const char *read_name = read_batch.GetSequenceNameAt(read_index);
   uint32_t read_length = read_batch.GetSequenceLengthAt(read_index);
-  const std::string &negative_read = read_batch.GetNegativeSequenceAt(read_index);
+  const char *negative_read = read_batch.GetNegativeSequenceAt(read_index);
   uint8_t is_unique = num_best_mappings == 1 ? 1 : 0;
   uint32_t barcode_key = 0;
   if (!is_bulk_data_) {
@@ -2228,7 +2631,7 @@ void Chromap<MappingRecord>::ProcessBestMappingsForSingleEndRead(Direction mappi
         const char *effect_read = read;
         if (mapping_direction == kNegative) {
           direction = 0;
-          effect_read = negative_read.data();
+          effect_read = negative_read;
         }
         uint32_t rid = mappings[mi].second >> 32;
 
@@ -2246,11 +2649,11 @@ void Chromap<MappingRecord>::ProcessBestMappingsForSingleEndRead(Direction mappi
           if (*num_best_mappings_reported >= 1) {
             flag |= BAM_FSECONDARY;
           }
-          EmplaceBackMappingRecord(read_id, read_name, 1, ref_start_position, rid, flag, 0, is_unique, mapq, NM, n_cigar, cigar, MD_tag, &((*mappings_on_diff_ref_seqs)[rid])); 
+          EmplaceBackMappingRecord(read_id, read_name, 1, ref_start_position, rid, flag, 0, is_unique, mapq, NM, n_cigar, cigar, MD_tag, rid, mappings_on_diff_ref_seqs); 
         } else if (output_mapping_in_PAF_) {
-          EmplaceBackMappingRecord(read_id, read_name, read_length, barcode_key, ref_start_position, ref_end_position - ref_start_position + 1, mapq, direction, is_unique, 1, &((*mappings_on_diff_ref_seqs)[rid]));
+          EmplaceBackMappingRecord(read_id, read_name, read_length, barcode_key, ref_start_position, ref_end_position - ref_start_position + 1, mapq, direction, is_unique, 1, rid, mappings_on_diff_ref_seqs);
         } else {
-          EmplaceBackMappingRecord(read_id, barcode_key, ref_start_position, ref_end_position - ref_start_position + 1, mapq, direction, is_unique, 1, &((*mappings_on_diff_ref_seqs)[rid]));
+          EmplaceBackMappingRecord(read_id, barcode_key, ref_start_position, ref_end_position - ref_start_position + 1, mapq, direction, is_unique, 1, rid, mappings_on_diff_ref_seqs);
         }
         (*num_best_mappings_reported)++;
         if (*num_best_mappings_reported == std::min(max_num_best_mappings_, num_best_mappings)) {
@@ -2263,7 +2666,7 @@ void Chromap<MappingRecord>::ProcessBestMappingsForSingleEndRead(Direction mappi
 }
 
 template <typename MappingRecord>
-void Chromap<MappingRecord>::GenerateBestMappingsForSingleEndRead(int num_positive_candidates, int num_negative_candidates, uint32_t repetitive_seed_length, int min_num_errors, int num_best_mappings, int second_min_num_errors, int num_second_best_mappings, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<std::pair<int, uint64_t> > &positive_mappings, const std::vector<SplitMapping> &positive_split_mappings, const std::vector<std::pair<int, uint64_t> > &negative_mappings, const std::vector<SplitMapping> &negative_split_mappings, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs) {
+void Chromap<MappingRecord>::GenerateBestMappingsForSingleEndRead(int num_positive_candidates, int num_negative_candidates, uint32_t repetitive_seed_length, int min_num_errors, int num_best_mappings, int second_min_num_errors, int num_second_best_mappings, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<std::pair<int, uint64_t> > &positive_mappings, const std::vector<SplitMapping> &positive_split_mappings, const std::vector<std::pair<int, uint64_t> > &negative_mappings, const std::vector<SplitMapping> &negative_split_mappings, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
   //uint8_t mapq = GetMAPQ(num_best_mappings, num_second_best_mappings);
   uint8_t mapq = 0;
   // we will use reservoir sampling 
@@ -2308,9 +2711,16 @@ uint32_t Chromap<MappingRecord>::LoadSingleEndReadsWithBarcodes(SequenceBatch *r
     bool no_more_read = read_batch->LoadOneSequenceAndSaveAt(num_loaded_reads);
     bool no_more_barcode = no_more_read;
     if (!is_bulk_data_) {
-      no_more_barcode = barcode_batch->LoadOneSequenceAndSaveAt(num_loaded_reads);
+      if (!BarcodesAreInReadNames()) {
+        no_more_barcode = barcode_batch->LoadOneSequenceAndSaveAt(num_loaded_reads);
+      } else if (!no_more_read) {
+        SaveBarcodeInReadNameAt(num_loaded_reads, *read_batch, barcode_batch);
+      }
     }
     if ((!no_more_read) && (!no_more_barcode)) {
+      if (!is_bulk_data_ && !BarcodesAreInReadNames() && barcode_batch->GetCurrentFileIndex() != read_batch->GetCurrentFileIndex()) {
+        Chromap<>::ExitWithMessage("Numbers of reads and barcodes don't match!");
+      }
       if (read_batch->GetSequenceLengthAt(num_loaded_reads) < (uint32_t)min_read_length_) {
         continue; // reads are too short, just drop.
       }
@@ -2338,7 +2748,7 @@ void Chromap<MappingRecord>::ConstructIndex() {
   // TODO(Haowen): Need a faster algorithm
   // Load all sequences in the reference into one batch
   SequenceBatch reference;
-  reference.InitializeLoading(reference_file_path_);
+  reference.InitializeLoading(reference_file_path_, num_threads_);
   uint32_t num_sequences = reference.LoadAllSequences();
   Index index(kmer_size_, window_size_, num_threads_, index_file_path_);
   index.Construct(num_sequences, reference);
@@ -2348,28 +2758,117 @@ void Chromap<MappingRecord>::ConstructIndex() {
 }
 
 template <typename MappingRecord>
-uint32_t Chromap<MappingRecord>::MoveMappingsInBuffersToMappingContainer(uint32_t num_reference_sequences, std::vector<std::vector<std::vector<MappingRecord> > > *mappings_on_diff_ref_seqs_for_diff_threads_for_saving) {
+uint32_t Chromap<MappingRecord>::MoveMappingsInBuffersToMappingContainer(uint32_t num_reference_sequences, std::vector<MappingBuffer<MappingRecord> > *mapping_buffers, int num_moving_threads) {
   //double real_start_time = Chromap<>::GetRealTime();
+  // A counting sort on the reference sequence index: group the records of each
+  // buffer, give each group its slots at the end of its container, then move
+  // all the groups in parallel. The records on each reference sequence end up
+  // in buffer order as before.
+  int num_buffers = mapping_buffers->size();
+#pragma omp parallel for default(none) shared(mapping_buffers, num_buffers) schedule(dynamic, 1) num_threads(num_moving_threads)
+  for (int bi = 0; bi < num_buffers; ++bi) {
+    (*mapping_buffers)[bi].GroupByReferenceSequence();
+  }
   uint32_t num_moved_mappings = 0;
-  for (int ti = 0; ti < num_threads_; ++ti) {
-    for (uint32_t i = 0; i < num_reference_sequences; ++i) {
-      num_moved_mappings += (*mappings_on_diff_ref_seqs_for_diff_threads_for_saving)[ti][i].size();
-      mappings_on_diff_ref_seqs_[i].insert(mappings_on_diff_ref_seqs_[i].end(), std::make_move_iterator((*mappings_on_diff_ref_seqs_for_diff_threads_for_saving)[ti][i].begin()), std::make_move_iterator((*mappings_on_diff_ref_seqs_for_diff_threads_for_saving)[ti][i].end()));
-      (*mappings_on_diff_ref_seqs_for_diff_threads_for_saving)[ti][i].clear();
+  std::vector<std::vector<size_t> > group_offsets_for_diff_buffers(num_buffers);
+  for (int bi = 0; bi < num_buffers; ++bi) {
+    const std::vector<std::pair<uint32_t, uint32_t> > &groups = (*mapping_buffers)[bi].GetGroups();
+    group_offsets_for_diff_buffers[bi].reserve(groups.size());
+    for (const std::pair<uint32_t, uint32_t> &group : groups) {
+      std::vector<MappingRecord> &mappings = mappings_on_diff_ref_seqs_[group.first];
+      group_offsets_for_diff_buffers[bi].emplace_back(mappings.size());
+      mappings.resize(mappings.size() + group.second);
+      num_moved_mappings += group.second;
     }
   }
+#pragma omp parallel for default(none) shared(mapping_buffers, num_buffers, group_offsets_for_diff_buffers) schedule(dynamic, 1) num_threads(num_moving_threads)
+  for (int bi = 0; bi < num_buffers; ++bi) {
+    (*mapping_buffers)[bi].MoveGroupsTo(group_offsets_for_diff_buffers[bi], &mappings_on_diff_ref_seqs_);
+  }
   //std::cerr << "Moved mappings in " << Chromap<>::GetRealTime() - real_start_time << "s.\n";
   return num_moved_mappings;
 }
 
 template <typename MappingRecord>
-void Chromap<MappingRecord>::SortOutputMappings(uint32_t num_reference_sequences, std::vector<std::vector<MappingRecord> > *mappings) {
+uint32_t Chromap<MappingRecord>::OutputMappingsInBuffers(uint32_t num_reference_sequences, const SequenceBatch &reference, std::vector<MappingBuffer<MappingRecord> > *mapping_buffers) {
+  // Unsorted output: Tn5 shift, filter and write the mappings of one batch,
+  // so nothing accumulates across batches.
+  uint32_t num_mappings_passing_filters = 0;
+  for (MappingBuffer<MappingRecord> &mapping_buffer : *mapping_buffers) {
+    for (size_t mi = 0; mi < mapping_buffer.GetNumMappings(); ++mi) {
+      MappingRecord &mapping = mapping_buffer.GetMappingAt(mi);
+      if (Tn5_shift_) {
+        mapping.Tn5Shift();
+      }
+      if (mapping.mapq >= mapq_threshold_) {
+        output_tools_->AppendMapping(mapping_buffer.GetReferenceSequenceIndexAt(mi), reference, mapping);
+        ++num_mappings_passing_filters;
+      }
+    }
+    mapping_buffer.Clear();
+  }
+  return num_mappings_passing_filters;
+}
+
+template <typename MappingRecord>
+std::vector<uint32_t> Chromap<MappingRecord>::GetReferenceSequenceIndicesByNumMappings(uint32_t num_reference_sequences, const std::vector<std::vector<MappingRecord> > &mappings) {
+  // Only the ref seqs with mappings, so that a reference with many short
+  // contigs doesn't hand out mostly empty work.
+  std::vector<uint32_t> reference_sequence_indices;
+  for (uint32_t ri = 0; ri < num_reference_sequences; ++ri) {
+    if (!mappings[ri].empty()) {
+      reference_sequence_indices.emplace_back(ri);
+    }
+  }
+  std::stable_sort(reference_sequence_indices.begin(), reference_sequence_indices.end(), [&mappings](uint32_t a, uint32_t b) {
+    return mappings[a].size() > mappings[b].size();
+  });
+  return reference_sequence_indices;
+}
+
+template <typename MappingRecord>
+void Chromap<MappingRecord>::SortMappingsInParallel(int num_sorting_threads, std::vector<MappingRecord> *mappings) {
+  // Sort one chunk per thread, then merge neighbouring chunks pairwise.
+  int num_chunks = num_sorting_threads;
+  std::vector<size_t> chunk_starts(num_chunks + 1);
+  for (int ci = 0; ci <= num_chunks; ++ci) {
+    chunk_starts[ci] = mappings->size() * ci / num_chunks;
+  }
+  MappingRecord *mappings_begin = mappings->data();
+#pragma omp parallel for default(none) shared(chunk_starts, mappings_begin, num_chunks) schedule(static, 1) num_threads(num_sorting_threads)
+  for (int ci = 0; ci < num_chunks; ++ci) {
+    SortMappings(mappings_begin + chunk_starts[ci], mappings_begin + chunk_starts[ci + 1]);
+  }
+  for (int merge_width = 1; merge_width < num_chunks; merge_width *= 2) {
+#pragma omp parallel for default(none) shared(chunk_starts, mappings_begin, num_chunks, merge_width) schedule(dynamic, 1) num_threads(num_sorting_threads)
+    for (int ci = 0; ci < num_chunks - merge_width; ci += 2 * merge_width) {
+      std::inplace_merge(mappings_begin + chunk_starts[ci], mappings_begin + chunk_starts[ci + merge_width], mappings_begin + chunk_starts[std::min(ci + 2 * merge_width, num_chunks)]);
+    }
+  }
+}
+
+template <typename MappingRecord>
+void Chromap<MappingRecord>::SortOutputMappings(uint32_t num_reference_sequences, std::vector<std::vector<MappingRecord> > *mappings, int num_sorting_threads) {
   //double real_dedupe_start_time = Chromap<>::GetRealTime();
-  uint32_t num_mappings = 0;
+  uint64_t num_mappings = 0;
   for (uint32_t ri = 0; ri < num_reference_sequences; ++ri) {
-    std::sort((*mappings)[ri].begin(), (*mappings)[ri].end());
     num_mappings += (*mappings)[ri].size(); 
   }
+  // Reference sequences holding more than a thread's share of the mappings
+  // are sorted by all the threads one after another. The others are handed
+  // out longest first so that no long one is left running alone at the end.
+  std::vector<uint32_t> reference_sequence_indices = GetReferenceSequenceIndicesByNumMappings(num_reference_sequences, *mappings);
+  uint32_t num_reference_sequences_with_mappings = reference_sequence_indices.size();
+  uint32_t num_large_reference_sequences = 0;
+  while (num_sorting_threads > 1 && num_large_reference_sequences < num_reference_sequences_with_mappings && (*mappings)[reference_sequence_indices[num_large_reference_sequences]].size() > num_mappings / num_sorting_threads) {
+    SortMappingsInParallel(num_sorting_threads, &((*mappings)[reference_sequence_indices[num_large_reference_sequences]]));
+    ++num_large_reference_sequences;
+  }
+#pragma omp parallel for default(none) shared(mappings, reference_sequence_indices, num_large_reference_sequences, num_reference_sequences_with_mappings) schedule(dynamic, 1) num_threads(num_sorting_threads)
+  for (uint32_t i = num_large_reference_sequences; i < num_reference_sequences_with_mappings; ++i) {
+    std::vector<MappingRecord> &mappings_on_one_ref_seq = (*mappings)[reference_sequence_indices[i]];
+    SortMappings(mappings_on_one_ref_seq.data(), mappings_on_one_ref_seq.data() + mappings_on_one_ref_seq.size());
+  }
   //std::cerr << "Sorted " << num_mappings << " elements in " << Chromap<>::GetRealTime() - real_dedupe_start_time << "s.\n";
 }
 
@@ -2378,30 +2877,32 @@ void Chromap<MappingRecord>::RemovePCRDuplicate(uint32_t num_reference_sequences
   uint32_t num_mappings = 0;
   double real_dedupe_start_time = Chromap<>::GetRealTime();
   for (uint32_t ri = 0; ri < num_reference_sequences; ++ri) {
-    //double real_start_time = Chromap<>::GetRealTime();
-    //radix_sort_with_barcode(mappings_on_diff_ref_seqs_[ri].data(), mappings_on_diff_ref_seqs_[ri].data() + mappings_on_diff_ref_seqs_[ri].size());
-    std::sort(mappings_on_diff_ref_seqs_[ri].begin(), mappings_on_diff_ref_seqs_[ri].end());
     num_mappings += mappings_on_diff_ref_seqs_[ri].size(); 
-    //std::cerr << "Sorted " << mappings_on_diff_ref_seqs_[ri].size() << " elements on " << ri << " in " << Chromap<>::GetRealTime() - real_start_time << "s.\n";
   }
+  SortOutputMappings(num_reference_sequences, &mappings_on_diff_ref_seqs_, num_threads_);
   std::cerr << "Sorted " << num_mappings << " elements in " << Chromap<>::GetRealTime() - real_dedupe_start_time << "s.\n";
   num_mappings = 0;
-  for (uint32_t ri = 0; ri < num_reference_sequences; ++ri) {
+  std::vector<uint32_t> reference_sequence_indices = GetReferenceSequenceIndicesByNumMappings(num_reference_sequences, mappings_on_diff_ref_seqs_);
+  uint32_t num_reference_sequences_with_mappings = reference_sequence_indices.size();
+#pragma omp parallel for default(none) shared(reference_sequence_indices, num_reference_sequences_with_mappings) schedule(dynamic, 1) num_threads(num_threads_) reduction(+:num_mappings)
+  for (uint32_t i = 0; i < num_reference_sequences_with_mappings; ++i) {
+    uint32_t ri = reference_sequence_indices[i];
     if (mappings_on_diff_ref_seqs_[ri].size() != 0) {
       deduped_mappings_on_diff_ref_seqs_[ri].emplace_back(mappings_on_diff_ref_seqs_[ri].front()); // ideally I should output the last of the dups of first mappings.
       //std::vector<MappingRecord>::iterator last_it = mappings_on_diff_ref_seqs_[ri].begin();
       auto last_it = mappings_on_diff_ref_seqs_[ri].begin();
-      uint8_t last_dup_count = 1;
+      // Each mapping also stands for the duplicates dropped before mapping.
+      uint8_t last_dup_count = 1 + duplicate_read_pair_set_.GetNumDuplicatesOf(last_it->GetReadId());
       //for (std::vector<MappingRecord>::iterator it = ++(mappings_on_diff_ref_seqs_[ri].begin()); it != mappings_on_diff_ref_seqs_[ri].end(); ++it) {
       for (auto it = ++(mappings_on_diff_ref_seqs_[ri].begin()); it != mappings_on_diff_ref_seqs_[ri].end(); ++it) {
         if (!((*it) == (*last_it))) {
           //last_it->num_dups = last_dup_count;
           deduped_mappings_on_diff_ref_seqs_[ri].back().num_dups = last_dup_count;
-          last_dup_count = 1;
+          last_dup_count = 1 + duplicate_read_pair_set_.GetNumDuplicatesOf(it->GetReadId());
           deduped_mappings_on_diff_ref_seqs_[ri].emplace_back((*it));
           last_it = it;
         } else {
-          ++last_dup_count;
+          last_dup_count += 1 + duplicate_read_pair_set_.GetNumDuplicatesOf(it->GetReadId());
         }
       }
       deduped_mappings_on_diff_ref_seqs_[ri].back().num_dups = last_dup_count;
@@ -2412,167 +2913,214 @@ void Chromap<MappingRecord>::RemovePCRDuplicate(uint32_t num_reference_sequences
   std::cerr << num_mappings << " mappings left after dedupe in " << Chromap<>::GetRealTime() - real_dedupe_start_time << "s.\n";
 }
 
+// SplitMix64 of the seed and the read id.
 template <typename MappingRecord>
-void Chromap<MappingRecord>::BuildAugmentedTree(uint32_t ref_id) {
-  //std::sort(mappings.begin(), mappings.end(), IntervalLess());
-  int max_level = 0;
-  size_t i, last_i = 0; // last_i points to the rightmost node in the tree
-  uint32_t last = 0; // last is the max value at node last_i
-  int k;
-  std::vector<MappingRecord> &mappings = allocated_mappings_on_diff_ref_seqs_[ref_id];
-  std::vector<uint32_t> &extras = tree_extras_on_diff_ref_seqs_[ref_id];
-  if (mappings.size() == 0) {
-    max_level = -1;
-  }
-  for (i = 0; i < mappings.size(); i += 2) { 
-    last_i = i; 
-    //last = mappings[i].max = mappings[i].en; // leaves (i.e. at level 0)
-    last = extras[i] = mappings[i].GetEndPosition(); // leaves (i.e. at level 0)
-  }
-  for (k = 1; 1LL<<k <= (int64_t)mappings.size(); ++k) { // process internal nodes in the bottom-up order
-    size_t x = 1LL<<(k-1);
-    size_t i0 = (x<<1) - 1;
-    size_t step = x<<2; // i0 is the first node
-    for (i = i0; i < mappings.size(); i += step) { // traverse all nodes at level k
-      uint32_t el = extras[i - x];                          // max value of the left child
-      uint32_t er = i + x < mappings.size()? extras[i + x] : last; // of the right child
-      uint32_t e = mappings[i].GetEndPosition();
-      e = e > el? e : el;
-      e = e > er? e : er;
-      extras[i] = e; // set the max value for node i
-    }
-    last_i = last_i>>k&1? last_i - x : last_i + x; // last_i now points to the parent of the original last_i
-    if (last_i < mappings.size() && extras[last_i] > last) // update last accordingly
-      last = extras[last_i];
-  }
-  max_level = k - 1;
-  tree_info_on_diff_ref_seqs_.emplace_back(max_level, mappings.size());
+uint64_t Chromap<MappingRecord>::GetMultiMappingAllocationRandomNumber(uint64_t read_id) const {
+  uint64_t z = (((uint64_t)(uint32_t)multi_mapping_allocation_seed_ << READ_ID_BITS | read_id) + 1) * 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
 }
 
 template <typename MappingRecord>
-uint32_t Chromap<MappingRecord>::GetNumOverlappedMappings(uint32_t ref_id, const MappingRecord &mapping) {
-  int t = 0;
-  StackCell stack[64];
-  //out.clear();
-  int num_overlapped_mappings = 0;
-  int max_level = tree_info_on_diff_ref_seqs_[ref_id].first;
-  uint32_t num_tree_nodes = tree_info_on_diff_ref_seqs_[ref_id].second;
-  std::vector<MappingRecord> &mappings = allocated_mappings_on_diff_ref_seqs_[ref_id];
-  std::vector<uint32_t> &extras = tree_extras_on_diff_ref_seqs_[ref_id];
-  //uint32_t interval_start = mapping.fragment_start_position; 
-  uint32_t interval_start = mapping.GetStartPosition() > (uint32_t)multi_mapping_allocation_distance_ ? mapping.GetStartPosition() - multi_mapping_allocation_distance_ : 0;
-  uint32_t interval_end = mapping.GetEndPosition() + (uint32_t)multi_mapping_allocation_distance_;
-  stack[t++] = StackCell(max_level, (1LL<<max_level) - 1, 0); // push the root; this is a top down traversal
-  while (t) { // the following guarantees that numbers in out[] are always sorted
-    StackCell z = stack[--t];
-    if (z.k <= 3) { // we are in a small subtree; traverse every node in this subtree
-      size_t i, i0 = z.x >> z.k << z.k, i1 = i0 + (1LL<<(z.k+1)) - 1;
-      if (i1 >= num_tree_nodes) {
-        i1 = num_tree_nodes;
-      }
-      for (i = i0; i < i1 && mappings[i].GetStartPosition() < interval_end; ++i) {
-        if (interval_start < mappings[i].GetEndPosition()) { // if overlap, append to out[]
-          //out.push_back(i);
-          ++num_overlapped_mappings;
-        }
-      }
-    } else if (z.w == 0) { // if left child not processed
-      size_t y = z.x - (1LL<<(z.k-1)); // the left child of z.x; NB: y may be out of range (i.e. y>=a.size())
-      stack[t++] = StackCell(z.k, z.x, 1); // re-add node z.x, but mark the left child having been processed
-      if (y >= num_tree_nodes || extras[y] > interval_start) // push the left child if y is out of range or may overlap with the query
-        stack[t++] = StackCell(z.k - 1, y, 0);
-    } else if (z.x < num_tree_nodes && mappings[z.x].GetStartPosition() < interval_end) { // need to push the right child
-      if (interval_start < mappings[z.x].GetEndPosition()) {
-        //out.push_back(z.x); // test if z.x overlaps the query; if yes, append to out[]
-        ++num_overlapped_mappings;
-      }
-      stack[t++] = StackCell(z.k - 1, z.x + (1LL<<(z.k-1)), 0); // push the right child
-    }
+void Chromap<MappingRecord>::WeighMultiMappings(const std::vector<MappingRecord> &uni_mappings, std::vector<MultiMapping<MappingRecord> > *multi_mappings) {
+  // Mappings are never empty, so the uni-mappings overlapping an extended
+  // multi-mapping [s, e) are the ones starting before e minus the ones ending
+  // by s. Each count is one sweep over the sorted uni-mapping starts or ends
+  // with the multi-mappings sorted the same way.
+  std::vector<uint32_t> uni_mapping_starts;
+  std::vector<uint32_t> uni_mapping_ends;
+  uni_mapping_starts.reserve(uni_mappings.size());
+  uni_mapping_ends.reserve(uni_mappings.size());
+  for (const MappingRecord &uni_mapping : uni_mappings) {
+    uni_mapping_starts.emplace_back(uni_mapping.GetStartPosition());
+    uni_mapping_ends.emplace_back(uni_mapping.GetEndPosition());
+  }
+  // The mappings are usually sorted by start position already.
+  if (!std::is_sorted(uni_mapping_starts.begin(), uni_mapping_starts.end())) {
+    std::sort(uni_mapping_starts.begin(), uni_mapping_starts.end());
+  }
+  std::sort(uni_mapping_ends.begin(), uni_mapping_ends.end());
+  // (position, multi-mapping index)
+  std::vector<uint64_t> interval_ends;
+  std::vector<uint64_t> interval_starts;
+  interval_ends.reserve(multi_mappings->size());
+  interval_starts.reserve(multi_mappings->size());
+  for (uint32_t mi = 0; mi < multi_mappings->size(); ++mi) {
+    const MappingRecord &mapping = (*multi_mappings)[mi].mapping;
+    uint32_t interval_start = mapping.GetStartPosition() > (uint32_t)multi_mapping_allocation_distance_ ? mapping.GetStartPosition() - multi_mapping_allocation_distance_ : 0;
+    uint32_t interval_end = mapping.GetEndPosition() + (uint32_t)multi_mapping_allocation_distance_;
+    interval_ends.emplace_back(((uint64_t)interval_end << 32) | mi);
+    interval_starts.emplace_back(((uint64_t)interval_start << 32) | mi);
+  }
+  std::sort(interval_ends.begin(), interval_ends.end());
+  if (!std::is_sorted(interval_starts.begin(), interval_starts.end())) {
+    std::sort(interval_starts.begin(), interval_starts.end());
+  }
+  uint32_t num_uni_mappings_before = 0;
+  for (uint64_t interval_end : interval_ends) {
+    while (num_uni_mappings_before < uni_mapping_starts.size() && uni_mapping_starts[num_uni_mappings_before] < (interval_end >> 32)) {
+      ++num_uni_mappings_before;
+    }
+    (*multi_mappings)[(uint32_t)interval_end].weight = num_uni_mappings_before;
+  }
+  num_uni_mappings_before = 0;
+  for (uint64_t interval_start : interval_starts) {
+    while (num_uni_mappings_before < uni_mapping_ends.size() && uni_mapping_ends[num_uni_mappings_before] <= (interval_start >> 32)) {
+      ++num_uni_mappings_before;
+    }
+    (*multi_mappings)[(uint32_t)interval_start].weight -= num_uni_mappings_before;
   }
-  return num_overlapped_mappings;
 }
 
 template <typename MappingRecord>
 void Chromap<MappingRecord>::AllocateMultiMappings(uint32_t num_reference_sequences) {
   double real_start_time = Chromap<>::GetRealTime();
   std::vector<std::vector<MappingRecord> > &mappings = remove_pcr_duplicates_ ? deduped_mappings_on_diff_ref_seqs_ : mappings_on_diff_ref_seqs_;
-  multi_mappings_.reserve((num_mapped_reads_ - num_uniquely_mapped_reads_) / 2);
-  allocated_mappings_on_diff_ref_seqs_.reserve(num_reference_sequences);
-  tree_extras_on_diff_ref_seqs_.reserve(num_reference_sequences);
-  tree_info_on_diff_ref_seqs_.reserve(num_reference_sequences);
-  // two passes, one for memory pre-allocation, another to move the mappings.
+  allocated_mappings_on_diff_ref_seqs_.clear();
+  allocated_mappings_on_diff_ref_seqs_.resize(num_reference_sequences);
+  // Keep the uni-mappings on each reference sequence and weigh its
+  // multi-mappings by the uni-mappings they overlap, in parallel.
+  std::vector<std::vector<MultiMapping<MappingRecord> > > multi_mappings_on_diff_ref_seqs(num_reference_sequences);
+  uint64_t num_multi_mappings = 0;
+  uint64_t min_read_id = MAX_NUM_READ_IDS;
+  uint64_t max_read_id = 0;
+#pragma omp parallel for default(none) shared(num_reference_sequences, mappings, multi_mappings_on_diff_ref_seqs) schedule(dynamic, 1) num_threads(num_threads_) reduction(+:num_multi_mappings) reduction(min:min_read_id) reduction(max:max_read_id)
   for (uint32_t ri = 0; ri < num_reference_sequences; ++ri) {
-    allocated_mappings_on_diff_ref_seqs_.emplace_back(std::vector<MappingRecord>());
-    tree_extras_on_diff_ref_seqs_.emplace_back(std::vector<uint32_t>());
-    uint32_t num_uni_mappings = 0;
-    uint32_t num_multi_mappings = 0;
-    for (uint32_t mi = 0; mi < mappings[ri].size(); ++mi) {
-      MappingRecord &mapping = mappings[ri][mi];
+    uint32_t num_multi_mappings_on_ref = 0;
+    for (const MappingRecord &mapping : mappings[ri]) {
       if ((mapping.mapq) < min_unique_mapping_mapq_) { // we have to ensure that the mapq is lower than this if and only if it is a multi-read.
-        ++num_multi_mappings;
-      } else {
-        ++num_uni_mappings;
+        ++num_multi_mappings_on_ref;
       }
     }
-    allocated_mappings_on_diff_ref_seqs_[ri].reserve(num_uni_mappings);
-    tree_extras_on_diff_ref_seqs_[ri].reserve(num_uni_mappings);
-    for (uint32_t mi = 0; mi < mappings[ri].size(); ++mi) {
-      MappingRecord &mapping = mappings[ri][mi];
+    multi_mappings_on_diff_ref_seqs[ri].reserve(num_multi_mappings_on_ref);
+    // Move the multi-mappings out and compact the uni-mappings in place.
+    std::vector<MappingRecord> &uni_mappings = allocated_mappings_on_diff_ref_seqs_[ri];
+    uni_mappings.swap(mappings[ri]);
+    size_t num_uni_mappings_on_ref = 0;
+    for (MappingRecord &mapping : uni_mappings) {
       if ((mapping.mapq) < min_unique_mapping_mapq_) {
-        multi_mappings_.emplace_back(ri, mapping);
+        min_read_id = std::min(min_read_id, mapping.GetReadId());
+        max_read_id = std::max(max_read_id, mapping.GetReadId());
+        multi_mappings_on_diff_ref_seqs[ri].emplace_back(MultiMapping<MappingRecord>{ri, 0, std::move(mapping)});
       } else {
-        allocated_mappings_on_diff_ref_seqs_[ri].emplace_back(mapping);
-        tree_extras_on_diff_ref_seqs_[ri].emplace_back(0);
+        if (&uni_mappings[num_uni_mappings_on_ref] != &mapping) {
+          uni_mappings[num_uni_mappings_on_ref] = std::move(mapping);
+        }
+        ++num_uni_mappings_on_ref;
       }
     }
+    uni_mappings.erase(uni_mappings.begin() + num_uni_mappings_on_ref, uni_mappings.end());
     std::vector<MappingRecord>().swap(mappings[ri]);
-    BuildAugmentedTree(ri);
-  }
-  std::cerr << "Got all " << multi_mappings_.size() << " multi-mappings!\n";
-  std::stable_sort(multi_mappings_.begin(), multi_mappings_.end(), ReadIdLess<MappingRecord>);
-  std::vector<uint32_t> weights;
-  weights.reserve(max_num_best_mappings_);
-  uint32_t sum_weight = 0;
-  assert(multi_mappings_.size() > 0);
-  uint32_t previous_read_id = multi_mappings_[0].second.read_id;
-  uint32_t start_mapping_index = 0;
-  // add a fake mapping at the end and make sure its id is different from the last one
-  assert(multi_mappings_.size() != UINT32_MAX);
-  std::pair<uint32_t, MappingRecord> foo_mapping = multi_mappings_.back();
-  foo_mapping.second.read_id = UINT32_MAX;
-  multi_mappings_.emplace_back(foo_mapping);
-  std::mt19937 generator(multi_mapping_allocation_seed_);
-  uint32_t current_read_id;//, reference_id, mapping_index;
-  //uint32_t allocated_read_id, allocated_reference_id, allocated_mapping_index;
+    WeighMultiMappings(uni_mappings, &multi_mappings_on_diff_ref_seqs[ri]);
+    num_multi_mappings += num_multi_mappings_on_ref;
+  }
+  std::cerr << "Got all " << num_multi_mappings << " multi-mappings!\n";
+  // Bucket the multi-mappings by read id range so that the buckets can be
+  // allocated independently. Within a bucket, the multi-mappings of a read keep
+  // the order of reference sequences and positions.
+  uint32_t num_buckets = num_multi_mappings == 0 ? 0 : num_multi_mapping_buckets_per_thread_ * num_threads_;
+  uint64_t bucket_width = num_multi_mappings == 0 ? 1 : (max_read_id - min_read_id) / num_buckets + 1;
+  std::vector<uint32_t> reference_sequence_indices_with_multi_mappings;
+  for (uint32_t ri = 0; ri < num_reference_sequences; ++ri) {
+    if (!multi_mappings_on_diff_ref_seqs[ri].empty()) {
+      reference_sequence_indices_with_multi_mappings.emplace_back(ri);
+    }
+  }
+  uint32_t num_reference_sequences_with_multi_mappings = reference_sequence_indices_with_multi_mappings.size();
+  // Numbers and then offsets of the multi-mappings of each reference sequence in
+  // each bucket.
+  std::vector<size_t> bucket_offsets_for_diff_ref_seqs((size_t)num_reference_sequences_with_multi_mappings * num_buckets, 0);
+#pragma omp parallel for default(none) shared(multi_mappings_on_diff_ref_seqs, reference_sequence_indices_with_multi_mappings, num_reference_sequences_with_multi_mappings, bucket_offsets_for_diff_ref_seqs, num_buckets, min_read_id, bucket_width) schedule(dynamic, 1) num_threads(num_threads_)
+  for (uint32_t i = 0; i < num_reference_sequences_with_multi_mappings; ++i) {
+    size_t *bucket_sizes = bucket_offsets_for_diff_ref_seqs.data() + (size_t)i * num_buckets;
+    for (const MultiMapping<MappingRecord> &multi_mapping : multi_mappings_on_diff_ref_seqs[reference_sequence_indices_with_multi_mappings[i]]) {
+      ++bucket_sizes[(multi_mapping.mapping.GetReadId() - min_read_id) / bucket_width];
+    }
+  }
+  std::vector<size_t> bucket_starts(num_buckets + 1, 0);
+  size_t offset = 0;
+  for (uint32_t bi = 0; bi < num_buckets; ++bi) {
+    bucket_starts[bi] = offset;
+    for (uint32_t i = 0; i < num_reference_sequences_with_multi_mappings; ++i) {
+      size_t &bucket_offset = bucket_offsets_for_diff_ref_seqs[(size_t)i * num_buckets + bi];
+      size_t bucket_size = bucket_offset;
+      bucket_offset = offset;
+      offset += bucket_size;
+    }
+  }
+  bucket_starts[num_buckets] = offset;
+  std::vector<MultiMapping<MappingRecord> > multi_mappings(num_multi_mappings);
+#pragma omp parallel for default(none) shared(multi_mappings, multi_mappings_on_diff_ref_seqs, reference_sequence_indices_with_multi_mappings, num_reference_sequences_with_multi_mappings, bucket_offsets_for_diff_ref_seqs, num_buckets, min_read_id, bucket_width) schedule(dynamic, 1) num_threads(num_threads_)
+  for (uint32_t i = 0; i < num_reference_sequences_with_multi_mappings; ++i) {
+    size_t *bucket_offsets = bucket_offsets_for_diff_ref_seqs.data() + (size_t)i * num_buckets;
+    std::vector<MultiMapping<MappingRecord> > &multi_mappings_on_ref = multi_mappings_on_diff_ref_seqs[reference_sequence_indices_with_multi_mappings[i]];
+    for (MultiMapping<MappingRecord> &multi_mapping : multi_mappings_on_ref) {
+      multi_mappings[bucket_offsets[(multi_mapping.mapping.GetReadId() - min_read_id) / bucket_width]++] = std::move(multi_mapping);
+    }
+    std::vector<MultiMapping<MappingRecord> >().swap(multi_mappings_on_ref);
+  }
+  // Allocate each read to one of its multi-mappings with a probability
+  // proportional to the weights. The draw only depends on the seed and the read
+  // id, so the result does not depend on the number of threads.
+  std::vector<std::vector<std::pair<uint32_t, MappingRecord> > > allocated_mappings_for_diff_buckets(num_buckets);
   uint32_t num_allocated_multi_mappings = 0;
   uint32_t num_multi_mappings_without_overlapping_unique_mappings = 0;
-  for (uint32_t mi = 0; mi < multi_mappings_.size(); ++mi) {
-    std::pair<uint32_t, MappingRecord> &current_multi_mapping = multi_mappings_[mi];//mappings[reference_id][mapping_index];
-    current_read_id = current_multi_mapping.second.read_id;
-    uint32_t num_overlaps = GetNumOverlappedMappings(current_multi_mapping.first, current_multi_mapping.second);
-    //std::cerr << mi << " " << current_read_id << " " << previous_read_id << " " << reference_id << " " << mapping_index << " " << interval_start << " " << num_overlaps << " " << sum_weight << "\n";
-    if (current_read_id == previous_read_id) {
-      weights.emplace_back(num_overlaps);
-      sum_weight += num_overlaps;
+#pragma omp parallel for default(none) shared(multi_mappings, bucket_starts, num_buckets, bucket_width, min_read_id, allocated_mappings_for_diff_buckets) schedule(dynamic, 1) num_threads(num_threads_) reduction(+:num_allocated_multi_mappings, num_multi_mappings_without_overlapping_unique_mappings)
+  for (uint32_t bi = 0; bi < num_buckets; ++bi) {
+    MultiMapping<MappingRecord> *bucket_begin = multi_mappings.data() + bucket_starts[bi];
+    MultiMapping<MappingRecord> *bucket_end = multi_mappings.data() + bucket_starts[bi + 1];
+    size_t bucket_size = bucket_end - bucket_begin;
+    // Group the multi-mappings of each read with a stable sort on the read id.
+    // The read ids in a bucket are usually dense enough for a counting sort.
+    std::vector<MultiMapping<MappingRecord> > sorted_multi_mappings;
+    if (bucket_width <= 4 * (uint64_t)bucket_size) {
+      uint64_t bucket_min_read_id = min_read_id + bi * bucket_width;
+      std::vector<uint32_t> read_offsets(bucket_width + 1, 0);
+      for (MultiMapping<MappingRecord> *it = bucket_begin; it != bucket_end; ++it) {
+        ++read_offsets[it->mapping.GetReadId() - bucket_min_read_id + 1];
+      }
+      for (uint64_t i = 1; i <= bucket_width; ++i) {
+        read_offsets[i] += read_offsets[i - 1];
+      }
+      sorted_multi_mappings.resize(bucket_size);
+      for (MultiMapping<MappingRecord> *it = bucket_begin; it != bucket_end; ++it) {
+        sorted_multi_mappings[read_offsets[it->mapping.GetReadId() - bucket_min_read_id]++] = std::move(*it);
+      }
+      bucket_begin = sorted_multi_mappings.data();
+      bucket_end = bucket_begin + bucket_size;
     } else {
-      // deal with the previous one.
+      std::stable_sort(bucket_begin, bucket_end, [](const MultiMapping<MappingRecord> &a, const MultiMapping<MappingRecord> &b) {
+        return a.mapping.GetReadId() < b.mapping.GetReadId();
+      });
+    }
+    for (MultiMapping<MappingRecord> *read_begin = bucket_begin, *read_end = bucket_begin; read_begin != bucket_end; read_begin = read_end) {
+      uint64_t read_id = read_begin->mapping.GetReadId();
+      uint64_t sum_weight = 0;
+      for (read_end = read_begin; read_end != bucket_end && read_end->mapping.GetReadId() == read_id; ++read_end) {
+        sum_weight += read_end->weight;
+      }
       if (sum_weight == 0) {
         ++num_multi_mappings_without_overlapping_unique_mappings;
-        //assert(weights.size() > 1); // After PCR dedupe, some multi-reads may become uni-reads. For now, we just assign it to that unique mapping positions.
-        //std::fill(weights.begin(), weights.end(), 1); // We drop the multi-mappings that have no overlap with uni-mappings.
-      } else {
-        std::discrete_distribution<uint32_t> distribution(weights.begin(), weights.end());
-        uint32_t randomly_assigned_mapping_index = distribution(generator);
-	allocated_mappings_on_diff_ref_seqs_[multi_mappings_[start_mapping_index + randomly_assigned_mapping_index].first].emplace_back(multi_mappings_[start_mapping_index + randomly_assigned_mapping_index].second);
-        ++num_allocated_multi_mappings;
+        // We drop the multi-mappings that have no overlap with uni-mappings.
+        continue;
       }
-      // update current
-      weights.clear();
-      weights.emplace_back(num_overlaps);
-      sum_weight = num_overlaps;
-      start_mapping_index = mi;
-      previous_read_id = current_read_id;
+      uint64_t target_weight = (uint64_t)(((unsigned __int128)GetMultiMappingAllocationRandomNumber(read_id) * sum_weight) >> 64);
+      MultiMapping<MappingRecord> *allocated_multi_mapping = read_begin;
+      while (target_weight >= allocated_multi_mapping->weight) {
+        target_weight -= allocated_multi_mapping->weight;
+        ++allocated_multi_mapping;
+      }
+      allocated_mappings_for_diff_buckets[bi].emplace_back(allocated_multi_mapping->rid, allocated_multi_mapping->mapping);
+      ++num_allocated_multi_mappings;
+    }
+  }
+  std::vector<MultiMapping<MappingRecord> >().swap(multi_mappings);
+  for (std::vector<std::pair<uint32_t, MappingRecord> > &allocated_mappings : allocated_mappings_for_diff_buckets) {
+    for (std::pair<uint32_t, MappingRecord> &allocated_mapping : allocated_mappings) {
+      allocated_mappings_on_diff_ref_seqs_[allocated_mapping.first].emplace_back(std::move(allocated_mapping.second));
     }
+    std::vector<std::pair<uint32_t, MappingRecord> >().swap(allocated_mappings);
   }
   std::cerr << "Allocated " << num_allocated_multi_mappings << " multi-mappings in "<< Chromap<>::GetRealTime() - real_start_time << "s.\n";
   std::cerr << "# multi-mappings that have no uni-mapping overlaps: " << num_multi_mappings_without_overlapping_unique_mappings << ".\n";
@@ -2629,7 +3177,7 @@ template <typename MappingRecord>
 void Chromap<MappingRecord>::VerifyCandidatesOnOneDirectionUsingSIMD(Direction candidate_direction, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const std::vector<Candidate> &candidates, std::vector<std::pair<int, uint64_t> > *mappings, int *min_num_errors, int *num_best_mappings, int *second_min_num_errors, int *num_second_best_mappings) {
   const char *read = read_batch.GetSequenceAt(read_index);
   uint32_t read_length = read_batch.GetSequenceLengthAt(read_index);
-  const std::string &negative_read = read_batch.GetNegativeSequenceAt(read_index); 
+  const char *negative_read = read_batch.GetNegativeSequenceAt(read_index); 
 
   size_t num_candidates = candidates.size();
   Candidate valid_candidates[NUM_VPU_LANES_];
@@ -2650,8 +3198,23 @@ void Chromap<MappingRecord>::VerifyCandidatesOnOneDirectionUsingSIMD(Direction c
       ++candidate_index;
       continue;
     } else {
+      const char *valid_candidate_start = reference.GetSequenceAt(rid) + position - error_threshold_;
+      // Candidates matching the read exactly on the seed-implied diagonal are accepted without banded alignment.
+      if (CountMismatchesOnDiagonal(valid_candidate_start, candidate_direction == kPositive ? read : negative_read, read_length, 0) == 0) {
+        if (*min_num_errors > 0) {
+          *second_min_num_errors = *min_num_errors;
+          *num_second_best_mappings = *num_best_mappings;
+          *min_num_errors = 0;
+          *num_best_mappings = 1;
+        } else {
+          (*num_best_mappings)++;
+        }
+        mappings->emplace_back(0, position + read_length - 1 + ((uint64_t)rid << 32));
+        ++candidate_index;
+        continue;
+      }
       valid_candidates[valid_candidate_index] = candidates[candidate_index];//reference.GetSequenceAt(rid) + position - error_threshold_;
-      valid_candidate_starts[valid_candidate_index] = reference.GetSequenceAt(rid) + position - error_threshold_;
+      valid_candidate_starts[valid_candidate_index] = valid_candidate_start;
       ++valid_candidate_index;
     }
     if (valid_candidate_index == (uint32_t)NUM_VPU_LANES_) {
@@ -2664,7 +3227,7 @@ void Chromap<MappingRecord>::VerifyCandidatesOnOneDirectionUsingSIMD(Direction c
         if (candidate_direction == kPositive) {
           BandedAlign8PatternsToText(valid_candidate_starts, read, read_length, mapping_edit_distances, mapping_end_positions);
         } else {
-          BandedAlign8PatternsToText(valid_candidate_starts, negative_read.data(), read_length, mapping_edit_distances, mapping_end_positions);
+          BandedAlign8PatternsToText(valid_candidate_starts, negative_read, read_length, mapping_edit_distances, mapping_end_positions);
         }
         for (int mi = 0; mi < NUM_VPU_LANES_; ++mi) {
           if (mapping_edit_distances[mi] <= error_threshold_) {
@@ -2699,7 +3262,7 @@ void Chromap<MappingRecord>::VerifyCandidatesOnOneDirectionUsingSIMD(Direction c
         if (candidate_direction == kPositive) {
           BandedAlign4PatternsToText(valid_candidate_starts, read, read_length, mapping_edit_distances, mapping_end_positions);
         } else {
-          BandedAlign4PatternsToText(valid_candidate_starts, negative_read.data(), read_length, mapping_edit_distances, mapping_end_positions);
+          BandedAlign4PatternsToText(valid_candidate_starts, negative_read, read_length, mapping_edit_distances, mapping_end_positions);
         }
         for (int mi = 0; mi < NUM_VPU_LANES_; ++mi) {
           if (mapping_edit_distances[mi] <= error_threshold_) {
@@ -2748,7 +3311,7 @@ void Chromap<MappingRecord>::VerifyCandidatesOnOneDirectionUsingSIMD(Direction c
     if (candidate_direction == kPositive) {
       num_errors = BandedAlignPatternToText(reference.GetSequenceAt(rid) + position - error_threshold_, read, read_length, &mapping_end_position);
     } else {
-      num_errors = BandedAlignPatternToText(reference.GetSequenceAt(rid) + position - error_threshold_, negative_read.data(), read_length, &mapping_end_position);
+      num_errors = BandedAlignPatternToText(reference.GetSequenceAt(rid) + position - error_threshold_, negative_read, read_length, &mapping_end_position);
     }
     if (num_errors <= error_threshold_) {
       if (num_errors < *min_num_errors) {
@@ -2777,7 +3340,7 @@ template <typename MappingRecord>
 void Chromap<MappingRecord>::VerifyCandidatesWithDropOffOnOneDirection(Direction candidate_direction, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const std::vector<Candidate> &candidates, std::vector<SplitMapping> *mappings, int *best_mapping_score, int *num_best_mappings, int *second_best_mapping_score, int *num_second_best_mappings) {
   const char *read = read_batch.GetSequenceAt(read_index);
   uint32_t read_length = read_batch.GetSequenceLengthAt(read_index);
-  const std::string &negative_read = read_batch.GetNegativeSequenceAt(read_index); 
+  const char *negative_read = read_batch.GetNegativeSequenceAt(read_index); 
   uint32_t candidate_count_threshold = 0;
   
   for (uint32_t ci = 0; ci < candidates.size(); ++ci) {
@@ -2828,26 +3391,26 @@ void Chromap<MappingRecord>::VerifyCandidatesWithDropOffOnOneDirection(Direction
       }
       //std::cerr << "P4: ne:" << (int)(mapping.num_errors) << " reads: " << mapping.mapping_start_position_on_read5 << " readl:" << mapping.mapping_length_on_read << " ms:" << mapping.GetEstimatedMappingScore(error_weight_) << " fs:" << mapping.mapping_start_position_on_ref << " mf:" << mapping.mapping_length_on_ref << "\n";
     } else { // negative strand
-      BandedAlignPatternToTextWithDropOffFrom3End(ref, negative_read.data(), read_length, &mapping);
+      BandedAlignPatternToTextWithDropOffFrom3End(ref, negative_read, read_length, &mapping);
       //std::cerr << "N1: ne:" << (int)(mapping.num_errors) << " reads: " << mapping.mapping_start_position_on_read5 << " readl:" << mapping.mapping_length_on_read << " ms:" << mapping.GetEstimatedMappingScore(error_weight_) << " fs:" << mapping.mapping_start_position_on_ref << " mf:" << mapping.mapping_length_on_ref << "\n";
       if (mapping.has_soft_clip_at_read5 == 1 && read_length > (uint32_t)(max_mapping_start_position_on_read5_ + min_read_mapping_length_)) {
-        BandedAlignPatternToTextWithDropOffFrom3End(ref, negative_read.data(), read_length - max_mapping_start_position_on_read5_, &mapping);
+        BandedAlignPatternToTextWithDropOffFrom3End(ref, negative_read, read_length - max_mapping_start_position_on_read5_, &mapping);
         //std::cerr << "N2: ne:" << (int)(mapping.num_errors) << " reads: " << mapping.mapping_start_position_on_read5 << " readl:" << mapping.mapping_length_on_read << " ms:" << mapping.GetEstimatedMappingScore(error_weight_) << " fs:" << mapping.mapping_start_position_on_ref << " mf:" << mapping.mapping_length_on_ref << "\n";
       }
       if (mapping.mapping_length_on_read >= min_read_mapping_length_) {
         uint32_t cliped_read_length = mapping.has_soft_clip_at_read5 == 1 ? read_length - max_mapping_start_position_on_read5_ : read_length;
         int fix_left_read_start = cliped_read_length - mapping.mapping_length_on_read;
         //std::cerr << "N3: ne:" << (int)(mapping.num_errors) << " reads: " << mapping.mapping_start_position_on_read5 << " readl:" << mapping.mapping_length_on_read << " ms:" << mapping.GetEstimatedMappingScore(error_weight_) << " fs:" << mapping.mapping_start_position_on_ref << " mf:" << mapping.mapping_length_on_ref << "\n";
-        //FixSplitMappingLeftEnd(ref + mapping_start_position_on_read5, negative_read.data() + mapping.mapping_start_position_on_read5, mapping.mapping_length_on_read, &mapping);
-        //FixSplitMappingLeftEnd(ref, negative_read.data(), mapping.has_soft_clip_at_read5 == 1 ? read_length - max_mapping_start_position_on_read5_ : read_length, &mapping);
+        //FixSplitMappingLeftEnd(ref + mapping_start_position_on_read5, negative_read + mapping.mapping_start_position_on_read5, mapping.mapping_length_on_read, &mapping);
+        //FixSplitMappingLeftEnd(ref, negative_read, mapping.has_soft_clip_at_read5 == 1 ? read_length - max_mapping_start_position_on_read5_ : read_length, &mapping);
         int fix_left_ref_start = cliped_read_length - mapping.mapping_length_on_read;
-        FixSplitMappingLeftEnd(ref + fix_left_ref_start, negative_read.data() + fix_left_read_start, mapping.mapping_length_on_read, &mapping);
+        FixSplitMappingLeftEnd(ref + fix_left_ref_start, negative_read + fix_left_read_start, mapping.mapping_length_on_read, &mapping);
         mapping.mapping_start_position_on_ref += fix_left_ref_start;
         mapping.mapping_start_position_on_read5 += fix_left_read_start;
-        //FixSplitMappingLeftEnd(ref, negative_read.data(), read_length, &mapping);
+        //FixSplitMappingLeftEnd(ref, negative_read, read_length, &mapping);
         if (mapping.mapping_length_on_read >= min_read_mapping_length_) {
           //std::cerr << "N3.5: ne:" << (int)(mapping.num_errors) << " reads: " << mapping.mapping_start_position_on_read5 << " readl:" << mapping.mapping_length_on_read << " ms:" << mapping.GetEstimatedMappingScore(error_weight_) << " fs:" << mapping.mapping_start_position_on_ref << " mf:" << mapping.mapping_length_on_ref << "\n";
-          FixSplitMappingRightEnd(ref + mapping.mapping_start_position_on_ref - error_threshold_, negative_read.data() + mapping.mapping_start_position_on_read5, mapping.mapping_length_on_read, &mapping);
+          FixSplitMappingRightEnd(ref + mapping.mapping_start_position_on_ref - error_threshold_, negative_read + mapping.mapping_start_position_on_read5, mapping.mapping_length_on_read, &mapping);
         }
       }
       //std::cerr << "N4: ne:" << (int)(mapping.num_errors) << " reads: " << mapping.mapping_start_position_on_read5 << " readl:" << mapping.mapping_length_on_read << " ms:" << mapping.GetEstimatedMappingScore(error_weight_) << " fs:" << mapping.mapping_start_position_on_ref << " mf:" << mapping.mapping_length_on_ref << "\n";
@@ -3418,7 +3981,7 @@ template <typename MappingRecord>
 void Chromap<MappingRecord>::VerifyCandidatesOnOneDirection(Direction candidate_direction, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const std::vector<Candidate> &candidates, std::vector<std::pair<int, uint64_t> > *mappings, std::vector<SplitMapping> *split_mappings, int *min_num_errors, int *num_best_mappings, int *second_min_num_errors, int *num_second_best_mappings) {
   const char *read = read_batch.GetSequenceAt(read_index);
   uint32_t read_length = read_batch.GetSequenceLengthAt(read_index);
-  const std::string &negative_read = read_batch.GetNegativeSequenceAt(read_index); 
+  const char *negative_read = read_batch.GetNegativeSequenceAt(read_index); 
   uint32_t candidate_count_threshold = 0;
   
   for (uint32_t ci = 0; ci < candidates.size(); ++ci) {
@@ -3434,10 +3997,15 @@ void Chromap<MappingRecord>::VerifyCandidatesOnOneDirection(Direction candidate_
     }
     int ref_mapping_end_position = read_length;
     int num_errors = 0;
-    if (candidate_direction == kPositive) {
-      num_errors = BandedAlignPatternToText(reference.GetSequenceAt(rid) + candidate_position - error_threshold_, read, read_length, &ref_mapping_end_position);
+    const char *candidate_start = reference.GetSequenceAt(rid) + candidate_position - error_threshold_;
+    const char *text = candidate_direction == kPositive ? read : negative_read;
+    // Check the seed-implied diagonal first. An exact match, or a single mismatch when the candidate is unique, is taken as is.
+    int max_num_mismatches_to_accept = candidates.size() == 1 ? std::min(1, error_threshold_) : 0;
+    num_errors = CountMismatchesOnDiagonal(candidate_start, text, read_length, max_num_mismatches_to_accept);
+    if (num_errors <= max_num_mismatches_to_accept) {
+      ref_mapping_end_position = read_length - 1 + error_threshold_;
     } else {
-      num_errors = BandedAlignPatternToText(reference.GetSequenceAt(rid) + candidate_position - error_threshold_, negative_read.data(), read_length, &ref_mapping_end_position);
+      num_errors = BandedAlignPatternToText(candidate_start, text, read_length, &ref_mapping_end_position);
     }
     if (num_errors <= error_threshold_) {
       if (num_errors < *min_num_errors) {
@@ -3557,11 +4125,95 @@ void Chromap<MappingRecord>::VerifyCandidates(const SequenceBatch &read_batch, u
   }
 }
 
+template <typename MappingRecord>
+template <int kErrorThreshold>
+void Chromap<MappingRecord>::SetBandedAlignKernels() {
+  banded_align_pattern_to_text_kernels_[0] = &Chromap<MappingRecord>::BandedAlignPatternToTextKernel<kErrorThreshold, 0>;
+  banded_align_pattern_to_text_kernels_[1] = &Chromap<MappingRecord>::BandedAlignPatternToTextKernel<kErrorThreshold, 50>;
+  banded_align_pattern_to_text_kernels_[2] = &Chromap<MappingRecord>::BandedAlignPatternToTextKernel<kErrorThreshold, 75>;
+  banded_align_pattern_to_text_kernels_[3] = &Chromap<MappingRecord>::BandedAlignPatternToTextKernel<kErrorThreshold, 100>;
+  banded_align_pattern_to_text_kernels_[4] = &Chromap<MappingRecord>::BandedAlignPatternToTextKernel<kErrorThreshold, 150>;
+  banded_align_8_patterns_to_text_kernels_[0] = &Chromap<MappingRecord>::BandedAlign8PatternsToTextKernel<kErrorThreshold, 0>;
+  banded_align_8_patterns_to_text_kernels_[1] = &Chromap<MappingRecord>::BandedAlign8PatternsToTextKernel<kErrorThreshold, 50>;
+  banded_align_8_patterns_to_text_kernels_[2] = &Chromap<MappingRecord>::BandedAlign8PatternsToTextKernel<kErrorThreshold, 75>;
+  banded_align_8_patterns_to_text_kernels_[3] = &Chromap<MappingRecord>::BandedAlign8PatternsToTextKernel<kErrorThreshold, 100>;
+  banded_align_8_patterns_to_text_kernels_[4] = &Chromap<MappingRecord>::BandedAlign8PatternsToTextKernel<kErrorThreshold, 150>;
+  banded_traceback_kernels_[0] = &Chromap<MappingRecord>::BandedTracebackKernel<kErrorThreshold, 0>;
+  banded_traceback_kernels_[1] = &Chromap<MappingRecord>::BandedTracebackKernel<kErrorThreshold, 50>;
+  banded_traceback_kernels_[2] = &Chromap<MappingRecord>::BandedTracebackKernel<kErrorThreshold, 75>;
+  banded_traceback_kernels_[3] = &Chromap<MappingRecord>::BandedTracebackKernel<kErrorThreshold, 100>;
+  banded_traceback_kernels_[4] = &Chromap<MappingRecord>::BandedTracebackKernel<kErrorThreshold, 150>;
+  banded_traceback_to_end_kernels_[0] = &Chromap<MappingRecord>::BandedTracebackToEndKernel<kErrorThreshold, 0>;
+  banded_traceback_to_end_kernels_[1] = &Chromap<MappingRecord>::BandedTracebackToEndKernel<kErrorThreshold, 50>;
+  banded_traceback_to_end_kernels_[2] = &Chromap<MappingRecord>::BandedTracebackToEndKernel<kErrorThreshold, 75>;
+  banded_traceback_to_end_kernels_[3] = &Chromap<MappingRecord>::BandedTracebackToEndKernel<kErrorThreshold, 100>;
+  banded_traceback_to_end_kernels_[4] = &Chromap<MappingRecord>::BandedTracebackToEndKernel<kErrorThreshold, 150>;
+}
+
+template <typename MappingRecord>
+void Chromap<MappingRecord>::InitializeBandedAlignKernels() {
+  // The error threshold is fixed for the whole run, so pick the specialized kernels once before mapping the first batch.
+  switch (error_threshold_) {
+    case 2:
+      SetBandedAlignKernels<2>();
+      break;
+    case 3:
+      SetBandedAlignKernels<3>();
+      break;
+    case 4:
+      SetBandedAlignKernels<4>();
+      break;
+    case 5:
+      SetBandedAlignKernels<5>();
+      break;
+    default:
+      // Generic kernels for all read lengths.
+      for (int i = 0; i < NUM_BANDED_ALIGN_READ_LENGTH_CLASSES; ++i) {
+        banded_align_pattern_to_text_kernels_[i] = &Chromap<MappingRecord>::BandedAlignPatternToTextKernel<0, 0>;
+        banded_align_8_patterns_to_text_kernels_[i] = &Chromap<MappingRecord>::BandedAlign8PatternsToTextKernel<0, 0>;
+        banded_traceback_kernels_[i] = &Chromap<MappingRecord>::BandedTracebackKernel<0, 0>;
+        banded_traceback_to_end_kernels_[i] = &Chromap<MappingRecord>::BandedTracebackToEndKernel<0, 0>;
+      }
+  }
+}
+
+template <typename MappingRecord>
+int Chromap<MappingRecord>::CountMismatchesOnDiagonal(const char *pattern, const char *text, const int read_length, const int max_num_mismatches) {
+  // pattern starts error_threshold_ bases before the seed-implied diagonal.
+  const char *diagonal = pattern + error_threshold_;
+  int num_mismatches = 0;
+  int i = 0;
+  for (; i + 16 <= read_length; i += 16) {
+    __m128i diagonal_vpu = _mm_loadu_si128((const __m128i *)(diagonal + i));
+    __m128i text_vpu = _mm_loadu_si128((const __m128i *)(text + i));
+    int match_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(diagonal_vpu, text_vpu));
+    num_mismatches += __builtin_popcount((~match_mask) & 0xffff);
+    if (num_mismatches > max_num_mismatches) {
+      return max_num_mismatches + 1;
+    }
+  }
+  for (; i < read_length; ++i) {
+    if (diagonal[i] != text[i]) {
+      ++num_mismatches;
+    }
+  }
+  return num_mismatches > max_num_mismatches ? max_num_mismatches + 1 : num_mismatches;
+}
+
 template <typename MappingRecord>
 int Chromap<MappingRecord>::BandedAlignPatternToText(const char *pattern, const char *text, const int read_length, int *mapping_end_position) {
+  return (this->*banded_align_pattern_to_text_kernels_[GetBandedAlignReadLengthClass(read_length)])(pattern, text, read_length, mapping_end_position);
+}
+
+// kErrorThreshold and kReadLength are 0 in the generic kernel, which falls back to the runtime values.
+template <typename MappingRecord>
+template <int kErrorThreshold, int kReadLength>
+int Chromap<MappingRecord>::BandedAlignPatternToTextKernel(const char *pattern, const char *text, const int read_length, int *mapping_end_position) {
+  const int error_threshold = kErrorThreshold > 0 ? kErrorThreshold : error_threshold_;
+  const int length = kReadLength > 0 ? kReadLength : read_length;
   //int error_count = 0;
-  //for (int i = 0; i < read_length; ++i) {
-  //  if (pattern[i + error_threshold_] != text[i]) {
+  //for (int i = 0; i < length; ++i) {
+  //  if (pattern[i + error_threshold] != text[i]) {
   //    ++error_count;
   //    if (error_count > 1) {
   //      break;
@@ -3569,15 +4221,15 @@ int Chromap<MappingRecord>::BandedAlignPatternToText(const char *pattern, const
   //  } 
   //}
   //if (error_count <= 1) {
-  //  *mapping_end_position = read_length - 1 + error_threshold_;
+  //  *mapping_end_position = length - 1 + error_threshold;
   //  return error_count;
   //}
   uint32_t Peq[5] = {0, 0, 0, 0, 0};
-  for (int i = 0; i < 2 * error_threshold_; i++) {
+  for (int i = 0; i < 2 * error_threshold; i++) {
     uint8_t base = SequenceBatch::CharToUint8(pattern[i]);
     Peq[base] = Peq[base] | (1 << i);
   }
-  uint32_t highest_bit_in_band_mask = 1 << (2 * error_threshold_);
+  uint32_t highest_bit_in_band_mask = 1 << (2 * error_threshold);
   uint32_t lowest_bit_in_band_mask = 1;
   uint32_t VP = 0;
   uint32_t VN = 0;
@@ -3586,8 +4238,8 @@ int Chromap<MappingRecord>::BandedAlignPatternToText(const char *pattern, const
   uint32_t HN = 0;
   uint32_t HP = 0;
   int num_errors_at_band_start_position = 0;
-  for (int i = 0; i < read_length; i++) {
-    uint8_t pattern_base = SequenceBatch::CharToUint8(pattern[i + 2 * error_threshold_]);
+  for (int i = 0; i < length; i++) {
+    uint8_t pattern_base = SequenceBatch::CharToUint8(pattern[i + 2 * error_threshold]);
     Peq[pattern_base] = Peq[pattern_base] | highest_bit_in_band_mask;
     X = Peq[SequenceBatch::CharToUint8(text[i])] | VN;
     D0 = ((VP + (X & VP)) ^ VP) | X;
@@ -3597,20 +4249,20 @@ int Chromap<MappingRecord>::BandedAlignPatternToText(const char *pattern, const
     VN = X & HP;
     VP = HN | ~(X | HP);
     num_errors_at_band_start_position += 1 - (D0 & lowest_bit_in_band_mask);
-    if (num_errors_at_band_start_position > 3 * error_threshold_) {
-      return error_threshold_ + 1;
+    if (num_errors_at_band_start_position > 3 * error_threshold) {
+      return error_threshold + 1;
     }
     for (int ai = 0; ai < 5; ai++) {
       Peq[ai] >>= 1;
     }
   }
-  int band_start_position = read_length - 1;
+  int band_start_position = length - 1;
   int min_num_errors = num_errors_at_band_start_position;
   *mapping_end_position = band_start_position;
-  for (int i = 0; i < 2 * error_threshold_; i++) {
+  for (int i = 0; i < 2 * error_threshold; i++) {
     num_errors_at_band_start_position = num_errors_at_band_start_position + ((VP >> i) & (uint32_t) 1);
     num_errors_at_band_start_position = num_errors_at_band_start_position - ((VN >> i) & (uint32_t) 1);
-    if (num_errors_at_band_start_position < min_num_errors || (num_errors_at_band_start_position == min_num_errors && i + 1 == error_threshold_)) {
+    if (num_errors_at_band_start_position < min_num_errors || (num_errors_at_band_start_position == min_num_errors && i + 1 == error_threshold)) {
       min_num_errors = num_errors_at_band_start_position;
       *mapping_end_position = band_start_position + 1 + i;
     }
@@ -3849,7 +4501,15 @@ void Chromap<MappingRecord>::BandedAlign4PatternsToText(const char **patterns, c
 
 template <typename MappingRecord>
 void Chromap<MappingRecord>::BandedAlign8PatternsToText(const char **patterns, const char *text, int read_length, int16_t *mapping_edit_distances, int16_t *mapping_end_positions) {
-  int ALPHABET_SIZE = 5;
+  (this->*banded_align_8_patterns_to_text_kernels_[GetBandedAlignReadLengthClass(read_length)])(patterns, text, read_length, mapping_edit_distances, mapping_end_positions);
+}
+
+template <typename MappingRecord>
+template <int kErrorThreshold, int kReadLength>
+void Chromap<MappingRecord>::BandedAlign8PatternsToTextKernel(const char **patterns, const char *text, int read_length, int16_t *mapping_edit_distances, int16_t *mapping_end_positions) {
+  const int error_threshold = kErrorThreshold > 0 ? kErrorThreshold : error_threshold_;
+  const int length = kReadLength > 0 ? kReadLength : read_length;
+  const int ALPHABET_SIZE = 5;
   const char *reference_sequence0 = patterns[0];
   const char *reference_sequence1 = patterns[1];
   const char *reference_sequence2 = patterns[2];
@@ -3858,7 +4518,7 @@ void Chromap<MappingRecord>::BandedAlign8PatternsToText(const char **patterns, c
   const char *reference_sequence5 = patterns[5];
   const char *reference_sequence6 = patterns[6];
   const char *reference_sequence7 = patterns[7];
-  uint16_t highest_bit_in_band_mask = 1 << (2 * error_threshold_);
+  uint16_t highest_bit_in_band_mask = 1 << (2 * error_threshold);
   __m128i highest_bit_in_band_mask_vpu0 = _mm_set_epi16(0, 0, 0, 0, 0, 0, 0, highest_bit_in_band_mask);
   __m128i highest_bit_in_band_mask_vpu1 = _mm_set_epi16(0, 0, 0, 0, 0, 0, highest_bit_in_band_mask, 0);
   __m128i highest_bit_in_band_mask_vpu2 = _mm_set_epi16(0, 0, 0, 0, 0, highest_bit_in_band_mask, 0, 0);
@@ -3872,7 +4532,7 @@ void Chromap<MappingRecord>::BandedAlign8PatternsToText(const char **patterns, c
   for (int ai = 0; ai < ALPHABET_SIZE; ai++) {
     Peq[ai] = _mm_setzero_si128();
   }
-  for (int i = 0; i < 2 * error_threshold_; i++) {
+  for (int i = 0; i < 2 * error_threshold; i++) {
     uint8_t base0 = SequenceBatch::CharToUint8(reference_sequence0[i]);
     uint8_t base1 = SequenceBatch::CharToUint8(reference_sequence1[i]);
     uint8_t base2 = SequenceBatch::CharToUint8(reference_sequence2[i]);
@@ -3904,16 +4564,16 @@ void Chromap<MappingRecord>::BandedAlign8PatternsToText(const char **patterns, c
   __m128i HP = _mm_setzero_si128();
   __m128i max_mask_vpu = _mm_set1_epi16(0xffff);
   __m128i num_errors_at_band_start_position_vpu = _mm_setzero_si128();
-  __m128i early_stop_threshold_vpu = _mm_set1_epi16(error_threshold_ * 3);
-  for (int i = 0; i < read_length; i++) {
-    uint8_t base0 = SequenceBatch::CharToUint8(reference_sequence0[i + 2 * error_threshold_]);
-    uint8_t base1 = SequenceBatch::CharToUint8(reference_sequence1[i + 2 * error_threshold_]);
-    uint8_t base2 = SequenceBatch::CharToUint8(reference_sequence2[i + 2 * error_threshold_]);
-    uint8_t base3 = SequenceBatch::CharToUint8(reference_sequence3[i + 2 * error_threshold_]);
-    uint8_t base4 = SequenceBatch::CharToUint8(reference_sequence4[i + 2 * error_threshold_]);
-    uint8_t base5 = SequenceBatch::CharToUint8(reference_sequence5[i + 2 * error_threshold_]);
-    uint8_t base6 = SequenceBatch::CharToUint8(reference_sequence6[i + 2 * error_threshold_]);
-    uint8_t base7 = SequenceBatch::CharToUint8(reference_sequence7[i + 2 * error_threshold_]);
+  __m128i early_stop_threshold_vpu = _mm_set1_epi16(error_threshold * 3);
+  for (int i = 0; i < length; i++) {
+    uint8_t base0 = SequenceBatch::CharToUint8(reference_sequence0[i + 2 * error_threshold]);
+    uint8_t base1 = SequenceBatch::CharToUint8(reference_sequence1[i + 2 * error_threshold]);
+    uint8_t base2 = SequenceBatch::CharToUint8(reference_sequence2[i + 2 * error_threshold]);
+    uint8_t base3 = SequenceBatch::CharToUint8(reference_sequence3[i + 2 * error_threshold]);
+    uint8_t base4 = SequenceBatch::CharToUint8(reference_sequence4[i + 2 * error_threshold]);
+    uint8_t base5 = SequenceBatch::CharToUint8(reference_sequence5[i + 2 * error_threshold]);
+    uint8_t base6 = SequenceBatch::CharToUint8(reference_sequence6[i + 2 * error_threshold]);
+    uint8_t base7 = SequenceBatch::CharToUint8(reference_sequence7[i + 2 * error_threshold]);
     Peq[base0] = _mm_or_si128(highest_bit_in_band_mask_vpu0, Peq[base0]);
     Peq[base1] = _mm_or_si128(highest_bit_in_band_mask_vpu1, Peq[base1]);
     Peq[base2] = _mm_or_si128(highest_bit_in_band_mask_vpu2, Peq[base2]);
@@ -3949,9 +4609,9 @@ void Chromap<MappingRecord>::BandedAlign8PatternsToText(const char **patterns, c
       Peq[ai] = _mm_srli_epi16(Peq[ai], 1);
     }
   }
-  int band_start_position = read_length - 1;
+  int band_start_position = length - 1;
   __m128i min_num_errors_vpu = num_errors_at_band_start_position_vpu;
-  for (int i = 0; i < 2 * error_threshold_; i++) {
+  for (int i = 0; i < 2 * error_threshold; i++) {
     __m128i lowest_bit_in_VP_vpu = _mm_and_si128(VP, lowest_bit_in_band_mask_vpu);
     __m128i lowest_bit_in_VN_vpu = _mm_and_si128(VN, lowest_bit_in_band_mask_vpu);
     num_errors_at_band_start_position_vpu = _mm_add_epi16(num_errors_at_band_start_position_vpu, lowest_bit_in_VP_vpu);
@@ -3961,7 +4621,7 @@ void Chromap<MappingRecord>::BandedAlign8PatternsToText(const char **patterns, c
     int mapping_end_positions_update_mask = _mm_movemask_epi8(mapping_end_positions_update_mask_vpu);
     int mapping_end_positions_update_mask1 = _mm_movemask_epi8(mapping_end_positions_update_mask_vpu1);
     for (int li = 0; li < 8; ++li) {
-      if ((mapping_end_positions_update_mask & 1) == 1 || ((mapping_end_positions_update_mask1 & 1) == 1 && i + 1 == error_threshold_)) {
+      if ((mapping_end_positions_update_mask & 1) == 1 || ((mapping_end_positions_update_mask1 & 1) == 1 && i + 1 == error_threshold)) {
         mapping_end_positions[li] = band_start_position + 1 + i;
       }
       mapping_end_positions_update_mask = mapping_end_positions_update_mask >> 2;
@@ -3976,28 +4636,36 @@ void Chromap<MappingRecord>::BandedAlign8PatternsToText(const char **patterns, c
 
 template <typename MappingRecord>
 void Chromap<MappingRecord>::BandedTraceback(int min_num_errors, const char *pattern, const char *text, const int read_length, int *mapping_start_position) {
+  (this->*banded_traceback_kernels_[GetBandedAlignReadLengthClass(read_length)])(min_num_errors, pattern, text, read_length, mapping_start_position);
+}
+
+template <typename MappingRecord>
+template <int kErrorThreshold, int kReadLength>
+void Chromap<MappingRecord>::BandedTracebackKernel(int min_num_errors, const char *pattern, const char *text, const int read_length, int *mapping_start_position) {
+  const int error_threshold = kErrorThreshold > 0 ? kErrorThreshold : error_threshold_;
+  const int length = kReadLength > 0 ? kReadLength : read_length;
   // fisrt calculate the hamming distance and see whether it's equal to # errors
   if (min_num_errors == 0) {
-    *mapping_start_position = error_threshold_;
+    *mapping_start_position = error_threshold;
     return;
   } 
   int error_count = 0;
-  for (int i = 0; i < read_length; ++i) {
-    if (pattern[i + error_threshold_] != text[i]) {
+  for (int i = 0; i < length; ++i) {
+    if (pattern[i + error_threshold] != text[i]) {
       ++error_count;
     } 
   }
   if (error_count == min_num_errors) {
-    *mapping_start_position = error_threshold_;
+    *mapping_start_position = error_threshold;
     return;
   }
   // if not then there are gaps so that we have to traceback with edit distance.
   uint32_t Peq[5] = {0, 0, 0, 0, 0};
-  for (int i = 0; i < 2 * error_threshold_; i++) {
-    uint8_t base = SequenceBatch::CharToUint8(pattern[read_length - 1 + 2 * error_threshold_ - i]);
+  for (int i = 0; i < 2 * error_threshold; i++) {
+    uint8_t base = SequenceBatch::CharToUint8(pattern[length - 1 + 2 * error_threshold - i]);
     Peq[base] = Peq[base] | (1 << i);
   }
-  uint32_t highest_bit_in_band_mask = 1 << (2 * error_threshold_);
+  uint32_t highest_bit_in_band_mask = 1 << (2 * error_threshold);
   uint32_t lowest_bit_in_band_mask = 1;
   uint32_t VP = 0;
   uint32_t VN = 0;
@@ -4006,10 +4674,10 @@ void Chromap<MappingRecord>::BandedTraceback(int min_num_errors, const char *pat
   uint32_t HN = 0;
   uint32_t HP = 0;
   int num_errors_at_band_start_position = 0;
-  for (int i = 0; i < read_length; i++) {
-    uint8_t pattern_base = SequenceBatch::CharToUint8(pattern[read_length - 1 - i]);
+  for (int i = 0; i < length; i++) {
+    uint8_t pattern_base = SequenceBatch::CharToUint8(pattern[length - 1 - i]);
     Peq[pattern_base] = Peq[pattern_base] | highest_bit_in_band_mask;
-    X = Peq[SequenceBatch::CharToUint8(text[read_length - 1 - i])] | VN;
+    X = Peq[SequenceBatch::CharToUint8(text[length - 1 - i])] | VN;
     D0 = ((VP + (X & VP)) ^ VP) | X;
     HN = VP & D0;
     HP = VN | ~(VP | D0);
@@ -4021,13 +4689,13 @@ void Chromap<MappingRecord>::BandedTraceback(int min_num_errors, const char *pat
       Peq[ai] >>= 1;
     }
   }
-  *mapping_start_position = 2 * error_threshold_;
-  for (int i = 0; i < 2 * error_threshold_; i++) {
+  *mapping_start_position = 2 * error_threshold;
+  for (int i = 0; i < 2 * error_threshold; i++) {
     num_errors_at_band_start_position = num_errors_at_band_start_position + ((VP >> i) & (uint32_t) 1);
     num_errors_at_band_start_position = num_errors_at_band_start_position - ((VN >> i) & (uint32_t) 1);
     if (num_errors_at_band_start_position == min_num_errors) {
-      *mapping_start_position = 2 * error_threshold_ - (1 + i);
-      if (i + 1 == error_threshold_) {
+      *mapping_start_position = 2 * error_threshold - (1 + i);
+      if (i + 1 == error_threshold) {
         return;
       }
     }
@@ -4036,28 +4704,36 @@ void Chromap<MappingRecord>::BandedTraceback(int min_num_errors, const char *pat
 
 template <typename MappingRecord>
 void Chromap<MappingRecord>::BandedTracebackToEnd(int min_num_errors, const char *pattern, const char *text, const int read_length, int *mapping_end_position) {
+  (this->*banded_traceback_to_end_kernels_[GetBandedAlignReadLengthClass(read_length)])(min_num_errors, pattern, text, read_length, mapping_end_position);
+}
+
+template <typename MappingRecord>
+template <int kErrorThreshold, int kReadLength>
+void Chromap<MappingRecord>::BandedTracebackToEndKernel(int min_num_errors, const char *pattern, const char *text, const int read_length, int *mapping_end_position) {
+  const int error_threshold = kErrorThreshold > 0 ? kErrorThreshold : error_threshold_;
+  const int length = kReadLength > 0 ? kReadLength : read_length;
   // fisrt calculate the hamming distance and see whether it's equal to # errors
   if (min_num_errors == 0) {
-    *mapping_end_position = read_length + error_threshold_;
+    *mapping_end_position = length + error_threshold;
     return;
   } 
   int error_count = 0;
-  for (int i = 0; i < read_length; ++i) {
-    if (pattern[i + error_threshold_] != text[i]) {
+  for (int i = 0; i < length; ++i) {
+    if (pattern[i + error_threshold] != text[i]) {
       ++error_count;
     } 
   }
   if (error_count == min_num_errors) {
-    *mapping_end_position = read_length + error_threshold_;
+    *mapping_end_position = length + error_threshold;
     return;
   }
   // if not then there are gaps so that we have to traceback with edit distance.
   uint32_t Peq[5] = {0, 0, 0, 0, 0};
-  for (int i = 0; i < 2 * error_threshold_; i++) {
+  for (int i = 0; i < 2 * error_threshold; i++) {
     uint8_t base = SequenceBatch::CharToUint8(pattern[i]);
     Peq[base] = Peq[base] | (1 << i);
   }
-  uint32_t highest_bit_in_band_mask = 1 << (2 * error_threshold_);
+  uint32_t highest_bit_in_band_mask = 1 << (2 * error_threshold);
   uint32_t lowest_bit_in_band_mask = 1;
   uint32_t VP = 0;
   uint32_t VN = 0;
@@ -4066,8 +4742,8 @@ void Chromap<MappingRecord>::BandedTracebackToEnd(int min_num_errors, const char
   uint32_t HN = 0;
   uint32_t HP = 0;
   int num_errors_at_band_start_position = 0;
-  for (int i = 0; i < read_length; i++) {
-    uint8_t pattern_base = SequenceBatch::CharToUint8(pattern[i + 2 * error_threshold_]);
+  for (int i = 0; i < length; i++) {
+    uint8_t pattern_base = SequenceBatch::CharToUint8(pattern[i + 2 * error_threshold]);
     Peq[pattern_base] = Peq[pattern_base] | highest_bit_in_band_mask;
     X = Peq[SequenceBatch::CharToUint8(text[i])] | VN;
     D0 = ((VP + (X & VP)) ^ VP) | X;
@@ -4081,14 +4757,14 @@ void Chromap<MappingRecord>::BandedTracebackToEnd(int min_num_errors, const char
       Peq[ai] >>= 1;
     }
   }
-  int band_start_position = read_length;
+  int band_start_position = length;
   *mapping_end_position = band_start_position + 1;
-  for (int i = 0; i < 2 * error_threshold_; i++) {
+  for (int i = 0; i < 2 * error_threshold; i++) {
     num_errors_at_band_start_position = num_errors_at_band_start_position + ((VP >> i) & (uint32_t) 1);
     num_errors_at_band_start_position = num_errors_at_band_start_position - ((VN >> i) & (uint32_t) 1);
     if (num_errors_at_band_start_position == min_num_errors) {
       *mapping_end_position = band_start_position + i + 1;
-      if (i + 1 == error_threshold_) {
+      if (i + 1 == error_threshold) {
         return;
       }
     }
@@ -4104,7 +4780,9 @@ void Chromap<MappingRecord>::OutputBarcodeStatistics() {
 template <typename MappingRecord>
 void Chromap<MappingRecord>::OutputMappingStatistics() {
   std::cerr << "Number of reads: " << num_reads_ << ".\n";
-  //std::cerr << "Number of duplicated reads: " << num_duplicated_reads_ << ".\n";
+  if (num_duplicated_reads_ > 0) {
+    std::cerr << "Number of duplicated reads skipped before mapping (not counted as mapped reads): " << num_duplicated_reads_ << ".\n";
+  }
   std::cerr << "Number of mapped reads: " << num_mapped_reads_ << ".\n";
   std::cerr << "Number of uniquely mapped reads: " << num_uniquely_mapped_reads_ << ".\n";
   std::cerr << "Number of reads have multi-mappings: " << num_mapped_reads_ - num_uniquely_mapped_reads_ << ".\n";
@@ -4114,6 +4792,33 @@ void Chromap<MappingRecord>::OutputMappingStatistics() {
   std::cerr << "Number of multi-mappings: " << num_mappings_ - num_uniquely_mapped_reads_ << ".\n";
 }
 
+template <typename MappingRecord>
+std::unique_ptr<OutputTools<MappingRecord> > Chromap<MappingRecord>::NewPairedTagAlignOutputTools(std::true_type has_full_layout) {
+  return std::unique_ptr<PairedTagAlignOutputTools<MappingRecord> >(new PairedTagAlignOutputTools<MappingRecord>);
+}
+
+template <typename MappingRecord>
+std::unique_ptr<OutputTools<MappingRecord> > Chromap<MappingRecord>::NewPairedTagAlignOutputTools(std::false_type has_full_layout) {
+  ExitWithMessage("TagAlign output needs the alignment lengths of the reads!");
+  return nullptr;
+}
+
+template <typename MappingRecord>
+void Chromap<MappingRecord>::OutputMappingMemoryUsage(uint32_t num_reference_sequences, const std::vector<std::vector<MappingRecord> > &mappings) {
+  typedef typename FullLayoutTraits<MappingRecord>::FullLayout FullLayout;
+  uint64_t num_mappings = 0;
+  uint64_t num_allocated_mappings = 0;
+  for (uint32_t ri = 0; ri < num_reference_sequences; ++ri) {
+    num_mappings += mappings[ri].size();
+    num_allocated_mappings += mappings[ri].capacity();
+  }
+  std::cerr << "Mapping records in memory: " << num_mappings << " x " << sizeof(MappingRecord) << " bytes, " << num_allocated_mappings * sizeof(MappingRecord) / (1024.0 * 1024.0) << "MB allocated";
+  if (!std::is_same<MappingRecord, FullLayout>::value) {
+    std::cerr << " (" << num_allocated_mappings * sizeof(FullLayout) / (1024.0 * 1024.0) << "MB with " << sizeof(FullLayout) << "-byte records keeping the alignment lengths)";
+  }
+  std::cerr << ".\n";
+}
+
 template <typename MappingRecord>
 void Chromap<MappingRecord>::OutputMappingStatistics(uint32_t num_reference_sequences, const std::vector<std::vector<MappingRecord> > &uni_mappings, const std::vector<std::vector<MappingRecord> > &multi_mappings) {
   uint64_t num_uni_mappings = 0;
@@ -4283,6 +4988,18 @@ uint8_t Chromap<MappingRecord>::GetMAPQForPairedEndRead(int num_positive_candida
   return (uint8_t)mapq;
 }
 
+template <typename MappingRecord>
+void ChromapDriver::RunMapping(const MappingParameters &mapping_parameters, std::true_type is_paired_end) {
+  Chromap<MappingRecord> chromap_for_mapping(mapping_parameters);
+  chromap_for_mapping.MapPairedEndReads();
+}
+
+template <typename MappingRecord>
+void ChromapDriver::RunMapping(const MappingParameters &mapping_parameters, std::false_type is_paired_end) {
+  Chromap<MappingRecord> chromap_for_mapping(mapping_parameters);
+  chromap_for_mapping.MapSingleEndReads();
+}
+
 void ChromapDriver::ParseArgsAndRun(int argc, char *argv[]) {
   cxxopts::Options options("chromap", "A short read mapper for chromatin biology");
   options.add_options("Indexing")
@@ -4307,28 +5024,42 @@ void ChromapDriver::ParseArgsAndRun(int argc, char *argv[]) {
     //("drop-repetitive-reads", "Drop reads with too many best mappings [500000]", cxxopts::value<int>(), "INT")
     ("trim-adapters", "Try to trim adapters on 3'")
     ("remove-pcr-duplicates", "Remove PCR duplicates")
+    ("online-dedup", "Remove PCR duplicates while mapping, keeping unique fragments instead of all mappings in memory (paired-end BED/TagAlign only)")
     //("allocate-multi-mappings", "Allocate multi-mappings")
     ("Tn5-shift", "Perform Tn5 shift")
     ("low-mem", "Use low memory mode")
+    ("mem-budget", "Memory in GB for mappings and merge buffers in low memory mode, implies --low-mem [1]", cxxopts::value<double>(), "FLOAT")
     ("t,num-threads", "# threads for mapping [1]", cxxopts::value<int>(), "INT");
   options.add_options("Peak")
     ("cell-by-bin", "Generate cell-by-bin matrix")
     ("bin-size", "Bin size to generate cell-by-bin matrix [5000]", cxxopts::value<int>(), "INT")
     ("depth-cutoff", "Depth cutoff for peak calling [3]", cxxopts::value<int>(), "INT")
-    ("peak-min-length", "Min length of peaks to report [30]", cxxopts::value<int>(), "INT")
-    ("peak-merge-max-length", "Peaks within this length will be merged [30]", cxxopts::value<int>(), "INT");
+    ("peak-pvalue-cutoff", "Call peaks on Tn5 cut sites against a local Poisson background with this -log10 p-value cutoff, instead of the depth cutoff", cxxopts::value<double>(), "FLOAT")
+    ("cut-site-smoothing-length", "Length each cut site is spread over for --peak-pvalue-cutoff [150]", cxxopts::value<int>(), "INT")
+    ("peak-lambda-windows", "Windows for the local background of --peak-pvalue-cutoff [10000]", cxxopts::value<std::vector<int>>(), "INT[,INT]")
+    ("peak-min-length", "Min length of peaks to report with --peak-pvalue-cutoff [30]", cxxopts::value<int>(), "INT")
+    ("peak-merge-max-length", "Peaks within this length will be merged with --peak-pvalue-cutoff [30]", cxxopts::value<int>(), "INT");
   options.add_options("Input")
     ("r,ref", "Reference file", cxxopts::value<std::string>(), "FILE")
     ("x,index", "Index file", cxxopts::value<std::string>(), "FILE")
     ("1,read1", "Single-end read files or paired-end read files 1", cxxopts::value<std::vector<std::string> >(), "FILE")
     ("2,read2", "Paired-end read files 2", cxxopts::value<std::vector<std::string> >(), "FILE")
+    ("interleaved", "Mates of paired-end reads are interleaved in read files 1")
     ("b,barcode", "Cell barcode files", cxxopts::value<std::vector<std::string> >(), "FILE")
-    ("barcode-whitelist", "Cell barcode whitelist file", cxxopts::value<std::string>(), "FILE");
+    ("barcode-tag", "Take cell barcodes from the read 1 comment field with this tag, e.g. CB:Z:", cxxopts::value<std::string>(), "STR")
+    ("barcode-qual-tag", "Take barcode quals from the read 1 comment field with this tag, e.g. CY:Z:", cxxopts::value<std::string>(), "STR")
+    ("barcode-name-field", "Take cell barcodes from this field of read 1 names, negative to count from the end", cxxopts::value<int>(), "INT")
+    ("barcode-name-delimiter", "Delimiter of the fields in read names [_]", cxxopts::value<std::string>(), "CHAR")
+    ("barcode-whitelist", "Cell barcode whitelist file", cxxopts::value<std::string>(), "FILE")
+    ("prefetch-lanes", "# read files after the current one to decompress ahead [1]", cxxopts::value<int>(), "INT")
+    ("wide-read-ids", "Use 40-bit read ids for 2^32 reads or more, at 4 more bytes per mapping. On when read files 1 take 32GB or more or are streamed");
   options.add_options("Output")
     ("o,output", "Output file", cxxopts::value<std::string>(), "FILE")
     ("p,matrix-output-prefix", "Prefix of matrix output files", cxxopts::value<std::string>(), "FILE")
     ("BED", "Output mappings in BED/BEDPE format")
-    ("TagAlign", "Output mappings in TagAlign/PairedTagAlign format");
+    ("TagAlign", "Output mappings in TagAlign/PairedTagAlign format")
+    ("unsorted-output", "Write mappings batch by batch as they are mapped, without sorting them")
+    ("temp-dir", "Directory for temp files in low memory mode [directory of the output file]", cxxopts::value<std::string>(), "DIR");
     //("PAF", "Output mappings in PAF format (only for test)");
   options.add_options()
     ("h,help", "Print help");
@@ -4349,6 +5080,7 @@ void ChromapDriver::ParseArgsAndRun(int argc, char *argv[]) {
     
   auto result = options.parse(argc, argv);
   // Optional parameters
+  chromap::MappingParameters mapping_parameters;
   int kmer_size = 17;
   if (result.count("k")) {
     kmer_size = result["kmer"].as<int>();
@@ -4357,131 +5089,143 @@ void ChromapDriver::ParseArgsAndRun(int argc, char *argv[]) {
   if (result.count("w")) {
     window_size = result["window"].as<int>();
   }
-  int error_threshold = 4;
   if (result.count("e")) {
-    error_threshold = result["error-threshold"].as<int>();
+    mapping_parameters.error_threshold = result["error-threshold"].as<int>();
   }
-  int match_score = 1;
   if (result.count("A")) {
-    match_score = result["match-score"].as<int>();
+    mapping_parameters.match_score = result["match-score"].as<int>();
   }
-  int mismatch_penalty = 4;
   if (result.count("B")) {
-    mismatch_penalty = result["mismatch-penalty"].as<int>();
+    mapping_parameters.mismatch_penalty = result["mismatch-penalty"].as<int>();
   }
-  std::vector<int> gap_open_penalties = {6, 6};
   if (result.count("O")) {
-    gap_open_penalties = result["gap-open-penalties"].as<std::vector<int>>();
+    mapping_parameters.gap_open_penalties = result["gap-open-penalties"].as<std::vector<int>>();
   }
-  std::vector<int> gap_extension_penalties = {1, 1};
   if (result.count("E")) {
-    gap_extension_penalties = result["gap-extension-penalties"].as<std::vector<int>>();
+    mapping_parameters.gap_extension_penalties = result["gap-extension-penalties"].as<std::vector<int>>();
   }
-  int min_num_seeds_required_for_mapping = 2;
   if (result.count("s")) {
-    min_num_seeds_required_for_mapping = result["min-num-seeds"].as<int>();
+    mapping_parameters.min_num_seeds_required_for_mapping = result["min-num-seeds"].as<int>();
   }
-  std::vector<int> max_seed_frequencies = {1000, 5000};
   if (result.count("f")) {
-    max_seed_frequencies = result["max-seed-frequencies"].as<std::vector<int>>();
+    mapping_parameters.max_seed_frequencies = result["max-seed-frequencies"].as<std::vector<int>>();
   } 
-  int max_num_best_mappings = 1; 
   if (result.count("n")) {
-    max_num_best_mappings = result["max-num-best-mappings"].as<int>();
+    mapping_parameters.max_num_best_mappings = result["max-num-best-mappings"].as<int>();
   } 
-  int max_insert_size = 1000;
   if (result.count("l")) {
-    max_insert_size = result["max-insert-size"].as<int>();
+    mapping_parameters.max_insert_size = result["max-insert-size"].as<int>();
   } 
-  uint8_t mapq_threshold = 30;
   if (result.count("q")) {
-    mapq_threshold = result["MAPQ-threshold"].as<uint8_t>();
+    mapping_parameters.mapq_threshold = result["MAPQ-threshold"].as<uint8_t>();
   } 
-  int num_threads = 1;
   if (result.count("t")) {
-    num_threads = result["num-threads"].as<int>();
+    mapping_parameters.num_threads = result["num-threads"].as<int>();
   } 
-  int min_read_length = 30;
+  if (result.count("prefetch-lanes")) {
+    mapping_parameters.num_prefetched_lanes = result["prefetch-lanes"].as<int>();
+  }
   if (result.count("min-read-length")) {
-    min_read_length = result["min-read-length"].as<int>();
+    mapping_parameters.min_read_length = result["min-read-length"].as<int>();
   }
-  int multi_mapping_allocation_distance = 0;
   if (result.count("multi-mapping-allocation-distance")) {
-    multi_mapping_allocation_distance = result["multi-mapping-allocation-distance"].as<int>();
+    mapping_parameters.multi_mapping_allocation_distance = result["multi-mapping-allocation-distance"].as<int>();
   }
-  int multi_mapping_allocation_seed = 11;
   if (result.count("multi-mapping-allocation-seed")) {
-    multi_mapping_allocation_seed = result["multi-mapping-allocation-seed"].as<int>();
+    mapping_parameters.multi_mapping_allocation_seed = result["multi-mapping-allocation-seed"].as<int>();
   }
-  int drop_repetitive_reads = 500000;
   if (result.count("drop-repetitive-reads")) {
-    drop_repetitive_reads = result["drop-repetitive-reads"].as<int>();
+    mapping_parameters.drop_repetitive_reads = result["drop-repetitive-reads"].as<int>();
   }
-  bool trim_adapters = false;
   if (result.count("trim-adapters")) {
-    trim_adapters = true;
+    mapping_parameters.trim_adapters = true;
   }
-  bool remove_pcr_duplicates = false;
   if (result.count("remove-pcr-duplicates")) {
-    remove_pcr_duplicates = true;
+    mapping_parameters.remove_pcr_duplicates = true;
+  }
+  if (result.count("online-dedup")) {
+    mapping_parameters.online_dedup = true;
   }
-  bool only_output_unique_mappings = true;
-  bool allocate_multi_mappings = false;
   if (result.count("allocate-multi-mappings")) {
-    allocate_multi_mappings = true;
-    only_output_unique_mappings = false;
+    mapping_parameters.allocate_multi_mappings = true;
+    mapping_parameters.only_output_unique_mappings = false;
   }
-  bool Tn5_shift = false;
   if (result.count("Tn5-shift")) {
-    Tn5_shift = true;
+    mapping_parameters.Tn5_shift = true;
   }
-  bool split_alignment = false;
   if (result.count("split-alignment")) {
-    split_alignment = true;
+    mapping_parameters.split_alignment = true;
   }
-  bool output_mapping_in_BED = false;
   if (result.count("BED")) {
-    output_mapping_in_BED = true;
+    mapping_parameters.output_mapping_in_BED = true;
   }
-  bool output_mapping_in_TagAlign = false;
   if (result.count("TagAlign")) {
-    output_mapping_in_TagAlign = true;
+    mapping_parameters.output_mapping_in_TagAlign = true;
   }
-  bool output_mapping_in_PAF = false;
   if (result.count("PAF")) {
-    output_mapping_in_PAF = true;
+    mapping_parameters.output_mapping_in_PAF = true;
   }
-  bool output_mapping_in_SAM = false;
   if (result.count("SAM")) {
-    output_mapping_in_SAM = true;
+    mapping_parameters.output_mapping_in_SAM = true;
   }
-  bool output_mapping_in_pairs = false;
   if (result.count("pairs")) {
-    output_mapping_in_pairs = true;
+    mapping_parameters.output_mapping_in_pairs = true;
   }
-  bool low_memory_mode = false;
   if (result.count("low-mem")) {
-    low_memory_mode = true;
+    mapping_parameters.low_memory_mode = true;
+  }
+  if (result.count("mem-budget")) {
+    double mem_budget_in_gb = result["mem-budget"].as<double>();
+    if (mem_budget_in_gb <= 0) {
+      chromap::Chromap<>::ExitWithMessage("The memory budget should be positive!");
+    }
+    mapping_parameters.mem_budget = mem_budget_in_gb * ((uint64_t)1 << 30);
+    mapping_parameters.low_memory_mode = true;
+  }
+  if (result.count("unsorted-output")) {
+    mapping_parameters.unsorted_output = true;
   }
-  bool cell_by_bin = false;
   if (result.count("cell-by-bin")) {
-    cell_by_bin = true;
+    mapping_parameters.cell_by_bin = true;
   }
-  int bin_size = 5000;
   if (result.count("bin-size")) {
-    bin_size = result["bin-size"].as<int>();
+    mapping_parameters.bin_size = result["bin-size"].as<int>();
   }
-  uint16_t depth_cutoff_to_call_peak = 3;
   if (result.count("depth-cutoff")) {
-    depth_cutoff_to_call_peak = result["depth-cutoff"].as<uint16_t>();
+    int depth_cutoff = result["depth-cutoff"].as<int>();
+    if (depth_cutoff < 0 || depth_cutoff > std::numeric_limits<uint16_t>::max()) {
+      chromap::Chromap<>::ExitWithMessage("The depth cutoff should be between 0 and 65535!");
+    }
+    mapping_parameters.depth_cutoff_to_call_peak = depth_cutoff;
   }
-  int peak_min_length = 30;
   if (result.count("peak-min-length")) {
-    peak_min_length = result["peak-min-length"].as<int>();
+    mapping_parameters.peak_min_length = result["peak-min-length"].as<int>();
   }
-  int peak_merge_max_length = 30;
   if (result.count("peak-merge-max-length")) {
-    peak_merge_max_length = result["peak-merge-max-length"].as<int>();
+    mapping_parameters.peak_merge_max_length = result["peak-merge-max-length"].as<int>();
+  }
+  if (mapping_parameters.peak_min_length < 0 || mapping_parameters.peak_merge_max_length < 0) {
+    chromap::Chromap<>::ExitWithMessage("The peak min length and merge max length should not be negative!");
+  }
+  if (result.count("peak-pvalue-cutoff")) {
+    mapping_parameters.peak_pvalue_cutoff = result["peak-pvalue-cutoff"].as<double>();
+    if (mapping_parameters.peak_pvalue_cutoff <= 0) {
+      chromap::Chromap<>::ExitWithMessage("The peak p-value cutoff should be positive!");
+    }
+  }
+  if (result.count("cut-site-smoothing-length")) {
+    mapping_parameters.cut_site_smoothing_length = result["cut-site-smoothing-length"].as<int>();
+    if (mapping_parameters.cut_site_smoothing_length <= 0) {
+      chromap::Chromap<>::ExitWithMessage("The cut site smoothing length should be positive!");
+    }
+  }
+  if (result.count("peak-lambda-windows")) {
+    mapping_parameters.peak_lambda_windows = result["peak-lambda-windows"].as<std::vector<int>>();
+    for (int peak_lambda_window : mapping_parameters.peak_lambda_windows) {
+      if (peak_lambda_window <= 0) {
+        chromap::Chromap<>::ExitWithMessage("The peak lambda windows should be positive!");
+      }
+    }
   }
 
   std::cerr << std::setprecision(2) << std::fixed;
@@ -4502,165 +5246,271 @@ void ChromapDriver::ParseArgsAndRun(int argc, char *argv[]) {
     std::cerr << "Kmer length: " << kmer_size << ", window size: " << window_size << "\n";
     std::cerr << "Reference file: " << reference_file_path << "\n";
     std::cerr << "Output file: " << output_file_path << "\n";
-    chromap::Chromap<> chromap_for_indexing(kmer_size, window_size, num_threads, reference_file_path, output_file_path);
+    chromap::Chromap<> chromap_for_indexing(kmer_size, window_size, mapping_parameters.num_threads, reference_file_path, output_file_path);
     chromap_for_indexing.ConstructIndex();
   } else if (result.count("m")) {
     std::cerr << "Start to map reads.\n";
-    std::string reference_file_path;
     if (result.count("r")) {
-      reference_file_path = result["ref"].as<std::string>();
+      mapping_parameters.reference_file_path = result["ref"].as<std::string>();
     } else {
       chromap::Chromap<>::ExitWithMessage("No reference specified!");
     }
-    std::string output_file_path;
     if (result.count("o")) {
-      output_file_path = result["output"].as<std::string>();
+      mapping_parameters.mapping_output_file_path = result["output"].as<std::string>();
     } else {
       chromap::Chromap<>::ExitWithMessage("No output file specified!");
     }
-    std::string index_file_path;
     if (result.count("x")) {
-      index_file_path = result["index"].as<std::string>();
+      mapping_parameters.index_file_path = result["index"].as<std::string>();
     } else {
       chromap::Chromap<>::ExitWithMessage("No index file specified!");
     }
-    std::vector<std::string> read_file1_paths;
     if (result.count("1")) {
-      read_file1_paths = result["read1"].as<std::vector<std::string> >();
+      mapping_parameters.read_file1_paths = result["read1"].as<std::vector<std::string> >();
     } else {
       chromap::Chromap<>::ExitWithMessage("No read file specified!");
     }
-    std::vector<std::string> read_file2_paths;
     if (result.count("2")) {
-      read_file2_paths = result["read2"].as<std::vector<std::string> >();
+      mapping_parameters.read_file2_paths = result["read2"].as<std::vector<std::string> >();
     }
-    std::vector<std::string> barcode_file_paths;
-    bool is_bulk_data = true;
     if (result.count("b")) {
-      is_bulk_data = false;
-      barcode_file_paths = result["barcode"].as<std::vector<std::string> >();
+      mapping_parameters.is_bulk_data = false;
+      mapping_parameters.barcode_file_paths = result["barcode"].as<std::vector<std::string> >();
+    }
+    // Each reader of "-" gets its own copy of the stdin descriptor, so two of
+    // them would split one stream between them.
+    size_t num_stdin_files = std::count(mapping_parameters.read_file1_paths.begin(), mapping_parameters.read_file1_paths.end(), "-") + std::count(mapping_parameters.read_file2_paths.begin(), mapping_parameters.read_file2_paths.end(), "-") + std::count(mapping_parameters.barcode_file_paths.begin(), mapping_parameters.barcode_file_paths.end(), "-");
+    if (num_stdin_files > 1) {
+      chromap::Chromap<>::ExitWithMessage("Stdin (-) can be given as at most one read or barcode file!");
+    }
+    // The compact mapping records keep 32-bit read ids unless there may be
+    // 2^32 reads or more, which take at least 8 bytes each in read files 1 even
+    // when compressed. The size of a stream such as stdin or a pipe is unknown,
+    // so it may hold that many.
+    bool wide_read_ids = false;
+    if (result.count("wide-read-ids")) {
+      wide_read_ids = true;
+    } else {
+      uint64_t read_file1_size = 0;
+      for (const std::string &read_file1_path : mapping_parameters.read_file1_paths) {
+        struct stat read_file1_status;
+        if (chromap::ParallelGzipReader::IsStream(read_file1_path)) {
+          wide_read_ids = true;
+        } else if (stat(read_file1_path.c_str(), &read_file1_status) == 0) {
+          read_file1_size += read_file1_status.st_size;
+        }
+      }
+      wide_read_ids = wide_read_ids || read_file1_size >= ((uint64_t)8 << 32);
+    }
+    if (result.count("barcode-tag")) {
+      mapping_parameters.barcode_tag = result["barcode-tag"].as<std::string>();
+    }
+    if (result.count("barcode-qual-tag")) {
+      mapping_parameters.barcode_qual_tag = result["barcode-qual-tag"].as<std::string>();
+    }
+    if (result.count("barcode-name-field")) {
+      mapping_parameters.barcode_name_field = result["barcode-name-field"].as<int>();
+    }
+    if (result.count("barcode-name-delimiter")) {
+      std::string delimiter = result["barcode-name-delimiter"].as<std::string>();
+      if (delimiter.size() != 1) {
+        chromap::Chromap<>::ExitWithMessage("The barcode name delimiter should be one character!");
+      }
+      mapping_parameters.barcode_name_delimiter = delimiter[0];
+    }
+    if (!mapping_parameters.barcode_tag.empty() || mapping_parameters.barcode_name_field != 0) {
+      if (!mapping_parameters.is_bulk_data) {
+        chromap::Chromap<>::ExitWithMessage("Cell barcodes can't be taken from both barcode files and read names!");
+      }
+      if (!mapping_parameters.barcode_tag.empty() && mapping_parameters.barcode_name_field != 0) {
+        chromap::Chromap<>::ExitWithMessage("Cell barcodes can't be taken from both a tag and a field of read names!");
+      }
+      mapping_parameters.is_bulk_data = false;
     }
-    std::string barcode_whitelist_file_path;
     if (result.count("barcode-whitelist")) {
-      if (is_bulk_data) {
+      if (mapping_parameters.is_bulk_data) {
         chromap::Chromap<>::ExitWithMessage("No barcode file specified but the barcode whitelist file is given!");
       }
-      barcode_whitelist_file_path = result["barcode-whitelist"].as<std::string>();
+      mapping_parameters.barcode_whitelist_file_path = result["barcode-whitelist"].as<std::string>();
     }
-    std::string matrix_output_prefix;
     if (result.count("p")) {
-      matrix_output_prefix = result["matrix-output-prefix"].as<std::string>();
-      if (is_bulk_data) {
+      mapping_parameters.matrix_output_prefix = result["matrix-output-prefix"].as<std::string>();
+      if (mapping_parameters.is_bulk_data) {
         chromap::Chromap<>::ExitWithMessage("No barcode file specified but asked to output matrix files!");
       }
     }
-    std::cerr << "Parameters: error threshold: " << error_threshold << ", match score: " << match_score << ", mismatch_penalty: " << mismatch_penalty << ", gap open penalties for deletions and insertions: " << gap_open_penalties[0] << "," << gap_open_penalties[1] << ", gap extension penalties for deletions and insertions: " << gap_extension_penalties[0] << "," << gap_extension_penalties[1] << ", min-num-seeds: " << min_num_seeds_required_for_mapping << ", max-seed-frequency: " << max_seed_frequencies[0] << "," << max_seed_frequencies[1] << ", max-num-best-mappings: " << max_num_best_mappings << ", max-insert-size: " << max_insert_size << ", MAPQ-threshold: " << (int)mapq_threshold << ", min-read-length: " << min_read_length << ", multi-mapping-allocation-distance: " << multi_mapping_allocation_distance << ", multi-mapping-allocation-seed: " << multi_mapping_allocation_seed << ", drop-repetitive-reads: " << drop_repetitive_reads << "\n";
-    std::cerr << "Number of threads: " << num_threads << "\n";
-    if (is_bulk_data) {
+    if (result.count("temp-dir")) {
+      mapping_parameters.temp_directory_path = result["temp-dir"].as<std::string>();
+      struct stat temp_directory_status;
+      if (stat(mapping_parameters.temp_directory_path.c_str(), &temp_directory_status) != 0 || !S_ISDIR(temp_directory_status.st_mode)) {
+        chromap::Chromap<>::ExitWithMessage("The temp directory " + mapping_parameters.temp_directory_path + " doesn't exist!");
+      }
+    }
+    std::cerr << "Parameters: error threshold: " << mapping_parameters.error_threshold << ", match score: " << mapping_parameters.match_score << ", mismatch_penalty: " << mapping_parameters.mismatch_penalty << ", gap open penalties for deletions and insertions: " << mapping_parameters.gap_open_penalties[0] << "," << mapping_parameters.gap_open_penalties[1] << ", gap extension penalties for deletions and insertions: " << mapping_parameters.gap_extension_penalties[0] << "," << mapping_parameters.gap_extension_penalties[1] << ", min-num-seeds: " << mapping_parameters.min_num_seeds_required_for_mapping << ", max-seed-frequency: " << mapping_parameters.max_seed_frequencies[0] << "," << mapping_parameters.max_seed_frequencies[1] << ", max-num-best-mappings: " << mapping_parameters.max_num_best_mappings << ", max-insert-size: " << mapping_parameters.max_insert_size << ", MAPQ-threshold: " << (int)mapping_parameters.mapq_threshold << ", min-read-length: " << mapping_parameters.min_read_length << ", multi-mapping-allocation-distance: " << mapping_parameters.multi_mapping_allocation_distance << ", multi-mapping-allocation-seed: " << mapping_parameters.multi_mapping_allocation_seed << ", drop-repetitive-reads: " << mapping_parameters.drop_repetitive_reads << "\n";
+    std::cerr << "Number of threads: " << mapping_parameters.num_threads << "\n";
+    if (mapping_parameters.is_bulk_data) {
       std::cerr << "Analyze bulk data.\n";
     } else {
       std::cerr << "Analyze single-cell data.\n";
     }
-    if (trim_adapters) {
+    if (mapping_parameters.trim_adapters) {
       std::cerr << "Will try to remove adapters on 3'.\n";
     } else {
       std::cerr << "Won't try to remove adapters on 3'.\n";
     }
-    if (remove_pcr_duplicates) {
+    if (mapping_parameters.low_memory_mode) {
+      if (mapping_parameters.output_mapping_in_PAF || mapping_parameters.output_mapping_in_SAM || mapping_parameters.output_mapping_in_pairs) {
+        chromap::Chromap<>::ExitWithMessage("Low memory mode doesn't support PAF, SAM or pairs output!");
+      }
+      std::cerr << "Will use low memory mode with a memory budget of " << mapping_parameters.mem_budget << " bytes.\n";
+      if (!mapping_parameters.temp_directory_path.empty()) {
+        std::cerr << "Will write temp files to " << mapping_parameters.temp_directory_path << ".\n";
+      }
+    }
+    if (mapping_parameters.online_dedup) {
+      if (!mapping_parameters.remove_pcr_duplicates) {
+        chromap::Chromap<>::ExitWithMessage("Online dedup is only used to remove PCR duplicates!");
+      }
+      if (mapping_parameters.low_memory_mode) {
+        chromap::Chromap<>::ExitWithMessage("Online dedup can't be used in low memory mode!");
+      }
+      if ((result.count("2") == 0 && result.count("interleaved") == 0) || !(mapping_parameters.output_mapping_in_BED || mapping_parameters.output_mapping_in_TagAlign)) {
+        std::cerr << "WARNING: online dedup only supports paired-end reads with BED/TagAlign output. PCR duplicates will be removed after mapping.\n";
+        mapping_parameters.online_dedup = false;
+      }
+    }
+    if (mapping_parameters.online_dedup) {
+      std::cerr << "Will remove PCR duplicates while mapping.\n";
+    } else if (mapping_parameters.remove_pcr_duplicates) {
       std::cerr << "Will remove PCR duplicates after mapping.\n";
     } else {
       std::cerr << "Won't remove PCR duplicates after mapping.\n";
     }
-    if (allocate_multi_mappings) {
+    if (mapping_parameters.allocate_multi_mappings) {
       std::cerr << "Will allocate multi-mappings after mapping.\n";
     } else {
       std::cerr << "Won't allocate multi-mappings after mapping.\n";
     }
-    if (only_output_unique_mappings) {
+    if (mapping_parameters.only_output_unique_mappings) {
       std::cerr << "Only output unique mappings after mapping.\n";
     } 
-    //if (allocate_multi_mappings && only_output_unique_mappings) {
+    //if (mapping_parameters.allocate_multi_mappings && mapping_parameters.only_output_unique_mappings) {
     //  std::cerr << "WARNING: you want to output unique mappings only but you ask to allocate multi-mappings! In this case, it won't allocate multi-mappings and will only output unique mappings.\n";
-    //  allocate_multi_mappings = false;
+    //  mapping_parameters.allocate_multi_mappings = false;
     //}
-    if (max_num_best_mappings > drop_repetitive_reads) {
-      std::cerr << "WARNING: you want to drop mapped reads with more than " << drop_repetitive_reads << " mappings. But you want to output top " << max_num_best_mappings << " best mappings. In this case, only reads with <=" << drop_repetitive_reads << " best mappings will be output.\n";
-      max_num_best_mappings = drop_repetitive_reads;
+    if (mapping_parameters.max_num_best_mappings > mapping_parameters.drop_repetitive_reads) {
+      std::cerr << "WARNING: you want to drop mapped reads with more than " << mapping_parameters.drop_repetitive_reads << " mappings. But you want to output top " << mapping_parameters.max_num_best_mappings << " best mappings. In this case, only reads with <=" << mapping_parameters.drop_repetitive_reads << " best mappings will be output.\n";
+      mapping_parameters.max_num_best_mappings = mapping_parameters.drop_repetitive_reads;
     }
-    if (Tn5_shift) {
+    if (mapping_parameters.Tn5_shift) {
       std::cerr << "Perform Tn5 shift.\n";
     }
-    if (split_alignment) {
+    if (mapping_parameters.unsorted_output) {
+      if (mapping_parameters.remove_pcr_duplicates || mapping_parameters.allocate_multi_mappings || mapping_parameters.low_memory_mode || !mapping_parameters.matrix_output_prefix.empty()) {
+        chromap::Chromap<>::ExitWithMessage("Unsorted output can't be used with PCR duplicate removal, multi-mapping allocation, low memory mode or matrix output!");
+      }
+      std::cerr << "Output mappings batch by batch without sorting.\n";
+    }
+    if (mapping_parameters.split_alignment) {
       std::cerr << "Allow split alignment.\n";
     }
-    if (output_mapping_in_BED) {
+    if (mapping_parameters.output_mapping_in_BED) {
       std::cerr << "Output mappings in BED/BEDPE format.\n";
-    } else if (output_mapping_in_TagAlign) {
+    } else if (mapping_parameters.output_mapping_in_TagAlign) {
       std::cerr << "Output mappings in TagAlign/PairedTagAlign format.\n";
-    } else if (output_mapping_in_PAF) {
+    } else if (mapping_parameters.output_mapping_in_PAF) {
       std::cerr << "Output mappings in PAF format.\n";
-    } else if (output_mapping_in_SAM) {
+    } else if (mapping_parameters.output_mapping_in_SAM) {
       std::cerr << "Output mappings in SAM format.\n";
-    } else if (output_mapping_in_pairs) {
+    } else if (mapping_parameters.output_mapping_in_pairs) {
       std::cerr << "Output mappings in pairs format.\n"; 
     } else {
       chromap::Chromap<>::ExitWithMessage("No output format specified!");
     }
-    std::cerr << "Reference file: " << reference_file_path << "\n";
-    std::cerr << "Index file: " << index_file_path << "\n";
-    for (size_t i = 0; i < read_file1_paths.size(); ++i) {
-      std::cerr << i + 1 << "th read 1 file: " << read_file1_paths[i] << "\n";
+    std::cerr << "Reference file: " << mapping_parameters.reference_file_path << "\n";
+    std::cerr << "Index file: " << mapping_parameters.index_file_path << "\n";
+    for (size_t i = 0; i < mapping_parameters.read_file1_paths.size(); ++i) {
+      std::cerr << i + 1 << "th read 1 file: " << mapping_parameters.read_file1_paths[i] << "\n";
     }
     if (result.count("2") != 0) {
-      for (size_t i = 0; i < read_file2_paths.size(); ++i) {
-        std::cerr << i + 1 << "th read 2 file: " << read_file2_paths[i] << "\n";
+      for (size_t i = 0; i < mapping_parameters.read_file2_paths.size(); ++i) {
+        std::cerr << i + 1 << "th read 2 file: " << mapping_parameters.read_file2_paths[i] << "\n";
       }
     }
+    if (result.count("interleaved") != 0) {
+      if (result.count("2") != 0) {
+        chromap::Chromap<>::ExitWithMessage("Read 2 files can't be specified for interleaved paired-end reads!");
+      }
+      std::cerr << "Mates of paired-end reads are interleaved in read 1 files.\n";
+    }
+    if (wide_read_ids) {
+      std::cerr << "Read ids take " << chromap::READ_ID_BITS << " bits in mapping records.\n";
+    }
     if (result.count("b") != 0) {
-      for (size_t i = 0; i < barcode_file_paths.size(); ++i) {
-        std::cerr << i + 1 << "th cell barcode file: " << barcode_file_paths[i] << "\n";
+      for (size_t i = 0; i < mapping_parameters.barcode_file_paths.size(); ++i) {
+        std::cerr << i + 1 << "th cell barcode file: " << mapping_parameters.barcode_file_paths[i] << "\n";
       }
     }
+    if (!mapping_parameters.barcode_tag.empty()) {
+      std::cerr << "Cell barcodes are taken from the read 1 comment field tagged " << mapping_parameters.barcode_tag << "\n";
+    } else if (mapping_parameters.barcode_name_field != 0) {
+      std::cerr << "Cell barcodes are taken from field " << mapping_parameters.barcode_name_field << " of read 1 names split by '" << mapping_parameters.barcode_name_delimiter << "'\n";
+    }
     if (result.count("barcode-whitelist") != 0) {
-      std::cerr << "Cell barcode whitelist file: " << barcode_whitelist_file_path << "\n";
+      std::cerr << "Cell barcode whitelist file: " << mapping_parameters.barcode_whitelist_file_path << "\n";
     }
-    std::cerr << "Output file: " << output_file_path << "\n";
+    std::cerr << "Output file: " << mapping_parameters.mapping_output_file_path << "\n";
     if (result.count("matrix-output-prefix") != 0) {
-      std::cerr << "Matrix output prefix: " << matrix_output_prefix << "\n";
-    }
-    if (result.count("2") == 0) {
-      if (output_mapping_in_PAF) {
-        chromap::Chromap<chromap::PAFMapping> chromap_for_mapping(error_threshold, match_score, mismatch_penalty, gap_open_penalties, gap_extension_penalties, min_num_seeds_required_for_mapping, max_seed_frequencies, max_num_best_mappings, max_insert_size, mapq_threshold, num_threads, min_read_length, multi_mapping_allocation_distance, multi_mapping_allocation_seed, drop_repetitive_reads, trim_adapters, remove_pcr_duplicates, is_bulk_data, allocate_multi_mappings, only_output_unique_mappings, Tn5_shift, split_alignment, output_mapping_in_BED, output_mapping_in_TagAlign, output_mapping_in_PAF, output_mapping_in_SAM, output_mapping_in_pairs, low_memory_mode, cell_by_bin, bin_size, depth_cutoff_to_call_peak, peak_min_length, peak_merge_max_length, reference_file_path, index_file_path, read_file1_paths, read_file2_paths, barcode_file_paths, barcode_whitelist_file_path, output_file_path, matrix_output_prefix);
-        chromap_for_mapping.MapSingleEndReads();
-      } else if (output_mapping_in_SAM) {
-        chromap::Chromap<chromap::SAMMapping> chromap_for_mapping(error_threshold, match_score, mismatch_penalty, gap_open_penalties, gap_extension_penalties, min_num_seeds_required_for_mapping, max_seed_frequencies, max_num_best_mappings, max_insert_size, mapq_threshold, num_threads, min_read_length, multi_mapping_allocation_distance, multi_mapping_allocation_seed, drop_repetitive_reads, trim_adapters, remove_pcr_duplicates, is_bulk_data, allocate_multi_mappings, only_output_unique_mappings, Tn5_shift, split_alignment, output_mapping_in_BED, output_mapping_in_TagAlign, output_mapping_in_PAF, output_mapping_in_SAM, output_mapping_in_pairs, low_memory_mode, cell_by_bin, bin_size, depth_cutoff_to_call_peak, peak_min_length, peak_merge_max_length, reference_file_path, index_file_path, read_file1_paths, read_file2_paths, barcode_file_paths, barcode_whitelist_file_path, output_file_path, matrix_output_prefix);
-        chromap_for_mapping.MapSingleEndReads();
+      std::cerr << "Matrix output prefix: " << mapping_parameters.matrix_output_prefix << "\n";
+    }
+    if (result.count("2") == 0 && result.count("interleaved") == 0) {
+      if (mapping_parameters.output_mapping_in_PAF) {
+        RunMapping<chromap::PAFMapping>(mapping_parameters, std::false_type());
+      } else if (mapping_parameters.output_mapping_in_SAM) {
+        RunMapping<chromap::SAMMapping>(mapping_parameters, std::false_type());
       } else {
-        if (result.count("b") != 0) {
-          chromap::Chromap<chromap::MappingWithBarcode> chromap_for_mapping(error_threshold, match_score, mismatch_penalty, gap_open_penalties, gap_extension_penalties, min_num_seeds_required_for_mapping, max_seed_frequencies, max_num_best_mappings, max_insert_size, mapq_threshold, num_threads, min_read_length, multi_mapping_allocation_distance, multi_mapping_allocation_seed, drop_repetitive_reads, trim_adapters, remove_pcr_duplicates, is_bulk_data, allocate_multi_mappings, only_output_unique_mappings, Tn5_shift, split_alignment, output_mapping_in_BED, output_mapping_in_TagAlign, output_mapping_in_PAF, output_mapping_in_SAM, output_mapping_in_pairs, low_memory_mode, cell_by_bin, bin_size, depth_cutoff_to_call_peak, peak_min_length, peak_merge_max_length, reference_file_path, index_file_path, read_file1_paths, read_file2_paths, barcode_file_paths, barcode_whitelist_file_path, output_file_path, matrix_output_prefix);
-          chromap_for_mapping.MapSingleEndReads();
+        if (!mapping_parameters.is_bulk_data) {
+          if (wide_read_ids) {
+            RunMapping<chromap::WideMappingWithBarcode>(mapping_parameters, std::false_type());
+          } else {
+            RunMapping<chromap::MappingWithBarcode>(mapping_parameters, std::false_type());
+          }
         } else {
-          chromap::Chromap<chromap::MappingWithoutBarcode> chromap_for_mapping(error_threshold, match_score, mismatch_penalty, gap_open_penalties, gap_extension_penalties, min_num_seeds_required_for_mapping, max_seed_frequencies, max_num_best_mappings, max_insert_size, mapq_threshold, num_threads, min_read_length, multi_mapping_allocation_distance, multi_mapping_allocation_seed, drop_repetitive_reads, trim_adapters, remove_pcr_duplicates, is_bulk_data, allocate_multi_mappings, only_output_unique_mappings, Tn5_shift, split_alignment, output_mapping_in_BED, output_mapping_in_TagAlign, output_mapping_in_PAF, output_mapping_in_SAM, output_mapping_in_pairs, low_memory_mode, cell_by_bin, bin_size, depth_cutoff_to_call_peak, peak_min_length, peak_merge_max_length, reference_file_path, index_file_path, read_file1_paths, read_file2_paths, barcode_file_paths, barcode_whitelist_file_path, output_file_path, matrix_output_prefix);
-          chromap_for_mapping.MapSingleEndReads();
+          if (wide_read_ids) {
+            RunMapping<chromap::WideMappingWithoutBarcode>(mapping_parameters, std::false_type());
+          } else {
+            RunMapping<chromap::MappingWithoutBarcode>(mapping_parameters, std::false_type());
+          }
         }
       }
     } else {
-      if (output_mapping_in_PAF) {
-        chromap::Chromap<chromap::PairedPAFMapping> chromap_for_mapping(error_threshold, match_score, mismatch_penalty, gap_open_penalties, gap_extension_penalties, min_num_seeds_required_for_mapping, max_seed_frequencies, max_num_best_mappings, max_insert_size, mapq_threshold, num_threads, min_read_length, multi_mapping_allocation_distance, multi_mapping_allocation_seed, drop_repetitive_reads, trim_adapters, remove_pcr_duplicates, is_bulk_data, allocate_multi_mappings, only_output_unique_mappings, Tn5_shift, split_alignment, output_mapping_in_BED, output_mapping_in_TagAlign, output_mapping_in_PAF, output_mapping_in_SAM, output_mapping_in_pairs, low_memory_mode, cell_by_bin, bin_size, depth_cutoff_to_call_peak, peak_min_length, peak_merge_max_length, reference_file_path, index_file_path, read_file1_paths, read_file2_paths, barcode_file_paths, barcode_whitelist_file_path, output_file_path, matrix_output_prefix);
-        chromap_for_mapping.MapPairedEndReads();
-      } else if (output_mapping_in_SAM) {
-        chromap::Chromap<chromap::SAMMapping> chromap_for_mapping(error_threshold, match_score, mismatch_penalty, gap_open_penalties, gap_extension_penalties, min_num_seeds_required_for_mapping, max_seed_frequencies, max_num_best_mappings, max_insert_size, mapq_threshold, num_threads, min_read_length, multi_mapping_allocation_distance, multi_mapping_allocation_seed, drop_repetitive_reads, trim_adapters, remove_pcr_duplicates, is_bulk_data, allocate_multi_mappings, only_output_unique_mappings, Tn5_shift, split_alignment, output_mapping_in_BED, output_mapping_in_TagAlign, output_mapping_in_PAF, output_mapping_in_SAM, output_mapping_in_pairs, low_memory_mode, cell_by_bin, bin_size, depth_cutoff_to_call_peak, peak_min_length, peak_merge_max_length, reference_file_path, index_file_path, read_file1_paths, read_file2_paths, barcode_file_paths, barcode_whitelist_file_path, output_file_path, matrix_output_prefix);
-        chromap_for_mapping.MapPairedEndReads();
-      } else if (output_mapping_in_pairs) {
-        chromap::Chromap<chromap::PairsMapping> chromap_for_mapping(error_threshold, match_score, mismatch_penalty, gap_open_penalties, gap_extension_penalties, min_num_seeds_required_for_mapping, max_seed_frequencies, max_num_best_mappings, max_insert_size, mapq_threshold, num_threads, min_read_length, multi_mapping_allocation_distance, multi_mapping_allocation_seed, drop_repetitive_reads, trim_adapters, remove_pcr_duplicates, is_bulk_data, allocate_multi_mappings, only_output_unique_mappings, Tn5_shift, split_alignment, output_mapping_in_BED, output_mapping_in_TagAlign, output_mapping_in_PAF, output_mapping_in_SAM, output_mapping_in_pairs, low_memory_mode, cell_by_bin, bin_size, depth_cutoff_to_call_peak, peak_min_length, peak_merge_max_length, reference_file_path, index_file_path, read_file1_paths, read_file2_paths, barcode_file_paths, barcode_whitelist_file_path, output_file_path, matrix_output_prefix);
-        chromap_for_mapping.MapPairedEndReads();
+      if (mapping_parameters.output_mapping_in_PAF) {
+        RunMapping<chromap::PairedPAFMapping>(mapping_parameters, std::true_type());
+      } else if (mapping_parameters.output_mapping_in_SAM) {
+        RunMapping<chromap::SAMMapping>(mapping_parameters, std::true_type());
+      } else if (mapping_parameters.output_mapping_in_pairs) {
+        RunMapping<chromap::PairsMapping>(mapping_parameters, std::true_type());
       } else {
-        if (result.count("b") != 0) {
-          chromap::Chromap<chromap::PairedEndMappingWithBarcode> chromap_for_mapping(error_threshold, match_score, mismatch_penalty, gap_open_penalties, gap_extension_penalties, min_num_seeds_required_for_mapping, max_seed_frequencies, max_num_best_mappings, max_insert_size, mapq_threshold, num_threads, min_read_length, multi_mapping_allocation_distance, multi_mapping_allocation_seed, drop_repetitive_reads, trim_adapters, remove_pcr_duplicates, is_bulk_data, allocate_multi_mappings, only_output_unique_mappings, Tn5_shift, split_alignment, output_mapping_in_BED, output_mapping_in_TagAlign, output_mapping_in_PAF, output_mapping_in_SAM, output_mapping_in_pairs, low_memory_mode, cell_by_bin, bin_size, depth_cutoff_to_call_peak, peak_min_length, peak_merge_max_length, reference_file_path, index_file_path, read_file1_paths, read_file2_paths, barcode_file_paths, barcode_whitelist_file_path, output_file_path, matrix_output_prefix);
-          chromap_for_mapping.MapPairedEndReads();
+        if (!mapping_parameters.is_bulk_data && mapping_parameters.output_mapping_in_BED) {
+          // BED output doesn't need the alignment lengths kept in the full
+          // record.
+          if (wide_read_ids) {
+            RunMapping<chromap::WidePairedEndFragmentWithBarcode>(mapping_parameters, std::true_type());
+          } else {
+            RunMapping<chromap::PairedEndFragmentWithBarcode>(mapping_parameters, std::true_type());
+          }
+        } else if (!mapping_parameters.is_bulk_data) {
+          if (wide_read_ids) {
+            RunMapping<chromap::WidePairedEndMappingWithBarcode>(mapping_parameters, std::true_type());
+          } else {
+            RunMapping<chromap::PairedEndMappingWithBarcode>(mapping_parameters, std::true_type());
+          }
         } else {
-          chromap::Chromap<chromap::PairedEndMappingWithoutBarcode> chromap_for_mapping(error_threshold, match_score, mismatch_penalty, gap_open_penalties, gap_extension_penalties, min_num_seeds_required_for_mapping, max_seed_frequencies, max_num_best_mappings, max_insert_size, mapq_threshold, num_threads, min_read_length, multi_mapping_allocation_distance, multi_mapping_allocation_seed, drop_repetitive_reads, trim_adapters, remove_pcr_duplicates, is_bulk_data, allocate_multi_mappings, only_output_unique_mappings, Tn5_shift, split_alignment, output_mapping_in_BED, output_mapping_in_TagAlign, output_mapping_in_PAF, output_mapping_in_SAM, output_mapping_in_pairs, low_memory_mode, cell_by_bin, bin_size, depth_cutoff_to_call_peak, peak_min_length, peak_merge_max_length, reference_file_path, index_file_path, read_file1_paths, read_file2_paths, barcode_file_paths, barcode_whitelist_file_path, output_file_path, matrix_output_prefix);
-          chromap_for_mapping.MapPairedEndReads();
+          if (wide_read_ids) {
+            RunMapping<chromap::WidePairedEndMappingWithoutBarcode>(mapping_parameters, std::true_type());
+          } else {
+            RunMapping<chromap::PairedEndMappingWithoutBarcode>(mapping_parameters, std::true_type());
+          }
         }
       }
     }
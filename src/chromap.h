@@ -1,26 +1,32 @@
 #ifndef CHROMAP_H_
 #define CHROMAP_H_
 
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <string>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <thread>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
+#include "bounded_queue.h"
+#include "duplicate_fragment_set.h"
+#include "duplicate_read_pair_set.h"
 #include "index.h"
 #include "khash.h"
 #include "ksort.h"
+#include "loser_tree.h"
+#include "mapping_buffer.h"
 #include "output_tools.h"
+#include "radix_sort.h"
 #include "sequence_batch.h"
+#include "temp_mapping_file.h"
 
 namespace chromap {
-struct uint128_t {
-  uint64_t first;
-  uint64_t second;
-};
-
 struct StackCell {
   size_t x; // node
   int k, w; // k: level; w: 0 if left child hasn't been processed
@@ -36,13 +42,83 @@ struct _mm_history {
   uint32_t repetitive_seed_length;
 };
 
+// A multi-mapping on reference sequence rid, weighted by the number of
+// uni-mappings it overlaps.
+template <typename MappingRecord>
+struct MultiMapping {
+  uint32_t rid;
+  uint32_t weight;
+  MappingRecord mapping;
+};
+
+// Peaks are called and the feature matrix is output only on the paired-end
+// records with barcodes.
+template <typename MappingRecord>
+struct HasBarcodedFragments : std::false_type {};
+
+template <typename ReadId>
+struct HasBarcodedFragments<BasicPairedEndMappingWithBarcode<ReadId> > : std::true_type {};
+
+template <typename ReadId>
+struct HasBarcodedFragments<BasicPairedEndFragmentWithBarcode<ReadId> > : std::true_type {};
+
+// Append the mapping of a read pair in the layout of MappingRecord. The records
+// with read names, e.g. SAM, are appended from their own fields, so the
+// primary template appends nothing.
+template <typename MappingRecord>
+struct PairedEndMappingAppender {
+  static void Append(uint64_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
+  }
+};
+
+template <typename ReadId>
+struct PairedEndMappingAppender<BasicPairedEndMappingWithoutBarcode<ReadId> > {
+  static void Append(uint64_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, uint32_t reference_sequence_index, MappingBuffer<BasicPairedEndMappingWithoutBarcode<ReadId> > *mappings_on_diff_ref_seqs) {
+    mappings_on_diff_ref_seqs->AppendOn(reference_sequence_index, BasicPairedEndMappingWithoutBarcode<ReadId>{ReadId(read_id), fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups, positive_alignment_length, negative_alignment_length});
+  }
+};
+
+template <typename ReadId>
+struct PairedEndMappingAppender<BasicPairedEndMappingWithBarcode<ReadId> > {
+  static void Append(uint64_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, uint32_t reference_sequence_index, MappingBuffer<BasicPairedEndMappingWithBarcode<ReadId> > *mappings_on_diff_ref_seqs) {
+    mappings_on_diff_ref_seqs->AppendOn(reference_sequence_index, BasicPairedEndMappingWithBarcode<ReadId>{ReadId(read_id), barcode, fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups, positive_alignment_length, negative_alignment_length});
+  }
+};
+
+template <typename ReadId>
+struct PairedEndMappingAppender<BasicPairedEndFragmentWithBarcode<ReadId> > {
+  static void Append(uint64_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, uint32_t reference_sequence_index, MappingBuffer<BasicPairedEndFragmentWithBarcode<ReadId> > *mappings_on_diff_ref_seqs) {
+    mappings_on_diff_ref_seqs->AppendOn(reference_sequence_index, BasicPairedEndFragmentWithBarcode<ReadId>{ReadId(read_id), barcode, fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups});
+  }
+};
+
+// The same for the mapping of a single-end read.
+template <typename MappingRecord>
+struct SingleEndMappingAppender {
+  static void Append(uint64_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs) {
+  }
+};
+
+template <typename ReadId>
+struct SingleEndMappingAppender<BasicMappingWithoutBarcode<ReadId> > {
+  static void Append(uint64_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint32_t reference_sequence_index, MappingBuffer<BasicMappingWithoutBarcode<ReadId> > *mappings_on_diff_ref_seqs) {
+    mappings_on_diff_ref_seqs->AppendOn(reference_sequence_index, BasicMappingWithoutBarcode<ReadId>{ReadId(read_id), fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups});
+  }
+};
+
+template <typename ReadId>
+struct SingleEndMappingAppender<BasicMappingWithBarcode<ReadId> > {
+  static void Append(uint64_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint32_t reference_sequence_index, MappingBuffer<BasicMappingWithBarcode<ReadId> > *mappings_on_diff_ref_seqs) {
+    mappings_on_diff_ref_seqs->AppendOn(reference_sequence_index, BasicMappingWithBarcode<ReadId>{ReadId(read_id), barcode, fragment_start_position, fragment_length, mapq, direction, is_unique, num_dups});
+  }
+};
+
 struct Peak {
   uint32_t start_position;
-  uint16_t length;
+  uint32_t length;
   uint32_t index;
 };
 
-KHASH_MAP_INIT_INT64(k128, uint128_t);
 KHASH_MAP_INIT_INT(k32, uint32_t);
 KHASH_SET_INIT_INT(k32_set);
 KHASH_MAP_INIT_INT64(kmatrix, uint32_t);
@@ -69,14 +145,75 @@ struct SplitMapping {
   }
 };
 
-#define SortMappingWithoutBarcode(m) (((((m).fragment_start_position<<16)|(m).fragment_length)<<8)|(m).mapq)
-//#define SortMappingWithoutBarcode(m) (m)
+// The parameters for read mapping, with their defaults on the command line.
+struct MappingParameters {
+  int error_threshold = 4;
+  int match_score = 1;
+  int mismatch_penalty = 4;
+  std::vector<int> gap_open_penalties = {6, 6};
+  std::vector<int> gap_extension_penalties = {1, 1};
+  int min_num_seeds_required_for_mapping = 2;
+  std::vector<int> max_seed_frequencies = {1000, 5000};
+  int max_num_best_mappings = 1;
+  int max_insert_size = 1000;
+  uint8_t mapq_threshold = 30;
+  int num_threads = 1;
+  int num_prefetched_lanes = 1;
+  int min_read_length = 30;
+  int multi_mapping_allocation_distance = 0;
+  int multi_mapping_allocation_seed = 11;
+  int drop_repetitive_reads = 500000;
+  bool trim_adapters = false;
+  bool remove_pcr_duplicates = false;
+  bool online_dedup = false;
+  bool is_bulk_data = true;
+  bool allocate_multi_mappings = false;
+  bool only_output_unique_mappings = true;
+  bool Tn5_shift = false;
+  bool split_alignment = false;
+  bool output_mapping_in_BED = false;
+  bool output_mapping_in_TagAlign = false;
+  bool output_mapping_in_PAF = false;
+  bool output_mapping_in_SAM = false;
+  bool output_mapping_in_pairs = false;
+  bool low_memory_mode = false;
+  uint64_t mem_budget = (uint64_t)1 << 30;
+  bool unsorted_output = false;
+  bool cell_by_bin = false;
+  int bin_size = 5000;
+  uint16_t depth_cutoff_to_call_peak = 3;
+  int peak_min_length = 30;
+  int peak_merge_max_length = 30;
+  double peak_pvalue_cutoff = 0;
+  int cut_site_smoothing_length = 150;
+  std::vector<int> peak_lambda_windows = {10000};
+  std::string reference_file_path;
+  std::string index_file_path;
+  std::vector<std::string> read_file1_paths;
+  std::vector<std::string> read_file2_paths;
+  std::vector<std::string> barcode_file_paths;
+  std::string barcode_tag;
+  std::string barcode_qual_tag;
+  int barcode_name_field = 0;
+  char barcode_name_delimiter = '_';
+  std::string barcode_whitelist_file_path;
+  std::string mapping_output_file_path;
+  std::string temp_directory_path;
+  std::string matrix_output_prefix;
+};
 
 class ChromapDriver {
  public:
   ChromapDriver() {}
   ~ChromapDriver() {}
   void ParseArgsAndRun(int argc, char *argv[]);
+
+ private:
+  // Map the reads with MappingRecord as the type of the mapping records.
+  template <typename MappingRecord>
+  void RunMapping(const MappingParameters &mapping_parameters, std::true_type is_paired_end);
+  template <typename MappingRecord>
+  void RunMapping(const MappingParameters &mapping_parameters, std::false_type is_paired_end);
 };
 
 template <typename MappingRecord = MappingWithoutBarcode>
@@ -84,15 +221,13 @@ class Chromap {
  public:
   // For index construction
   Chromap(int kmer_size, int window_size, int num_threads, const std::string &reference_file_path, const std::string &index_file_path) : kmer_size_(kmer_size), window_size_(window_size), num_threads_(num_threads), reference_file_path_(reference_file_path), index_file_path_(index_file_path) {
-    barcode_lookup_table_ = NULL;
     barcode_whitelist_lookup_table_ = NULL;
     barcode_histogram_ = NULL;
     barcode_index_table_ = NULL;
   }
 
   // For mapping
-  Chromap(int error_threshold, int match_score, int mismatch_penalty, const std::vector<int> &gap_open_penalties, const std::vector<int> &gap_extension_penalties, int min_num_seeds_required_for_mapping, const std::vector<int> &max_seed_frequencies, int max_num_best_mappings, int max_insert_size, uint8_t mapq_threshold, int num_threads, int min_read_length, int multi_mapping_allocation_distance, int multi_mapping_allocation_seed, int drop_repetitive_reads, bool trim_adapters, bool remove_pcr_duplicates, bool is_bulk_data, bool allocate_multi_mappings, bool only_output_unique_mappings, bool Tn5_shift, bool split_alignment, bool output_mapping_in_BED, bool output_mapping_in_TagAlign, bool output_mapping_in_PAF, bool output_mapping_in_SAM, bool output_mapping_in_pairs, bool low_memory_mode, bool cell_by_bin, int bin_size, uint16_t depth_cutoff_to_call_peak, int peak_min_length, int peak_merge_max_length, const std::string &reference_file_path, const std::string &index_file_path, const std::vector<std::string> &read_file1_paths, const std::vector<std::string> &read_file2_paths, const std::vector<std::string> &barcode_file_paths, const std::string &barcode_whitelist_file_path, const std::string &mapping_output_file_path, const std::string &matrix_output_prefix) : error_threshold_(error_threshold), match_score_(match_score), mismatch_penalty_(mismatch_penalty), gap_open_penalties_(gap_open_penalties), gap_extension_penalties_(gap_extension_penalties), min_num_seeds_required_for_mapping_(min_num_seeds_required_for_mapping), max_seed_frequencies_(max_seed_frequencies), max_num_best_mappings_(max_num_best_mappings), max_insert_size_(max_insert_size), mapq_threshold_(mapq_threshold), num_threads_(num_threads), min_read_length_(min_read_length), multi_mapping_allocation_distance_(multi_mapping_allocation_distance), multi_mapping_allocation_seed_(multi_mapping_allocation_seed), drop_repetitive_reads_(drop_repetitive_reads), trim_adapters_(trim_adapters), remove_pcr_duplicates_(remove_pcr_duplicates), is_bulk_data_(is_bulk_data), allocate_multi_mappings_(allocate_multi_mappings), only_output_unique_mappings_(only_output_unique_mappings), Tn5_shift_(Tn5_shift), split_alignment_(split_alignment), output_mapping_in_BED_(output_mapping_in_BED), output_mapping_in_TagAlign_(output_mapping_in_TagAlign), output_mapping_in_PAF_(output_mapping_in_PAF), output_mapping_in_SAM_(output_mapping_in_SAM), output_mapping_in_pairs_(output_mapping_in_pairs), low_memory_mode_(low_memory_mode), cell_by_bin_(cell_by_bin), bin_size_(bin_size), depth_cutoff_to_call_peak_(depth_cutoff_to_call_peak), peak_min_length_(peak_min_length), peak_merge_max_length_(peak_merge_max_length), reference_file_path_(reference_file_path), index_file_path_(index_file_path), read_file1_paths_(read_file1_paths), read_file2_paths_(read_file2_paths), barcode_file_paths_(barcode_file_paths), barcode_whitelist_file_path_(barcode_whitelist_file_path), mapping_output_file_path_(mapping_output_file_path), matrix_output_prefix_(matrix_output_prefix) {
-    barcode_lookup_table_ = kh_init(k32);
+  Chromap(const MappingParameters &mapping_parameters) : error_threshold_(mapping_parameters.error_threshold), match_score_(mapping_parameters.match_score), mismatch_penalty_(mapping_parameters.mismatch_penalty), gap_open_penalties_(mapping_parameters.gap_open_penalties), gap_extension_penalties_(mapping_parameters.gap_extension_penalties), min_num_seeds_required_for_mapping_(mapping_parameters.min_num_seeds_required_for_mapping), max_seed_frequencies_(mapping_parameters.max_seed_frequencies), max_num_best_mappings_(mapping_parameters.max_num_best_mappings), max_insert_size_(mapping_parameters.max_insert_size), mapq_threshold_(mapping_parameters.mapq_threshold), num_threads_(mapping_parameters.num_threads), num_prefetched_lanes_(mapping_parameters.num_prefetched_lanes), min_read_length_(mapping_parameters.min_read_length), multi_mapping_allocation_distance_(mapping_parameters.multi_mapping_allocation_distance), multi_mapping_allocation_seed_(mapping_parameters.multi_mapping_allocation_seed), drop_repetitive_reads_(mapping_parameters.drop_repetitive_reads), trim_adapters_(mapping_parameters.trim_adapters), remove_pcr_duplicates_(mapping_parameters.remove_pcr_duplicates), online_dedup_(mapping_parameters.online_dedup), is_bulk_data_(mapping_parameters.is_bulk_data), allocate_multi_mappings_(mapping_parameters.allocate_multi_mappings), only_output_unique_mappings_(mapping_parameters.only_output_unique_mappings), Tn5_shift_(mapping_parameters.Tn5_shift), split_alignment_(mapping_parameters.split_alignment), output_mapping_in_BED_(mapping_parameters.output_mapping_in_BED), output_mapping_in_TagAlign_(mapping_parameters.output_mapping_in_TagAlign), output_mapping_in_PAF_(mapping_parameters.output_mapping_in_PAF), output_mapping_in_SAM_(mapping_parameters.output_mapping_in_SAM), output_mapping_in_pairs_(mapping_parameters.output_mapping_in_pairs), low_memory_mode_(mapping_parameters.low_memory_mode), mem_budget_(mapping_parameters.mem_budget), unsorted_output_(mapping_parameters.unsorted_output), cell_by_bin_(mapping_parameters.cell_by_bin), bin_size_(mapping_parameters.bin_size), depth_cutoff_to_call_peak_(mapping_parameters.depth_cutoff_to_call_peak), peak_min_length_(mapping_parameters.peak_min_length), peak_merge_max_length_(mapping_parameters.peak_merge_max_length), peak_pvalue_cutoff_(mapping_parameters.peak_pvalue_cutoff), cut_site_smoothing_length_(mapping_parameters.cut_site_smoothing_length), peak_lambda_windows_(mapping_parameters.peak_lambda_windows), reference_file_path_(mapping_parameters.reference_file_path), index_file_path_(mapping_parameters.index_file_path), read_file1_paths_(mapping_parameters.read_file1_paths), read_file2_paths_(mapping_parameters.read_file2_paths), barcode_file_paths_(mapping_parameters.barcode_file_paths), barcode_tag_(mapping_parameters.barcode_tag), barcode_qual_tag_(mapping_parameters.barcode_qual_tag), barcode_name_field_(mapping_parameters.barcode_name_field), barcode_name_delimiter_(mapping_parameters.barcode_name_delimiter), barcode_whitelist_file_path_(mapping_parameters.barcode_whitelist_file_path), mapping_output_file_path_(mapping_parameters.mapping_output_file_path), temp_directory_path_(mapping_parameters.temp_directory_path), matrix_output_prefix_(mapping_parameters.matrix_output_prefix) {
     barcode_whitelist_lookup_table_ = kh_init(k32);
     barcode_histogram_ = kh_init(k32);
     barcode_index_table_ = kh_init(k32);
@@ -114,50 +249,43 @@ class Chromap {
     if (barcode_index_table_ != NULL) {
       kh_destroy(k32, barcode_index_table_);
     }
-    if (barcode_lookup_table_ != NULL) {
-      kh_destroy(k32, barcode_lookup_table_);
-    }
-    if (read_lookup_tables_.size() > 0) {
-      for (uint32_t i = 0; i < read_lookup_tables_.size(); ++i) {
-        kh_destroy(k128, read_lookup_tables_[i]);
-      }
-    }
   }
 
-  KRADIX_SORT_INIT(without_barcode, MappingWithoutBarcode, SortMappingWithoutBarcode, 11);
-  KRADIX_SORT_INIT(with_barcode, MappingWithBarcode, SortMappingWithoutBarcode, 15);
-
   // For paired-end read mapping
   void MapPairedEndReads();
   uint32_t LoadPairedEndReadsWithBarcodes(SequenceBatch *read_batch1, SequenceBatch *read_batch2, SequenceBatch *barcode_batch);
+  inline bool BarcodesAreInReadNames() const {
+    return !barcode_tag_.empty() || barcode_name_field_ != 0;
+  }
+  void SaveBarcodeInReadNameAt(uint32_t read_index, const SequenceBatch &read_batch, SequenceBatch *barcode_batch);
   void TrimAdapterForPairedEndRead(uint32_t pair_index, SequenceBatch *read_batch1, SequenceBatch *read_batch2);
-  bool PairedEndReadWithBarcodeIsDuplicate(uint32_t pair_index, const SequenceBatch &barcode_batch, const SequenceBatch &read_batch1, const SequenceBatch &read_batch2);
+  bool PairedEndReadWithBarcodeIsDuplicate(uint32_t pair_index, const SequenceBatch &barcode_batch, const SequenceBatch &read_batch1, const SequenceBatch &read_batch2, uint64_t *read_pair_hash);
   void ReduceCandidatesForPairedEndReadOnOneDirection(const std::vector<Candidate> &candidates1, const std::vector<Candidate> &candidates2, std::vector<Candidate> *filtered_candidates1, std::vector<Candidate> *filtered_candidates2);
   void ReduceCandidatesForPairedEndRead(const std::vector<Candidate> &positive_candidates1, const std::vector<Candidate> &negative_candidates1, const std::vector<Candidate> &positive_candidates2, const std::vector<Candidate> &negative_candidates2, std::vector<Candidate> *filtered_positive_candidates1, std::vector<Candidate> *filtered_negative_candidates1, std::vector<Candidate> *filtered_positive_candidates2, std::vector<Candidate> *filtered_negative_candidates2);
   void GenerateBestMappingsForPairedEndReadOnOneDirection(Direction first_read_direction, uint32_t pair_index, int num_candidates1, int min_num_errors1, int num_best_mappings1, int second_min_num_errors1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<std::pair<int, uint64_t> > &mappings1, int num_candidates2, int min_num_errors2, int num_best_mappings2, int second_min_num_errors2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const SequenceBatch &reference, const std::vector<std::pair<int, uint64_t> > &mappings2, std::vector<std::pair<uint32_t, uint32_t> > *best_mappings, int *min_sum_errors, int *num_best_mappings, int *second_min_sum_errors, int *num_second_best_mappings);
   void RecalibrateBestMappingsForPairedEndReadOnOneDirection(Direction first_read_direction, uint32_t pair_index, int min_sum_errors, int second_min_sum_errors, int min_num_errors1, int num_best_mappings1, int second_min_num_errors1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<std::pair<int, uint64_t> > &mappings1, int min_num_errors2, int num_best_mappings2, int second_min_num_errors2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const SequenceBatch &reference, const std::vector<std::pair<int, uint64_t> > &mappings2, const std::vector<std::pair<uint32_t, uint32_t> > &edit_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *best_mappings, int *best_alignment_score, int *num_best_mappings, int *second_best_alignment_score, int *num_second_best_mappings);
-  void ProcessBestMappingsForPairedEndReadOnOneDirection(Direction first_read_direction, Direction second_read_direction, uint32_t pair_index, uint8_t mapq, int num_candidates1, uint32_t repetitive_seed_length1, int min_num_errors1, int num_best_mappings1, int second_min_num_errors1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<std::pair<int, uint64_t> > &mappings1, const std::vector<SplitMapping> &split_mappings1, int num_candidates2, uint32_t repetitive_seed_length2, int min_num_errors2, int num_best_mappings2, int second_min_num_errors2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<int> &best_mapping_indices, const std::vector<std::pair<int, uint64_t> > &mappings2, const std::vector<SplitMapping> &split_mappings2, const std::vector<std::pair<uint32_t, uint32_t> > &best_mappings, int min_sum_errors, int num_best_mappings, int second_min_sum_errors, int num_second_best_mappings, int *best_mapping_index, int *num_best_mappings_reported, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs);
-  void GenerateBestMappingsForPairedEndRead(uint32_t pair_index, int num_positive_candidates1, int num_negative_candidates1, uint32_t repetitive_seed_length1, int min_num_errors1, int num_best_mappings1, int second_min_num_errors1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<std::pair<int, uint64_t> > &positive_mappings1, const std::vector<SplitMapping> &positive_split_mappings1, const std::vector<std::pair<int, uint64_t> > &negative_mappings1, const std::vector<SplitMapping> &negative_split_mappings1, int num_positive_candidates2, int num_negative_candidates2, uint32_t repetitive_seed_length2, int min_num_errors2, int num_best_mappings2, int second_min_num_errors2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<std::pair<int, uint64_t> > &positive_mappings2, const std::vector<SplitMapping> &positive_split_mappings2, const std::vector<std::pair<int, uint64_t> > &negative_mappings2, const std::vector<SplitMapping> &negative_split_mappings2, std::vector<int> *best_mapping_indices, std::mt19937 *generator, std::vector<std::pair<uint32_t, uint32_t> > *F1R2_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *F2R1_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *F1F2_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *R1R2_best_mappings, int *min_sum_errors, int *num_best_mappings, int *second_min_sum_errors, int *num_second_best_mappings, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs);
-  void EmplaceBackMappingRecord(uint32_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, std::vector<MappingRecord> *mappings_on_diff_ref_seqs);
-  void EmplaceBackMappingRecord(uint32_t read_id, const char *read1_name, const char *read2_name, uint16_t read1_length, uint16_t read2_length, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq1, uint8_t mapq2, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, std::vector<MappingRecord> *mappings_on_diff_ref_seqs);
-  void EmplaceBackMappingRecord(uint32_t read_id, const char *read_name, uint32_t cell_barcode, int rid1, int rid2, uint32_t pos1, uint32_t pos2, int direction1, int direction2, uint8_t mapq, uint8_t is_unique, uint8_t num_dups, std::vector<MappingRecord> *mappings_on_diff_ref_seqs);
+  void ProcessBestMappingsForPairedEndReadOnOneDirection(Direction first_read_direction, Direction second_read_direction, uint32_t pair_index, uint8_t mapq, int num_candidates1, uint32_t repetitive_seed_length1, int min_num_errors1, int num_best_mappings1, int second_min_num_errors1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<std::pair<int, uint64_t> > &mappings1, const std::vector<SplitMapping> &split_mappings1, int num_candidates2, uint32_t repetitive_seed_length2, int min_num_errors2, int num_best_mappings2, int second_min_num_errors2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<int> &best_mapping_indices, const std::vector<std::pair<int, uint64_t> > &mappings2, const std::vector<SplitMapping> &split_mappings2, const std::vector<std::pair<uint32_t, uint32_t> > &best_mappings, int min_sum_errors, int num_best_mappings, int second_min_sum_errors, int num_second_best_mappings, int *best_mapping_index, int *num_best_mappings_reported, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
+  void GenerateBestMappingsForPairedEndRead(uint32_t pair_index, int num_positive_candidates1, int num_negative_candidates1, uint32_t repetitive_seed_length1, int min_num_errors1, int num_best_mappings1, int second_min_num_errors1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<std::pair<int, uint64_t> > &positive_mappings1, const std::vector<SplitMapping> &positive_split_mappings1, const std::vector<std::pair<int, uint64_t> > &negative_mappings1, const std::vector<SplitMapping> &negative_split_mappings1, int num_positive_candidates2, int num_negative_candidates2, uint32_t repetitive_seed_length2, int min_num_errors2, int num_best_mappings2, int second_min_num_errors2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<std::pair<int, uint64_t> > &positive_mappings2, const std::vector<SplitMapping> &positive_split_mappings2, const std::vector<std::pair<int, uint64_t> > &negative_mappings2, const std::vector<SplitMapping> &negative_split_mappings2, std::vector<int> *best_mapping_indices, std::mt19937 *generator, std::vector<std::pair<uint32_t, uint32_t> > *F1R2_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *F2R1_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *F1F2_best_mappings, std::vector<std::pair<uint32_t, uint32_t> > *R1R2_best_mappings, int *min_sum_errors, int *num_best_mappings, int *second_min_sum_errors, int *num_second_best_mappings, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
+  void EmplaceBackMappingRecord(uint64_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
+  void EmplaceBackMappingRecord(uint64_t read_id, const char *read1_name, const char *read2_name, uint16_t read1_length, uint16_t read2_length, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq1, uint8_t mapq2, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint16_t positive_alignment_length, uint16_t negative_alignment_length, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
+  void EmplaceBackMappingRecord(uint64_t read_id, const char *read_name, uint32_t cell_barcode, int rid1, int rid2, uint32_t pos1, uint32_t pos2, int direction1, int direction2, uint8_t mapq, uint8_t is_unique, uint8_t num_dups, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
   void ApplyTn5ShiftOnPairedEndMapping(uint32_t num_reference_sequences, std::vector<std::vector<MappingRecord> > *mappings);
 
   // For single-end read mapping
   void MapSingleEndReads();
-  void GenerateBestMappingsForSingleEndRead(int num_positive_candidates, int num_negative_candidates, uint32_t repetitive_seed_length, int min_num_errors, int num_best_mappings, int second_min_num_errors, int num_second_best_mappings, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<std::pair<int, uint64_t> > &positive_mappings, const std::vector<SplitMapping> &positive_split_mappings, const std::vector<std::pair<int, uint64_t> > &negative_mappings, const std::vector<SplitMapping> &negative_split_mappings, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs);
-  void ProcessBestMappingsForSingleEndRead(Direction mapping_direction, uint8_t mapq, int num_candidates, uint32_t repetitive_seed_length, int min_num_errors, int num_best_mappings, int second_min_num_errors, int num_second_best_mappings, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<int> &best_mapping_indices, const std::vector<std::pair<int, uint64_t> > &mappings, const std::vector<SplitMapping> &split_mappings, int *best_mapping_index, int *num_best_mappings_reported, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs);
-  void EmplaceBackMappingRecord(uint32_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, std::vector<MappingRecord> *mappings_on_diff_ref_seqs);
-  void EmplaceBackMappingRecord(uint32_t read_id, const char* read_name, uint16_t read_length, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, std::vector<MappingRecord> *mappings_on_diff_ref_seqs);
-  void EmplaceBackMappingRecord(uint32_t read_id, const char *read_name, uint8_t num_dups, int64_t position, int rid, int flag, uint8_t direction, uint8_t is_unique, uint8_t mapq, uint32_t NM, int n_cigar, uint32_t *cigar, std::string &MD_tag, std::vector<MappingRecord> *mappings_on_diff_ref_seqs);
+  void GenerateBestMappingsForSingleEndRead(int num_positive_candidates, int num_negative_candidates, uint32_t repetitive_seed_length, int min_num_errors, int num_best_mappings, int second_min_num_errors, int num_second_best_mappings, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<std::pair<int, uint64_t> > &positive_mappings, const std::vector<SplitMapping> &positive_split_mappings, const std::vector<std::pair<int, uint64_t> > &negative_mappings, const std::vector<SplitMapping> &negative_split_mappings, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
+  void ProcessBestMappingsForSingleEndRead(Direction mapping_direction, uint8_t mapq, int num_candidates, uint32_t repetitive_seed_length, int min_num_errors, int num_best_mappings, int second_min_num_errors, int num_second_best_mappings, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<int> &best_mapping_indices, const std::vector<std::pair<int, uint64_t> > &mappings, const std::vector<SplitMapping> &split_mappings, int *best_mapping_index, int *num_best_mappings_reported, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
+  void EmplaceBackMappingRecord(uint64_t read_id, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
+  void EmplaceBackMappingRecord(uint64_t read_id, const char* read_name, uint16_t read_length, uint32_t barcode, uint32_t fragment_start_position, uint16_t fragment_length, uint8_t mapq, uint8_t direction, uint8_t is_unique, uint8_t num_dups, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
+  void EmplaceBackMappingRecord(uint64_t read_id, const char *read_name, uint8_t num_dups, int64_t position, int rid, int flag, uint8_t direction, uint8_t is_unique, uint8_t mapq, uint32_t NM, int n_cigar, uint32_t *cigar, std::string &MD_tag, uint32_t reference_sequence_index, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
   void ApplyTn5ShiftOnSingleEndMapping(uint32_t num_reference_sequences, std::vector<std::vector<MappingRecord> > *mappings);
   uint32_t LoadSingleEndReadsWithBarcodes(SequenceBatch *read_batch, SequenceBatch *barcode_batch);
 
   // For split alignment
   void VerifyCandidatesWithDropOffOnOneDirection(Direction candidate_direction, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const std::vector<Candidate> &candidates, std::vector<SplitMapping> *mappings, int *best_mapping_score, int *num_best_mappings, int *second_best_mapping_score, int *num_second_best_mappings);
-  void GenerateBestSplitMappingsForPairedEndRead(uint32_t pair_index, int num_positive_candidates1, int num_negative_candidates1, uint32_t repetitive_seed_length1, int best_mapping_score1, int num_best_mappings1, int second_best_mapping_score1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<SplitMapping> &positive_mappings1, const std::vector<SplitMapping> &negative_mappings1, int num_positive_candidates2, int num_negative_candidates2, uint32_t repetitive_seed_length2, int best_mapping_score2, int num_best_mappings2, int second_best_mapping_score2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const std::vector<SplitMapping> &positive_mappings2, const std::vector<SplitMapping> &negative_mappings2, const SequenceBatch &reference, const SequenceBatch &barcode_batch, std::vector<int> *best_mapping_indices, std::mt19937 *generator, int *best_mapping_score, int *num_best_mappings, int *second_best_mapping_score, int *num_second_best_mappings, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs);
-  void GenerateBestSplitMappingsForPairedEndReadOnOneMate(uint32_t pair_index, int num_positive_candidates, int num_negative_candidates, uint32_t repetitive_seed_length, int best_mapping_score, int num_best_mappings, int second_best_mapping_score, int num_second_best_mappings, const SequenceBatch &read_batch, const std::vector<SplitMapping> &positive_mappings, const std::vector<SplitMapping> &negative_mappings, const SequenceBatch &reference, const SequenceBatch &barcode_batch, std::vector<int> *best_mapping_indices, std::mt19937 *generator, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs);
-  void ProcessBestSplitMappingsForSingleEndRead(Direction mapping_direction, uint8_t mapq, int num_candidates, uint32_t repetitive_seed_length, int max_mapping_score, int num_best_mappings, int second_max_mapping_score, int num_second_best_mappings, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<int> &best_mapping_indices, const std::vector<SplitMapping> &mappings, int *best_mapping_index, int *num_best_mappings_reported, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs);
+  void GenerateBestSplitMappingsForPairedEndRead(uint32_t pair_index, int num_positive_candidates1, int num_negative_candidates1, uint32_t repetitive_seed_length1, int best_mapping_score1, int num_best_mappings1, int second_best_mapping_score1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<SplitMapping> &positive_mappings1, const std::vector<SplitMapping> &negative_mappings1, int num_positive_candidates2, int num_negative_candidates2, uint32_t repetitive_seed_length2, int best_mapping_score2, int num_best_mappings2, int second_best_mapping_score2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const std::vector<SplitMapping> &positive_mappings2, const std::vector<SplitMapping> &negative_mappings2, const SequenceBatch &reference, const SequenceBatch &barcode_batch, std::vector<int> *best_mapping_indices, std::mt19937 *generator, int *best_mapping_score, int *num_best_mappings, int *second_best_mapping_score, int *num_second_best_mappings, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
+  void GenerateBestSplitMappingsForPairedEndReadOnOneMate(uint32_t pair_index, int num_positive_candidates, int num_negative_candidates, uint32_t repetitive_seed_length, int best_mapping_score, int num_best_mappings, int second_best_mapping_score, int num_second_best_mappings, const SequenceBatch &read_batch, const std::vector<SplitMapping> &positive_mappings, const std::vector<SplitMapping> &negative_mappings, const SequenceBatch &reference, const SequenceBatch &barcode_batch, std::vector<int> *best_mapping_indices, std::mt19937 *generator, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
+  void ProcessBestSplitMappingsForSingleEndRead(Direction mapping_direction, uint8_t mapq, int num_candidates, uint32_t repetitive_seed_length, int max_mapping_score, int num_best_mappings, int second_max_mapping_score, int num_second_best_mappings, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const SequenceBatch &barcode_batch, const std::vector<int> &best_mapping_indices, const std::vector<SplitMapping> &mappings, int *best_mapping_index, int *num_best_mappings_reported, MappingBuffer<MappingRecord> *mappings_on_diff_ref_seqs);
   void FixSplitMappingRightEnd(const char *pattern, const char *text, const int read_length, SplitMapping *mapping);
   void FixSplitMappingLeftEnd(const char *pattern, const char *text, const int read_length, SplitMapping *mapping);
   int GenerateCigarUsingEditDistance(const char *pattern, const char *text, int read_length, int mapping_edit_distance, int mapping_end_position, std::vector<uint32_t> &cigar);
@@ -165,37 +293,76 @@ class Chromap {
   // Supportive functions
   void ConstructIndex();
   int BandedAlignPatternToText(const char *pattern, const char *text, const int read_length, int *mapping_end_location);
+  int CountMismatchesOnDiagonal(const char *pattern, const char *text, const int read_length, const int max_num_mismatches);
   int BandedAlignPatternToTextWithDropOff(const char *pattern, const char *text, const int read_length, SplitMapping *mapping);
   int BandedAlignPatternToTextWithDropOffFrom3End(const char *pattern, const char *text, const int read_length, SplitMapping *mapping);
   void BandedAlign4PatternsToText(const char **patterns, const char *text, int read_length, int32_t *mapping_edit_distances, int32_t *mapping_end_positions);
   void BandedAlign8PatternsToText(const char **patterns, const char *text, int read_length, int16_t *mapping_edit_distances, int16_t *mapping_end_positions);
+  void InitializeBandedAlignKernels();
+  template <int kErrorThreshold> void SetBandedAlignKernels();
+  template <int kErrorThreshold, int kReadLength> int BandedAlignPatternToTextKernel(const char *pattern, const char *text, const int read_length, int *mapping_end_position);
+  template <int kErrorThreshold, int kReadLength> void BandedAlign8PatternsToTextKernel(const char **patterns, const char *text, int read_length, int16_t *mapping_edit_distances, int16_t *mapping_end_positions);
+  inline static int GetBandedAlignReadLengthClass(int read_length) {
+    switch (read_length) {
+      case 50:
+        return 1;
+      case 75:
+        return 2;
+      case 100:
+        return 3;
+      case 150:
+        return 4;
+      default:
+        return 0;
+    }
+  }
   void BandedTraceback(int min_num_errors, const char *pattern, const char *text, const int read_length, int *mapping_start_position);
   void BandedTracebackToEnd(int min_num_errors, const char *pattern, const char *text, const int read_length, int *mapping_end_position);
+  template <int kErrorThreshold, int kReadLength> void BandedTracebackKernel(int min_num_errors, const char *pattern, const char *text, const int read_length, int *mapping_start_position);
+  template <int kErrorThreshold, int kReadLength> void BandedTracebackToEndKernel(int min_num_errors, const char *pattern, const char *text, const int read_length, int *mapping_end_position);
   void MergeCandidates(std::vector<Candidate> &c1, std::vector<Candidate> &c2, std::vector<Candidate> &buffer);
   void SupplementCandidates(const Index &index, uint32_t repetitive_seed_length1, uint32_t repetitive_seed_length2, std::vector<std::pair<uint64_t, uint64_t> > &minimizers1, std::vector<std::pair<uint64_t, uint64_t> > &minimizers2, std::vector<uint64_t> &positive_hits1, std::vector<uint64_t> &positive_hits2, std::vector<Candidate> &positive_candidates1, std::vector<Candidate> &positive_candidates2, std::vector<Candidate> &positive_candidates1_buffer, std::vector<Candidate> &positive_candidates2_buffer, std::vector<uint64_t> &negative_hits1, std::vector<uint64_t> &negative_hits2, std::vector<Candidate> &negative_candidates1, std::vector<Candidate> &negative_candidates2, std::vector<Candidate> &negative_candidates1_buffer, std::vector<Candidate> &negative_candidates2_buffer);
   void PostProcessingInLowMemory(uint32_t num_mappings_in_mem, uint32_t num_reference_sequences, const SequenceBatch &reference);
+  void WaitForOutputTurn(int chunk_index, std::mutex *chunk_mutex, std::condition_variable *output_turn_condition, const int *next_chunk_to_output);
+  void OutputDedupedMappingsInBuffer(const SequenceBatch &reference, std::vector<MappingRecord> *deduped_mappings, std::vector<std::pair<uint32_t, size_t> > *deduped_mapping_ends);
   void VerifyCandidatesOnOneDirectionUsingSIMD(Direction candidate_direction, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const std::vector<Candidate> &candidates, std::vector<std::pair<int, uint64_t> > *mappings, int *min_num_errors, int *num_best_mappings, int *second_min_num_errors, int *num_second_best_mappings);
   void VerifyCandidatesOnOneDirection(Direction candidate_direction, const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const std::vector<Candidate> &candidates, std::vector<std::pair<int, uint64_t> > *mappings, std::vector<SplitMapping> *split_mappings, int *min_num_errors, int *num_best_mappings, int *second_min_num_errors, int *num_second_best_mappings);
   void VerifyCandidates(const SequenceBatch &read_batch, uint32_t read_index, const SequenceBatch &reference, const std::vector<std::pair<uint64_t, uint64_t> > &minimizers, const std::vector<Candidate> &positive_candidates, const std::vector<Candidate> &negative_candidates, std::vector<std::pair<int, uint64_t> > *positive_mappings, std::vector<SplitMapping> *positive_split_mappings, std::vector<std::pair<int, uint64_t> > *negative_mappings, std::vector<SplitMapping> *negative_split_mappings, int *min_num_errors, int *num_best_mappings, int *second_min_num_errors, int *num_second_best_mappings);
   void GenerateMDTag(const char *pattern, const char *text, int mapping_start_position, int n_cigar, const uint32_t *cigar, int &NM, std::string &MD_tag);
   void AllocateMultiMappings(uint32_t num_reference_sequences);
   void RemovePCRDuplicate(uint32_t num_reference_sequences);
-  uint32_t MoveMappingsInBuffersToMappingContainer(uint32_t num_reference_sequences, std::vector<std::vector<std::vector<MappingRecord> > > *mappings_on_diff_ref_seqs_for_diff_threads_for_saving);
+  uint32_t MoveMappingsInBuffersToMappingContainer(uint32_t num_reference_sequences, std::vector<MappingBuffer<MappingRecord> > *mapping_buffers, int num_moving_threads);
+  uint32_t OutputMappingsInBuffers(uint32_t num_reference_sequences, const SequenceBatch &reference, std::vector<MappingBuffer<MappingRecord> > *mapping_buffers);
   void OutputBarcodeStatistics();
   void OutputMappingStatistics();
+  void OutputMappingMemoryUsage(uint32_t num_reference_sequences, const std::vector<std::vector<MappingRecord> > &mappings);
+  // Only the records with the full layout keep the alignment lengths TagAlign
+  // output needs.
+  std::unique_ptr<OutputTools<MappingRecord> > NewPairedTagAlignOutputTools(std::true_type has_full_layout);
+  std::unique_ptr<OutputTools<MappingRecord> > NewPairedTagAlignOutputTools(std::false_type has_full_layout);
   void OutputMappingStatistics(uint32_t num_reference_sequences, const std::vector<std::vector<MappingRecord> > &uni_mappings, const std::vector<std::vector<MappingRecord> > &multi_mappings);
   uint8_t GetMAPQForSingleEndRead(int error_threshold, int num_candidates, uint32_t repetitive_seed_length, uint16_t alignment_length, int min_num_errors, int num_best_mappings, int second_min_num_errors, int num_second_best_mappings);
   uint8_t GetMAPQForPairedEndRead(int num_positive_candidates, int num_negative_candidates, uint32_t repetitive_seed_length1, uint32_t repetitive_seed_length2, uint16_t positive_alignment_length, uint16_t negative_alignment_length, int min_sum_errors, int num_best_mappings, int second_min_sum_errors, int num_second_best_mappings, int min_num_errors1, int min_num_errors2, int num_best_mappings1, int num_best_mappings2, int second_min_num_errors1, int second_min_num_errors2, int num_second_best_mappings1, int num_second_best_mappings2, uint8_t &mapq1, uint8_t &mapq2);
-  void SortOutputMappings(uint32_t num_reference_sequences, std::vector<std::vector<MappingRecord> > *mappings);
-  void BuildAugmentedTree(uint32_t ref_id);
-  uint32_t GetNumOverlappedMappings(uint32_t ref_id, const MappingRecord &mapping);
+  std::vector<uint32_t> GetReferenceSequenceIndicesByNumMappings(uint32_t num_reference_sequences, const std::vector<std::vector<MappingRecord> > &mappings);
+  void SortMappingsInParallel(int num_sorting_threads, std::vector<MappingRecord> *mappings);
+  void SortOutputMappings(uint32_t num_reference_sequences, std::vector<std::vector<MappingRecord> > *mappings, int num_sorting_threads);
+  uint64_t GetMultiMappingAllocationRandomNumber(uint64_t read_id) const;
+  void WeighMultiMappings(const std::vector<MappingRecord> &uni_mappings, std::vector<MultiMapping<MappingRecord> > *multi_mappings);
   void LoadBarcodeWhitelist();
   void ComputeBarcodeAbundance(uint64_t max_num_sample_barcodes);
   void UpdateBarcodeAbundance(uint32_t num_loaded_barcodes, const SequenceBatch &barcode_batch);
   void CorrectBarcodeAt(uint32_t barcode_index, SequenceBatch *barcode_batch, uint64_t *num_barcode_in_whitelist, uint64_t *num_corrected_barcode);
   uint32_t CallPeaks(uint16_t coverage_threshold, uint32_t num_reference_sequences, const SequenceBatch &reference);
   void OutputFeatureMatrix(uint32_t num_sequences, const SequenceBatch &reference);
-  void GetNumOverlappedBins(uint32_t rid, uint32_t start_position, uint16_t mapping_length, uint32_t num_sequences, const SequenceBatch &reference, std::vector<uint32_t> &overlapped_peak_indices);
+  // Shared by the paired-end record types with barcodes.
+  uint32_t CallPeaksOnBarcodedFragments(uint16_t coverage_threshold, uint32_t num_reference_sequences, const SequenceBatch &reference, std::false_type has_barcoded_fragments);
+  uint32_t CallPeaksOnBarcodedFragments(uint16_t coverage_threshold, uint32_t num_reference_sequences, const SequenceBatch &reference, std::true_type has_barcoded_fragments);
+  void CallPeaksOnReferenceSequence(uint16_t coverage_threshold, uint32_t reference_sequence_length, const std::vector<MappingRecord> &mappings, std::vector<Peak> *peaks);
+  void CallPeaksOnCutSites(double genome_background_lambda, uint32_t reference_sequence_length, const std::vector<MappingRecord> &mappings, std::vector<Peak> *peaks);
+  void MergePeaks(std::vector<Peak> *peaks);
+  void OutputFeatureMatrixOfBarcodedFragments(uint32_t num_sequences, const SequenceBatch &reference, std::false_type has_barcoded_fragments);
+  void OutputFeatureMatrixOfBarcodedFragments(uint32_t num_sequences, const SequenceBatch &reference, std::true_type has_barcoded_fragments);
+  void GetNumOverlappedBins(uint32_t rid, uint32_t start_position, uint16_t mapping_length, std::vector<uint32_t> &overlapped_peak_indices);
   uint32_t GetNumOverlappedPeaks(uint32_t ref_id, const MappingRecord &mapping, std::vector<uint32_t> &overlapped_peak_indices);
   void BuildAugmentedTreeForPeaks(uint32_t ref_id);
   void OutputMappingsInVector(uint8_t mapq_threshold, uint32_t num_reference_sequences, const SequenceBatch &reference, const std::vector<std::vector<MappingRecord> > &mappings);
@@ -204,6 +371,11 @@ class Chromap {
   void GetRefStartEndPositionForReadFromMapping(Direction mapping_direction, const std::pair<int, uint64_t> &mapping, const char *read, int read_length, const SplitMapping &split_mapping, const SequenceBatch &reference, uint32_t *ref_start_position, uint32_t *ref_end_position, int *n_cigar, uint32_t **cigar, int *NM, std::string &MD_TAG);
   void GenerateBestSplitMappingsForPairedEndReadOnOneDirection(Direction first_read_direction, uint32_t pair_index, int num_candidates1, int min_num_errors1, int num_best_mappings1, int second_min_num_errors1, int num_second_best_mappings1, const SequenceBatch &read_batch1, const std::vector<SplitMapping> &mappings1, int num_candidates2, int min_num_errors2, int num_best_mappings2, int second_min_num_errors2, int num_second_best_mappings2, const SequenceBatch &read_batch2, const SequenceBatch &reference, const std::vector<SplitMapping> &mappings2, std::vector<std::pair<uint32_t, uint32_t> > *best_mappings, int *min_sum_errors, int *num_best_mappings, int *second_min_sum_errors, int *num_second_best_mappings);
 
+  // The read files of all the streams, and the lanes prefetched after them, are
+  // open at the same time, so they share the threads for BGZF decompression.
+  inline int GetNumInflateThreadsPerReadFile(int num_read_streams) const {
+    return std::max(1, num_threads_ / (num_read_streams * (1 + num_prefetched_lanes_)));
+  }
   inline static double GetRealTime() {
     struct timeval tp;
     struct timezone tzp;
@@ -215,6 +387,9 @@ class Chromap {
     getrusage(RUSAGE_SELF, &r);
     return r.ru_utime.tv_sec + r.ru_stime.tv_sec + 1e-6 * (r.ru_utime.tv_usec + r.ru_stime.tv_usec);
   }
+  // -log10 of the probability that a Poisson variable with mean lambda is at
+  // least observation.
+  static double GetPoissonUpperTailScore(uint64_t observation, double lambda);
   inline static void ExitWithMessage(const std::string &message) {
     std::cerr << message << std::endl;
     exit(-1);
@@ -226,6 +401,12 @@ class Chromap {
   int window_size_;
   int error_threshold_;
   int NUM_VPU_LANES_;
+  // Banded alignment kernels indexed by read length class (0: any length, 1: 50bp, 2: 75bp, 3: 100bp, 4: 150bp).
+  static const int NUM_BANDED_ALIGN_READ_LENGTH_CLASSES = 5;
+  int (Chromap::*banded_align_pattern_to_text_kernels_[NUM_BANDED_ALIGN_READ_LENGTH_CLASSES])(const char *pattern, const char *text, const int read_length, int *mapping_end_position);
+  void (Chromap::*banded_align_8_patterns_to_text_kernels_[NUM_BANDED_ALIGN_READ_LENGTH_CLASSES])(const char **patterns, const char *text, int read_length, int16_t *mapping_edit_distances, int16_t *mapping_end_positions);
+  void (Chromap::*banded_traceback_kernels_[NUM_BANDED_ALIGN_READ_LENGTH_CLASSES])(int min_num_errors, const char *pattern, const char *text, const int read_length, int *mapping_start_position);
+  void (Chromap::*banded_traceback_to_end_kernels_[NUM_BANDED_ALIGN_READ_LENGTH_CLASSES])(int min_num_errors, const char *pattern, const char *text, const int read_length, int *mapping_end_position);
   int match_score_;
   int mismatch_penalty_;
   std::vector<int> gap_open_penalties_;
@@ -236,6 +417,7 @@ class Chromap {
   int max_insert_size_;
   uint8_t mapq_threshold_;
   int num_threads_;
+  int num_prefetched_lanes_ = 1; // # read files (lanes) opened and decompressed ahead of the one being loaded
   int min_read_length_;
   int multi_mapping_allocation_distance_;
   int multi_mapping_allocation_seed_;
@@ -245,6 +427,7 @@ class Chromap {
   int error_weight_ = 3;
   bool trim_adapters_;
   bool remove_pcr_duplicates_;
+  bool online_dedup_; // remove PCR duplicates while mapping
   bool is_bulk_data_;
   bool allocate_multi_mappings_;
   bool only_output_unique_mappings_;
@@ -256,33 +439,47 @@ class Chromap {
   bool output_mapping_in_SAM_;
   bool output_mapping_in_pairs_;
   uint32_t read_batch_size_ = 500000; // default batch size, # reads for single-end reads, # read pairs for paired-end reads
+  int num_batches_in_pipeline_ = 3; // # read batches circulating between the reader, mappers and writer
   bool low_memory_mode_;
+  uint64_t mem_budget_; // bytes of mappings kept in memory and of merge buffers in low memory mode
+  bool unsorted_output_; // write the mappings of each batch once it is mapped, without sorting
   bool cell_by_bin_;
   int bin_size_;
   uint16_t depth_cutoff_to_call_peak_;
   int peak_min_length_;
   int peak_merge_max_length_;
+  double peak_pvalue_cutoff_; // -log10 p-value cutoff of the Poisson peak caller, 0 to call peaks with the depth cutoff
+  int cut_site_smoothing_length_; // length each Tn5 cut site is spread over
+  std::vector<int> peak_lambda_windows_; // windows to estimate the local background in
   std::string reference_file_path_;
   std::string index_file_path_;
   std::vector<std::string> read_file1_paths_;
   std::vector<std::string> read_file2_paths_;
   std::vector<std::string> barcode_file_paths_;
+  // Barcodes can instead be taken from the read 1 headers, either from the
+  // comment field starting with barcode_tag_ (e.g. CB:Z:) or from a field of
+  // the name split by barcode_name_delimiter_ (1-based, negative from the end).
+  std::string barcode_tag_;
+  std::string barcode_qual_tag_;
+  int barcode_name_field_ = 0;
+  char barcode_name_delimiter_ = '_';
   std::string barcode_whitelist_file_path_;
   std::string mapping_output_file_path_;
+  std::string temp_directory_path_; // temp files go next to the output file if empty
   FILE *mapping_output_file_;
   std::string matrix_output_prefix_;
   //khash_t(k32_set)* barcode_whitelist_lookup_table_;
   khash_t(k32)* barcode_whitelist_lookup_table_;
   // For identical read dedupe
-  int allocated_barcode_lookup_table_size_ = (1 << 10);
-  khash_t(k32)* barcode_lookup_table_;
-  std::vector<khash_t(k128)* > read_lookup_tables_;
+  DuplicateReadPairSet duplicate_read_pair_set_;
+  // For online dedupe
+  DuplicateFragmentSet<MappingRecord> duplicate_fragment_set_;
   // For mapping
   int min_unique_mapping_mapq_ = 4;
-  std::vector<TempMappingFileHandle<MappingRecord> > temp_mapping_file_handles_;
+  int num_multi_mapping_buckets_per_thread_ = 8; // read id ranges allocated in parallel
+  TempMappingSpiller<MappingRecord> temp_mapping_spiller_;
   std::vector<std::vector<MappingRecord> > mappings_on_diff_ref_seqs_;
   std::vector<std::vector<MappingRecord> > deduped_mappings_on_diff_ref_seqs_;
-  std::vector<std::pair<uint32_t, MappingRecord> > multi_mappings_;
   std::vector<std::vector<MappingRecord> > allocated_mappings_on_diff_ref_seqs_;
   std::vector<std::vector<uint32_t> > tree_extras_on_diff_ref_seqs_; // max
   std::vector<std::pair<int, uint32_t> > tree_info_on_diff_ref_seqs_; // (max_level, # nodes)
@@ -302,8 +499,10 @@ class Chromap {
   khash_t(k32)* barcode_histogram_;
   khash_t(k32)* barcode_index_table_;
   // For peak calling
-  std::vector<std::vector<uint16_t> > pileup_on_diff_ref_seqs_;
   std::vector<std::vector<Peak> > peaks_on_diff_ref_seqs_;
+  // For cell by bin matrix, index of the first bin on each ref seq, with the
+  // total number of bins at the end
+  std::vector<uint32_t> bin_offsets_on_diff_ref_seqs_;
 };
 } // namespace chromap
 
@@ -0,0 +1,290 @@
+#ifndef DUPLICATEFRAGMENTSET_H_
+#define DUPLICATEFRAGMENTSET_H_
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "duplicate_read_pair_set.h"
+#include "khash.h"
+#include "mapping_buffer.h"
+#include "sequence_batch.h" // used by output_tools.h
+#include "output_tools.h"
+
+namespace chromap {
+struct FragmentKey {
+  uint32_t cell_barcode;
+  uint32_t fragment_start_position;
+  uint32_t fragment_length;
+};
+
+inline khint_t HashFragmentKey(const FragmentKey &key) {
+  uint64_t hash = ((uint64_t)key.cell_barcode << 32 | key.fragment_start_position) ^ ((uint64_t)key.fragment_length * 0x9e3779b97f4a7c15ULL);
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return (khint_t)hash;
+}
+
+inline bool FragmentKeysAreEqual(const FragmentKey &a, const FragmentKey &b) {
+  return a.cell_barcode == b.cell_barcode && a.fragment_start_position == b.fragment_start_position && a.fragment_length == b.fragment_length;
+}
+
+KHASH_INIT(k_fragment, FragmentKey, uint32_t, 1, HashFragmentKey, FragmentKeysAreEqual);
+
+// A member of a fragment that is not its representative and whose duplicates
+// dropped before mapping are looked up by read id. The read id has the type of
+// the one in the mapping records, which keeps the member in 8 bytes, or 12 with
+// wide read ids.
+template <typename ReadId>
+struct FragmentMember {
+  ReadId read_id;
+  uint32_t fragment_index;
+  uint64_t GetReadId() const {
+    return read_id;
+  }
+};
+
+// Only paired-end records whose duplicates are defined by the barcode, start
+// and length can be deduped while mapping.
+template <typename MappingRecord>
+struct DuplicateFragmentTraits {
+  typedef FragmentMember<uint64_t> Member;
+  static bool IsSupported() {
+    return false;
+  }
+  static FragmentKey GetKey(const MappingRecord &mapping) {
+    return FragmentKey{0, 0, 0}; // unsupported record types never get here
+  }
+};
+
+template <typename ReadId>
+struct DuplicateFragmentTraits<BasicPairedEndMappingWithoutBarcode<ReadId> > {
+  typedef FragmentMember<ReadId> Member;
+  static bool IsSupported() {
+    return true;
+  }
+  static FragmentKey GetKey(const BasicPairedEndMappingWithoutBarcode<ReadId> &mapping) {
+    return FragmentKey{0, mapping.fragment_start_position, mapping.fragment_length};
+  }
+};
+
+template <typename ReadId>
+struct DuplicateFragmentTraits<BasicPairedEndMappingWithBarcode<ReadId> > {
+  typedef FragmentMember<ReadId> Member;
+  static bool IsSupported() {
+    return true;
+  }
+  static FragmentKey GetKey(const BasicPairedEndMappingWithBarcode<ReadId> &mapping) {
+    return FragmentKey{mapping.cell_barcode, mapping.fragment_start_position, mapping.fragment_length};
+  }
+};
+
+template <typename ReadId>
+struct DuplicateFragmentTraits<BasicPairedEndFragmentWithBarcode<ReadId> > {
+  typedef FragmentMember<ReadId> Member;
+  static bool IsSupported() {
+    return true;
+  }
+  static FragmentKey GetKey(const BasicPairedEndFragmentWithBarcode<ReadId> &mapping) {
+    return FragmentKey{mapping.cell_barcode, mapping.fragment_start_position, mapping.fragment_length};
+  }
+};
+
+// PCR duplicate removal done while mapping. The mappings of each batch are
+// merged into a hash table per reference sequence keyed on (barcode, start,
+// length), which keeps one representative per unique fragment along with the
+// number of mappings it stands for. Once all reads are mapped, the
+// representatives are sorted and written out, which gives the same result as
+// sorting all the mappings and collapsing the duplicates afterwards.
+//
+// The duplicates of a read pair dropped before mapping are credited to the
+// fragment its only mapping is merged into through the fingerprint of the
+// pair, so the set grows with the number of unique fragments. Only the pairs
+// with several mappings keep the read ids of their non-representative
+// mappings to look up the duplicates at the end. The fingerprints themselves
+// still take one entry per unique read pair in DuplicateReadPairSet.
+template <typename MappingRecord>
+class DuplicateFragmentSet {
+ public:
+  typedef typename DuplicateFragmentTraits<MappingRecord>::Member FragmentMember;
+  DuplicateFragmentSet() {}
+  ~DuplicateFragmentSet() {
+    Destroy();
+  }
+  static bool IsSupported() {
+    return DuplicateFragmentTraits<MappingRecord>::IsSupported();
+  }
+  void Initialize(uint32_t num_reference_sequences) {
+    Destroy();
+    fragment_indices_on_diff_ref_seqs_.reserve(num_reference_sequences);
+    for (uint32_t ri = 0; ri < num_reference_sequences; ++ri) {
+      fragment_indices_on_diff_ref_seqs_.emplace_back(kh_init(k_fragment));
+    }
+    representatives_on_diff_ref_seqs_.assign(num_reference_sequences, std::vector<MappingRecord>());
+    num_dups_on_diff_ref_seqs_.assign(num_reference_sequences, std::vector<uint32_t>());
+    other_members_on_diff_ref_seqs_.assign(num_reference_sequences, std::vector<FragmentMember>());
+    num_rid_bits_ = 0;
+    while (((uint64_t)1 << num_rid_bits_) < num_reference_sequences) {
+      ++num_rid_bits_;
+    }
+  }
+  void Destroy() {
+    for (size_t ri = 0; ri < fragment_indices_on_diff_ref_seqs_.size(); ++ri) {
+      kh_destroy(k_fragment, fragment_indices_on_diff_ref_seqs_[ri]);
+    }
+    fragment_indices_on_diff_ref_seqs_.clear();
+    representatives_on_diff_ref_seqs_.clear();
+    num_dups_on_diff_ref_seqs_.clear();
+    other_members_on_diff_ref_seqs_.clear();
+  }
+  // Merge the mappings in the per-thread buffers of one batch and clear the
+  // buffers. read_pair_hashes holds the fingerprint key hash of each pair in
+  // read_batch1, which the duplicates of the pair are credited through. Return
+  // the number of merged mappings.
+  uint32_t Merge(bool Tn5_shift, const SequenceBatch &read_batch1, const std::vector<uint64_t> &read_pair_hashes, DuplicateReadPairSet *duplicate_read_pair_set, std::vector<MappingBuffer<MappingRecord> > *mapping_buffers) {
+    uint32_t num_merged_mappings = 0;
+    for (MappingBuffer<MappingRecord> &mapping_buffer : *mapping_buffers) {
+      size_t num_mappings = mapping_buffer.GetNumMappings();
+      for (size_t mi = 0; mi < num_mappings; ++mi) {
+        MappingRecord &mapping = mapping_buffer.GetMappingAt(mi);
+        if (Tn5_shift) {
+          mapping.Tn5Shift();
+        }
+        uint32_t ri = mapping_buffer.GetReferenceSequenceIndexAt(mi);
+        bool is_representative = false;
+        uint32_t fragment_index = Insert(ri, mapping, &is_representative);
+        // The mappings of a pair are generated one after another by the same
+        // thread, so a pair with a single mapping has no neighbor with its
+        // read id.
+        uint64_t read_id = mapping.GetReadId();
+        bool is_only_mapping = (mi == 0 || mapping_buffer.GetMappingAt(mi - 1).GetReadId() != read_id) && (mi + 1 == num_mappings || mapping_buffer.GetMappingAt(mi + 1).GetReadId() != read_id);
+        bool is_credited = false;
+        if (is_only_mapping && HasFragmentId(fragment_index)) {
+          uint32_t pair_index = FindPairIndex(read_batch1, read_id);
+          is_credited = duplicate_read_pair_set->CreditDuplicatesToFragment(read_pair_hashes[pair_index], read_id, GetFragmentId(ri, fragment_index));
+        }
+        if (!is_credited && !is_representative) {
+          AddOtherMember(ri, read_id, fragment_index);
+        }
+      }
+      num_merged_mappings += mapping_buffer.GetNumMappings();
+      mapping_buffer.Clear();
+    }
+    return num_merged_mappings;
+  }
+  // Move the sorted representatives into deduped_mappings_on_diff_ref_seqs and
+  // release the tables. Each representative also counts the duplicates of its
+  // members dropped before mapping, either credited to the fragment or looked
+  // up by read id. Return the number of representatives.
+  uint64_t Finalize(const DuplicateReadPairSet &duplicate_read_pair_set, std::vector<std::vector<MappingRecord> > *deduped_mappings_on_diff_ref_seqs) {
+    uint64_t num_representatives = 0;
+    for (size_t ri = 0; ri < fragment_indices_on_diff_ref_seqs_.size(); ++ri) {
+      std::vector<MappingRecord> &representatives = representatives_on_diff_ref_seqs_[ri];
+      std::vector<uint32_t> &num_dups = num_dups_on_diff_ref_seqs_[ri];
+      for (const FragmentMember &member : other_members_on_diff_ref_seqs_[ri]) {
+        num_dups[member.fragment_index] += duplicate_read_pair_set.GetNumDuplicatesOf(member.GetReadId());
+      }
+      for (size_t fi = 0; fi < representatives.size(); ++fi) {
+        if (HasFragmentId(fi)) {
+          num_dups[fi] += duplicate_read_pair_set.GetNumDuplicatesOfFragment(GetFragmentId(ri, fi));
+        }
+        // The count wraps around like the one in RemovePCRDuplicate.
+        representatives[fi].num_dups = num_dups[fi] + duplicate_read_pair_set.GetNumDuplicatesOf(representatives[fi].GetReadId());
+      }
+      std::sort(representatives.begin(), representatives.end());
+      num_representatives += representatives.size();
+      (*deduped_mappings_on_diff_ref_seqs)[ri].swap(representatives);
+      std::vector<MappingRecord>().swap(representatives);
+      std::vector<uint32_t>().swap(num_dups);
+      std::vector<FragmentMember>().swap(other_members_on_diff_ref_seqs_[ri]);
+      kh_destroy(k_fragment, fragment_indices_on_diff_ref_seqs_[ri]);
+      fragment_indices_on_diff_ref_seqs_[ri] = kh_init(k_fragment);
+    }
+    return num_representatives;
+  }
+  uint64_t GetNumFragments() const {
+    uint64_t num_fragments = 0;
+    for (size_t ri = 0; ri < representatives_on_diff_ref_seqs_.size(); ++ri) {
+      num_fragments += representatives_on_diff_ref_seqs_[ri].size();
+    }
+    return num_fragments;
+  }
+  uint64_t GetMemoryBytes() const {
+    uint64_t memory_bytes = 0;
+    for (size_t ri = 0; ri < fragment_indices_on_diff_ref_seqs_.size(); ++ri) {
+      khint_t num_buckets = kh_n_buckets(fragment_indices_on_diff_ref_seqs_[ri]);
+      memory_bytes += (uint64_t)num_buckets * (sizeof(FragmentKey) + sizeof(uint32_t)) + (num_buckets >> 4) * sizeof(khint32_t);
+      memory_bytes += representatives_on_diff_ref_seqs_[ri].capacity() * sizeof(MappingRecord);
+      memory_bytes += num_dups_on_diff_ref_seqs_[ri].capacity() * sizeof(uint32_t);
+      memory_bytes += other_members_on_diff_ref_seqs_[ri].capacity() * sizeof(FragmentMember);
+    }
+    return memory_bytes;
+  }
+
+ protected:
+  // Return the index of the fragment the mapping is merged into and whether
+  // the mapping became its representative.
+  inline uint32_t Insert(size_t ri, const MappingRecord &mapping, bool *is_representative) {
+    khash_t(k_fragment) *fragment_indices = fragment_indices_on_diff_ref_seqs_[ri];
+    std::vector<MappingRecord> &representatives = representatives_on_diff_ref_seqs_[ri];
+    int khash_return_code;
+    khiter_t iterator = kh_put(k_fragment, fragment_indices, DuplicateFragmentTraits<MappingRecord>::GetKey(mapping), &khash_return_code);
+    if (khash_return_code != 0) { // newly inserted
+      uint32_t fragment_index = representatives.size();
+      kh_value(fragment_indices, iterator) = fragment_index;
+      representatives.emplace_back(mapping);
+      num_dups_on_diff_ref_seqs_[ri].emplace_back(1);
+      *is_representative = true;
+      return fragment_index;
+    }
+    // Keep the smallest mapping as the representative, which is the one a
+    // sort would put first. The replaced representative becomes a member,
+    // whose read id is kept in case its duplicates were not credited to the
+    // fragment. Otherwise the lookup just finds nothing.
+    uint32_t fragment_index = kh_value(fragment_indices, iterator);
+    ++num_dups_on_diff_ref_seqs_[ri][fragment_index];
+    MappingRecord &representative = representatives[fragment_index];
+    *is_representative = mapping < representative;
+    if (*is_representative) {
+      AddOtherMember(ri, representative.GetReadId(), fragment_index);
+      representative = mapping;
+    }
+    return fragment_index;
+  }
+  // A fragment id packs the fragment index above the reference sequence index
+  // and has to fit in the read id bits of a fingerprint. The duplicates of
+  // fragments with larger indices are looked up by read id instead.
+  inline bool HasFragmentId(uint32_t fragment_index) const {
+    return ((uint64_t)fragment_index << num_rid_bits_) < MAX_NUM_READ_IDS;
+  }
+  inline uint64_t GetFragmentId(size_t ri, uint32_t fragment_index) const {
+    return ((uint64_t)fragment_index << num_rid_bits_) | ri;
+  }
+  // The pairs of a batch are in the order of their read ids.
+  static uint32_t FindPairIndex(const SequenceBatch &read_batch1, uint64_t read_id) {
+    uint32_t low = 0;
+    uint32_t high = read_batch1.GetNumSequences();
+    while (low < high) {
+      uint32_t middle = low + (high - low) / 2;
+      if (read_batch1.GetSequenceIdAt(middle) < read_id) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    return low;
+  }
+  inline void AddOtherMember(size_t ri, uint64_t read_id, uint32_t fragment_index) {
+    other_members_on_diff_ref_seqs_[ri].emplace_back(FragmentMember{static_cast<decltype(FragmentMember::read_id)>(read_id), fragment_index});
+  }
+  std::vector<khash_t(k_fragment)*> fragment_indices_on_diff_ref_seqs_;
+  std::vector<std::vector<MappingRecord> > representatives_on_diff_ref_seqs_;
+  std::vector<std::vector<uint32_t> > num_dups_on_diff_ref_seqs_;
+  std::vector<std::vector<FragmentMember> > other_members_on_diff_ref_seqs_;
+  int num_rid_bits_ = 0;
+};
+
+} // namespace chromap
+
+#endif // DUPLICATEFRAGMENTSET_H_
@@ -0,0 +1,164 @@
+#ifndef DUPLICATEREADPAIRSET_H_
+#define DUPLICATEREADPAIRSET_H_
+
+#include <string.h>
+
+#include <mutex>
+#include <vector>
+
+#include "khash.h"
+#include "sequence_batch.h"
+
+namespace chromap {
+// The read id of the representative and the number of its duplicates share 64
+// bits. Once the only mapping of the representative is merged into a fragment
+// while mapping, the read id is replaced by the id of the fragment, so that its
+// duplicates are credited to the fragment. The count wraps around at 2^23,
+// which is a multiple of the 256 the uint8_t counts in the mapping records wrap
+// around at, so nothing downstream changes.
+struct ReadPairFingerprint {
+  uint64_t check_hash;
+  uint64_t representative_id : READ_ID_BITS, is_fragment_id : 1, num_duplicates : 63 - READ_ID_BITS;
+};
+
+KHASH_MAP_INIT_INT64(k64_fingerprint, ReadPairFingerprint);
+KHASH_MAP_INIT_INT64(k64_dup_count, uint32_t);
+
+// Set of read pair fingerprints shared by all the mapping threads. It is split
+// into shards by the fingerprint, each guarded by its own mutex, so concurrent
+// inserts rarely contend. The first pair inserted with a fingerprint is its
+// representative and later pairs with the same fingerprint are counted as its
+// duplicates.
+class DuplicateReadPairSet {
+ public:
+  DuplicateReadPairSet() : shard_mutexes_(NUM_SHARDS_) {
+    shards_.reserve(NUM_SHARDS_);
+    for (int i = 0; i < NUM_SHARDS_; ++i) {
+      shards_.emplace_back(kh_init(k64_fingerprint));
+    }
+    num_duplicates_of_representatives_ = kh_init(k64_dup_count);
+    num_duplicates_of_fragments_ = kh_init(k64_dup_count);
+  }
+  ~DuplicateReadPairSet() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      kh_destroy(k64_fingerprint, shards_[i]);
+    }
+    kh_destroy(k64_dup_count, num_duplicates_of_representatives_);
+    kh_destroy(k64_dup_count, num_duplicates_of_fragments_);
+  }
+  // Return true if the fingerprint is already in the set. A fingerprint
+  // consists of a key hash and a check hash, and a pair whose key hash matches
+  // but check hash does not is treated as distinct but is not inserted.
+  inline bool Insert(uint64_t key_hash, uint64_t check_hash, uint64_t read_id) {
+    int shard_index = key_hash >> (64 - LOG_NUM_SHARDS_);
+    khash_t(k64_fingerprint) *shard = shards_[shard_index];
+    std::lock_guard<std::mutex> lock(shard_mutexes_[shard_index]);
+    int khash_return_code;
+    khiter_t iterator = kh_put(k64_fingerprint, shard, key_hash, &khash_return_code);
+    ReadPairFingerprint &fingerprint = kh_value(shard, iterator);
+    if (khash_return_code != 0) { // newly inserted
+      fingerprint.check_hash = check_hash;
+      fingerprint.representative_id = read_id;
+      fingerprint.is_fragment_id = 0;
+      fingerprint.num_duplicates = 0;
+      return false;
+    }
+    if (fingerprint.check_hash != check_hash) {
+      return false;
+    }
+    ++fingerprint.num_duplicates;
+    return true;
+  }
+  // Credit the duplicates of the read pair with the key hash, both the ones
+  // found so far and later, to the fragment instead of the read id. Return
+  // false if read_id is not the representative of the key hash, e.g. when the
+  // check hash of the pair didn't match and it was not inserted.
+  inline bool CreditDuplicatesToFragment(uint64_t key_hash, uint64_t read_id, uint64_t fragment_id) {
+    int shard_index = key_hash >> (64 - LOG_NUM_SHARDS_);
+    khash_t(k64_fingerprint) *shard = shards_[shard_index];
+    std::lock_guard<std::mutex> lock(shard_mutexes_[shard_index]);
+    khiter_t iterator = kh_get(k64_fingerprint, shard, key_hash);
+    if (iterator == kh_end(shard)) {
+      return false;
+    }
+    ReadPairFingerprint &fingerprint = kh_value(shard, iterator);
+    if (fingerprint.is_fragment_id || fingerprint.representative_id != read_id) {
+      return false;
+    }
+    fingerprint.representative_id = fragment_id;
+    fingerprint.is_fragment_id = 1;
+    return true;
+  }
+  // Collect the number of duplicates of each representative or fragment that
+  // has any and release the fingerprints. Call after all the inserts.
+  void FinalizeDuplicateCounts() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      khash_t(k64_fingerprint) *shard = shards_[i];
+      for (khiter_t iterator = kh_begin(shard); iterator != kh_end(shard); ++iterator) {
+        if (kh_exist(shard, iterator) && kh_value(shard, iterator).num_duplicates > 0) {
+          const ReadPairFingerprint &fingerprint = kh_value(shard, iterator);
+          khash_t(k64_dup_count) *num_duplicates = fingerprint.is_fragment_id ? num_duplicates_of_fragments_ : num_duplicates_of_representatives_;
+          int khash_return_code;
+          khiter_t count_iterator = kh_put(k64_dup_count, num_duplicates, fingerprint.representative_id, &khash_return_code);
+          if (khash_return_code != 0) { // newly inserted
+            kh_value(num_duplicates, count_iterator) = 0;
+          }
+          kh_value(num_duplicates, count_iterator) += fingerprint.num_duplicates;
+        }
+      }
+      kh_destroy(k64_fingerprint, shard);
+      shards_[i] = kh_init(k64_fingerprint);
+    }
+  }
+  inline uint32_t GetNumDuplicatesOf(uint64_t read_id) const {
+    return GetNumDuplicates(num_duplicates_of_representatives_, read_id);
+  }
+  inline uint32_t GetNumDuplicatesOfFragment(uint64_t fragment_id) const {
+    return GetNumDuplicates(num_duplicates_of_fragments_, fragment_id);
+  }
+  inline uint32_t GetNumRepresentativesWithDuplicates() const {
+    return kh_size(num_duplicates_of_representatives_);
+  }
+  // Hash a sequence 8 bytes at a time with the murmur3 finalizer as the mixer.
+  inline static uint64_t HashSequence(const char *sequence, uint32_t sequence_length, uint64_t seed) {
+    uint64_t hash = seed ^ ((uint64_t)sequence_length * 0x9e3779b97f4a7c15ULL);
+    uint32_t i = 0;
+    for (; i + 8 <= sequence_length; i += 8) {
+      uint64_t word;
+      memcpy(&word, sequence + i, 8);
+      hash = MixHash(hash ^ word);
+    }
+    uint64_t last_word = 0;
+    memcpy(&last_word, sequence + i, sequence_length - i);
+    return MixHash(hash ^ last_word);
+  }
+
+ protected:
+  inline static uint32_t GetNumDuplicates(const khash_t(k64_dup_count) *num_duplicates, uint64_t id) {
+    if (kh_size(num_duplicates) == 0) {
+      return 0;
+    }
+    khiter_t iterator = kh_get(k64_dup_count, num_duplicates, id);
+    if (iterator == kh_end(num_duplicates)) {
+      return 0;
+    }
+    return kh_value(num_duplicates, iterator);
+  }
+  inline static uint64_t MixHash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+  }
+  static const int LOG_NUM_SHARDS_ = 8;
+  static const int NUM_SHARDS_ = 1 << LOG_NUM_SHARDS_;
+  std::vector<khash_t(k64_fingerprint)*> shards_;
+  std::vector<std::mutex> shard_mutexes_;
+  khash_t(k64_dup_count) *num_duplicates_of_representatives_;
+  khash_t(k64_dup_count) *num_duplicates_of_fragments_;
+};
+} // namespace chromap
+
+#endif // DUPLICATEREADPAIRSET_H_
@@ -0,0 +1,90 @@
+#ifndef LOSERTREE_H_
+#define LOSERTREE_H_
+
+#include <vector>
+
+namespace chromap {
+// Tournament tree of losers for k-way merging sorted runs. Each internal node
+// keeps the run that lost the match played there, so advancing the winner only
+// replays the matches on its path to the root, i.e. O(log k) comparisons per
+// record instead of scanning all k runs. A Run provides IsExhausted(),
+// Current() and Next(). Exhausted runs lose every match and ties go to the run
+// with the smaller index, so equal records come out in run order.
+template <typename Run>
+class LoserTree {
+ public:
+  LoserTree() {}
+  ~LoserTree() {}
+  void Initialize(std::vector<Run> *runs) {
+    runs_ = runs;
+    size_t num_runs = runs_->size();
+    losers_.assign(num_runs, 0);
+    if (num_runs == 0) {
+      winner_ = 0;
+      return;
+    }
+    // Leaf i is node num_runs + i and node n plays the winners of nodes 2n and
+    // 2n + 1.
+    std::vector<size_t> winners(2 * num_runs);
+    for (size_t ri = 0; ri < num_runs; ++ri) {
+      winners[num_runs + ri] = ri;
+    }
+    for (size_t ni = num_runs - 1; ni >= 1; --ni) {
+      size_t left = winners[2 * ni];
+      size_t right = winners[2 * ni + 1];
+      if (Beats(left, right)) {
+        winners[ni] = left;
+        losers_[ni] = right;
+      } else {
+        winners[ni] = right;
+        losers_[ni] = left;
+      }
+    }
+    winner_ = winners[1];
+  }
+  // Return the index of the run with the smallest current record, which is an
+  // exhausted run once all the runs are exhausted.
+  inline size_t GetWinner() const {
+    return winner_;
+  }
+  inline bool IsEmpty() const {
+    return runs_->empty() || (*runs_)[winner_].IsExhausted();
+  }
+  // Advance the winner run and replay its matches.
+  inline void Next() {
+    (*runs_)[winner_].Next();
+    size_t num_runs = runs_->size();
+    for (size_t ni = (num_runs + winner_) / 2; ni >= 1; ni /= 2) {
+      if (Beats(losers_[ni], winner_)) {
+        size_t loser = winner_;
+        winner_ = losers_[ni];
+        losers_[ni] = loser;
+      }
+    }
+  }
+
+ protected:
+  inline bool Beats(size_t a, size_t b) const {
+    const Run &run_a = (*runs_)[a];
+    const Run &run_b = (*runs_)[b];
+    if (run_a.IsExhausted()) {
+      return false;
+    }
+    if (run_b.IsExhausted()) {
+      return true;
+    }
+    if (run_a.Current() < run_b.Current()) {
+      return true;
+    }
+    if (run_b.Current() < run_a.Current()) {
+      return false;
+    }
+    return a < b;
+  }
+  std::vector<Run> *runs_ = NULL;
+  std::vector<size_t> losers_;
+  size_t winner_ = 0;
+};
+} // namespace chromap
+
+#endif // LOSERTREE_H_
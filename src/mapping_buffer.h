@@ -0,0 +1,113 @@
+#ifndef MAPPINGBUFFER_H_
+#define MAPPINGBUFFER_H_
+
+#include <utility>
+#include <vector>
+
+namespace chromap {
+const int RID_DIGIT_BITS = 11;
+const uint32_t RID_DIGIT_MASK = (1 << RID_DIGIT_BITS) - 1;
+
+// Mappings generated by one thread for one batch of reads. The records on all
+// the reference sequences share one contiguous arena in the order they are
+// generated, with the reference sequence index of each record kept aside, so
+// neither appending nor the size of the buffer depends on the number of
+// reference sequences.
+template <typename MappingRecord>
+class MappingBuffer {
+ public:
+  MappingBuffer() {}
+  ~MappingBuffer() {}
+  void Reserve(size_t num_mappings) {
+    mappings_.reserve(num_mappings);
+    rids_.reserve(num_mappings);
+  }
+  // Append a record on reference sequence rid to the arena.
+  inline void AppendOn(uint32_t rid, MappingRecord &&mapping) {
+    mappings_.emplace_back(std::move(mapping));
+    rids_.emplace_back(rid);
+  }
+  inline size_t GetNumMappings() const {
+    return mappings_.size();
+  }
+  inline uint32_t GetReferenceSequenceIndexAt(size_t mi) const {
+    return rids_[mi];
+  }
+  inline MappingRecord &GetMappingAt(size_t mi) {
+    return mappings_[mi];
+  }
+  // Order the records by reference sequence index with an LSD radix sort,
+  // i.e. stable counting sorts on RID_DIGIT_BITS bits at a time, so records on
+  // the same reference sequence keep their order. The digit histograms have a
+  // fixed size, so the cost grows with the number of records rather than with
+  // the number of reference sequences.
+  void GroupByReferenceSequence() {
+    size_t num_mappings = rids_.size();
+    sorted_indices_.resize(num_mappings);
+    for (size_t mi = 0; mi < num_mappings; ++mi) {
+      sorted_indices_[mi] = mi;
+    }
+    uint32_t rid_bits = 0;
+    for (uint32_t rid : rids_) {
+      rid_bits |= rid;
+    }
+    index_buffer_.resize(num_mappings);
+    for (int shift = 0; shift < 32 && (rid_bits >> shift) != 0; shift += RID_DIGIT_BITS) {
+      uint32_t digit_offsets[1 << RID_DIGIT_BITS] = {0};
+      for (uint32_t mi : sorted_indices_) {
+        ++digit_offsets[(rids_[mi] >> shift) & RID_DIGIT_MASK];
+      }
+      uint32_t offset = 0;
+      for (uint32_t &digit_offset : digit_offsets) {
+        uint32_t digit_count = digit_offset;
+        digit_offset = offset;
+        offset += digit_count;
+      }
+      for (uint32_t mi : sorted_indices_) {
+        index_buffer_[digit_offsets[(rids_[mi] >> shift) & RID_DIGIT_MASK]++] = mi;
+      }
+      sorted_indices_.swap(index_buffer_);
+    }
+    groups_.clear();
+    for (uint32_t mi : sorted_indices_) {
+      uint32_t rid = rids_[mi];
+      if (groups_.empty() || groups_.back().first != rid) {
+        groups_.emplace_back(rid, 0);
+      }
+      ++groups_.back().second;
+    }
+  }
+  // (rid, number of records) of the groups, sorted by rid.
+  inline const std::vector<std::pair<uint32_t, uint32_t> > &GetGroups() const {
+    return groups_;
+  }
+  // Move the records of group gi to group_offsets[gi] in the container of its
+  // reference sequence, which must have room for them, and clear the buffer.
+  void MoveGroupsTo(const std::vector<size_t> &group_offsets, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs) {
+    size_t si = 0;
+    for (size_t gi = 0; gi < groups_.size(); ++gi) {
+      MappingRecord *destination = (*mappings_on_diff_ref_seqs)[groups_[gi].first].data() + group_offsets[gi];
+      for (uint32_t i = 0; i < groups_[gi].second; ++i, ++si) {
+        destination[i] = std::move(mappings_[sorted_indices_[si]]);
+      }
+    }
+    Clear();
+  }
+  void Clear() {
+    mappings_.clear();
+    rids_.clear();
+    sorted_indices_.clear();
+    groups_.clear();
+  }
+
+ protected:
+  std::vector<MappingRecord> mappings_;
+  std::vector<uint32_t> rids_;
+  // Arena indices of the records ordered by reference sequence index.
+  std::vector<uint32_t> sorted_indices_;
+  std::vector<uint32_t> index_buffer_;
+  std::vector<std::pair<uint32_t, uint32_t> > groups_;
+};
+} // namespace chromap
+
+#endif // MAPPINGBUFFER_H_
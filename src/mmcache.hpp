@@ -1,6 +1,8 @@
 #ifndef CHROMAP_CACHE_H_
 #define CHROMAP_CACHE_H_
 
+#include <mutex>
+
 #include "index.h"
 
 #define FINGER_PRINT_SIZE 103
@@ -120,6 +122,10 @@ class mm_cache {
   struct _mm_cache_entry *cache;
   int kmer_length;
   int update_limit;
+  // The mappers query the cache while the previous batch is added to it on
+  // another thread, so each entry is guarded by one of a set of striped locks.
+  static const int NUM_ENTRY_LOCKS = 4096;
+  std::mutex entry_locks[NUM_ENTRY_LOCKS];
 
   // 0: not match. -1: opposite order. 1: same order
   int IsMinimizersMatchCache(const std::vector<std::pair<uint64_t, uint64_t> > &minimizers, const struct _mm_cache_entry &cache) {
@@ -191,6 +197,7 @@ class mm_cache {
     for (i = 0 ; i < msize; ++i)
       h += (minimizers[i].first);
     int hidx = h % cache_size;
+    std::lock_guard<std::mutex> lock(entry_locks[hidx % NUM_ENTRY_LOCKS]);
     int direction = IsMinimizersMatchCache(minimizers, cache[hidx]);
     if (direction == 1) {
       int shift = (int)minimizers[0].second >> 1;
@@ -224,6 +231,7 @@ class mm_cache {
     }
     int hidx = h % cache_size;
     int finger_print = f % FINGER_PRINT_SIZE; 
+    std::lock_guard<std::mutex> lock(entry_locks[hidx % NUM_ENTRY_LOCKS]);
 
     ++cache[hidx].finger_print_cnt[finger_print];
     ++cache[hidx].finger_print_cnt_sum;
@@ -6,6 +6,7 @@
 #include <functional>
 #include <iostream>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include "chromap.h"
@@ -122,14 +123,13 @@ const int8_t bam_cigar_table[256] = {
 /*! @abstract supplementary alignment */
 #define BAM_FSUPPLEMENTARY 2048
 
-template <typename MappingRecord>
-bool ReadIdLess(const std::pair<uint32_t, MappingRecord> &a, const std::pair<uint32_t, MappingRecord> &b) { 
-  return a.second.read_id < b.second.read_id; 
-}
-
+// Read ids take up to READ_ID_BITS bits. The records with a read name have
+// room for a uint64_t read id. The compact ones are templates on the read id
+// type: a uint32_t unless the input may have more than 2^32 reads, in which
+// case a WideReadId is used.
 // When direction = 1, strand is positive
 struct PAFMapping {
-  uint32_t read_id;
+  uint64_t read_id;
   std::string read_name;
   uint16_t read_length;
   uint32_t fragment_start_position;
@@ -158,10 +158,13 @@ struct PAFMapping {
   uint32_t GetEndPosition() const { // exclusive
     return fragment_start_position + fragment_length;
   }
+  uint64_t GetReadId() const {
+    return read_id;
+  }
 };
 
 struct PairedPAFMapping {
-  uint32_t read_id;
+  uint64_t read_id;
   std::string read1_name;
   std::string read2_name;
   uint16_t read1_length;
@@ -195,10 +198,13 @@ struct PairedPAFMapping {
   uint32_t GetEndPosition() const { // exclusive
     return fragment_start_position + fragment_length;
   }
+  uint64_t GetReadId() const {
+    return read_id;
+  }
 };
 
 struct SAMMapping {
-  uint32_t read_id;
+  uint64_t read_id;
   std::string read_name;
   //uint16_t read_length;
   //uint32_t fragment_start_position;
@@ -275,6 +281,9 @@ struct SAMMapping {
       return pos + 1;
     }
   }
+  uint64_t GetReadId() const {
+    return read_id;
+  }
 };
 
 struct PairedSAMMapping {
@@ -314,7 +323,7 @@ struct PairedSAMMapping {
 
 // Format for pairtools for HiC data.
 struct PairsMapping {  
-  uint32_t read_id;
+  uint64_t read_id;
   std::string read_name;
   uint32_t cell_barcode;
   int rid1;
@@ -360,21 +369,53 @@ struct PairsMapping {
   uint32_t GetEndPosition() const { // exclusive
     return pos2;
   }
+  uint64_t GetReadId() const {
+    return read_id;
+  }
 };
 
 
-struct MappingWithBarcode {
-  uint32_t read_id;
+// A read id of READ_ID_BITS bits split into a 32-bit low part and an 8-bit
+// high part, which keeps the compact records 4-byte aligned.
+struct WideReadId {
+  uint32_t low;
+  uint8_t high;
+  WideReadId() = default;
+  WideReadId(uint64_t read_id) : low((uint32_t)read_id), high((uint8_t)(read_id >> 32)) {}
+  operator uint64_t() const {
+    return ((uint64_t)high << 32) | low;
+  }
+  bool operator<(const WideReadId& id) const {
+    return std::tie(high, low) < std::tie(id.high, id.low);
+  }
+  bool operator==(const WideReadId& id) const {
+    return std::tie(high, low) == std::tie(id.high, id.low);
+  }
+};
+
+template <typename ReadId>
+struct ReadIdTraits {
+  static const int NUM_BITS = READ_ID_BITS;
+};
+
+template <>
+struct ReadIdTraits<uint32_t> {
+  static const int NUM_BITS = 32;
+};
+
+template <typename ReadId>
+struct BasicMappingWithBarcode {
+  ReadId read_id;
   uint32_t cell_barcode;
   uint32_t fragment_start_position;
   uint16_t fragment_length;
   uint8_t mapq : 6, direction : 1, is_unique : 1;
   uint8_t num_dups;
   //uint8_t mapq;
-  bool operator<(const MappingWithBarcode& m) const {
+  bool operator<(const BasicMappingWithBarcode& m) const {
     return std::tie(fragment_start_position, fragment_length, cell_barcode, mapq, direction, is_unique, read_id) < std::tie(m.fragment_start_position, m.fragment_length, m.cell_barcode, m.mapq, m.direction, m.is_unique, m.read_id);
   }
-  bool operator==(const MappingWithBarcode& m) const {
+  bool operator==(const BasicMappingWithBarcode& m) const {
     return std::tie(cell_barcode, fragment_start_position) == std::tie(m.cell_barcode, m.fragment_start_position);
   }
   void Tn5Shift() {
@@ -393,19 +434,25 @@ struct MappingWithBarcode {
   uint32_t GetEndPosition() const { // exclusive
     return fragment_start_position + fragment_length;
   }
+  uint64_t GetReadId() const {
+    return read_id;
+  }
 };
+typedef BasicMappingWithBarcode<uint32_t> MappingWithBarcode;
+typedef BasicMappingWithBarcode<WideReadId> WideMappingWithBarcode;
 
-struct MappingWithoutBarcode {
-  uint32_t read_id;
+template <typename ReadId>
+struct BasicMappingWithoutBarcode {
+  ReadId read_id;
   uint32_t fragment_start_position;
   uint16_t fragment_length;
   //uint8_t mapq;
   uint8_t mapq : 6, direction : 1, is_unique : 1;
   uint8_t num_dups;
-  bool operator<(const MappingWithoutBarcode& m) const {
+  bool operator<(const BasicMappingWithoutBarcode& m) const {
     return std::tie(fragment_start_position, fragment_length, mapq, direction, is_unique, read_id) < std::tie(m.fragment_start_position, m.fragment_length, m.mapq, m.direction, m.is_unique, m.read_id);
   }
-  bool operator==(const MappingWithoutBarcode& m) const {
+  bool operator==(const BasicMappingWithoutBarcode& m) const {
     return std::tie(fragment_start_position) == std::tie(m.fragment_start_position);
   }
   void Tn5Shift() {
@@ -424,10 +471,16 @@ struct MappingWithoutBarcode {
   uint32_t GetEndPosition() const { // exclusive
     return fragment_start_position + fragment_length;
   }
+  uint64_t GetReadId() const {
+    return read_id;
+  }
 };
+typedef BasicMappingWithoutBarcode<uint32_t> MappingWithoutBarcode;
+typedef BasicMappingWithoutBarcode<WideReadId> WideMappingWithoutBarcode;
 
-struct PairedEndMappingWithBarcode {
-  uint32_t read_id;
+template <typename ReadId>
+struct BasicPairedEndMappingWithBarcode {
+  ReadId read_id;
   uint32_t cell_barcode;
   uint32_t fragment_start_position;
   uint16_t fragment_length;
@@ -436,10 +489,10 @@ struct PairedEndMappingWithBarcode {
   //uint8_t mapq;
   uint16_t positive_alignment_length;
   uint16_t negative_alignment_length;
-  bool operator<(const PairedEndMappingWithBarcode& m) const {
+  bool operator<(const BasicPairedEndMappingWithBarcode& m) const {
     return std::tie(fragment_start_position, fragment_length, cell_barcode, mapq, direction, is_unique, read_id, positive_alignment_length, negative_alignment_length) < std::tie(m.fragment_start_position, m.fragment_length, m.cell_barcode, m.mapq, m.direction, m.is_unique, m.read_id, m.positive_alignment_length, m.negative_alignment_length);
   }
-  bool operator==(const PairedEndMappingWithBarcode& m) const {
+  bool operator==(const BasicPairedEndMappingWithBarcode& m) const {
     return std::tie(cell_barcode, fragment_start_position, fragment_length) == std::tie(m.cell_barcode, m.fragment_start_position, m.fragment_length);
   }
   void Tn5Shift() {
@@ -457,10 +510,65 @@ struct PairedEndMappingWithBarcode {
   uint32_t GetEndPosition() const { // exclusive
     return fragment_start_position + fragment_length;
   }
+  uint64_t GetReadId() const {
+    return read_id;
+  }
+};
+typedef BasicPairedEndMappingWithBarcode<uint32_t> PairedEndMappingWithBarcode;
+typedef BasicPairedEndMappingWithBarcode<WideReadId> WidePairedEndMappingWithBarcode;
+
+// Paired-end mapping with barcode for BED output, which never looks at the
+// alignment lengths of the two reads. Dropping them brings the record from 20
+// to 16 bytes.
+template <typename ReadId>
+struct BasicPairedEndFragmentWithBarcode {
+  ReadId read_id;
+  uint32_t cell_barcode;
+  uint32_t fragment_start_position;
+  uint16_t fragment_length;
+  uint8_t mapq : 6, direction : 1, is_unique : 1;
+  uint8_t num_dups;
+  bool operator<(const BasicPairedEndFragmentWithBarcode& m) const {
+    return std::tie(fragment_start_position, fragment_length, cell_barcode, mapq, direction, is_unique, read_id) < std::tie(m.fragment_start_position, m.fragment_length, m.cell_barcode, m.mapq, m.direction, m.is_unique, m.read_id);
+  }
+  bool operator==(const BasicPairedEndFragmentWithBarcode& m) const {
+    return std::tie(cell_barcode, fragment_start_position, fragment_length) == std::tie(m.cell_barcode, m.fragment_start_position, m.fragment_length);
+  }
+  void Tn5Shift() {
+    fragment_start_position += 4;
+    fragment_length -= 9;
+  }
+  bool IsPositive() const {
+    return direction > 0 ? true : false;
+  }
+  uint32_t GetStartPosition() const { // inclusive
+    return fragment_start_position;
+  }
+  uint32_t GetEndPosition() const { // exclusive
+    return fragment_start_position + fragment_length;
+  }
+  uint64_t GetReadId() const {
+    return read_id;
+  }
 };
+typedef BasicPairedEndFragmentWithBarcode<uint32_t> PairedEndFragmentWithBarcode;
+typedef BasicPairedEndFragmentWithBarcode<WideReadId> WidePairedEndFragmentWithBarcode;
 
-struct PairedEndMappingWithoutBarcode {
-  uint32_t read_id;
+// The record type with all the fields a mapping record can drop, e.g. the
+// alignment lengths left out of the fragments for BED output.
+template <typename MappingRecord>
+struct FullLayoutTraits {
+  typedef MappingRecord FullLayout;
+};
+
+template <typename ReadId>
+struct FullLayoutTraits<BasicPairedEndFragmentWithBarcode<ReadId> > {
+  typedef BasicPairedEndMappingWithBarcode<ReadId> FullLayout;
+};
+
+template <typename ReadId>
+struct BasicPairedEndMappingWithoutBarcode {
+  ReadId read_id;
   uint32_t fragment_start_position;
   uint16_t fragment_length;
   uint8_t mapq : 6, direction : 1, is_unique : 1;
@@ -468,10 +576,10 @@ struct PairedEndMappingWithoutBarcode {
   //uint8_t mapq;
   uint16_t positive_alignment_length;
   uint16_t negative_alignment_length;
-  bool operator<(const PairedEndMappingWithoutBarcode& m) const {
+  bool operator<(const BasicPairedEndMappingWithoutBarcode& m) const {
     return std::tie(fragment_start_position, fragment_length, mapq, direction, is_unique, read_id, positive_alignment_length, negative_alignment_length) < std::tie(m.fragment_start_position, m.fragment_length, m.mapq, m.direction, m.is_unique, m.read_id, m.positive_alignment_length, m.negative_alignment_length);
   }
-  bool operator==(const PairedEndMappingWithoutBarcode& m) const {
+  bool operator==(const BasicPairedEndMappingWithoutBarcode& m) const {
     return std::tie(fragment_start_position, fragment_length) == std::tie(m.fragment_start_position, m.fragment_length);
   }
   void Tn5Shift() {
@@ -489,92 +597,21 @@ struct PairedEndMappingWithoutBarcode {
   uint32_t GetEndPosition() const { // exclusive
     return fragment_start_position + fragment_length;
   }
-};
-
-template <typename MappingRecord>
-struct TempMappingFileHandle {
-  std::string file_path;
-  FILE *file;
-  bool all_loaded;
-  uint32_t num_mappings;
-  uint32_t block_size;
-  uint32_t current_rid;
-  uint32_t current_mapping_index;
-  uint32_t num_mappings_on_current_rid;
-  uint32_t num_loaded_mappings_on_current_rid;
-  std::vector<MappingRecord> mappings; // this vector only keep mappings on the same ref seq
-  inline void InitializeTempMappingLoading(uint32_t num_reference_sequences) {
-    file = fopen(file_path.c_str(), "rb");
-    assert(file != NULL);
-    all_loaded = false;
-    current_rid = 0;
-    fread(&num_mappings_on_current_rid, sizeof(size_t), 1, file);
-    mappings.resize(block_size);
-    num_loaded_mappings_on_current_rid = 0;
-    //std::cerr << "Block size: " << block_size << ", initialize temp file " << file_path << "\n";
-  }
-  inline void FinalizeTempMappingLoading() {
-    fclose(file);
-  }
-  inline void LoadTempMappingBlock(uint32_t num_reference_sequences) {
-    num_mappings = 0;
-    while (num_mappings == 0) {
-      // Only keep mappings on one ref seq, which means # mappings in buffer can be less than block size
-      // Two cases: current ref seq has remainings or not
-      if (num_loaded_mappings_on_current_rid < num_mappings_on_current_rid) {
-        // Check if # remains larger than block size
-        uint32_t num_mappings_to_load_on_current_rid = num_mappings_on_current_rid - num_loaded_mappings_on_current_rid;
-        if (num_mappings_to_load_on_current_rid > block_size) {
-          num_mappings_to_load_on_current_rid = block_size;
-        }
-        //std::cerr << num_mappings_to_load_on_current_rid << " " << num_loaded_mappings_on_current_rid << " " << num_mappings_on_current_rid << "\n";
-        //std::cerr << mappings.size() << "\n";
-        fread(mappings.data(), sizeof(MappingRecord), num_mappings_to_load_on_current_rid, file);
-        //std::cerr << "Load mappings\n";
-        num_loaded_mappings_on_current_rid += num_mappings_to_load_on_current_rid;
-        num_mappings = num_mappings_to_load_on_current_rid;
-      } else {
-        // Move to next rid
-        ++current_rid;
-        if (current_rid < num_reference_sequences) {
-          //std::cerr << "Load size\n";
-          fread(&num_mappings_on_current_rid, sizeof(size_t), 1, file);
-          //std::cerr << "Load size " << num_mappings_on_current_rid << "\n";
-          num_loaded_mappings_on_current_rid = 0;
-        } else {
-          all_loaded = true;
-          break;
-        }
-      }
-    }
-    current_mapping_index = 0;
-  }
-  inline void Next(uint32_t num_reference_sequences) {
-    ++current_mapping_index;
-    if (current_mapping_index >= num_mappings) {
-      LoadTempMappingBlock(num_reference_sequences);
-    }
+  uint64_t GetReadId() const {
+    return read_id;
   }
 };
+typedef BasicPairedEndMappingWithoutBarcode<uint32_t> PairedEndMappingWithoutBarcode;
+typedef BasicPairedEndMappingWithoutBarcode<WideReadId> WidePairedEndMappingWithoutBarcode;
+
+static_assert(sizeof(MappingWithoutBarcode) == 12 && sizeof(MappingWithBarcode) == 16 && sizeof(PairedEndMappingWithoutBarcode) == 16 && sizeof(PairedEndMappingWithBarcode) == 20 && sizeof(PairedEndFragmentWithBarcode) == 16, "The compact records with 32-bit read ids should be packed");
+static_assert(sizeof(WideMappingWithoutBarcode) == 16 && sizeof(WideMappingWithBarcode) == 20 && sizeof(WidePairedEndMappingWithoutBarcode) == 20 && sizeof(WidePairedEndMappingWithBarcode) == 24 && sizeof(WidePairedEndFragmentWithBarcode) == 20, "The compact records with wide read ids should be packed");
 
 template <typename MappingRecord>
 class OutputTools {
  public:
   OutputTools() {}
   virtual ~OutputTools() {}
-  inline void OutputTempMapping(const std::string &temp_mapping_output_file_path, uint32_t num_reference_sequences, const std::vector<std::vector<MappingRecord> > &mappings) {
-    FILE *temp_mapping_output_file = fopen(temp_mapping_output_file_path.c_str(), "wb");
-    assert(temp_mapping_output_file != NULL);
-    for (size_t ri = 0; ri < num_reference_sequences; ++ri) {
-      // make sure mappings[ri] exists even if its size is 0
-      size_t num_mappings = mappings[ri].size();
-      fwrite(&num_mappings, sizeof(size_t), 1, temp_mapping_output_file);
-      if (mappings[ri].size() > 0) {
-        fwrite(mappings[ri].data(), sizeof(MappingRecord), mappings[ri].size(), temp_mapping_output_file);
-      }
-    }
-    fclose(temp_mapping_output_file);
-  }
   inline void LoadBinaryTempMapping(const std::string &temp_mapping_file_path, uint32_t num_reference_sequences, std::vector<std::vector<MappingRecord> > &mappings) {
     FILE *temp_mapping_file = fopen(temp_mapping_file_path.c_str(), "rb");
     assert(temp_mapping_file != NULL);
@@ -637,7 +674,7 @@ class OutputTools {
       }
     } 
   }
-  void OutputPeaks(uint32_t peak_start_position, uint16_t peak_length, uint32_t rid, const SequenceBatch &reference) {
+  void OutputPeaks(uint32_t peak_start_position, uint32_t peak_length, uint32_t rid, const SequenceBatch &reference) {
     const char *sequence_name = reference.GetSequenceNameAt(rid);
     fprintf(peak_output_file_, "%s\t%u\t%u\n", sequence_name, peak_start_position + 1, peak_start_position + peak_length);
   }
@@ -679,13 +716,16 @@ class BEDOutputTools : public OutputTools<MappingRecord> {
   }
 };
 
-template <>
-inline void BEDOutputTools<MappingWithBarcode>::AppendMapping(uint32_t rid, const SequenceBatch &reference, const MappingWithBarcode &mapping) {
-  std::string strand = mapping.IsPositive() ? "+" : "-";
-  const char *reference_sequence_name = reference.GetSequenceNameAt(rid);
-  uint32_t mapping_end_position = mapping.GetEndPosition();
-  this->AppendMappingOutput(std::string(reference_sequence_name) + "\t" + std::to_string(mapping.GetStartPosition()) + "\t" + std::to_string(mapping_end_position) + "\t" + Seed2Sequence(mapping.cell_barcode, cell_barcode_length_) +"\n");
-}
+template <typename ReadId>
+class BEDOutputTools<BasicMappingWithBarcode<ReadId> > : public OutputTools<BasicMappingWithBarcode<ReadId> > {
+  void OutputHeader(uint32_t num_reference_sequences, const SequenceBatch &reference) {
+  }
+  inline void AppendMapping(uint32_t rid, const SequenceBatch &reference, const BasicMappingWithBarcode<ReadId> &mapping) {
+    const char *reference_sequence_name = reference.GetSequenceNameAt(rid);
+    uint32_t mapping_end_position = mapping.GetEndPosition();
+    this->AppendMappingOutput(std::string(reference_sequence_name) + "\t" + std::to_string(mapping.GetStartPosition()) + "\t" + std::to_string(mapping_end_position) + "\t" + this->Seed2Sequence(mapping.cell_barcode, this->cell_barcode_length_) +"\n");
+  }
+};
 
 template <typename MappingRecord>
 class BEDPEOutputTools : public OutputTools<MappingRecord> {
@@ -699,15 +739,27 @@ class BEDPEOutputTools : public OutputTools<MappingRecord> {
   }
 };
 
-template <>
-//class BEDPEOutputTools<PairedEndMappingWithBarcode> : public OutputTools<PairedEndMappingWithBarcode> {
-  inline void BEDPEOutputTools<PairedEndMappingWithBarcode>::AppendMapping(uint32_t rid, const SequenceBatch &reference, const PairedEndMappingWithBarcode &mapping) {
-    std::string strand = mapping.IsPositive() ? "+" : "-";
+template <typename ReadId>
+class BEDPEOutputTools<BasicPairedEndMappingWithBarcode<ReadId> > : public OutputTools<BasicPairedEndMappingWithBarcode<ReadId> > {
+  void OutputHeader(uint32_t num_reference_sequences, const SequenceBatch &reference) {
+  }
+  inline void AppendMapping(uint32_t rid, const SequenceBatch &reference, const BasicPairedEndMappingWithBarcode<ReadId> &mapping) {
+    const char *reference_sequence_name = reference.GetSequenceNameAt(rid);
+    uint32_t mapping_end_position = mapping.GetEndPosition();
+    this->AppendMappingOutput(std::string(reference_sequence_name) + "\t" + std::to_string(mapping.GetStartPosition()) + "\t" + std::to_string(mapping_end_position) + "\t" + this->Seed2Sequence(mapping.cell_barcode, this->cell_barcode_length_) + "\t" + std::to_string(mapping.num_dups) + "\n");
+  }
+};
+
+template <typename ReadId>
+class BEDPEOutputTools<BasicPairedEndFragmentWithBarcode<ReadId> > : public OutputTools<BasicPairedEndFragmentWithBarcode<ReadId> > {
+  void OutputHeader(uint32_t num_reference_sequences, const SequenceBatch &reference) {
+  }
+  inline void AppendMapping(uint32_t rid, const SequenceBatch &reference, const BasicPairedEndFragmentWithBarcode<ReadId> &mapping) {
     const char *reference_sequence_name = reference.GetSequenceNameAt(rid);
     uint32_t mapping_end_position = mapping.GetEndPosition();
-    this->AppendMappingOutput(std::string(reference_sequence_name) + "\t" + std::to_string(mapping.GetStartPosition()) + "\t" + std::to_string(mapping_end_position) + "\t" + Seed2Sequence(mapping.cell_barcode, cell_barcode_length_) + "\t" + std::to_string(mapping.num_dups) + "\n");
+    this->AppendMappingOutput(std::string(reference_sequence_name) + "\t" + std::to_string(mapping.GetStartPosition()) + "\t" + std::to_string(mapping_end_position) + "\t" + this->Seed2Sequence(mapping.cell_barcode, this->cell_barcode_length_) + "\t" + std::to_string(mapping.num_dups) + "\n");
   }
-//};
+};
 
 template <typename MappingRecord>
 class TagAlignOutputTools : public OutputTools<MappingRecord> {
@@ -723,6 +775,7 @@ class TagAlignOutputTools : public OutputTools<MappingRecord> {
 
 template <typename MappingRecord>
 class PairedTagAlignOutputTools : public OutputTools<MappingRecord> {
+  static_assert(std::is_same<MappingRecord, typename FullLayoutTraits<MappingRecord>::FullLayout>::value, "TagAlign output needs the alignment lengths of the reads");
   void OutputHeader(uint32_t num_reference_sequences, const SequenceBatch &reference) {
   }
   inline void AppendMapping(uint32_t rid, const SequenceBatch &reference, const MappingRecord &mapping) {
@@ -764,23 +817,31 @@ inline void PAFOutputTools<PAFMapping>::AppendMapping(uint32_t rid, const Sequen
   this->AppendMappingOutput(mapping.read_name + "\t" + std::to_string(mapping.read_length) + "\t" + std::to_string(0) + "\t" + std::to_string(mapping.read_length) + "\t" + strand + "\t" + std::string(reference_sequence_name) + "\t" + std::to_string(reference_sequence_length) + "\t" + std::to_string(mapping.fragment_start_position) + "\t" + std::to_string(mapping_end_position) + "\t" + std::to_string(mapping.read_length) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(mapping.mapq) + "\n");
 }
 
-template <>
-inline void PAFOutputTools<MappingWithBarcode>::AppendMapping(uint32_t rid, const SequenceBatch &reference, const MappingWithBarcode &mapping) {
-  const char *reference_sequence_name = reference.GetSequenceNameAt(rid);
-  uint32_t reference_sequence_length = reference.GetSequenceLengthAt(rid);
-  std::string strand = mapping.IsPositive() ? "+" : "-";
-  uint32_t mapping_end_position = mapping.fragment_start_position + mapping.fragment_length;
-  this->AppendMappingOutput(std::to_string(mapping.read_id) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(0) + "\t" + std::to_string(mapping.fragment_length) + "\t" + strand + "\t" + std::string(reference_sequence_name) + "\t" + std::to_string(reference_sequence_length) + "\t" + std::to_string(mapping.fragment_start_position) + "\t" + std::to_string(mapping_end_position) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(mapping.mapq) + "\n");
-}
+template <typename ReadId>
+class PAFOutputTools<BasicMappingWithBarcode<ReadId> > : public OutputTools<BasicMappingWithBarcode<ReadId> > {
+  void OutputHeader(uint32_t num_reference_sequences, const SequenceBatch &reference) {
+  }
+  inline void AppendMapping(uint32_t rid, const SequenceBatch &reference, const BasicMappingWithBarcode<ReadId> &mapping) {
+    const char *reference_sequence_name = reference.GetSequenceNameAt(rid);
+    uint32_t reference_sequence_length = reference.GetSequenceLengthAt(rid);
+    std::string strand = mapping.IsPositive() ? "+" : "-";
+    uint32_t mapping_end_position = mapping.fragment_start_position + mapping.fragment_length;
+    this->AppendMappingOutput(std::to_string(mapping.GetReadId()) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(0) + "\t" + std::to_string(mapping.fragment_length) + "\t" + strand + "\t" + std::string(reference_sequence_name) + "\t" + std::to_string(reference_sequence_length) + "\t" + std::to_string(mapping.fragment_start_position) + "\t" + std::to_string(mapping_end_position) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(mapping.mapq) + "\n");
+  }
+};
 
-template <>
-inline void PAFOutputTools<MappingWithoutBarcode>::AppendMapping(uint32_t rid, const SequenceBatch &reference, const MappingWithoutBarcode &mapping) {
-  const char *reference_sequence_name = reference.GetSequenceNameAt(rid);
-  uint32_t reference_sequence_length = reference.GetSequenceLengthAt(rid);
-  std::string strand = mapping.IsPositive() ? "+" : "-";
-  uint32_t mapping_end_position = mapping.fragment_start_position + mapping.fragment_length;
-  this->AppendMappingOutput(std::to_string(mapping.read_id) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(0) + "\t" + std::to_string(mapping.fragment_length) + "\t" + strand + "\t" + std::string(reference_sequence_name) + "\t" + std::to_string(reference_sequence_length) + "\t" + std::to_string(mapping.fragment_start_position) + "\t" + std::to_string(mapping_end_position) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(mapping.mapq) + "\n");
-}
+template <typename ReadId>
+class PAFOutputTools<BasicMappingWithoutBarcode<ReadId> > : public OutputTools<BasicMappingWithoutBarcode<ReadId> > {
+  void OutputHeader(uint32_t num_reference_sequences, const SequenceBatch &reference) {
+  }
+  inline void AppendMapping(uint32_t rid, const SequenceBatch &reference, const BasicMappingWithoutBarcode<ReadId> &mapping) {
+    const char *reference_sequence_name = reference.GetSequenceNameAt(rid);
+    uint32_t reference_sequence_length = reference.GetSequenceLengthAt(rid);
+    std::string strand = mapping.IsPositive() ? "+" : "-";
+    uint32_t mapping_end_position = mapping.fragment_start_position + mapping.fragment_length;
+    this->AppendMappingOutput(std::to_string(mapping.GetReadId()) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(0) + "\t" + std::to_string(mapping.fragment_length) + "\t" + strand + "\t" + std::string(reference_sequence_name) + "\t" + std::to_string(reference_sequence_length) + "\t" + std::to_string(mapping.fragment_start_position) + "\t" + std::to_string(mapping_end_position) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(mapping.fragment_length) + "\t" + std::to_string(mapping.mapq) + "\n");
+  }
+};
 
 template <typename MappingRecord>
 class PairedPAFOutputTools : public OutputTools<MappingRecord> {
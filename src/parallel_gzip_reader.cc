@@ -0,0 +1,293 @@
+#include "parallel_gzip_reader.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "chromap.h"
+
+namespace chromap {
+bool ParallelGzipReader::IsStream(const std::string &file_path) {
+  if (file_path == "-") {
+    return true;
+  }
+  struct stat file_status;
+  return stat(file_path.c_str(), &file_status) == 0 && !S_ISREG(file_status.st_mode);
+}
+
+bool ParallelGzipReader::Open(const std::string &file_path, int num_inflate_threads) {
+  Close();
+  file_path_ = file_path;
+  num_bgzf_inflate_threads_ = std::max(1, std::min(num_inflate_threads, MAX_NUM_BGZF_INFLATE_THREADS));
+  stop_loading_ = false;
+  current_chunk_index_ = -1;
+  current_chunk_offset_ = 0;
+  reached_end_ = false;
+  uncompressed_file_size_ = 0;
+  if (IsStream(file_path_)) {
+    // A pipe cannot be rewound after sniffing the BGZF header, so it is always
+    // inflated by gzread, which reads BGZF and plain text as well.
+    int file_descriptor = file_path_ == "-" ? dup(STDIN_FILENO) : open(file_path_.c_str(), O_RDONLY);
+    if (file_descriptor < 0) {
+      return false;
+    }
+    gzip_file_ = gzdopen(file_descriptor, "r");
+    if (gzip_file_ == NULL) {
+      close(file_descriptor);
+      return false;
+    }
+    is_bgzf_ = false;
+    InitializeChunks(3);
+    loading_thread_ = std::thread(&ParallelGzipReader::InflateGzipChunks, this);
+    is_open_ = true;
+    return true;
+  }
+  FILE *file = fopen(file_path_.c_str(), "rb");
+  if (file == NULL) {
+    return false;
+  }
+  // BGZF files start with a gzip header whose only extra subfield is "BC".
+  uint8_t header[16];
+  size_t num_header_bytes = fread(header, 1, 16, file);
+  is_bgzf_ = num_header_bytes == 16 && header[0] == 31 && header[1] == 139 && header[2] == 8 && (header[3] & 4) != 0 && header[10] == 6 && header[11] == 0 && header[12] == 'B' && header[13] == 'C' && header[14] == 2 && header[15] == 0;
+  bool is_gzip = num_header_bytes >= 2 && header[0] == 31 && header[1] == 139;
+  struct stat file_status;
+  if (!is_gzip && fstat(fileno(file), &file_status) == 0) {
+    uncompressed_file_size_ = file_status.st_size;
+  }
+  InitializeChunks(is_bgzf_ ? 2 * num_bgzf_inflate_threads_ + 2 : 3);
+  if (is_bgzf_) {
+    rewind(file);
+    bgzf_file_ = file;
+    bgzf_chunk_queue_.reset(new BoundedQueue<int>(chunks_.size() + num_bgzf_inflate_threads_));
+    loading_thread_ = std::thread(&ParallelGzipReader::LoadBGZFChunks, this);
+    for (int thread_index = 0; thread_index < num_bgzf_inflate_threads_; ++thread_index) {
+      inflate_threads_.emplace_back(&ParallelGzipReader::InflateBGZFChunks, this);
+    }
+  } else {
+    fclose(file);
+    gzip_file_ = gzopen(file_path_.c_str(), "r");
+    if (gzip_file_ == NULL) {
+      return false;
+    }
+    loading_thread_ = std::thread(&ParallelGzipReader::InflateGzipChunks, this);
+  }
+  is_open_ = true;
+  return true;
+}
+
+void ParallelGzipReader::InitializeChunks(int num_chunks) {
+  chunks_.assign(num_chunks, Chunk());
+  free_chunk_queue_.reset(new BoundedQueue<int>(num_chunks));
+  ordered_chunk_queue_.reset(new BoundedQueue<int>(num_chunks + 1));
+  for (int chunk_index = 0; chunk_index < num_chunks; ++chunk_index) {
+    free_chunk_queue_->Push(chunk_index);
+  }
+}
+
+void ParallelGzipReader::Close() {
+  if (!is_open_) {
+    return;
+  }
+  // Drain the chunks still in flight so that the loading thread cannot block
+  // on a full queue, then wait for it to notice the stop flag.
+  stop_loading_ = true;
+  if (current_chunk_index_ >= 0) {
+    free_chunk_queue_->Push(current_chunk_index_);
+    current_chunk_index_ = -1;
+  }
+  while (!reached_end_) {
+    int chunk_index = ordered_chunk_queue_->Pop();
+    if (chunk_index < 0) {
+      reached_end_ = true;
+    } else {
+      free_chunk_queue_->Push(chunk_index);
+    }
+  }
+  loading_thread_.join();
+  for (std::thread &inflate_thread : inflate_threads_) {
+    inflate_thread.join();
+  }
+  inflate_threads_.clear();
+  if (bgzf_file_ != NULL) {
+    fclose(bgzf_file_);
+    bgzf_file_ = NULL;
+  }
+  if (gzip_file_ != NULL) {
+    gzclose(gzip_file_);
+    gzip_file_ = NULL;
+  }
+  chunks_.clear();
+  is_open_ = false;
+}
+
+int ParallelGzipReader::Read(void *buffer, unsigned length) {
+  while (current_chunk_index_ < 0) {
+    if (reached_end_) {
+      return 0;
+    }
+    int chunk_index = ordered_chunk_queue_->Pop();
+    if (chunk_index < 0) {
+      reached_end_ = true;
+      return 0;
+    }
+    {
+      std::unique_lock<std::mutex> lock(ready_mutex_);
+      ready_condition_.wait(lock, [&] { return chunks_[chunk_index].is_ready; });
+    }
+    if (chunks_[chunk_index].decompressed.empty()) {
+      free_chunk_queue_->Push(chunk_index);
+    } else {
+      current_chunk_index_ = chunk_index;
+      current_chunk_offset_ = 0;
+    }
+  }
+  const std::vector<char> &decompressed = chunks_[current_chunk_index_].decompressed;
+  uint32_t num_bytes = std::min((size_t)length, decompressed.size() - current_chunk_offset_);
+  memcpy(buffer, decompressed.data() + current_chunk_offset_, num_bytes);
+  current_chunk_offset_ += num_bytes;
+  if (current_chunk_offset_ == decompressed.size()) {
+    free_chunk_queue_->Push(current_chunk_index_);
+    current_chunk_index_ = -1;
+  }
+  return num_bytes;
+}
+
+void ParallelGzipReader::MarkChunkReady(int chunk_index) {
+  {
+    std::lock_guard<std::mutex> lock(ready_mutex_);
+    chunks_[chunk_index].is_ready = true;
+  }
+  ready_condition_.notify_all();
+}
+
+void ParallelGzipReader::InflateGzipChunks() {
+  while (!stop_loading_) {
+    int chunk_index = free_chunk_queue_->Pop();
+    if (stop_loading_) {
+      break;
+    }
+    Chunk &chunk = chunks_[chunk_index];
+    chunk.decompressed.resize(GZIP_CHUNK_SIZE_);
+    int num_bytes = gzread(gzip_file_, chunk.decompressed.data(), GZIP_CHUNK_SIZE_);
+    if (num_bytes < 0) {
+      Chromap<>::ExitWithMessage("Failed to decompress " + file_path_);
+    }
+    if (num_bytes == 0) {
+      break;
+    }
+    chunk.decompressed.resize(num_bytes);
+    MarkChunkReady(chunk_index);
+    ordered_chunk_queue_->Push(chunk_index);
+  }
+  ordered_chunk_queue_->Push(-1);
+}
+
+bool ParallelGzipReader::ReadBGZFBlock(Chunk &chunk) {
+  uint8_t header[12];
+  size_t num_header_bytes = fread(header, 1, 12, bgzf_file_);
+  if (num_header_bytes == 0) {
+    return false;
+  }
+  if (num_header_bytes < 12 || header[0] != 31 || header[1] != 139 || header[2] != 8 || (header[3] & 4) == 0) {
+    Chromap<>::ExitWithMessage("Corrupted BGZF block in " + file_path_);
+  }
+  uint32_t extra_length = header[10] | (header[11] << 8);
+  size_t block_start = chunk.compressed.size();
+  chunk.compressed.resize(block_start + 12 + extra_length);
+  memcpy(chunk.compressed.data() + block_start, header, 12);
+  uint8_t *extra = chunk.compressed.data() + block_start + 12;
+  if (fread(extra, 1, extra_length, bgzf_file_) != extra_length) {
+    Chromap<>::ExitWithMessage("Truncated BGZF block in " + file_path_);
+  }
+  // The total block size minus one is stored in the "BC" subfield.
+  uint32_t block_size = 0;
+  for (uint32_t subfield_start = 0; subfield_start + 4 <= extra_length;) {
+    const uint8_t *subfield = extra + subfield_start;
+    uint32_t subfield_length = subfield[2] | (subfield[3] << 8);
+    if (subfield[0] == 'B' && subfield[1] == 'C' && subfield_length == 2 && subfield_start + 6 <= extra_length) {
+      block_size = (subfield[4] | (subfield[5] << 8)) + 1;
+    }
+    subfield_start += 4 + subfield_length;
+  }
+  if (block_size < 12 + extra_length + 8) {
+    Chromap<>::ExitWithMessage("Corrupted BGZF block in " + file_path_);
+  }
+  uint32_t remaining_length = block_size - 12 - extra_length;
+  chunk.compressed.resize(block_start + block_size);
+  if (fread(chunk.compressed.data() + block_start + 12 + extra_length, 1, remaining_length, bgzf_file_) != remaining_length) {
+    Chromap<>::ExitWithMessage("Truncated BGZF block in " + file_path_);
+  }
+  const uint8_t *trailer = chunk.compressed.data() + block_start + block_size - 8;
+  BGZFBlock block;
+  block.data_offset = block_start + 12 + extra_length;
+  block.data_length = remaining_length - 8;
+  block.crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t)trailer[3] << 24);
+  block.decompressed_length = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((uint32_t)trailer[7] << 24);
+  block.decompressed_offset = chunk.blocks.empty() ? 0 : chunk.blocks.back().decompressed_offset + chunk.blocks.back().decompressed_length;
+  chunk.blocks.push_back(block);
+  return true;
+}
+
+void ParallelGzipReader::LoadBGZFChunks() {
+  while (!stop_loading_) {
+    int chunk_index = free_chunk_queue_->Pop();
+    if (stop_loading_) {
+      break;
+    }
+    Chunk &chunk = chunks_[chunk_index];
+    chunk.compressed.clear();
+    chunk.blocks.clear();
+    while ((int)chunk.blocks.size() < NUM_BGZF_BLOCKS_PER_CHUNK_ && ReadBGZFBlock(chunk)) {
+    }
+    if (chunk.blocks.empty()) {
+      break;
+    }
+    chunk.decompressed.resize(chunk.blocks.back().decompressed_offset + chunk.blocks.back().decompressed_length);
+    {
+      std::lock_guard<std::mutex> lock(ready_mutex_);
+      chunk.is_ready = false;
+    }
+    ordered_chunk_queue_->Push(chunk_index);
+    bgzf_chunk_queue_->Push(chunk_index);
+  }
+  ordered_chunk_queue_->Push(-1);
+  for (int thread_index = 0; thread_index < num_bgzf_inflate_threads_; ++thread_index) {
+    bgzf_chunk_queue_->Push(-1);
+  }
+}
+
+void ParallelGzipReader::InflateBGZFChunks() {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, -15) != Z_OK) { // raw deflate data
+    Chromap<>::ExitWithMessage("Failed to initialize zlib");
+  }
+  while (true) {
+    int chunk_index = bgzf_chunk_queue_->Pop();
+    if (chunk_index < 0) {
+      break;
+    }
+    Chunk &chunk = chunks_[chunk_index];
+    for (const BGZFBlock &block : chunk.blocks) {
+      if (block.decompressed_length == 0) { // e.g. the EOF marker block
+        continue;
+      }
+      Bytef *decompressed = (Bytef*)chunk.decompressed.data() + block.decompressed_offset;
+      inflateReset(&stream);
+      stream.next_in = chunk.compressed.data() + block.data_offset;
+      stream.avail_in = block.data_length;
+      stream.next_out = decompressed;
+      stream.avail_out = block.decompressed_length;
+      if (inflate(&stream, Z_FINISH) != Z_STREAM_END || stream.avail_out != 0 || crc32(0, decompressed, block.decompressed_length) != block.crc) {
+        Chromap<>::ExitWithMessage("Failed to decompress BGZF block in " + file_path_);
+      }
+    }
+    MarkChunkReady(chunk_index);
+  }
+  inflateEnd(&stream);
+}
+} // namespace chromap
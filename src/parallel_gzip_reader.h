@@ -0,0 +1,99 @@
+#ifndef PARALLELGZIPREADER_H_
+#define PARALLELGZIPREADER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <zlib.h>
+
+#include "bounded_queue.h"
+
+namespace chromap {
+// Reads a (possibly gzipped) sequence file with decompression running ahead of
+// the parser. BGZF files are cut into chunks of independent blocks that are
+// inflated in parallel by a pool of threads sized by the caller. Plain gzip or
+// uncompressed files, as well as stdin and named pipes, are inflated by a
+// single thread that keeps a few chunks ahead. Either way the decompressed
+// chunks are handed to Read in file order.
+class ParallelGzipReader {
+ public:
+  ParallelGzipReader() {}
+  ~ParallelGzipReader() {
+    Close();
+  }
+  // Return false if the file cannot be opened. The path "-" reads stdin. BGZF
+  // files are inflated by num_inflate_threads threads, at most
+  // MAX_NUM_BGZF_INFLATE_THREADS.
+  bool Open(const std::string &file_path, int num_inflate_threads);
+  void Close();
+  // Same contract as gzread: return the number of bytes copied into buffer and
+  // return 0 at the end of the file.
+  int Read(void *buffer, unsigned length);
+  inline bool IsBGZF() const {
+    return is_bgzf_;
+  }
+  // Size of an uncompressed regular file, or 0 if the size of the content is
+  // unknown before reading it, i.e. for gzipped files and streams.
+  inline uint64_t GetUncompressedFileSize() const {
+    return uncompressed_file_size_;
+  }
+  // Return true for stdin and named pipes, which can only be read once.
+  static bool IsStream(const std::string &file_path);
+  static const int MAX_NUM_BGZF_INFLATE_THREADS = 4;
+
+ protected:
+  struct BGZFBlock {
+    uint32_t data_offset; // offset of the deflate data in the compressed chunk
+    uint32_t data_length;
+    uint32_t decompressed_offset;
+    uint32_t decompressed_length;
+    uint32_t crc;
+  };
+  struct Chunk {
+    std::vector<uint8_t> compressed;
+    std::vector<BGZFBlock> blocks;
+    std::vector<char> decompressed;
+    bool is_ready;
+  };
+  // Return false at the end of the file.
+  bool ReadBGZFBlock(Chunk &chunk);
+  void LoadBGZFChunks();
+  void InflateBGZFChunks();
+  void InflateGzipChunks();
+  void MarkChunkReady(int chunk_index);
+  void InitializeChunks(int num_chunks);
+  static const int NUM_BGZF_BLOCKS_PER_CHUNK_ = 64;
+  static const uint32_t GZIP_CHUNK_SIZE_ = 1 << 22;
+  std::string file_path_;
+  bool is_open_ = false;
+  bool is_bgzf_ = false;
+  uint64_t uncompressed_file_size_ = 0;
+  int num_bgzf_inflate_threads_ = 1;
+  FILE *bgzf_file_ = NULL;
+  gzFile gzip_file_ = NULL;
+  std::vector<Chunk> chunks_;
+  // Chunk indices flow from free_chunk_queue_ to the loading thread, which
+  // pushes them to ordered_chunk_queue_ in file order (and to
+  // bgzf_chunk_queue_ for the inflate threads). Read consumes
+  // ordered_chunk_queue_ and recycles each chunk once it is drained. A chunk
+  // index of -1 marks the end of the file.
+  std::unique_ptr<BoundedQueue<int> > free_chunk_queue_;
+  std::unique_ptr<BoundedQueue<int> > ordered_chunk_queue_;
+  std::unique_ptr<BoundedQueue<int> > bgzf_chunk_queue_;
+  std::mutex ready_mutex_;
+  std::condition_variable ready_condition_;
+  std::atomic<bool> stop_loading_;
+  std::thread loading_thread_;
+  std::vector<std::thread> inflate_threads_;
+  int current_chunk_index_ = -1;
+  uint32_t current_chunk_offset_ = 0;
+  bool reached_end_ = false;
+};
+} // namespace chromap
+
+#endif // PARALLELGZIPREADER_H_
@@ -0,0 +1,170 @@
+#ifndef RADIXSORT_H_
+#define RADIXSORT_H_
+
+#include <algorithm>
+#include <utility>
+
+#include "sequence_batch.h" // used by output_tools.h
+#include "output_tools.h"
+
+namespace chromap {
+// A 64-bit key packing the leading fields compared by operator< of a mapping
+// record, so that a smaller key always means a smaller record. Records with
+// the same key are ordered by operator< itself.
+template <typename MappingRecord>
+struct RadixSortKey {
+  // SAMMapping and PairsMapping don't have a key consistent with operator<.
+  static bool IsSupported() {
+    return false;
+  }
+  static uint64_t Get(const MappingRecord &mapping) {
+    return 0;
+  }
+};
+
+// (start, length, barcode, ...): the top 16 bits of the barcode.
+template <typename ReadId>
+struct RadixSortKey<BasicMappingWithBarcode<ReadId> > {
+  static bool IsSupported() {
+    return true;
+  }
+  static uint64_t Get(const BasicMappingWithBarcode<ReadId> &mapping) {
+    return ((uint64_t)mapping.fragment_start_position << 32) | ((uint64_t)mapping.fragment_length << 16) | (mapping.cell_barcode >> 16);
+  }
+};
+
+template <typename ReadId>
+struct RadixSortKey<BasicPairedEndMappingWithBarcode<ReadId> > {
+  static bool IsSupported() {
+    return true;
+  }
+  static uint64_t Get(const BasicPairedEndMappingWithBarcode<ReadId> &mapping) {
+    return ((uint64_t)mapping.fragment_start_position << 32) | ((uint64_t)mapping.fragment_length << 16) | (mapping.cell_barcode >> 16);
+  }
+};
+
+template <typename ReadId>
+struct RadixSortKey<BasicPairedEndFragmentWithBarcode<ReadId> > {
+  static bool IsSupported() {
+    return true;
+  }
+  static uint64_t Get(const BasicPairedEndFragmentWithBarcode<ReadId> &mapping) {
+    return ((uint64_t)mapping.fragment_start_position << 32) | ((uint64_t)mapping.fragment_length << 16) | (mapping.cell_barcode >> 16);
+  }
+};
+
+// (start, length, mapq, direction, is_unique, read id, ...): the top 8 bits of
+// the read id.
+template <typename ReadId>
+struct RadixSortKey<BasicMappingWithoutBarcode<ReadId> > {
+  static bool IsSupported() {
+    return true;
+  }
+  static uint64_t Get(const BasicMappingWithoutBarcode<ReadId> &mapping) {
+    return ((uint64_t)mapping.fragment_start_position << 32) | ((uint64_t)mapping.fragment_length << 16) | (mapping.mapq << 10) | (mapping.direction << 9) | (mapping.is_unique << 8) | (uint8_t)(mapping.GetReadId() >> (ReadIdTraits<ReadId>::NUM_BITS - 8));
+  }
+};
+
+template <typename ReadId>
+struct RadixSortKey<BasicPairedEndMappingWithoutBarcode<ReadId> > {
+  static bool IsSupported() {
+    return true;
+  }
+  static uint64_t Get(const BasicPairedEndMappingWithoutBarcode<ReadId> &mapping) {
+    return ((uint64_t)mapping.fragment_start_position << 32) | ((uint64_t)mapping.fragment_length << 16) | (mapping.mapq << 10) | (mapping.direction << 9) | (mapping.is_unique << 8) | (uint8_t)(mapping.GetReadId() >> (ReadIdTraits<ReadId>::NUM_BITS - 8));
+  }
+};
+
+template <>
+struct RadixSortKey<PAFMapping> {
+  static bool IsSupported() {
+    return true;
+  }
+  static uint64_t Get(const PAFMapping &mapping) {
+    return ((uint64_t)mapping.fragment_start_position << 32) | ((uint64_t)mapping.fragment_length << 16) | (mapping.mapq << 10) | (mapping.direction << 9) | (mapping.is_unique << 8) | (mapping.read_id >> 32);
+  }
+};
+
+// (start, length, mapq1, mapq2, direction, is_unique, ...).
+template <>
+struct RadixSortKey<PairedPAFMapping> {
+  static bool IsSupported() {
+    return true;
+  }
+  static uint64_t Get(const PairedPAFMapping &mapping) {
+    return ((uint64_t)mapping.fragment_start_position << 32) | ((uint64_t)mapping.fragment_length << 16) | (mapping.mapq1 << 8) | (mapping.mapq2 << 2) | (mapping.direction << 1) | mapping.is_unique;
+  }
+};
+
+const int RADIX_SORT_MIN_SIZE = 64;
+
+// In-place MSD radix sort on the key, 8 bits at a time. Buckets that are small
+// or whose key bits are used up are finished by std::sort, so the result is
+// the same as sorting the whole range with std::sort.
+template <typename MappingRecord>
+void RadixSortMappingsOnDigit(MappingRecord *begin, MappingRecord *end, int shift) {
+  if (end - begin <= RADIX_SORT_MIN_SIZE || shift < 0) {
+    std::sort(begin, end);
+    return;
+  }
+  size_t bucket_sizes[256] = {0};
+  for (MappingRecord *it = begin; it != end; ++it) {
+    ++bucket_sizes[(RadixSortKey<MappingRecord>::Get(*it) >> shift) & 255];
+  }
+  MappingRecord *bucket_heads[256];
+  MappingRecord *bucket_ends[256];
+  MappingRecord *bucket_start = begin;
+  for (int bi = 0; bi < 256; ++bi) {
+    bucket_heads[bi] = bucket_start;
+    bucket_start += bucket_sizes[bi];
+    bucket_ends[bi] = bucket_start;
+  }
+  // Swap each misplaced record into the head of its bucket until every head
+  // reaches the end of its bucket.
+  for (int bi = 0; bi < 256; ++bi) {
+    while (bucket_heads[bi] != bucket_ends[bi]) {
+      int digit = (RadixSortKey<MappingRecord>::Get(*bucket_heads[bi]) >> shift) & 255;
+      if (digit == bi) {
+        ++bucket_heads[bi];
+      } else {
+        std::swap(*bucket_heads[bi], *bucket_heads[digit]);
+        ++bucket_heads[digit];
+      }
+    }
+  }
+  // The lowest digit may overlap bits already sorted on, which is harmless.
+  int next_shift = shift == 0 ? -1 : std::max(shift - 8, 0);
+  MappingRecord *bucket_begin = begin;
+  for (int bi = 0; bi < 256; ++bi) {
+    if (bucket_sizes[bi] > 1) {
+      RadixSortMappingsOnDigit(bucket_begin, bucket_begin + bucket_sizes[bi], next_shift);
+    }
+    bucket_begin += bucket_sizes[bi];
+  }
+}
+
+// Sort the records by operator<, with the radix sort when the record type has a
+// key.
+template <typename MappingRecord>
+void SortMappings(MappingRecord *begin, MappingRecord *end) {
+  if (!RadixSortKey<MappingRecord>::IsSupported()) {
+    std::sort(begin, end);
+    return;
+  }
+  // Start from the highest bit set in any key, so the first digit is not wasted
+  // on bits that are zero for all the records, e.g. the top bits of the start
+  // position on a short reference sequence.
+  uint64_t key_bits = 0;
+  for (MappingRecord *it = begin; it != end; ++it) {
+    key_bits |= RadixSortKey<MappingRecord>::Get(*it);
+  }
+  int num_key_bits = 0;
+  while (key_bits != 0) {
+    ++num_key_bits;
+    key_bits >>= 1;
+  }
+  RadixSortMappingsOnDigit(begin, end, num_key_bits == 0 ? -1 : std::max(num_key_bits - 8, 0));
+}
+} // namespace chromap
+
+#endif // RADIXSORT_H_
@@ -1,6 +1,10 @@
 #include "sequence_batch.h"
 
+#include <ctype.h>
+#include <string.h>
+
 #include <tuple>
+#include <utility>
 
 #include "chromap.h"
 
@@ -8,34 +12,237 @@ namespace chromap {
 constexpr uint8_t SequenceBatch::char_to_uint8_table_[256];
 constexpr char SequenceBatch::uint8_to_char_table_[8];
 
-void SequenceBatch::InitializeLoading(const std::string &sequence_file_path) {
-  sequence_file_path_ = sequence_file_path;
-  sequence_file_ = gzopen(sequence_file_path_.c_str(), "r");
-  if (sequence_file_ == NULL) {
-    Chromap<>::ExitWithMessage("Cannot find sequence file" + sequence_file_path);
+void SequenceBatch::InitializeLoading(const std::string &sequence_file_path, int num_inflate_threads) {
+  InitializeLoading(std::vector<std::string>(1, sequence_file_path), 0, num_inflate_threads);
+}
+
+void SequenceBatch::InitializeLoading(const std::vector<std::string> &sequence_file_paths, int num_prefetched_files, int num_inflate_threads) {
+  sequence_file_paths_ = sequence_file_paths;
+  num_prefetched_files_ = num_prefetched_files;
+  num_inflate_threads_ = num_inflate_threads;
+  next_file_index_ = 0;
+  prefetched_sequence_files_.clear();
+  if (!OpenNextSequenceFile()) {
+    Chromap<>::ExitWithMessage("No sequence file to load");
+  }
+}
+
+bool SequenceBatch::OpenNextSequenceFile() {
+  // Keep the next few files open so that their decompression runs ahead
+  // while the current file is parsed.
+  while (next_file_index_ < sequence_file_paths_.size() && prefetched_sequence_files_.size() <= (size_t)num_prefetched_files_) {
+    std::unique_ptr<ParallelGzipReader> sequence_file(new ParallelGzipReader());
+    if (!sequence_file->Open(sequence_file_paths_[next_file_index_], num_inflate_threads_)) {
+      Chromap<>::ExitWithMessage("Cannot find sequence file" + sequence_file_paths_[next_file_index_]);
+    }
+    prefetched_sequence_files_.push_back(std::move(sequence_file));
+    ++next_file_index_;
+  }
+  if (prefetched_sequence_files_.empty()) {
+    return false;
+  }
+  sequence_file_ = std::move(prefetched_sequence_files_.front());
+  prefetched_sequence_files_.pop_front();
+  loading_file_index_ = next_file_index_ - prefetched_sequence_files_.size() - 1;
+  sequence_file_path_ = sequence_file_paths_[loading_file_index_];
+  input_buffer_.resize(1 << 20);
+  input_begin_ = 0;
+  input_end_ = 0;
+  reached_input_end_ = false;
+  split_line_.clear();
+  line_is_split_ = false;
+  has_next_header_line_ = false;
+  return true;
+}
+
+bool SequenceBatch::ReadLine(const char **line, uint32_t *line_length) {
+  if (line_is_split_) {
+    split_line_.clear();
+    line_is_split_ = false;
+  }
+  while (true) {
+    const char *line_start = input_buffer_.data() + input_begin_;
+    const char *line_end = (const char*)memchr(line_start, '\n', input_end_ - input_begin_);
+    if (line_end != NULL) {
+      input_begin_ = line_end + 1 - input_buffer_.data();
+      if (split_line_.empty()) {
+        *line = line_start;
+        *line_length = line_end - line_start;
+      } else {
+        split_line_.append(line_start, line_end - line_start);
+        *line = split_line_.data();
+        *line_length = split_line_.size();
+        line_is_split_ = true;
+      }
+      break;
+    }
+    // Keep the partial line and refill the buffer
+    split_line_.append(line_start, input_end_ - input_begin_);
+    input_begin_ = 0;
+    input_end_ = 0;
+    if (!reached_input_end_) {
+      int num_bytes = sequence_file_->Read(input_buffer_.data(), input_buffer_.size());
+      if (num_bytes > 0) {
+        input_end_ = num_bytes;
+        continue;
+      }
+      reached_input_end_ = true;
+    }
+    if (split_line_.empty()) {
+      return false;
+    }
+    // The last line has no line break
+    *line = split_line_.data();
+    *line_length = split_line_.size();
+    line_is_split_ = true;
+    break;
+  }
+  if (*line_length > 0 && (*line)[*line_length - 1] == '\r') {
+    --(*line_length);
+  }
+  return true;
+}
+
+int SequenceBatch::LoadOneRecord() {
+  // The files are loaded back to back as one stream, but a record never spans
+  // two files.
+  int length = LoadOneRecordFromCurrentFile();
+  while (length == -1 && OpenNextSequenceFile()) {
+    length = LoadOneRecordFromCurrentFile();
+  }
+  current_file_index_ = loading_file_index_;
+  return length;
+}
+
+void SequenceBatch::SwapLoadingState(SequenceBatch &batch) {
+  sequence_file_path_.swap(batch.sequence_file_path_);
+  sequence_file_.swap(batch.sequence_file_);
+  sequence_file_paths_.swap(batch.sequence_file_paths_);
+  std::swap(loading_file_index_, batch.loading_file_index_);
+  std::swap(next_file_index_, batch.next_file_index_);
+  std::swap(num_prefetched_files_, batch.num_prefetched_files_);
+  prefetched_sequence_files_.swap(batch.prefetched_sequence_files_);
+  input_buffer_.swap(batch.input_buffer_);
+  std::swap(input_begin_, batch.input_begin_);
+  std::swap(input_end_, batch.input_end_);
+  std::swap(reached_input_end_, batch.reached_input_end_);
+  split_line_.swap(batch.split_line_);
+  std::swap(line_is_split_, batch.line_is_split_);
+  next_header_line_.swap(batch.next_header_line_);
+  std::swap(has_next_header_line_, batch.has_next_header_line_);
+}
+
+int SequenceBatch::LoadOneRecordFromCurrentFile() {
+  const char *line;
+  uint32_t line_length;
+  if (has_next_header_line_) {
+    line = next_header_line_.data();
+    line_length = next_header_line_.size();
+    has_next_header_line_ = false;
+  } else {
+    do {
+      if (!ReadLine(&line, &line_length)) {
+        return -1;
+      }
+    } while (line_length == 0 || (line[0] != '>' && line[0] != '@'));
+  }
+  // The name ends at the first white space and the rest is the comment
+  uint32_t name_length = 0;
+  while (name_length + 1 < line_length && !isspace(line[name_length + 1])) {
+    ++name_length;
+  }
+  uint32_t comment_length = name_length + 2 < line_length ? line_length - name_length - 2 : 0;
+  uint64_t name_offset = sequence_data_.size();
+  sequence_data_.insert(sequence_data_.end(), line + 1, line + 1 + name_length);
+  sequence_data_.push_back('\0');
+  uint64_t comment_offset = sequence_data_.size();
+  sequence_data_.insert(sequence_data_.end(), line + 2 + name_length, line + 2 + name_length + comment_length);
+  sequence_data_.push_back('\0');
+  // Sequence lines run until the separator of a FASTQ record or the next header
+  uint64_t sequence_offset = sequence_data_.size();
+  uint32_t sequence_length = 0;
+  bool has_qual = false;
+  while (ReadLine(&line, &line_length)) {
+    if (line_length > 0 && (line[0] == '>' || line[0] == '@')) {
+      next_header_line_.assign(line, line_length);
+      has_next_header_line_ = true;
+      break;
+    }
+    if (line_length > 0 && line[0] == '+') {
+      has_qual = true;
+      break;
+    }
+    sequence_data_.insert(sequence_data_.end(), line, line + line_length);
+    sequence_length += line_length;
+  }
+  sequence_data_.push_back('\0');
+  uint64_t qual_offset = sequence_data_.size();
+  if (has_qual) {
+    uint32_t qual_length = 0;
+    while (qual_length < sequence_length && ReadLine(&line, &line_length)) {
+      sequence_data_.insert(sequence_data_.end(), line, line + line_length);
+      qual_length += line_length;
+    }
+    if (qual_length != sequence_length) {
+      sequence_data_.resize(name_offset);
+      return -2;
+    }
+  }
+  sequence_data_.push_back('\0');
+  if (sequence_length == 0) {
+    sequence_data_.resize(name_offset);
+    return 0;
+  }
+  name_offsets_.push_back(name_offset);
+  comment_offsets_.push_back(comment_offset);
+  sequence_offsets_.push_back(sequence_offset);
+  qual_offsets_.push_back(qual_offset);
+  name_lengths_.push_back(name_length);
+  comment_lengths_.push_back(comment_length);
+  sequence_lengths_.push_back(sequence_length);
+  CheckNextId();
+  ids_.push_back(num_loaded_sequences_);
+  negative_sequence_offsets_.push_back(sequence_offset);
+  ++num_loaded_sequences_;
+  return sequence_length;
+}
+
+void SequenceBatch::CheckNextId() const {
+  if ((num_loaded_sequences_ >> num_id_bits_) == 0) {
+    return;
+  }
+  if (num_id_bits_ < READ_ID_BITS) {
+    Chromap<>::ExitWithMessage("Too many reads for " + std::to_string(num_id_bits_) + "-bit read ids, please rerun with --wide-read-ids!");
+  }
+  Chromap<>::ExitWithMessage("Too many reads, read ids are limited to " + std::to_string(READ_ID_BITS) + " bits!");
+}
+
+void SequenceBatch::DiscardSequencesFrom(uint32_t sequence_index) {
+  if (sequence_index < ids_.size()) {
+    sequence_data_.resize(name_offsets_[sequence_index]);
+    name_offsets_.resize(sequence_index);
+    comment_offsets_.resize(sequence_index);
+    sequence_offsets_.resize(sequence_index);
+    qual_offsets_.resize(sequence_index);
+    name_lengths_.resize(sequence_index);
+    comment_lengths_.resize(sequence_index);
+    sequence_lengths_.resize(sequence_index);
+    ids_.resize(sequence_index);
+    negative_sequence_offsets_.resize(sequence_index);
   }
-  sequence_kseq_ = kseq_init(sequence_file_);
 }
 
 uint32_t SequenceBatch::LoadBatch() {
   double real_start_time = Chromap<>::GetRealTime();
   uint32_t num_sequences = 0;
   num_bases_ = 0;
+  DiscardSequencesFrom(0);
   for (uint32_t sequence_index = 0; sequence_index < max_num_sequences_; ++sequence_index) { 
-    int length = kseq_read(sequence_kseq_);
+    int length = LoadOneRecord();
     while (length == 0) { // Skip the sequences of length 0
-      length = kseq_read(sequence_kseq_);
+      length = LoadOneRecord();
     }
     if (length > 0) {
-      kseq_t *sequence = sequence_batch_[sequence_index];
-      std::swap(sequence_kseq_->seq, sequence->seq);
-      std::swap(sequence_kseq_->name, sequence->name);
-      std::swap(sequence_kseq_->comment, sequence->comment);
-      if (sequence_kseq_->qual.l != 0) { // fastq file
-        std::swap(sequence_kseq_->qual, sequence->qual);
-      }
-      sequence->id = num_loaded_sequences_;
-      ++num_loaded_sequences_;
       ++num_sequences;
       num_bases_ += length;
     } else {
@@ -46,6 +253,7 @@ uint32_t SequenceBatch::LoadBatch() {
       break;
     }
   }
+  ReserveNegativeSequences();
   if (num_sequences != 0) {
     std::cerr << "Loaded sequence batch successfully in " << Chromap<>::GetRealTime() - real_start_time << "s, ";
     std::cerr << "number of sequences: " << num_sequences << ", ";
@@ -59,60 +267,77 @@ uint32_t SequenceBatch::LoadBatch() {
 bool SequenceBatch::LoadOneSequenceAndSaveAt(uint32_t sequence_index) {
   //double real_start_time = Chromap::GetRealTime();
   bool no_more_sequence = false;
-  int length = kseq_read(sequence_kseq_);
+  DiscardSequencesFrom(sequence_index);
+  int length = LoadOneRecord();
   while (length == 0) { // Skip the sequences of length 0
-    length = kseq_read(sequence_kseq_);
-  }
-  if (length > 0) {
-    kseq_t *sequence = sequence_batch_[sequence_index];
-    std::swap(sequence_kseq_->seq, sequence->seq);
-    std::swap(sequence_kseq_->name, sequence->name);
-    std::swap(sequence_kseq_->comment, sequence->comment);
-    sequence->id = num_loaded_sequences_;
-    ++num_loaded_sequences_;
-    if (sequence_kseq_->qual.l != 0) { // fastq file
-      std::swap(sequence_kseq_->qual, sequence->qual);
-    } 
-  } else {
+    length = LoadOneRecord();
+  }
+  if (length < 0) {
     if (length != -1) {
       Chromap<>::ExitWithMessage("Didn't reach the end of sequence file, which might be corrupted!");
     }
     // make sure to reach the end of file rather than meet an error
     no_more_sequence = true;
+  } else {
+    ReserveNegativeSequences();
   }
   return no_more_sequence;
 }
 
+void SequenceBatch::SaveSequenceAt(uint32_t sequence_index, const char *sequence, uint32_t sequence_length, const char *qual) {
+  DiscardSequencesFrom(sequence_index);
+  uint64_t name_offset = sequence_data_.size();
+  sequence_data_.push_back('\0');
+  uint64_t comment_offset = sequence_data_.size();
+  sequence_data_.push_back('\0');
+  uint64_t sequence_offset = sequence_data_.size();
+  sequence_data_.insert(sequence_data_.end(), sequence, sequence + sequence_length);
+  sequence_data_.push_back('\0');
+  uint64_t qual_offset = sequence_data_.size();
+  if (qual != NULL) {
+    sequence_data_.insert(sequence_data_.end(), qual, qual + sequence_length);
+  } else {
+    sequence_data_.insert(sequence_data_.end(), sequence_length, 'I');
+  }
+  sequence_data_.push_back('\0');
+  name_offsets_.push_back(name_offset);
+  comment_offsets_.push_back(comment_offset);
+  sequence_offsets_.push_back(sequence_offset);
+  qual_offsets_.push_back(qual_offset);
+  name_lengths_.push_back(0);
+  comment_lengths_.push_back(0);
+  sequence_lengths_.push_back(sequence_length);
+  CheckNextId();
+  ids_.push_back(num_loaded_sequences_);
+  negative_sequence_offsets_.push_back(sequence_offset);
+  ++num_loaded_sequences_;
+}
+
 uint32_t SequenceBatch::LoadAllSequences() {
   double real_start_time = Chromap<>::GetRealTime();
-  sequence_batch_.reserve(200);
   uint32_t num_sequences = 0;
   num_bases_ = 0;
-  int length = kseq_read(sequence_kseq_);
+  DiscardSequencesFrom(0);
+  // Growing the buffer by doubling keeps the old and new copies alive at the
+  // same time, which takes 2-3x the reference size at peak. The names,
+  // sequences and their terminators are stored without the line breaks, so
+  // they take at most the file size plus one byte per record, and each record
+  // takes at least 5 bytes in the file. The pages reserved but not written are
+  // never touched.
+  uint64_t file_size = sequence_file_->GetUncompressedFileSize();
+  if (file_size > 0) {
+    sequence_data_.reserve(file_size + file_size / 4 + 2);
+  }
+  int length = LoadOneRecord();
   while (length >= 0) { 
-    if (length == 0) { // Skip the sequences of length 0
-      continue;
-    } else if (length > 0) {
-      sequence_batch_.emplace_back((kseq_t*)calloc(1, sizeof(kseq_t)));
-      kseq_t *sequence = sequence_batch_.back();
-      std::swap(sequence_kseq_->seq, sequence->seq);
-      std::swap(sequence_kseq_->name, sequence->name);
-      std::swap(sequence_kseq_->comment, sequence->comment);
-      if (sequence_kseq_->qual.l != 0) { // fastq file
-        std::swap(sequence_kseq_->qual, sequence->qual);
-      }
-      sequence->id = num_loaded_sequences_;
-      ++num_loaded_sequences_;
+    if (length > 0) { // sequences of length 0 are skipped
       ++num_sequences;
       num_bases_ += length;
-    } else {
-      if (length != -1) {
-        Chromap<>::ExitWithMessage("Didn't reach the end of sequence file, which might be corrupted!");
-      }
-      // make sure to reach the end of file rather than meet an error
-      break;
     }
-    length = kseq_read(sequence_kseq_);
+    length = LoadOneRecord();
+  }
+  if (length != -1) {
+    Chromap<>::ExitWithMessage("Didn't reach the end of sequence file, which might be corrupted!");
   }
   std::cerr << "Loaded all sequences successfully in " << Chromap<>::GetRealTime() - real_start_time << "s, ";
   std::cerr << "number of sequences: " << num_sequences << ", ";
@@ -121,7 +346,7 @@ uint32_t SequenceBatch::LoadAllSequences() {
 }
 
 void SequenceBatch::FinalizeLoading() {
-  kseq_destroy(sequence_kseq_);
-  gzclose(sequence_file_);
+  sequence_file_.reset();
+  prefetched_sequence_files_.clear();
 }
 } // namespace chromap
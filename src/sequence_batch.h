@@ -1,101 +1,158 @@
 #ifndef SEQUENCEBATCH_H_
 #define SEQUENCEBATCH_H_
 
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <smmintrin.h>
 #include <string>
 #include <vector>
 #include <unistd.h>
 #include <zlib.h>
 
-#include "kseq.h"
+#include "parallel_gzip_reader.h"
 
 namespace chromap {
+// Sequences are given ids in the order they are loaded, which are stable across
+// batches and stored in up to READ_ID_BITS bits in the mapping records.
+const int READ_ID_BITS = 40;
+const uint64_t MAX_NUM_READ_IDS = (uint64_t)1 << READ_ID_BITS;
+
 class SequenceBatch {
  public:
-  KSEQ_INIT(gzFile, gzread);
   SequenceBatch(){}
   SequenceBatch(uint32_t max_num_sequences) : max_num_sequences_(max_num_sequences) {
-    // Construct once and use update methods when loading each batch
-    sequence_batch_.reserve(max_num_sequences_);
-    for (uint32_t i = 0; i < max_num_sequences_; ++i) {
-      sequence_batch_.emplace_back((kseq_t*)calloc(1, sizeof(kseq_t)));
-      sequence_batch_.back()->f = NULL;
-    }
-    negative_sequence_batch_.assign(max_num_sequences_, "");
-  }
-  ~SequenceBatch(){
-    if (sequence_batch_.size() > 0) {
-      for (uint32_t i = 0; i < sequence_batch_.size(); ++i) {
-        kseq_destroy(sequence_batch_[i]);
-      }
-    }
+    // Construct once and reuse the storage when loading each batch
+    name_offsets_.reserve(max_num_sequences_);
+    comment_offsets_.reserve(max_num_sequences_);
+    sequence_offsets_.reserve(max_num_sequences_);
+    qual_offsets_.reserve(max_num_sequences_);
+    name_lengths_.reserve(max_num_sequences_);
+    comment_lengths_.reserve(max_num_sequences_);
+    sequence_lengths_.reserve(max_num_sequences_);
+    ids_.reserve(max_num_sequences_);
+    negative_sequence_offsets_.reserve(max_num_sequences_);
   }
+  ~SequenceBatch(){}
   inline uint32_t GetMaxBatchSize() const {
     return max_num_sequences_;
   }
   inline uint64_t GetNumBases() const {
     return num_bases_;
   }
-  inline std::vector<kseq_t*> & GetSequenceBatch() {
-    return sequence_batch_;
-  }
-  inline std::vector<std::string> & GetNegativeSequenceBatch() {
-    return negative_sequence_batch_;
+  inline uint32_t GetNumSequences() const {
+    return ids_.size();
   }
   inline const char * GetSequenceAt(uint32_t sequence_index) const {
-    return sequence_batch_[sequence_index]->seq.s;
+    return sequence_data_.data() + sequence_offsets_[sequence_index];
   }
   inline uint32_t GetSequenceLengthAt(uint32_t sequence_index) const {
-    return sequence_batch_[sequence_index]->seq.l;
+    return sequence_lengths_[sequence_index];
   }
   inline const char * GetSequenceNameAt(uint32_t sequence_index) const {
-    return sequence_batch_[sequence_index]->name.s;
+    return sequence_data_.data() + name_offsets_[sequence_index];
   }
   inline uint32_t GetSequenceNameLengthAt(uint32_t sequence_index) const {
-    return sequence_batch_[sequence_index]->name.l;
+    return name_lengths_[sequence_index];
+  }
+  inline const char * GetSequenceCommentAt(uint32_t sequence_index) const {
+    return sequence_data_.data() + comment_offsets_[sequence_index];
+  }
+  inline uint32_t GetSequenceCommentLengthAt(uint32_t sequence_index) const {
+    return comment_lengths_[sequence_index];
   }
   inline const char * GetSequenceQualAt(uint32_t sequence_index) const {
-    return sequence_batch_[sequence_index]->qual.s;
+    return sequence_data_.data() + qual_offsets_[sequence_index];
   }
-  inline uint32_t GetSequenceIdAt(uint32_t sequence_index) const {
-    return sequence_batch_[sequence_index]->id;
+  inline uint64_t GetSequenceIdAt(uint32_t sequence_index) const {
+    return ids_[sequence_index];
   }
-  inline const std::string & GetNegativeSequenceAt(uint32_t sequence_index) const {
-    return negative_sequence_batch_[sequence_index];
+  inline const char * GetNegativeSequenceAt(uint32_t sequence_index) const {
+    return negative_sequence_data_.data() + negative_sequence_offsets_[sequence_index];
   }
-//  inline char GetReverseComplementBaseOfSequenceAt(uint32_t sequence_index, uint32_t position) {
-//    kseq_t *sequence = sequence_batch_[sequence_index];
-//    return Uint8ToChar(((uint8_t)3) ^ (CharToUint8((sequence->seq.s)[sequence->seq.l - position - 1])));
-//  }
+  // The reverse complement is written to the slot of the sequence in the
+  // negative sequence arena, so different sequences can be prepared in
+  // parallel.
   inline void PrepareNegativeSequenceAt(uint32_t sequence_index) {
-    kseq_t *sequence = sequence_batch_[sequence_index];
-    uint32_t sequence_length = sequence->seq.l;
-    std::string &negative_sequence = negative_sequence_batch_[sequence_index];
-    negative_sequence.clear();
-    negative_sequence.reserve(sequence_length);
-    for (uint32_t i = 0; i < sequence_length; ++i) {
-      negative_sequence.push_back(Uint8ToChar(((uint8_t)3) ^ (CharToUint8((sequence->seq.s)[sequence_length - i - 1]))));
+    const char *sequence = GetSequenceAt(sequence_index);
+    uint32_t sequence_length = GetSequenceLengthAt(sequence_index);
+    char *negative_sequence = negative_sequence_data_.data() + sequence_offsets_[sequence_index];
+    negative_sequence_offsets_[sequence_index] = sequence_offsets_[sequence_index];
+    // Complement 16 bases at a time by their low nibbles, which are distinct
+    // for A, C, G and T in either case. Other characters, detected by
+    // comparing with the expected lower case base, become N as in Uint8ToChar.
+    const __m128i complement_table = _mm_setr_epi8('N', 'T', 'N', 'G', 'A', 'N', 'N', 'C', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N');
+    const __m128i lower_case_base_table = _mm_setr_epi8(0, 'a', 0, 'c', 't', 0, 0, 'g', 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i reverse_shuffle = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m128i low_nibble_mask = _mm_set1_epi8(0x0f);
+    const __m128i lower_case_bit = _mm_set1_epi8(0x20);
+    const __m128i ambiguous_bases = _mm_set1_epi8('N');
+    uint32_t num_simd_bases = sequence_length & ~(uint32_t)15;
+    for (uint32_t i = 0; i < num_simd_bases; i += 16) {
+      __m128i bases = _mm_loadu_si128((const __m128i*)(sequence + sequence_length - i - 16));
+      __m128i low_nibbles = _mm_and_si128(bases, low_nibble_mask);
+      __m128i complements = _mm_shuffle_epi8(complement_table, low_nibbles);
+      __m128i is_valid_base = _mm_cmpeq_epi8(_mm_or_si128(bases, lower_case_bit), _mm_shuffle_epi8(lower_case_base_table, low_nibbles));
+      complements = _mm_blendv_epi8(ambiguous_bases, complements, is_valid_base);
+      _mm_storeu_si128((__m128i*)(negative_sequence + i), _mm_shuffle_epi8(complements, reverse_shuffle));
+    }
+    for (uint32_t i = num_simd_bases; i < sequence_length; ++i) {
+      negative_sequence[i] = Uint8ToChar(((uint8_t)3) ^ (CharToUint8(sequence[sequence_length - i - 1])));
     }
   }
+  // Trimming drops bases from the 3' end, which is the front of the reverse
+  // complement, so the negative sequence view just moves forward.
   inline void TrimSequenceAt(uint32_t sequence_index, int length_after_trim) {
-    kseq_t *sequence = sequence_batch_[sequence_index];
-    negative_sequence_batch_[sequence_index].erase(negative_sequence_batch_[sequence_index].begin(), negative_sequence_batch_[sequence_index].begin() + sequence->seq.l - length_after_trim);
-    sequence->seq.l = length_after_trim;
+    negative_sequence_offsets_[sequence_index] += sequence_lengths_[sequence_index] - length_after_trim;
+    sequence_lengths_[sequence_index] = length_after_trim;
   }
   inline void SwapSequenceBatch(SequenceBatch &batch) {
-    sequence_batch_.swap(batch.GetSequenceBatch());
-    negative_sequence_batch_.swap(batch.GetNegativeSequenceBatch());
+    sequence_data_.swap(batch.sequence_data_);
+    name_offsets_.swap(batch.name_offsets_);
+    comment_offsets_.swap(batch.comment_offsets_);
+    sequence_offsets_.swap(batch.sequence_offsets_);
+    qual_offsets_.swap(batch.qual_offsets_);
+    name_lengths_.swap(batch.name_lengths_);
+    comment_lengths_.swap(batch.comment_lengths_);
+    sequence_lengths_.swap(batch.sequence_lengths_);
+    ids_.swap(batch.ids_);
+    negative_sequence_data_.swap(batch.negative_sequence_data_);
+    negative_sequence_offsets_.swap(batch.negative_sequence_offsets_);
+  }
+  void InitializeLoading(const std::string &sequence_file_path, int num_inflate_threads);
+  // Load the files one after another as if they were concatenated, e.g. the
+  // lanes of a sequencing run. Up to num_prefetched_files files after the
+  // current one are opened and decompressed ahead. Each open file is inflated
+  // by up to num_inflate_threads threads.
+  void InitializeLoading(const std::vector<std::string> &sequence_file_paths, int num_prefetched_files, int num_inflate_threads);
+  // Index of the file the last sequence was loaded from.
+  inline size_t GetCurrentFileIndex() const {
+    return current_file_index_;
+  }
+  // Exchange the input streams and parser states of two batches, so that a
+  // batch can load sequences from the stream of another, e.g. the mates of
+  // interleaved read pairs.
+  void SwapLoadingState(SequenceBatch &batch);
+  // The ids have to fit in the read ids of the mapping records, which may be
+  // narrower than READ_ID_BITS.
+  inline void SetNumIdBits(int num_id_bits) {
+    num_id_bits_ = num_id_bits;
   }
-  void InitializeLoading(const std::string &sequence_file_path);
   void FinalizeLoading();
   // Return the number of reads loaded into the batch
   // and return 0 if there is no more reads
   uint32_t LoadBatch();
+  // Sequences at sequence_index and after are discarded before loading, so
+  // sequences must be saved in order, though the last one may be overwritten.
   bool LoadOneSequenceAndSaveAt(uint32_t sequence_index);
   uint32_t LoadAllSequences();
+  // Save a sequence that is not loaded from a file, e.g. a barcode parsed from
+  // the header of a read, at sequence_index. Same as LoadOneSequenceAndSaveAt,
+  // sequences at sequence_index and after are discarded first. Without a qual,
+  // all the bases get the same qual.
+  void SaveSequenceAt(uint32_t sequence_index, const char *sequence, uint32_t sequence_length, const char *qual);
   inline void CorrectBaseAt(uint32_t sequence_index, uint32_t base_position, char correct_base) {
-    kseq_t *sequence = sequence_batch_[sequence_index];
-    sequence->seq.s[base_position] = correct_base;
+    sequence_data_[sequence_offsets_[sequence_index] + base_position] = correct_base;
   }
 
   inline static uint8_t CharToUint8(const char c) {
@@ -144,14 +201,63 @@ class SequenceBatch {
   }
 
  protected:
-  uint32_t num_loaded_sequences_ = 0;
+  // Return false if there is no more line. The line excludes the line break.
+  bool ReadLine(const char **line, uint32_t *line_length);
+  // Append the next FASTA/FASTQ record to the batch. Return the sequence
+  // length, -1 at the end of the last file or -2 if the record is truncated.
+  int LoadOneRecord();
+  int LoadOneRecordFromCurrentFile();
+  // Move on to the next file. Return false if there is no more file.
+  bool OpenNextSequenceFile();
+  void DiscardSequencesFrom(uint32_t sequence_index);
+  // Exit if the id of the next sequence doesn't fit in num_id_bits_ bits.
+  void CheckNextId() const;
+  // Make room for the reverse complements of all loaded sequences. Only read
+  // batches do this, as the reverse complement of the reference is not needed.
+  inline void ReserveNegativeSequences() {
+    if (negative_sequence_data_.size() < sequence_data_.size()) {
+      negative_sequence_data_.resize(sequence_data_.size());
+    }
+  }
+  uint64_t num_loaded_sequences_ = 0;
+  int num_id_bits_ = READ_ID_BITS;
   uint32_t max_num_sequences_;
   uint64_t num_bases_;
   std::string sequence_file_path_;
-  gzFile sequence_file_; 
-  kseq_t *sequence_kseq_;
-  std::vector<kseq_t*> sequence_batch_;
-  std::vector<std::string> negative_sequence_batch_;
+  std::unique_ptr<ParallelGzipReader> sequence_file_;
+  std::vector<std::string> sequence_file_paths_;
+  size_t current_file_index_ = 0;
+  size_t loading_file_index_ = 0;
+  size_t next_file_index_ = 0;
+  int num_prefetched_files_ = 0;
+  int num_inflate_threads_ = 1;
+  std::deque<std::unique_ptr<ParallelGzipReader> > prefetched_sequence_files_;
+  // Parser state. A line split across two reads of the file is assembled in
+  // split_line_, and the header line that ends a FASTA record is kept in
+  // next_header_line_ until the next record is loaded.
+  std::vector<char> input_buffer_;
+  uint32_t input_begin_ = 0;
+  uint32_t input_end_ = 0;
+  bool reached_input_end_ = false;
+  std::string split_line_;
+  bool line_is_split_ = false;
+  std::string next_header_line_;
+  bool has_next_header_line_ = false;
+  // All the names, comments, sequences and quals of the batch are stored in
+  // one buffer, each null-terminated, and located through the offset arrays.
+  std::vector<char> sequence_data_;
+  std::vector<uint64_t> name_offsets_;
+  std::vector<uint64_t> comment_offsets_;
+  std::vector<uint64_t> sequence_offsets_;
+  std::vector<uint64_t> qual_offsets_;
+  std::vector<uint32_t> name_lengths_;
+  std::vector<uint32_t> comment_lengths_;
+  std::vector<uint32_t> sequence_lengths_;
+  std::vector<uint64_t> ids_;
+  // Reverse complements share the layout of sequence_data_ and are located
+  // through their own offsets, which move forward when sequences are trimmed.
+  std::vector<char> negative_sequence_data_;
+  std::vector<uint64_t> negative_sequence_offsets_;
   static constexpr uint8_t char_to_uint8_table_[256] = {4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4};
   static constexpr char uint8_to_char_table_[8] = {'A', 'C', 'G', 'T', 'N', 'N', 'N', 'N'};
 };
@@ -0,0 +1,320 @@
+#ifndef TEMPMAPPINGFILE_H_
+#define TEMPMAPPINGFILE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sequence_batch.h" // used by output_tools.h
+#include "output_tools.h"
+#include "radix_sort.h"
+
+namespace chromap {
+// Temp files spilled in low memory mode keep the sorted mappings on each ref
+// seq in blocks of up to TEMP_MAPPING_BLOCK_SIZE mappings. Each block is stored
+// as its number of mappings and compressed size, both uint32_t, followed by the
+// block compressed by zlib. Before compression, the start positions are
+// replaced by their differences to the previous mapping and the bytes of the
+// records are transposed, so that the same field of all the mappings is
+// stored together and compresses well. Blocks of fewer than
+// TEMP_MAPPING_MIN_COMPRESSED_BLOCK_SIZE mappings, e.g. on the short contigs of
+// a draft assembly, and blocks that don't shrink are stored as they are, which
+// is told by the stored size being the size of the block.
+const uint32_t TEMP_MAPPING_BLOCK_SIZE = 8192;
+const uint32_t TEMP_MAPPING_MIN_COMPRESSED_BLOCK_SIZE = 256;
+const int TEMP_MAPPING_COMPRESSION_LEVEL = 1;
+
+template <typename MappingRecord>
+struct TempMappingDelta {
+  static void Encode(uint32_t num_mappings, MappingRecord *mappings) {
+    for (uint32_t mi = num_mappings - 1; mi > 0; --mi) {
+      mappings[mi].fragment_start_position -= mappings[mi - 1].fragment_start_position;
+    }
+  }
+  static void Decode(uint32_t num_mappings, MappingRecord *mappings) {
+    for (uint32_t mi = 1; mi < num_mappings; ++mi) {
+      mappings[mi].fragment_start_position += mappings[mi - 1].fragment_start_position;
+    }
+  }
+};
+
+// SAM and pairs mappings hold strings and are never spilled.
+template <>
+struct TempMappingDelta<SAMMapping> {
+  static void Encode(uint32_t num_mappings, SAMMapping *mappings) {}
+  static void Decode(uint32_t num_mappings, SAMMapping *mappings) {}
+};
+
+template <>
+struct TempMappingDelta<PairsMapping> {
+  static void Encode(uint32_t num_mappings, PairsMapping *mappings) {}
+  static void Decode(uint32_t num_mappings, PairsMapping *mappings) {}
+};
+
+template <typename MappingRecord>
+struct TempMappingFileHandle {
+  // The mappings on one ref seq start at offset in the file.
+  struct RefSeqSection {
+    uint32_t rid;
+    uint64_t offset;
+    uint64_t num_mappings;
+  };
+  std::string file_path;
+  // Only the ref seqs with mappings have a section, in the order of rids.
+  std::vector<RefSeqSection> sections;
+  uint64_t num_bytes;
+  // The whole file is mapped, so the blocks are inflated straight from the
+  // page cache.
+  const uint8_t *data;
+  inline void InitializeTempMappingLoading() {
+    data = NULL;
+    if (num_bytes == 0) {
+      return;
+    }
+    int file_descriptor = open(file_path.c_str(), O_RDONLY);
+    if (file_descriptor < 0) {
+      std::cerr << "Failed to open temp file " << file_path << std::endl;
+      exit(-1);
+    }
+    void *mapped_data = mmap(NULL, num_bytes, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+    close(file_descriptor);
+    if (mapped_data == MAP_FAILED) {
+      std::cerr << "Failed to map temp file " << file_path << std::endl;
+      exit(-1);
+    }
+    madvise(mapped_data, num_bytes, MADV_SEQUENTIAL);
+    data = (const uint8_t*)mapped_data;
+  }
+  inline void FinalizeTempMappingLoading() {
+    if (data != NULL) {
+      munmap((void*)data, num_bytes);
+      data = NULL;
+    }
+  }
+  inline const RefSeqSection *FindSection(uint32_t rid) const {
+    typename std::vector<RefSeqSection>::const_iterator it = std::lower_bound(sections.begin(), sections.end(), rid, [](const RefSeqSection &section, uint32_t rid) { return section.rid < rid; });
+    if (it == sections.end() || it->rid != rid) {
+      return NULL;
+    }
+    return &(*it);
+  }
+};
+
+// Reads the mappings of one temp file on one ref seq block by block. The
+// cursors of different threads share the mapped file, and the kernel is asked
+// to read the next block ahead while the current one is being merged.
+template <typename MappingRecord>
+struct TempMappingRunCursor {
+  const TempMappingFileHandle<MappingRecord> *handle;
+  uint64_t next_offset;
+  uint64_t num_mappings_to_load;
+  uint32_t num_mappings;
+  uint32_t current_mapping_index;
+  std::vector<MappingRecord> mappings;
+  std::vector<uint8_t> transposed_block;
+  // Memory used by a cursor that has loaded a block.
+  static uint64_t GetMaxMemoryBytes() {
+    return 2 * (uint64_t)TEMP_MAPPING_BLOCK_SIZE * sizeof(MappingRecord);
+  }
+  inline void Initialize(const TempMappingFileHandle<MappingRecord> &temp_mapping_file_handle, uint32_t rid) {
+    handle = &temp_mapping_file_handle;
+    const typename TempMappingFileHandle<MappingRecord>::RefSeqSection *section = handle->FindSection(rid);
+    next_offset = section == NULL ? 0 : section->offset;
+    num_mappings_to_load = section == NULL ? 0 : section->num_mappings;
+    LoadTempMappingBlock();
+  }
+  inline void LoadTempMappingBlock() {
+    num_mappings = 0;
+    current_mapping_index = 0;
+    if (num_mappings_to_load == 0) {
+      return;
+    }
+    uint32_t block_header[2];
+    if (next_offset + sizeof(block_header) > handle->num_bytes) {
+      std::cerr << "Truncated temp file " << handle->file_path << std::endl;
+      exit(-1);
+    }
+    memcpy(block_header, handle->data + next_offset, sizeof(block_header));
+    next_offset += sizeof(block_header);
+    num_mappings = block_header[0];
+    if (next_offset + block_header[1] > handle->num_bytes) {
+      std::cerr << "Truncated temp file " << handle->file_path << std::endl;
+      exit(-1);
+    }
+    const uint8_t *compressed_block = handle->data + next_offset;
+    next_offset += block_header[1];
+    num_mappings_to_load -= num_mappings;
+    if (num_mappings_to_load > 0) {
+      // Blocks of the same run are about the same size.
+      uint64_t page_size = sysconf(_SC_PAGESIZE);
+      uint64_t next_page_offset = next_offset / page_size * page_size;
+      madvise((void*)(handle->data + next_page_offset), std::min(next_offset + sizeof(block_header) + block_header[1], handle->num_bytes) - next_page_offset, MADV_WILLNEED);
+    }
+    uLongf num_transposed_bytes = (uLongf)num_mappings * sizeof(MappingRecord);
+    transposed_block.resize(num_transposed_bytes);
+    mappings.resize(num_mappings);
+    if (block_header[1] == num_transposed_bytes) {
+      memcpy(transposed_block.data(), compressed_block, num_transposed_bytes);
+    } else if (uncompress(transposed_block.data(), &num_transposed_bytes, compressed_block, block_header[1]) != Z_OK || num_transposed_bytes != (uLongf)num_mappings * sizeof(MappingRecord)) {
+      std::cerr << "Corrupted temp file " << handle->file_path << std::endl;
+      exit(-1);
+    }
+    uint8_t *block = (uint8_t*)mappings.data();
+    for (size_t bi = 0; bi < sizeof(MappingRecord); ++bi) {
+      const uint8_t *transposed_bytes = transposed_block.data() + bi * num_mappings;
+      for (uint32_t mi = 0; mi < num_mappings; ++mi) {
+        block[mi * sizeof(MappingRecord) + bi] = transposed_bytes[mi];
+      }
+    }
+    TempMappingDelta<MappingRecord>::Decode(num_mappings, mappings.data());
+  }
+  inline bool IsExhausted() const {
+    return current_mapping_index >= num_mappings;
+  }
+  inline const MappingRecord &Current() const {
+    return mappings[current_mapping_index];
+  }
+  inline void Next() {
+    ++current_mapping_index;
+    if (current_mapping_index >= num_mappings) {
+      LoadTempMappingBlock();
+    }
+  }
+};
+
+// Spills mappings to temp files on a background thread. Spill takes over the
+// mappings in the container and hands back the container of the previous
+// spill, so the caller keeps filling one container while the other is being
+// sorted, compressed and written. It only waits when the previous spill is
+// still running.
+template <typename MappingRecord>
+class TempMappingSpiller {
+ public:
+  TempMappingSpiller() {}
+  ~TempMappingSpiller() {
+    Wait();
+  }
+  void Initialize(const std::string &temp_file_path_prefix, uint32_t num_reference_sequences) {
+    temp_file_path_prefix_ = temp_file_path_prefix;
+    spilling_mappings_on_diff_ref_seqs_.assign(num_reference_sequences, std::vector<MappingRecord>());
+  }
+  // The mappings must be sorted if are_sorted is true; otherwise they are
+  // sorted on the background thread.
+  void Spill(bool are_sorted, std::vector<std::vector<MappingRecord> > *mappings_on_diff_ref_seqs) {
+    Wait();
+    TempMappingFileHandle<MappingRecord> temp_mapping_file_handle;
+    temp_mapping_file_handle.file_path = temp_file_path_prefix_ + ".temp" + std::to_string(temp_mapping_file_handles_.size());
+    temp_mapping_file_handles_.emplace_back(temp_mapping_file_handle);
+    spilling_mappings_on_diff_ref_seqs_.swap(*mappings_on_diff_ref_seqs);
+    spilling_thread_ = std::thread(&TempMappingSpiller::SpillMappings, this, are_sorted);
+  }
+  // Wait for the running spill to finish.
+  void Wait() {
+    if (spilling_thread_.joinable()) {
+      std::chrono::steady_clock::time_point wait_start_time = std::chrono::steady_clock::now();
+      spilling_thread_.join();
+      wait_time_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - wait_start_time).count();
+    }
+  }
+  std::vector<TempMappingFileHandle<MappingRecord> > &GetTempMappingFileHandles() {
+    return temp_mapping_file_handles_;
+  }
+  void OutputStats() const {
+    uint64_t num_spilled_bytes = 0;
+    for (const TempMappingFileHandle<MappingRecord> &temp_mapping_file_handle : temp_mapping_file_handles_) {
+      num_spilled_bytes += temp_mapping_file_handle.num_bytes;
+    }
+    std::cerr << "Spilled " << num_spilled_mappings_ << " mappings into " << temp_mapping_file_handles_.size() << " temp files of " << num_spilled_bytes << " bytes (" << num_spilled_mappings_ * sizeof(MappingRecord) << " bytes uncompressed) in " << spill_time_ << "s, waited " << wait_time_ << "s for spills.\n";
+  }
+
+ protected:
+  void Write(FILE *temp_file, const std::string &file_path, const void *buffer, size_t num_bytes) {
+    if (fwrite(buffer, 1, num_bytes, temp_file) != num_bytes) {
+      std::cerr << "Failed to write temp file " << file_path << std::endl;
+      exit(-1);
+    }
+  }
+  void SpillMappings(bool are_sorted) {
+    std::chrono::steady_clock::time_point spill_start_time = std::chrono::steady_clock::now();
+    TempMappingFileHandle<MappingRecord> &temp_mapping_file_handle = temp_mapping_file_handles_.back();
+    FILE *temp_file = fopen(temp_mapping_file_handle.file_path.c_str(), "wb");
+    if (temp_file == NULL) {
+      std::cerr << "Failed to create temp file " << temp_mapping_file_handle.file_path << std::endl;
+      exit(-1);
+    }
+    std::vector<MappingRecord> block;
+    std::vector<uint8_t> transposed_block;
+    std::vector<uint8_t> compressed_block;
+    uint64_t offset = 0;
+    for (uint32_t rid = 0; rid < spilling_mappings_on_diff_ref_seqs_.size(); ++rid) {
+      std::vector<MappingRecord> &mappings = spilling_mappings_on_diff_ref_seqs_[rid];
+      if (mappings.empty()) {
+        continue;
+      }
+      if (!are_sorted) {
+        SortMappings(mappings.data(), mappings.data() + mappings.size());
+      }
+      temp_mapping_file_handle.sections.emplace_back(typename TempMappingFileHandle<MappingRecord>::RefSeqSection{rid, offset, mappings.size()});
+      for (size_t block_start = 0; block_start < mappings.size(); block_start += TEMP_MAPPING_BLOCK_SIZE) {
+        uint32_t num_mappings = std::min((size_t)TEMP_MAPPING_BLOCK_SIZE, mappings.size() - block_start);
+        block.assign(mappings.begin() + block_start, mappings.begin() + block_start + num_mappings);
+        TempMappingDelta<MappingRecord>::Encode(num_mappings, block.data());
+        transposed_block.resize((size_t)num_mappings * sizeof(MappingRecord));
+        const uint8_t *block_bytes = (const uint8_t*)block.data();
+        for (size_t bi = 0; bi < sizeof(MappingRecord); ++bi) {
+          uint8_t *transposed_bytes = transposed_block.data() + bi * num_mappings;
+          for (uint32_t mi = 0; mi < num_mappings; ++mi) {
+            transposed_bytes[mi] = block_bytes[mi * sizeof(MappingRecord) + bi];
+          }
+        }
+        // Setting up zlib costs more than compressing a small block saves.
+        uLongf num_compressed_bytes = transposed_block.size();
+        const uint8_t *stored_block = transposed_block.data();
+        if (num_mappings >= TEMP_MAPPING_MIN_COMPRESSED_BLOCK_SIZE) {
+          num_compressed_bytes = compressBound(transposed_block.size());
+          compressed_block.resize(num_compressed_bytes);
+          if (compress2(compressed_block.data(), &num_compressed_bytes, transposed_block.data(), transposed_block.size(), TEMP_MAPPING_COMPRESSION_LEVEL) != Z_OK) {
+            std::cerr << "Failed to compress mappings for temp file " << temp_mapping_file_handle.file_path << std::endl;
+            exit(-1);
+          }
+          if (num_compressed_bytes < transposed_block.size()) {
+            stored_block = compressed_block.data();
+          } else {
+            num_compressed_bytes = transposed_block.size();
+          }
+        }
+        uint32_t block_header[2] = {num_mappings, (uint32_t)num_compressed_bytes};
+        Write(temp_file, temp_mapping_file_handle.file_path, block_header, sizeof(block_header));
+        Write(temp_file, temp_mapping_file_handle.file_path, stored_block, num_compressed_bytes);
+        offset += sizeof(block_header) + num_compressed_bytes;
+      }
+      num_spilled_mappings_ += mappings.size();
+      mappings.clear();
+    }
+    if (fclose(temp_file) != 0) {
+      std::cerr << "Failed to write temp file " << temp_mapping_file_handle.file_path << std::endl;
+      exit(-1);
+    }
+    temp_mapping_file_handle.num_bytes = offset;
+    spill_time_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - spill_start_time).count();
+  }
+  std::string temp_file_path_prefix_;
+  std::vector<TempMappingFileHandle<MappingRecord> > temp_mapping_file_handles_;
+  std::vector<std::vector<MappingRecord> > spilling_mappings_on_diff_ref_seqs_;
+  std::thread spilling_thread_;
+  uint64_t num_spilled_mappings_ = 0;
+  double spill_time_ = 0;
+  double wait_time_ = 0;
+};
+} // namespace chromap
+
+#endif // TEMPMAPPINGFILE_H_